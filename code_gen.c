@@ -27,6 +27,7 @@
 #include "utils.h"
 #include "version.h"
 #include "my-stdlib.h"
+#include "my-string.h"
 
 /*** The reader will likely find it useful to consult the file
  *** `MOOCodeSequences.txt' in this directory while reading the code in this
@@ -53,6 +54,7 @@ struct gstate {
     Var *literals;
     unsigned num_fork_vectors, max_fork_vectors;
     Bytecodes *fork_vectors;
+    unsigned lineno;		/* of the statement being generated */
 };
 typedef struct gstate GState;
 
@@ -83,6 +85,8 @@ struct state {
     unsigned saved_stack;
     unsigned num_loops, max_loops;
     Loop *loops;
+    unsigned num_lines, max_lines;
+    Line_Entry *lines;
     GState *gstate;
 };
 typedef struct state State;
@@ -110,6 +114,7 @@ init_gstate(GState * gstate)
     gstate->max_literals = gstate->max_fork_vectors = 0;
     gstate->fork_vectors = 0;
     gstate->literals = 0;
+    gstate->lineno = 0;
 }
 
 static void
@@ -149,6 +154,11 @@ init_state(State * state, GState * gstate)
     state->max_loops = 5;
     state->loops = mymalloc(sizeof(Loop) * state->max_loops, M_CODE_GEN);
 
+    state->num_lines = 0;
+    state->max_lines = 10;
+    state->lines = mymalloc(sizeof(Line_Entry) * state->max_lines,
+			    M_CODE_GEN);
+
     state->gstate = gstate;
 }
 
@@ -162,6 +172,7 @@ free_state(State state)
     myfree(state.trymap, M_BYTECODES);
 #endif				/* BYTECODE_REDUCE_REF */
     myfree(state.loops, M_CODE_GEN);
+    myfree(state.lines, M_CODE_GEN);
 }
 
 static void
@@ -270,11 +281,14 @@ add_literal(Var v, State * state)
 	    gstate->max_literals = new_max;
 	}
 	if (v.type == TYPE_STR) {
-	    /* intern string if we can */
+	    /* intern string if we can; identifiers share storage with
+	     * the property and verb names they are likely to match */
 	    Var nv;
+	    const char *s = str_intern(v.v.str);
 
 	    nv.type = TYPE_STR;
-	    nv.v.str = str_intern(v.v.str);
+	    nv.v.str = str_intern_ident(s);
+	    free_str(s);
 	    gstate->literals[i = gstate->num_literals++] = nv;
 	} else {
 	    gstate->literals[i = gstate->num_literals++] = var_ref(v);
@@ -448,6 +462,24 @@ restore_stack_top(unsigned old, State * state)
     state->saved_stack = old;
 }
 
+/* Records that the code from here on is reported as being on LINE, and
+ * returns the entry's index, so that LINE can be filled in later.  The
+ * lines are those find_hot_node() in decompile.c used to count.
+ */
+static int
+add_line(unsigned line, State * state)
+{
+    if (state->num_lines == state->max_lines) {
+	state->max_lines *= 2;
+	state->lines = myrealloc(state->lines,
+				 sizeof(Line_Entry) * state->max_lines,
+				 M_CODE_GEN);
+    }
+    state->lines[state->num_lines].pc = state->num_bytes;
+    state->lines[state->num_lines].line = line;
+    return state->num_lines++;
+}
+
 static void
 enter_loop(int id, Fixup top_label, unsigned top_stack,
 	   int bottom_label, unsigned bottom_stack, State * state)
@@ -930,7 +962,10 @@ static Bytecodes stmt_to_code(Stmt *, GState *);
 static void
 generate_stmt(Stmt * stmt, State * state)
 {
+    unsigned *line = &state->gstate->lineno;
+
     for (; stmt; stmt = stmt->next) {
+	add_line(*line, state);
 	switch (stmt->kind) {
 	case STMT_COND:
 	    {
@@ -941,19 +976,24 @@ generate_stmt(Stmt * stmt, State * state)
 		for (arms = stmt->s.cond.arms; arms; arms = arms->next) {
 		    int else_label;
 
+		    add_line(*line, state);
 		    generate_expr(arms->condition, state);
 		    emit_byte(if_op, state);
 		    else_label = add_label(state);
 		    pop_stack(1, state);
+		    ++*line;
 		    generate_stmt(arms->stmt, state);
+		    add_line(*line - 1, state);		/* last line of the arm */
 		    emit_byte(OP_JUMP, state);
 		    end_label = add_linked_label(end_label, state);
 		    define_label(else_label, state);
 		    if_op = OP_EIF;
 		}
 
-		if (stmt->s.cond.otherwise)
+		if (stmt->s.cond.otherwise) {
+		    ++*line;
 		    generate_stmt(stmt->s.cond.otherwise, state);
+		}
 		define_label(end_label, state);
 	    }
 	    break;
@@ -971,8 +1011,10 @@ generate_stmt(Stmt * stmt, State * state)
 		end_label = add_label(state);
 		enter_loop(stmt->s.list.id, loop_top, state->cur_stack,
 			   end_label, state->cur_stack - 2, state);
+		++*line;
 		generate_stmt(stmt->s.list.body, state);
 		end_label = exit_loop(state);
+		add_line(*line, state);	/* `endfor' */
 		emit_byte(OP_JUMP, state);
 		add_known_label(loop_top, state);
 		define_label(end_label, state);
@@ -992,8 +1034,10 @@ generate_stmt(Stmt * stmt, State * state)
 		end_label = add_label(state);
 		enter_loop(stmt->s.range.id, loop_top, state->cur_stack,
 			   end_label, state->cur_stack - 2, state);
+		++*line;
 		generate_stmt(stmt->s.range.body, state);
 		end_label = exit_loop(state);
+		add_line(*line, state);	/* `endfor' */
 		emit_byte(OP_JUMP, state);
 		add_known_label(loop_top, state);
 		define_label(end_label, state);
@@ -1017,8 +1061,10 @@ generate_stmt(Stmt * stmt, State * state)
 		pop_stack(1, state);
 		enter_loop(stmt->s.loop.id, loop_top, state->cur_stack,
 			   end_label, state->cur_stack, state);
+		++*line;
 		generate_stmt(stmt->s.loop.body, state);
 		end_label = exit_loop(state);
+		add_line(*line, state);	/* `endwhile' */
 		emit_byte(OP_JUMP, state);
 		add_known_label(loop_top, state);
 		define_label(end_label, state);
@@ -1030,6 +1076,7 @@ generate_stmt(Stmt * stmt, State * state)
 		emit_byte(OP_FORK_WITH_ID, state);
 	    else
 		emit_byte(OP_FORK, state);
+	    ++*line;
 	    add_fork(stmt_to_code(stmt->s.fork.body, state->gstate), state);
 	    if (stmt->s.fork.id >= 0)
 		add_var_ref(stmt->s.fork.id, state);
@@ -1051,33 +1098,43 @@ generate_stmt(Stmt * stmt, State * state)
 	case STMT_TRY_EXCEPT:
 	    {
 		int end_label, arm_count = 0;
+		int arm_lines = state->num_lines;
 		Except_Arm *ex;
 
+		/* The codes are reported as on their `except' lines. */
 		for (ex = stmt->s.catch.excepts; ex; ex = ex->next) {
+		    add_line(0, state);
 		    generate_codes(ex->codes, state);
 		    emit_extended_byte(EOP_PUSH_LABEL, state);
 		    ex->label = add_label(state);
 		    push_stack(1, state);
 		    arm_count++;
 		}
+		add_line(*line, state);
 		emit_extended_byte(EOP_TRY_EXCEPT, state);
 		emit_byte(arm_count, state);
 		push_stack(1, state);
 		INCR_TRY_DEPTH(state);
+		++*line;
 		generate_stmt(stmt->s.catch.body, state);
 		DECR_TRY_DEPTH(state);
+		add_line(*line - 1, state);	/* last line of the body */
 		emit_extended_byte(EOP_END_EXCEPT, state);
 		end_label = add_label(state);
 		pop_stack(2 * arm_count + 1, state);	/* 2(codes,pc) + catch */
 		for (ex = stmt->s.catch.excepts; ex; ex = ex->next) {
+		    state->lines[arm_lines++].line = *line;
+		    add_line(*line, state);
 		    define_label(ex->label, state);
 		    push_stack(1, state);	/* exception tuple */
 		    if (ex->id >= 0)
 			emit_var_op(OP_PUT, ex->id, state);
 		    emit_byte(OP_POP, state);
 		    pop_stack(1, state);
+		    ++*line;
 		    generate_stmt(ex->stmt, state);
 		    if (ex->next) {
+			add_line(*line - 1, state);
 			emit_byte(OP_JUMP, state);
 			end_label = add_linked_label(end_label, state);
 		    }
@@ -1093,13 +1150,17 @@ generate_stmt(Stmt * stmt, State * state)
 		handler_label = add_label(state);
 		push_stack(1, state);
 		INCR_TRY_DEPTH(state);
+		++*line;
 		generate_stmt(stmt->s.finally.body, state);
 		DECR_TRY_DEPTH(state);
+		add_line(*line, state);	/* `finally' */
 		emit_extended_byte(EOP_END_FINALLY, state);
 		pop_stack(1, state);	/* FINALLY marker */
 		define_label(handler_label, state);
 		push_stack(2, state);	/* continuation value, reason */
+		++*line;
 		generate_stmt(stmt->s.finally.handler, state);
+		add_line(*line, state);	/* `endtry' */
 		emit_extended_byte(EOP_CONTINUE, state);
 		pop_stack(2, state);
 	    }
@@ -1140,6 +1201,7 @@ generate_stmt(Stmt * stmt, State * state)
 	default:
 	    panic("Can't happen in GENERATE_STMT()");
 	}
+	++*line;
     }
 }
 
@@ -1173,7 +1235,7 @@ stmt_to_code(Stmt * stmt, GState * gstate)
 {
     State state;
     Bytecodes bc;
-    int old_i, new_i, fix_i;
+    int old_i, new_i, fix_i, line_i;
 #ifdef BYTECODE_REDUCE_REF
     int *bbd, n_bbd;		/* basic block delimiters */
     unsigned varbits;		/* variables we've seen */
@@ -1186,6 +1248,7 @@ stmt_to_code(Stmt * stmt, GState * gstate)
     init_state(&state, gstate);
 
     generate_stmt(stmt, &state);
+    add_line(gstate->lineno, &state);	/* `endfork', or past the end */
     emit_ending_op(OP_DONE, &state);
 
     if (state.cur_stack != 0)
@@ -1292,7 +1355,10 @@ stmt_to_code(Stmt * stmt, GState * gstate)
 
     fixup = state.fixups;
     fix_i = 0;
+    line_i = 0;
     for (old_i = new_i = 0; old_i < state.num_bytes; old_i++) {
+	while (line_i < state.num_lines && state.lines[line_i].pc == old_i)
+	    state.lines[line_i++].pc = new_i;
 	if (fix_i < state.num_fixups && fixup->pc == old_i) {
 	    unsigned value, size = 0;	/* initialized to silence warning */
 
@@ -1341,6 +1407,22 @@ stmt_to_code(Stmt * stmt, GState * gstate)
 	    bc.vector[new_i++] = state.bytes[old_i];
     }
 
+    /* Where entries share a PC, the last one is for the code there; the
+     * rest are needed only where the line changes.
+     */
+    bc.num_lines = 0;
+    for (line_i = 0; line_i < state.num_lines; line_i++) {
+	Line_Entry *e = &state.lines[line_i];
+
+	if (bc.num_lines > 0 && state.lines[bc.num_lines - 1].pc == e->pc)
+	    bc.num_lines--;
+	if (bc.num_lines == 0
+	    || state.lines[bc.num_lines - 1].line != e->line)
+	    state.lines[bc.num_lines++] = *e;
+    }
+    bc.lines = mymalloc(sizeof(Line_Entry) * bc.num_lines, M_BYTECODES);
+    memcpy(bc.lines, state.lines, sizeof(Line_Entry) * bc.num_lines);
+
     free_state(state);
 
     return bc;
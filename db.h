@@ -61,6 +61,23 @@ extern int db_flush(enum db_flush_type);
 				 * argument.  Returns true on success.
 				 */
 
+extern void db_checkpoint_finished(int success);
+				/* Tell the database module that a checkpoint
+				 * started by db_flush(FLUSH_ALL_NOW) in a
+				 * forked child has finished, successfully or
+				 * not.
+				 */
+
+extern int db_checkpoint_in_progress(void);
+extern int db_continue_checkpoint(void);
+				/* With BACKGROUND_CHECKPOINTS, a checkpoint
+				 * started by db_flush(FLUSH_ALL_NOW) is
+				 * written a slice per call to
+				 * db_continue_checkpoint(), which returns 0
+				 * until it is over and then 1 for failure or
+				 * 2 for success.
+				 */
+
 extern int32 db_disk_size(void);
 				/* Return the total size, in bytes, of the most
 				 * recent full representation of the database
@@ -160,6 +177,14 @@ extern int db_for_all_contents(Objid,
 				 *      db_change_location()
 				 */
 extern void db_change_location(Objid oid, Objid location);
+extern unsigned db_contents_version(Objid);
+				/* Changes whenever an object enters or leaves
+				 * the given one, or one of its contents is
+				 * renamed; for caches of what is inside it.
+				 * Compare only together with
+				 * db_property_watch_generation(), which
+				 * covers recycling and renumbering.
+				 */
 
 typedef enum {
     /* Permanent flags */
@@ -286,6 +311,7 @@ typedef struct {
     enum bi_prop built_in;	/* true iff property is a built-in one */
     Objid definer;		/* if !built_in, the object defining prop */
     void *ptr;			/* null iff property not found */
+    int index;			/* private to db_properties.c */
 } db_prop_handle;
 
 extern db_prop_handle db_find_property(Objid oid, const char *name,
@@ -314,6 +340,13 @@ extern db_prop_handle db_find_property(Objid oid, const char *name,
 				 * `db_prop_handle' argument are guaranteed to
 				 * leave the handle intact.
 				 */
+extern db_prop_handle db_find_property2(Objid oid, const char *name,
+					Var * value);
+				/* As above, but NAME must be a MOO string
+				 * (e.g., a program literal), so that a name
+				 * shared through str_intern_ident() can be
+				 * matched by pointer.
+				 */
 
 extern Var db_property_value(db_prop_handle);
 extern void db_set_property_value(db_prop_handle, Var);
@@ -355,6 +388,21 @@ extern int db_property_allows(db_prop_handle, Objid,
 				 * This function may not be called for built-in
 				 * properties.
 				 */
+
+extern void db_watch_property(db_prop_handle);
+extern unsigned db_property_watch_generation(void);
+				/* Support for caches of property values kept
+				 * outside the DB.  Once the property found by
+				 * the given handle is watched, any
+				 * db_set_property_value() on that property,
+				 * on any object, advances the generation, as
+				 * does any change to propdefs, parentage or
+				 * object validity.  Advancing the generation
+				 * forgets all watches, so a cache filled under
+				 * an older generation must be discarded
+				 * entirely.  Watching a built-in property or a
+				 * handle that was not found is a no-op.
+				 */
 
 
 /**** verbs ****/
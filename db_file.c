@@ -19,8 +19,15 @@
  * Routines for initializing, loading, dumping, and shutting down the database
  *****************************************************************************/
 
+#include <errno.h>
+
+#include "my-fcntl.h"
+#include "my-signal.h"
 #include "my-stat.h"
+#include "my-string.h"
+#include "my-sys-time.h"
 #include "my-unistd.h"
+#include "my-wait.h"
 #include "my-stdio.h"
 #include "my-stdlib.h"
 
@@ -31,6 +38,7 @@
 #include "exceptions.h"
 #include "list.h"
 #include "log.h"
+#include "md5.h"
 #include "options.h"
 #include "server.h"
 #include "storage.h"
@@ -38,12 +46,20 @@
 #include "str_intern.h"
 #include "tasks.h"
 #include "timers.h"
+#include "utils.h"
 #include "version.h"
 
 static char *input_db_name, *dump_db_name;
 static int dump_generation = 0;
+static int loaded_redo_segment = 0;	/* first redo segment to replay */
+static FILE *input_db;
+static FILE *program_source = 0;	/* input_db, if kept open for it */
 static const char *header_format_string
 = "** LambdaMOO Database, Format Version %u **\n";
+static const char *delta_header_format_string
+= "** LambdaMOO Database Delta, Format Version %u **\n";
+static const char *redo_header_format_string
+= "** LambdaMOO Database Redo Log, Format Version %u **\n";
 
 DB_Version dbio_input_version;
 
@@ -59,6 +75,9 @@ read_verbdef(Verbdef * v)
     v->prep = dbio_read_num();
     v->next = 0;
     v->program = 0;
+#ifdef LAZY_PROGRAMS
+    v->lazy = 0;
+#endif
 }
 
 static void
@@ -103,7 +122,7 @@ write_propval(Pval * p)
 /*********** Object I/O ***********/
 
 static int
-read_object(void)
+read_object(int replay)
 {
     Objid oid;
     Object *o;
@@ -112,17 +131,23 @@ read_object(void)
     Verbdef *v, **prevv;
     int nprops;
 
-    if (dbio_scanf("#%d", &oid) != 1 || oid != db_last_used_objid() + 1)
+    /* When replaying a delta or redo record, the slot has already been
+     * emptied, and may lie past the current end of the DB.
+     */
+    if (dbio_scanf("#%d", &oid) != 1
+	|| (replay ? oid < 0 : oid != db_last_used_objid() + 1))
 	return 0;
     dbio_read_line(s, sizeof(s));
 
     if (strcmp(s, " recycled\n") == 0) {
-	dbpriv_new_recycled_object();
+	while (db_last_used_objid() < oid)
+	    dbpriv_new_recycled_object();
 	return 1;
     } else if (strcmp(s, "\n") != 0)
 	return 0;
 
-    o = dbpriv_new_object();
+    if (!(o = dbpriv_new_object_at(oid)))
+	return 0;
     o->name = dbio_read_string_intern();
     (void) dbio_read_string();	/* discard old handles string */
     o->flags = dbio_read_num();
@@ -165,6 +190,8 @@ read_object(void)
     for (i = 0; i < nprops; i++) {
 	read_propval(o->propval + i);
     }
+    o->propsparse = 0;
+    dbpriv_compact_propvals(o, nprops);
 
     return 1;
 }
@@ -212,8 +239,14 @@ write_object(Objid oid)
     nprops = dbpriv_count_properties(oid);
 
     dbio_write_num(nprops);
-    for (i = 0; i < nprops; i++)
-	write_propval(o->propval + i);
+    for (i = 0; i < nprops; i++) {
+	Pval pv;
+
+	pv.var = dbpriv_propval_value(o, i);
+	pv.owner = *dbpriv_propval_owner(o, i);
+	pv.perms = *dbpriv_propval_perms(o, i);
+	write_propval(&pv);
+    }
 }
 
 
@@ -390,15 +423,206 @@ fmt_verb_name(void *data)
     return reset_stream(s);
 }
 
+/* The number of processes to use for a job configured for WORKERS of
+ * them, where 0 or less means one per online CPU.
+ */
 static int
-read_db_file(void)
+worker_count(int workers)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    if (workers <= 0)
+	workers = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return workers > 0 ? workers : 1;
+}
+
+/* Programs are read in two passes: the first slices out each verb's
+ * source text, and the second compiles them all, in parallel where
+ * possible (see dbio_compile_programs()), before they are attached in
+ * order.
+ */
+static int
+read_programs(int nprogs, int quiet)
+{
+    Objid oid;
+    int i, vnum, nread, used;
+    db_verb_handle h, *handles;
+    Program_Source *sources;
+    struct timeval start, end;
+    int success = 1;
+
+    if (!quiet)
+	oklog("LOADING: Reading %d MOO verb programs...\n", nprogs);
+    handles = mymalloc((nprogs + 1) * sizeof(db_verb_handle), M_STRUCT);
+    sources = mymalloc((nprogs + 1) * sizeof(Program_Source), M_STRUCT);
+    for (nread = 0; nread < nprogs; nread++) {
+	i = nread + 1;
+	if (dbio_scanf("#%d:%d\n", &oid, &vnum) != 2) {
+	    errlog("READ_DB_FILE: Bad program header, i = %d.\n", i);
+	    success = 0;
+	    break;
+	}
+	if (!valid(oid)) {
+	    errlog("READ_DB_FILE: Verb for non-existant object: #%d:%d.\n",
+		   oid, vnum);
+	    success = 0;
+	    break;
+	}
+	h = db_find_indexed_verb(oid, vnum + 1);	/* DB file is 0-based. */
+	if (!h.ptr) {
+	    errlog("READ_DB_FILE: Unknown verb index: #%d:%d.\n", oid, vnum);
+	    success = 0;
+	    break;
+	}
+	if (!(sources[nread].text = dbio_read_program_text())) {
+	    errlog("READ_DB_FILE: Unexpected EOF in program #%d:%d.\n",
+		   oid, vnum);
+	    success = 0;
+	    break;
+	}
+	handles[nread] = db_dup_verb_handle(h);
+	sources[nread].data = &handles[nread];
+	sources[nread].program = 0;
+    }
+
+    if (success) {
+	gettimeofday(&start, 0);
+	used = dbio_compile_programs(dbio_input_version, sources, nprogs,
+				     fmt_verb_name,
+				     quiet ? 1
+				     : worker_count(LOAD_COMPILE_WORKERS));
+	gettimeofday(&end, 0);
+	if (!quiet)
+	    oklog("LOADING: Compiled %d verb programs in %d ms"
+		  " using %d process%s\n", nprogs,
+		  (int) ((end.tv_sec - start.tv_sec) * 1000
+			 + (end.tv_usec - start.tv_usec) / 1000),
+		  used, used == 1 ? "" : "es");
+    }
+
+    for (i = 0; i < nread; i++) {
+	if (success && !sources[i].program) {
+	    errlog("READ_DB_FILE: Unparsable program %s.\n",
+		   fmt_verb_name(&handles[i]));
+	    success = 0;
+	}
+	if (success)
+	    db_set_verb_program(handles[i], sources[i].program);
+	else if (sources[i].program)
+	    free_program(sources[i].program);
+	db_free_verb_handle(handles[i]);
+	free_str(sources[i].text);
+    }
+    myfree(handles, M_STRUCT);
+    myfree(sources, M_STRUCT);
+
+    if (success && !quiet) {
+	oklog("LOADING: Done reading %d verb programs...\n", nprogs);
+	program_dedup_log();
+    }
+    return success;
+}
+
+#ifdef LAZY_PROGRAMS
+
+/* With LAZY_PROGRAMS, the programs in a DB file of the current version
+ * are not compiled at all while loading: index_programs() just notes
+ * where each one's source is (see db_verb_program()), and the file is
+ * kept open to read them from.  Until a verb is changed, its source is
+ * copied back out as is whenever it is written, loaded or not; that is
+ * what unparsing it would produce, as the file was written that way.
+ */
+static int
+index_programs(int nprogs)
 {
     Objid oid;
+    Verbdef *v;
+    long offset;
+    int i, n, vnum, length;
+
+    oklog("LOADING: Indexing %d MOO verb programs...\n", nprogs);
+    for (i = 1; i <= nprogs; i++) {
+	if (dbio_scanf("#%d:%d\n", &oid, &vnum) != 2) {
+	    errlog("READ_DB_FILE: Bad program header, i = %d.\n", i);
+	    return 0;
+	}
+	if (!valid(oid)) {
+	    errlog("READ_DB_FILE: Verb for non-existant object: #%d:%d.\n",
+		   oid, vnum);
+	    return 0;
+	}
+	for (v = dbpriv_find_object(oid)->verbdefs, n = vnum; v && n > 0;
+	     v = v->next)
+	    n--;
+	if (!v || vnum < 0 || v->lazy) {
+	    errlog("READ_DB_FILE: Unknown verb index: #%d:%d.\n", oid, vnum);
+	    return 0;
+	}
+	if ((length = dbio_skip_program_text(&offset)) < 0) {
+	    errlog("READ_DB_FILE: Unexpected EOF in program #%d:%d.\n",
+		   oid, vnum);
+	    return 0;
+	}
+	dbpriv_set_lazy_program(v, offset, length);
+    }
+    oklog("LOADING: Done indexing %d verb programs...\n", nprogs);
+    return 1;
+}
+
+/* Returns the source L points to, which the caller must myfree(), or
+ * null if it can't be read.
+ */
+static char *
+program_text(Lazy_Program * l)
+{
+    char *text = mymalloc(l->length + 1, M_STRING);
+    int done = 0, n;
+
+    /* pread() leaves the file position alone, which forked children
+     * writing a checkpoint share with the server.
+     */
+    while (done < l->length) {
+	n = pread(fileno(program_source), text + done, l->length - done,
+		  l->offset + done);
+	if (n <= 0) {
+	    myfree(text, M_STRING);
+	    return 0;
+	}
+	done += n;
+    }
+    text[done] = '\0';
+    return text;
+}
+
+Program *
+dbpriv_load_program(db_verb_handle h, Lazy_Program * l)
+{
+    Program_Source src;
+    char *text = program_text(l);
+
+    if (!text) {
+	errlog("DB_VERB_PROGRAM: Cannot read program %s.\n",
+	       fmt_verb_name(&h));
+	return 0;
+    }
+    src.text = text;
+    src.data = &h;
+    dbio_compile_programs(current_db_version, &src, 1, fmt_verb_name, 1);
+    myfree(text, M_STRING);
+    if (!src.program)
+	errlog("DB_VERB_PROGRAM: Unparsable program %s.\n",
+	       fmt_verb_name(&h));
+    return src.program;
+}
+
+#endif				/* LAZY_PROGRAMS */
+
+static int
+read_db_file(void)
+{
     int nobjs, nprogs, nusers;
     Var user_list;
-    int i, vnum, dummy;
-    db_verb_handle h;
-    Program *program;
+    int i, dummy;
 
     if (dbio_scanf(header_format_string, &dbio_input_version) != 1)
 	dbio_input_version = DBV_Prehistory;
@@ -419,6 +643,8 @@ read_db_file(void)
 	errlog("READ_DB_FILE: Bad header\n");
 	return 0;
     }
+    /* Older servers always write 0 here; see the redo log below. */
+    loaded_redo_segment = dummy > 0 ? dummy : 0;
     user_list = new_list(nusers);
     for (i = 1; i <= nusers; i++) {
 	user_list.v.list[i].type = TYPE_OBJ;
@@ -428,7 +654,7 @@ read_db_file(void)
 
     oklog("LOADING: Reading %d objects...\n", nobjs);
     for (i = 1; i <= nobjs; i++) {
-	if (!read_object()) {
+	if (!read_object(0)) {
 	    errlog("READ_DB_FILE: Bad object #%d.\n", i - 1);
 	    return 0;
 	}
@@ -440,35 +666,85 @@ read_db_file(void)
 	errlog("READ_DB_FILE: Errors in object hierarchies.\n");
 	return 0;
     }
-    oklog("LOADING: Reading %d MOO verb programs...\n", nprogs);
-    for (i = 1; i <= nprogs; i++) {
-	if (dbio_scanf("#%d:%d\n", &oid, &vnum) != 2) {
-	    errlog("READ_DB_FILE: Bad program header, i = %d.\n", i);
-	    return 0;
-	}
-	if (!valid(oid)) {
-	    errlog("READ_DB_FILE: Verb for non-existant object: #%d:%d.\n",
-		   oid, vnum);
-	    return 0;
-	}
-	h = db_find_indexed_verb(oid, vnum + 1);	/* DB file is 0-based. */
-	if (!h.ptr) {
-	    errlog("READ_DB_FILE: Unknown verb index: #%d:%d.\n", oid, vnum);
-	    return 0;
-	}
-	h = db_dup_verb_handle(h);
-	program = dbio_read_program(dbio_input_version, fmt_verb_name, &h);
-	if (!program) {
-	    errlog("READ_DB_FILE: Unparsable program #%d:%d.\n", oid, vnum);
-	    db_free_verb_handle(h);
+#ifdef LAZY_PROGRAMS
+    if (dbio_input_version == current_db_version) {
+	program_source = input_db;
+	return index_programs(nprogs);
+    }
+#endif
+    return read_programs(nprogs, 0);
+}
+
+/* The rest of a delta after its header, or a redo record (see
+ * write_changes()).  Redo records are QUIET: they are not logged, and
+ * the hierarchy is checked once after the last of them.
+ */
+static int
+read_delta_file(int quiet)
+{
+    int nobjs, nchanged, nprogs, nusers, nvictims;
+    Var user_list;
+    Objid oid, last = db_last_used_objid();
+    Objid *victims;
+    int *nslots;
+    int i;
+
+    if (dbio_scanf("%d\n%d\n%d\n%d\n",
+		   &nobjs, &nchanged, &nprogs, &nusers) != 4) {
+	errlog("READ_DELTA_FILE: Bad header\n");
+	return 0;
+    }
+    user_list = new_list(nusers);
+    for (i = 1; i <= nusers; i++) {
+	user_list.v.list[i].type = TYPE_OBJ;
+	user_list.v.list[i].v.obj = dbio_read_objid();
+    }
+    free_var(db_all_users());
+    dbpriv_set_all_users(user_list);
+
+    /* The changed objects, plus any old ones past the new end of the
+     * DB, are thrown away before the new versions are read.  Their
+     * property counts depend on their ancestors, so take them all first.
+     */
+    victims = mymalloc((nchanged + (last >= nobjs ? last - nobjs + 1 : 0)
+			+ 1) * sizeof(Objid), M_OBJECT_TABLE);
+    for (i = nvictims = 0; i < nchanged; i++)
+	victims[nvictims++] = dbio_read_objid();
+    for (oid = nobjs; oid <= last; oid++)
+	victims[nvictims++] = oid;
+    nslots = mymalloc((nvictims + 1) * sizeof(int), M_OBJECT_TABLE);
+    for (i = 0; i < nvictims; i++)
+	nslots[i] = valid(victims[i]) ? dbpriv_count_properties(victims[i])
+	    : 0;
+    for (i = 0; i < nvictims; i++)
+	if (victims[i] <= last)
+	    dbpriv_release_object(victims[i], nslots[i]);
+    myfree(nslots, M_OBJECT_TABLE);
+    myfree(victims, M_OBJECT_TABLE);
+
+    if (!quiet)
+	oklog("LOADING: Reading %d changed objects...\n", nchanged);
+    for (i = 1; i <= nchanged; i++)
+	if (!read_object(1)) {
+	    errlog("READ_DELTA_FILE: Bad object (%d of %d).\n", i, nchanged);
 	    return 0;
 	}
-	db_set_verb_program(h, program);
-	db_free_verb_handle(h);
-	if (i == nprogs || log_report_progress())
-	    oklog("LOADING: Done reading %d verb programs...\n", i);
+    if (!dbpriv_set_last_used_objid(nobjs - 1)
+	|| db_last_used_objid() != nobjs - 1) {
+	errlog("READ_DELTA_FILE: Wrong number of objects.\n");
+	return 0;
+    }
+
+    if (!quiet && !validate_hierarchies()) {
+	errlog("READ_DELTA_FILE: Errors in object hierarchies.\n");
+	return 0;
     }
+    return read_programs(nprogs, quiet);
+}
 
+static int
+read_db_tail(void)
+{
     oklog("LOADING: Reading forked and suspended tasks...\n");
     if (!read_task_queue()) {
 	errlog("READ_DB_FILE: Can't read task queue.\n");
@@ -485,125 +761,1383 @@ read_db_file(void)
 
 /*********** File-level Output ***********/
 
-static int
-write_db_file(const char *reason)
+/* The redo log segment that follows the checkpoint being written, or 0;
+ * see the redo log below.
+ */
+static int pending_redo_segment = 0;
+
+/* Output is written a chunk at a time; with compression, each chunk is
+ * collected in a scratch file and then appended to its destination as a
+ * gzip member.
+ */
+static FILE *chunk_scratch = 0;
+
+static FILE *
+begin_chunk(FILE * dest, int level)
+{
+    FILE *out;
+
+    if (level > 0 && !(chunk_scratch = tmpfile()))
+	RAISE(dbpriv_dbio_failed, 0);
+    out = chunk_scratch ? chunk_scratch : dest;
+    dbpriv_set_dbio_output(out);
+    return out;
+}
+
+static void
+end_chunk(FILE * dest, int level)
+{
+    FILE *scratch = chunk_scratch;
+
+    dbpriv_set_dbio_output(dest);
+    if (scratch) {
+	chunk_scratch = 0;
+	TRY
+	    dbpriv_write_chunk(scratch, level);
+	FINALLY
+	    fclose(scratch);
+	ENDTRY;
+    }
+}
+
+static void
+abandon_chunk(void)
+{
+    if (chunk_scratch)
+	fclose(chunk_scratch);
+    chunk_scratch = 0;
+}
+
+/* Writes objects LO through HI, logging progress unless REASON is null. */
+static void
+write_objects(const char *reason, Objid lo, Objid hi)
 {
     Objid oid;
-    Objid max_oid = db_last_used_objid();
-    Verbdef *v;
-    Var user_list;
-    int i;
-    volatile int nprogs = 0;
-    volatile int success = 1;
 
-    for (oid = 0; oid <= max_oid; oid++) {
-	if (valid(oid))
-	    for (v = dbpriv_find_object(oid)->verbdefs; v; v = v->next)
-		if (v->program)
-		    nprogs++;
+    for (oid = lo; oid <= hi; oid++) {
+	write_object(oid);
+	if (reason && (oid == hi || log_report_progress()))
+	    oklog("%s: Done writing %d objects...\n", reason, oid + 1);
     }
+}
 
-    user_list = db_all_users();
+static void
+write_verb_program(Verbdef * v)
+{
+#ifdef LAZY_PROGRAMS
+    if (!v->program) {
+	char *text = program_text(v->lazy);
+
+	if (!text)
+	    RAISE(dbpriv_dbio_failed, 0);
+	TRY
+	    dbio_printf("%s.\n", text);
+	FINALLY
+	    myfree(text, M_STRING);
+	ENDTRY;
+	return;
+    }
+#endif
+    dbio_write_program(v->program);
+}
 
-    TRY {
-	dbio_printf(header_format_string, current_db_version);
-	dbio_printf("%d\n%d\n%d\n%d\n",
-		    max_oid + 1, nprogs, 0, user_list.v.list[0].v.num);
-	for (i = 1; i <= user_list.v.list[0].v.num; i++)
-	    dbio_write_objid(user_list.v.list[i].v.obj);
-	oklog("%s: Writing %d objects...\n", reason, max_oid + 1);
-	for (oid = 0; oid <= max_oid; oid++) {
-	    write_object(oid);
-	    if (oid == max_oid || log_report_progress())
-		oklog("%s: Done writing %d objects...\n", reason, oid + 1);
-	}
-	oklog("%s: Writing %d MOO verb programs...\n", reason, nprogs);
-	for (i = 0, oid = 0; oid <= max_oid; oid++)
-	    if (valid(oid)) {
-		int vcount = 0;
-
-		for (v = dbpriv_find_object(oid)->verbdefs; v; v = v->next) {
-		    if (v->program) {
-			dbio_printf("#%d:%d\n", oid, vcount);
-			dbio_write_program(v->program);
-			if (++i == nprogs || log_report_progress())
-			    oklog("%s: Done writing %d verb programs...\n",
-				  reason, i);
-		    }
-		    vcount++;
+/* Writes the verb programs of objects LO through HI, logging progress
+ * against a total of NPROGS unless REASON is null.
+ */
+static void
+write_programs(const char *reason, Objid lo, Objid hi, int nprogs)
+{
+    Objid oid;
+    Verbdef *v;
+    int i = 0;
+
+    for (oid = lo; oid <= hi; oid++)
+	if (valid(oid)) {
+	    int vcount = 0;
+
+	    for (v = dbpriv_find_object(oid)->verbdefs; v; v = v->next) {
+		if (dbpriv_has_program(v)) {
+		    dbio_printf("#%d:%d\n", oid, vcount);
+		    write_verb_program(v);
+		    if (reason && (++i == nprogs || log_report_progress()))
+			oklog("%s: Done writing %d verb programs...\n",
+			      reason, i);
 		}
+		vcount++;
 	    }
-	oklog("%s: Writing forked and suspended tasks...\n", reason);
-	write_task_queue();
-	oklog("%s: Writing list of formerly active connections...\n", reason);
-	write_active_connections();
-    }
-    EXCEPT(dbpriv_dbio_failed)
-	success = 0;
-    ENDTRY;
+	}
+}
 
-    return success;
+/* A full dump may be split into parts, each a range of object numbers,
+ * which are written (and compressed) at the same time by the server and
+ * WORKERS - 1 forked children.  Part W's objects and its programs go to
+ * PARTS[2W] and PARTS[2W + 1], each as a single chunk, and the server
+ * concatenates them all in order.  As with compiling programs at load time,
+ * a child reports a finished part by sending its number and pid down a
+ * pipe, and any part not reported is written by the server itself.
+ */
+static Objid
+part_start(int w, int workers, Objid max_oid)
+{
+    return (Objid) ((double) (max_oid + 1) * w / workers);
 }
 
-typedef enum {
-    DUMP_SHUTDOWN, DUMP_CHECKPOINT, DUMP_PANIC
-} Dump_Reason;
-const char *reason_names[] =
-{"DUMPING", "CHECKPOINTING", "PANIC-DUMPING"};
+static void
+write_part(int w, int workers, Objid max_oid, FILE ** parts, int level)
+{
+    Objid lo = part_start(w, workers, max_oid);
+    Objid hi = part_start(w + 1, workers, max_oid) - 1;
+
+    begin_chunk(parts[2 * w], level);
+    write_objects(0, lo, hi);
+    end_chunk(parts[2 * w], level);
+    begin_chunk(parts[2 * w + 1], level);
+    write_programs(0, lo, hi, 0);
+    end_chunk(parts[2 * w + 1], level);
+}
 
 static int
-dump_database(Dump_Reason reason)
+open_part(int w, FILE ** parts)
 {
-    Stream *s = new_stream(100);
-    char *temp_name;
-    FILE *f;
-    int success;
+    if ((parts[2 * w] = tmpfile()) && (parts[2 * w + 1] = tmpfile()))
+	return 1;
+    if (parts[2 * w])
+	fclose(parts[2 * w]);
+    parts[2 * w] = 0;
+    return 0;
+}
 
-  retryDumping:
+static void
+close_part(int w, FILE ** parts)
+{
+    if (parts[2 * w]) {
+	fclose(parts[2 * w]);
+	fclose(parts[2 * w + 1]);
+	parts[2 * w] = parts[2 * w + 1] = 0;
+    }
+}
 
-    stream_printf(s, "%s.#%d#", dump_db_name, dump_generation);
-    remove(reset_stream(s));	/* Remove previous checkpoint */
+/* In a forked writer: writes part W and reports on TO_PARENT that it's
+ * done.
+ */
+static void
+write_part_and_exit(int w, int workers, Objid max_oid, FILE ** parts,
+		    int level, int to_parent)
+{
+    int report[2];
 
-    if (reason == DUMP_PANIC)
-	stream_printf(s, "%s.PANIC", dump_db_name);
-    else {
-	dump_generation++;
-	stream_printf(s, "%s.#%d#", dump_db_name, dump_generation);
+    TRY {
+	write_part(w, workers, max_oid, parts, level);
+	report[0] = w;
+	report[1] = getpid();
+	if (fflush(parts[2 * w]) == 0
+	    && fflush(parts[2 * w + 1]) == 0
+	    && write(to_parent, report, sizeof(report)) == sizeof(report))
+	    _exit(0);
     }
-    temp_name = reset_stream(s);
-
-    oklog("%s on %s ...\n", reason_names[reason], temp_name);
+    EXCEPT(dbpriv_dbio_failed)
+	;
+    ENDTRY;
+    _exit(1);
+}
 
-#ifdef UNFORKED_CHECKPOINTS
-    reset_command_history();
-#else
-    if (reason == DUMP_CHECKPOINT) {
-	switch (fork_server("checkpointer")) {
-	case FORK_PARENT:
-	    reset_command_history();
-	    free_stream(s);
-	    return 1;
-	case FORK_ERROR:
-	    free_stream(s);
-	    return 0;
-	case FORK_CHILD:
-	    set_server_cmdline("(MOO checkpointer)");
-	    break;
+static void
+write_parts(const char *reason, Objid max_oid, int nprogs, int workers,
+	    FILE * out, int level)
+{
+    FILE **parts = mymalloc(2 * workers * sizeof(FILE *), M_STRUCT);
+    char *done = mymalloc(workers, M_STRUCT);
+    int fds[2];
+    int w;
+
+    fds[0] = -1;
+    memset(parts, 0, 2 * workers * sizeof(FILE *));
+    memset(done, 0, workers);
+    oklog("%s: Writing %d objects in %d parts...\n", reason, max_oid + 1,
+	  workers);
+
+#if HAVE_WAITPID
+    if (pipe(fds) < 0)
+	fds[0] = -1;
+    else {
+	for (w = 1; w < workers; w++) {
+	    if (!open_part(w, parts))
+		continue;
+	    switch (fork_server("checkpoint writer")) {
+	    case FORK_CHILD:
+		close(fds[0]);
+		write_part_and_exit(w, workers, max_oid, parts, level, fds[1]);
+	    case FORK_PARENT:
+		break;
+	    case FORK_ERROR:
+		close_part(w, parts);
+		break;
+	    }
 	}
+	close(fds[1]);
     }
 #endif
 
-    success = 1;
-    if ((f = fopen(temp_name, "w")) != 0) {
-	dbpriv_set_dbio_output(f);
-	if (!write_db_file(reason_names[reason])) {
-	    log_perror("Trying to dump database");
-	    fclose(f);
-	    remove(temp_name);
-	    if (reason == DUMP_CHECKPOINT) {
-		errlog("Abandoning checkpoint attempt...\n");
-		success = 0;
-	    } else {
+    TRY {
+	for (w = 0; w < workers; w++) {
+#if HAVE_WAITPID
+	    if (w == 1 && fds[0] >= 0) {
+		int report[2];
+
+		while (read(fds[0], report, sizeof(report)) == sizeof(report)) {
+		    if (report[0] > 0 && report[0] < workers)
+			done[report[0]] = 1;
+		    waitpid(report[1], 0, 0);
+		}
+		close(fds[0]);
+		fds[0] = -1;
+	    }
+#endif
+	    if (done[w])
+		continue;
+	    close_part(w, parts);
+	    if (!open_part(w, parts))
+		RAISE(dbpriv_dbio_failed, 0);
+	    write_part(w, workers, max_oid, parts, level);
+	    done[w] = 1;
+	}
+	oklog("%s: Done writing %d objects...\n", reason, max_oid + 1);
+	dbpriv_set_dbio_output(out);
+	for (w = 0; w < workers; w++)
+	    dbpriv_write_chunk(parts[2 * w], 0);
+	oklog("%s: Writing %d MOO verb programs...\n", reason, nprogs);
+	for (w = 0; w < workers; w++)
+	    dbpriv_write_chunk(parts[2 * w + 1], 0);
+	oklog("%s: Done writing %d verb programs...\n", reason, nprogs);
+    }
+    FINALLY {
+	abandon_chunk();
+	dbpriv_set_dbio_output(out);
+	if (fds[0] >= 0)
+	    close(fds[0]);
+	for (w = 0; w < workers; w++)
+	    close_part(w, parts);
+	myfree(parts, M_STRUCT);
+	myfree(done, M_STRUCT);
+    }
+    ENDTRY;
+}
+
+static int
+count_programs(Objid max_oid)
+{
+    Objid oid;
+    Verbdef *v;
+    int nprogs = 0;
+
+    for (oid = 0; oid <= max_oid; oid++) {
+	if (valid(oid))
+	    for (v = dbpriv_find_object(oid)->verbdefs; v; v = v->next)
+		if (dbpriv_has_program(v))
+		    nprogs++;
+    }
+    return nprogs;
+}
+
+static void
+write_db_header(Objid max_oid, int nprogs)
+{
+    Var user_list = db_all_users();
+    int i;
+
+    dbio_printf(header_format_string, current_db_version);
+    dbio_printf("%d\n%d\n%d\n%d\n",
+		max_oid + 1, nprogs, pending_redo_segment,
+		user_list.v.list[0].v.num);
+    for (i = 1; i <= user_list.v.list[0].v.num; i++)
+	dbio_write_objid(user_list.v.list[i].v.obj);
+}
+
+/* The body of write_db_file(), kept out of its TRY so that none of these
+ * locals lives across the setjmp().
+ */
+static void
+write_db_contents(const char *reason, FILE * out, int workers, int level)
+{
+    Objid max_oid = db_last_used_objid();
+    int nprogs = count_programs(max_oid);
+
+    /* Too many parts for too few objects just costs processes. */
+    if (workers > (max_oid + 1) / 256)
+	workers = (max_oid + 1) / 256;
+
+    begin_chunk(out, level);
+    write_db_header(max_oid, nprogs);
+    end_chunk(out, level);
+    if (workers > 1)
+	write_parts(reason, max_oid, nprogs, workers, out, level);
+    else {
+	oklog("%s: Writing %d objects...\n", reason, max_oid + 1);
+	begin_chunk(out, level);
+	write_objects(reason, 0, max_oid);
+	end_chunk(out, level);
+	oklog("%s: Writing %d MOO verb programs...\n", reason, nprogs);
+	begin_chunk(out, level);
+	write_programs(reason, 0, max_oid, nprogs);
+	end_chunk(out, level);
+    }
+    begin_chunk(out, level);
+    oklog("%s: Writing forked and suspended tasks...\n", reason);
+    write_task_queue();
+    oklog("%s: Writing list of formerly active connections...\n", reason);
+    write_active_connections();
+    end_chunk(out, level);
+}
+
+/* Writes a full DB to OUT, using up to WORKERS processes, in chunks
+ * compressed at LEVEL if that's positive.
+ */
+static int
+write_db_file(const char *reason, FILE * out, int workers, int level)
+{
+    volatile int success = 1;
+
+    TRY
+	write_db_contents(reason, out, workers, level);
+    EXCEPT(dbpriv_dbio_failed)
+	success = 0;
+    ENDTRY;
+
+    abandon_chunk();
+    dbpriv_set_dbio_output(out);
+    return success;
+}
+
+/*********** Incremental checkpoints ***********/
+
+/* With $server_options.checkpoint_deltas set to N > 0, each checkpoint
+ * after a full one writes only the object slots changed since the last
+ * successful checkpoint (with their verb programs, the user list, tasks
+ * and connections) to DUMP.delta.K, for K = 1, 2, ...  Every Nth
+ * checkpoint and every shutdown writes the full DB again and removes
+ * the deltas.  At load time INPUT.delta.1, INPUT.delta.2, ... are
+ * replayed over INPUT as long as each names the MD5 digest of INPUT and
+ * the right sequence number.
+ */
+
+static int have_base = 0;	/* dump_db_name is a full dump of ours */
+static int delta_count = 0;	/* deltas written on top of it */
+static unsigned base_epoch = 0;	/* changes up to here are on disk */
+static unsigned pending_epoch;
+static int pending_delta;
+static int checkpoint_in_flight = 0;
+static char base_digest[33];	/* of dump_db_name, once it's been needed */
+
+static const char *
+aux_name(const char *db_name, const char *kind, int seq)
+{
+    static Stream *s = 0;
+
+    if (!s)
+	s = new_stream(100);
+
+    stream_printf(s, "%s.%s.%d", db_name, kind, seq);
+    return reset_stream(s);
+}
+
+/* Returns the MD5 digest of the file NAME in hex, or "" if it can't be
+ * read.
+ */
+static const char *
+file_digest(const char *name)
+{
+    static char hex[33];
+    static const char digits[] = "0123456789abcdef";
+    FILE *f = fopen(name, "r");
+    md5ctx_t context;
+    uint8 buffer[16384], result[16];
+    size_t count;
+    int i;
+
+    hex[0] = '\0';
+    if (!f)
+	return hex;
+    md5_Init(&context);
+    while ((count = fread(buffer, 1, sizeof(buffer), f)) > 0)
+	md5_Update(&context, buffer, count);
+    if (!ferror(f)) {
+	md5_Final(&context, result);
+	for (i = 0; i < 16; i++) {
+	    hex[2 * i] = digits[result[i] >> 4];
+	    hex[2 * i + 1] = digits[result[i] & 0xF];
+	}
+	hex[32] = '\0';
+    }
+    fclose(f);
+    return hex;
+}
+
+static void
+remove_deltas(const char *db_name)
+{
+    int seq;
+
+    for (seq = 1; remove(aux_name(db_name, "delta", seq)) == 0; seq++)
+	;
+}
+
+/* The body shared by deltas and redo records: the user list and the
+ * given object slots, in increasing order, with their verb programs.
+ * REASON is null for redo records, which are not logged.
+ */
+static void
+write_changes(const char *reason, Objid * oids, int n)
+{
+    Objid max_oid = db_last_used_objid();
+    Var user_list = db_all_users();
+    Verbdef *v;
+    int i, nprogs = 0;
+
+    for (i = 0; i < n; i++)
+	if (valid(oids[i]))
+	    for (v = dbpriv_find_object(oids[i])->verbdefs; v; v = v->next)
+		if (dbpriv_has_program(v))
+		    nprogs++;
+
+    dbio_printf("%d\n%d\n%d\n%d\n",
+		max_oid + 1, n, nprogs, user_list.v.list[0].v.num);
+    for (i = 1; i <= user_list.v.list[0].v.num; i++)
+	dbio_write_objid(user_list.v.list[i].v.obj);
+    for (i = 0; i < n; i++)
+	dbio_write_objid(oids[i]);
+    if (reason)
+	oklog("%s: Writing %d changed objects...\n", reason, n);
+    for (i = 0; i < n; i++)
+	write_object(oids[i]);
+    if (reason)
+	oklog("%s: Writing %d MOO verb programs...\n", reason, nprogs);
+    for (i = 0; i < n; i++)
+	if (valid(oids[i])) {
+	    int vcount = 0;
+
+	    for (v = dbpriv_find_object(oids[i])->verbdefs; v; v = v->next) {
+		if (dbpriv_has_program(v)) {
+		    dbio_printf("#%d:%d\n", oids[i], vcount);
+		    write_verb_program(v);
+		}
+		vcount++;
+	    }
+	}
+}
+
+static int
+write_delta_file(const char *reason, const char *base, int seq)
+{
+    Objid oid;
+    Objid max_oid = db_last_used_objid();
+    Objid *oids;
+    int n = 0;
+    volatile int success = 1;
+
+    oids = mymalloc((max_oid + 2) * sizeof(Objid), M_OBJECT_TABLE);
+    for (oid = 0; oid <= max_oid; oid++)
+	if (dbpriv_slot_epoch(oid) > base_epoch)
+	    oids[n++] = oid;
+
+    TRY {
+	dbio_printf(delta_header_format_string, current_db_version);
+	dbio_printf("%s\n%d\n%d\n", base, seq, pending_redo_segment);
+	write_changes(reason, oids, n);
+	oklog("%s: Writing forked and suspended tasks...\n", reason);
+	write_task_queue();
+	oklog("%s: Writing list of formerly active connections...\n", reason);
+	write_active_connections();
+    }
+    EXCEPT(dbpriv_dbio_failed)
+	success = 0;
+    ENDTRY;
+
+    myfree(oids, M_OBJECT_TABLE);
+    return success;
+}
+
+/*********** Redo log ***********/
+
+/* With $server_options.redo_log set, changes made between checkpoints are
+ * also appended to a redo log, so that a crash loses only what the tasks
+ * of the last pass through the ready queue did, not everything since the
+ * last checkpoint.  The log is split into segments, DUMP.redo.N.  Each
+ * checkpoint starts a new segment and records its number (in the
+ * otherwise unused third header field of a full DB, or in a delta's
+ * header); older segments are removed once the checkpoint succeeds.
+ *
+ * db_flush(FLUSH_IF_FULL) commits one record per call, holding the current
+ * state of every object slot dirtied since the previous commit, in the
+ * same form as a delta.  The server calls it after each pass through the
+ * ready tasks, so all the tasks of a pass share one record.  At load time,
+ * INPUT.redo.N, N+1, ... are replayed after the checkpoint that named N,
+ * stopping at the first incomplete record.  The task queue and the
+ * connections still come from that checkpoint.
+ *
+ * Each segment is written by its own redo writer process (see
+ * redo_writer()), so that neither the writes nor the fsync()s hold up the
+ * server.  Records go to it down the non-blocking pipe REDO_TO; whatever
+ * the pipe won't take at once waits in REDO_PENDING.  If the writer falls
+ * more than REDO_BUFFER_SIZE bytes behind, or dies, logging stops until the
+ * next checkpoint rather than leave a gap in the log.  If no writer can be
+ * started, the server writes the segment itself.  The writer forces the
+ * segment to disk subject to $server_options.redo_fsync_interval: negative
+ * for never, 0 (the default) after each batch of records it reads, and N
+ * for at most once every N seconds.
+ */
+
+static int redo_fd = -1;	/* segment being written, if any */
+static int redo_to = -1;	/* pipe to its writer, if any */
+static FILE *redo_buffer = 0;	/* scratch space for each record */
+static char *redo_pending = 0;
+static int redo_pending_length = 0, redo_pending_size = 0;
+static int redo_next_segment = 1;
+static int redo_fsync_interval;
+static time_t redo_last_sync;
+static int pending_redo_floor = 0;	/* segments below this are obsolete
+					 * once the checkpoint in progress
+					 * succeeds */
+
+static int
+write_fully(int fd, const char *text, int length)
+{
+    int count;
+
+    while (length > 0) {
+	count = write(fd, text, length);
+	if (count < 0 && errno == EINTR)
+	    continue;
+	if (count <= 0)
+	    return 0;
+	text += count;
+	length -= count;
+    }
+    return 1;
+}
+
+/* The redo writer process: copies records from the server into the segment
+ * until the server closes the pipe.  It exits at once if it can't write, so
+ * that the server notices.  It keeps no other descriptors open, so as not to
+ * hold on to the server's connections.
+ */
+static void
+redo_writer(int to_server, int from_server)
+{
+    static char buffer[65536];
+    int fd, max_fd, count, unsynced = 0;
+
+    set_server_cmdline("(MOO redo writer)");
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    max_fd = sysconf(_SC_OPEN_MAX);
+    for (fd = 0; fd < (max_fd > 0 ? max_fd : 256); fd++)
+	if (fd != from_server && fd != redo_fd)
+	    close(fd);
+
+    for (;;) {
+#if HAVE_SELECT
+	if (unsynced) {		/* wait only until the next fsync() is due */
+	    fd_set readable;
+	    struct timeval tv;
+	    time_t left = redo_last_sync + redo_fsync_interval - time(0);
+
+	    FD_ZERO(&readable);
+	    FD_SET(from_server, &readable);
+	    tv.tv_sec = left > 0 ? left : 0;
+	    tv.tv_usec = 0;
+	    if (select(from_server + 1, &readable, 0, 0, &tv) == 0) {
+		if (fsync(redo_fd) != 0)
+		    _exit(1);
+		redo_last_sync = time(0);
+		unsynced = 0;
+		continue;
+	    }
+	}
+#endif
+	count = read(from_server, buffer, sizeof(buffer));
+	if (count < 0 && errno == EINTR)
+	    continue;
+	if (count <= 0)
+	    break;
+	if (!write_fully(redo_fd, buffer, count))
+	    _exit(1);
+	if (redo_fsync_interval >= 0) {
+	    unsynced = 1;
+	    if (time(0) - redo_last_sync >= redo_fsync_interval) {
+		if (fsync(redo_fd) != 0)
+		    _exit(1);
+		redo_last_sync = time(0);
+		unsynced = 0;
+	    }
+	}
+    }
+    if (unsynced && fsync(redo_fd) != 0)
+	_exit(1);
+    _exit(0);
+}
+
+/* Sends as much of REDO_PENDING as the pipe will take, returning false if
+ * the writer has gone away.
+ */
+static int
+redo_write_pending(void)
+{
+    int sent = 0, count, ok = 1;
+
+    while (sent < redo_pending_length) {
+	count = write(redo_to, redo_pending + sent,
+		      redo_pending_length - sent);
+	if (count > 0)
+	    sent += count;
+	else if (count < 0 && errno == EINTR)
+	    continue;
+	else {
+	    ok = count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	    break;
+	}
+    }
+    redo_pending_length -= sent;
+    memmove(redo_pending, redo_pending + sent, redo_pending_length);
+    return ok;
+}
+
+/* Hands the writer whatever it hasn't taken yet, waiting up to ten seconds
+ * for it to make room.
+ */
+static void
+redo_drain(void)
+{
+    time_t give_up = time(0) + 10;
+
+    while (redo_to >= 0 && redo_pending_length > 0) {
+#if HAVE_SELECT
+	fd_set writable;
+	struct timeval tv;
+#endif
+
+	if (!redo_write_pending()) {
+	    errlog("REDO: Log writer has died\n");
+	    return;
+	}
+	if (redo_pending_length == 0)
+	    return;
+	if (time(0) >= give_up) {
+	    errlog("REDO: Log writer is stuck; %d bytes of the log are lost\n",
+		   redo_pending_length);
+	    return;
+	}
+#if HAVE_SELECT
+	FD_ZERO(&writable);
+	FD_SET(redo_to, &writable);
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	select(redo_to + 1, 0, &writable, 0, &tv);
+#else
+	sleep(1);
+#endif
+    }
+}
+
+static void
+redo_close(void)
+{
+    redo_drain();
+    if (redo_to >= 0) {
+	close(redo_to);
+	redo_to = -1;
+    }
+    if (redo_fd >= 0) {
+	close(redo_fd);
+	redo_fd = -1;
+    }
+    redo_pending_length = 0;
+    dbpriv_journaling = 0;
+}
+
+/* In a forked checkpointer, let go of the log and its writer. */
+static void
+redo_abandon(void)
+{
+    if (redo_to >= 0)
+	close(redo_to);
+    if (redo_fd >= 0)
+	close(redo_fd);
+    if (redo_buffer)
+	close(fileno(redo_buffer));
+    redo_to = redo_fd = -1;
+    redo_buffer = 0;
+    redo_pending_length = 0;
+    dbpriv_journaling = 0;
+}
+
+static int
+redo_open(void)
+{
+    const char *name;
+    char header[100];
+    int flags, from_writer;
+
+    if (!server_int_option("redo_log", 0))
+	return 0;
+
+    if (!redo_buffer && !(redo_buffer = tmpfile())) {
+	log_perror("REDO: Creating scratch file");
+	return 0;
+    }
+    name = aux_name(dump_db_name, "redo", redo_next_segment);
+    redo_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+    sprintf(header, redo_header_format_string, current_db_version);
+    if (redo_fd < 0 || !write_fully(redo_fd, header, strlen(header))) {
+	log_perror("REDO: Opening log segment");
+	if (redo_fd >= 0)
+	    close(redo_fd);
+	redo_fd = -1;
+	return 0;
+    }
+    redo_fsync_interval = server_int_option("redo_fsync_interval", 0);
+    redo_last_sync = time(0);
+
+    if (!spawn_pipe(redo_writer, &redo_to, &from_writer)) {
+	errlog("REDO: Can't start log writer; writing the log directly\n");
+	redo_to = -1;
+    } else {
+	close(from_writer);	/* the writer never answers */
+	if ((flags = fcntl(redo_to, F_GETFL, 0)) >= 0)
+	    fcntl(redo_to, F_SETFL, flags | NONBLOCK_FLAG);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    oklog("REDO: Logging changes to %s\n", name);
+
+    dbpriv_clear_journal();
+    dbpriv_journaling = 1;
+
+    return redo_next_segment++;
+}
+
+static int
+compare_oids(const void *a, const void *b)
+{
+    Objid x = *(const Objid *) a, y = *(const Objid *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void
+redo_commit(void)
+{
+    Objid max_oid = db_last_used_objid();
+    Objid *oids;
+    int n;
+    long length;
+    char prefix[30];
+    volatile int ok = 1;
+
+    if (redo_to >= 0 && redo_pending_length > 0 && !redo_write_pending()) {
+	errlog("REDO: Log writer has died\n");
+	ok = 0;
+    }
+    oids = dbpriv_journal(&n);
+    if (ok && (redo_fd < 0 || n == 0))
+	return;
+    if (ok && redo_to >= 0 && redo_pending_length > REDO_BUFFER_SIZE) {
+	errlog("REDO: Log writer is more than %d bytes behind\n",
+	       REDO_BUFFER_SIZE);
+	ok = 0;
+    }
+
+    /* Slots past the end were cut off by reset_max_object(), which the
+     * record's object count conveys by itself.
+     */
+    qsort(oids, n, sizeof(Objid), compare_oids);
+    while (n > 0 && oids[n - 1] > max_oid)
+	n--;
+
+    if (ok) {
+	rewind(redo_buffer);
+	dbpriv_set_dbio_output(redo_buffer);
+	TRY
+	    write_changes(0, oids, n);
+	EXCEPT(dbpriv_dbio_failed)
+	    ok = 0;
+	ENDTRY;
+    }
+    dbpriv_clear_journal();
+
+    /* The length prefix lets the loader recognize a torn last record. */
+    if (ok) {
+	int needed;
+
+	length = ftell(redo_buffer);
+	sprintf(prefix, "+%ld\n", length);
+	needed = redo_pending_length + strlen(prefix) + length;
+	if (needed > redo_pending_size) {
+	    char *new;
+
+	    redo_pending_size = (needed < 2 * redo_pending_size
+				 ? 2 * redo_pending_size : needed);
+	    new = mymalloc(redo_pending_size, M_STRING);
+	    if (redo_pending) {
+		memcpy(new, redo_pending, redo_pending_length);
+		myfree(redo_pending, M_STRING);
+	    }
+	    redo_pending = new;
+	}
+	memcpy(redo_pending + redo_pending_length, prefix, strlen(prefix));
+	rewind(redo_buffer);
+	ok = fread(redo_pending + redo_pending_length + strlen(prefix), 1,
+		   length, redo_buffer) == (size_t) length;
+	if (!ok)
+	    log_perror("REDO: Reading scratch file");
+	else
+	    redo_pending_length = needed;
+    }
+    if (ok && redo_to >= 0 && !redo_write_pending()) {
+	errlog("REDO: Log writer has died\n");
+	ok = 0;
+    } else if (ok && redo_to < 0) {
+	ok = write_fully(redo_fd, redo_pending, redo_pending_length);
+	redo_pending_length = 0;
+	if (ok && redo_fsync_interval >= 0) {
+	    time_t now = time(0);
+
+	    if (now - redo_last_sync >= redo_fsync_interval) {
+		ok = fsync(redo_fd) == 0;
+		redo_last_sync = now;
+	    }
+	}
+	if (!ok)
+	    log_perror("REDO: Writing log");
+    }
+    if (!ok) {
+	errlog("REDO: Logging suspended until the next checkpoint\n");
+	redo_pending_length = 0;
+	redo_close();
+    }
+}
+
+/* Replays INPUT.redo.N, N+1, ... until one is missing or ends early. */
+static int
+replay_redo_log(void)
+{
+    int first = loaded_redo_segment;
+    int segment, records = 0;
+    int complete = 1;
+    FILE *f;
+
+    if (first == 0)
+	return 1;
+    redo_next_segment = first;
+
+    for (segment = first; complete
+	 && (f = fopen(aux_name(input_db_name, "redo", segment), "r")) != 0;
+	 segment++) {
+	struct stat st;
+	int length;
+
+	dbpriv_set_dbio_input(f);
+	fstat(fileno(f), &st);
+	if (dbio_scanf(redo_header_format_string, &dbio_input_version) != 1
+	    || !check_db_version(dbio_input_version))
+	    complete = 0;
+	else
+	    while (dbio_scanf("+%d\n", &length) == 1) {
+		if (ftell(f) + length > st.st_size) {
+		    complete = 0;
+		    break;
+		}
+		if (!read_delta_file(1)) {
+		    errlog("LOADING: Bad redo record in %s\n",
+			   aux_name(input_db_name, "redo", segment));
+		    fclose(f);
+		    return 0;
+		}
+		records++;
+	    }
+	if (ftell(f) != st.st_size)
+	    complete = 0;
+	if (!complete) {
+	    errlog("LOADING: %s ends with an incomplete record\n",
+		   aux_name(input_db_name, "redo", segment));
+	    loaded_redo_segment = 0;	/* don't log after a gap */
+	}
+	fclose(f);
+	redo_next_segment = segment + 1;
+    }
+
+    oklog("LOADING: Replayed %d redo records from %d log segments\n",
+	  records, segment - first);
+    if (records > 0 && !validate_hierarchies()) {
+	errlog("LOADING: Errors in object hierarchies after redo log\n");
+	return 0;
+    }
+    return 1;
+}
+
+static void
+remove_redo_segments(int below)
+{
+    while (--below > 0 && remove(aux_name(dump_db_name, "redo", below)) == 0)
+	;
+}
+
+static void
+checkpoint_done(int success)
+{
+    if (success) {
+	base_epoch = pending_epoch;
+	if (pending_delta)
+	    delta_count++;
+	else {
+	    have_base = 1;
+	    delta_count = 0;
+	    base_digest[0] = '\0';
+	}
+	remove_redo_segments(pending_redo_floor);
+    }
+    checkpoint_in_flight = 0;
+}
+
+void
+db_checkpoint_finished(int success)
+{
+    if (checkpoint_in_flight)
+	checkpoint_done(success);
+}
+
+typedef enum {
+    DUMP_SHUTDOWN, DUMP_CHECKPOINT, DUMP_PANIC
+} Dump_Reason;
+const char *reason_names[] =
+{"DUMPING", "CHECKPOINTING", "PANIC-DUMPING"};
+
+/* Finishes F, a dump written on TEMP_NAME, and moves it to FINAL_NAME,
+ * if that's not null.
+ */
+static int
+commit_dump(FILE * f, const char *reason, const char *temp_name,
+	    const char *final_name, int incremental)
+{
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+    oklog("%s on %s finished\n", reason, temp_name);
+    if (final_name) {
+	remove(final_name);
+	if (rename(temp_name, final_name) != 0) {
+	    log_perror("Renaming temporary dump file");
+	    return 0;
+	} else if (!incremental)
+	    remove_deltas(dump_db_name);
+    }
+    return 1;
+}
+
+/*********** Background checkpoints ***********/
+
+/* With BACKGROUND_CHECKPOINTS defined, the server writes each full
+ * checkpoint itself, a slice of at most BACKGROUND_CHECKPOINT_SLICE
+ * milliseconds at a time between rounds of tasks, instead of forking a
+ * child to do it.  The file is still the DB as of the checkpoint's start:
+ * the header goes out, and the task queue and connections are set aside
+ * in a scratch file, right then; after that, the first time a task is
+ * about to change an object slot whose verb programs haven't been written
+ * yet, dbpriv_dirty() has the old versions of the slot and its programs
+ * saved in another scratch file, to be copied into the dump in their
+ * place.  Incremental checkpoints are small, and are written on the spot.
+ */
+
+#ifdef BACKGROUND_CHECKPOINTS
+
+int dbpriv_snapshotting = 0;
+
+typedef struct {
+    long object;		/* offset of the slot's old version, or -1 if
+				 * it had already been written */
+    long programs;		/* offset of its old verb programs */
+    long end;
+} Saved_Slot;
+
+static FILE *bg_file = 0;	/* the checkpoint in progress, if any */
+static char *bg_temp_name;
+static FILE *bg_out;		/* where its current chunk goes */
+static Objid bg_max_oid;
+static int bg_nprogs;
+static int bg_phase;		/* 0 = objects, 1 = programs */
+static Objid bg_next;		/* next slot for the current phase */
+static int bg_failed;
+static FILE *bg_tail;		/* the task queue and connections */
+static FILE *bg_saved;		/* old versions of changed slots */
+static int *bg_saved_index;	/* per slot, its entry in bg_slots or -1 */
+static Saved_Slot *bg_slots;
+static int bg_nslots, bg_max_slots;
+static int bg_result = 0;	/* for db_continue_checkpoint() */
+
+void
+dbpriv_snapshot_object(Objid oid)
+{
+    Saved_Slot *s;
+
+    if (oid > bg_max_oid || bg_saved_index[oid] >= 0 || bg_failed
+	|| (bg_phase == 1 && oid < bg_next))
+	return;
+
+    if (bg_nslots == bg_max_slots) {
+	Saved_Slot *new;
+	int i;
+
+	bg_max_slots = bg_max_slots ? bg_max_slots * 2 : 64;
+	new = mymalloc(bg_max_slots * sizeof(Saved_Slot), M_OBJECT_TABLE);
+	for (i = 0; i < bg_nslots; i++)
+	    new[i] = bg_slots[i];
+	if (bg_slots)
+	    myfree(bg_slots, M_OBJECT_TABLE);
+	bg_slots = new;
+    }
+    s = &bg_slots[bg_nslots];
+
+    dbpriv_set_dbio_output(bg_saved);
+    TRY {
+	if (fseek(bg_saved, 0, SEEK_END) != 0)
+	    RAISE(dbpriv_dbio_failed, 0);
+	s->object = -1;
+	if (bg_phase == 0 && oid >= bg_next) {
+	    s->object = ftell(bg_saved);
+	    write_object(oid);
+	}
+	s->programs = ftell(bg_saved);
+	write_programs(0, oid, oid, 0);
+	s->end = ftell(bg_saved);
+	bg_saved_index[oid] = bg_nslots++;
+    }
+    EXCEPT(dbpriv_dbio_failed)
+	bg_failed = 1;
+    ENDTRY;
+}
+
+static void
+copy_saved(long from, long to)
+{
+    char buffer[8192];
+    size_t n;
+
+    if (fseek(bg_saved, from, SEEK_SET) != 0)
+	RAISE(dbpriv_dbio_failed, 0);
+    while (from < to) {
+	n = to - from < (long) sizeof(buffer) ? to - from : sizeof(buffer);
+	if (fread(buffer, 1, n, bg_saved) != n
+	    || fwrite(buffer, 1, n, bg_out) != n)
+	    RAISE(dbpriv_dbio_failed, 0);
+	from += n;
+    }
+}
+
+static void
+end_background_dump(void)
+{
+    dbpriv_snapshotting = 0;
+    abandon_chunk();
+    if (bg_tail)
+	fclose(bg_tail);
+    if (bg_saved)
+	fclose(bg_saved);
+    if (bg_saved_index)
+	myfree(bg_saved_index, M_OBJECT_TABLE);
+    if (bg_slots)
+	myfree(bg_slots, M_OBJECT_TABLE);
+    free_str(bg_temp_name);
+    bg_file = bg_tail = bg_saved = 0;
+    bg_saved_index = 0;
+    bg_slots = 0;
+    bg_nslots = bg_max_slots = 0;
+}
+
+static void
+abandon_background_dump(void)
+{
+    if (bg_file) {
+	errlog("CHECKPOINTING: Abandoning checkpoint on %s\n", bg_temp_name);
+	fclose(bg_file);
+	remove(bg_temp_name);
+	end_background_dump();
+	checkpoint_done(0);
+    }
+}
+
+static int
+start_background_dump(const char *temp_name)
+{
+    volatile int ok = 1;
+    Objid oid;
+
+    if (!(bg_file = fopen(temp_name, "w"))) {
+	log_perror("Opening temporary dump file");
+	return 0;
+    }
+    bg_temp_name = str_dup(temp_name);
+    bg_max_oid = db_last_used_objid();
+    bg_nprogs = count_programs(bg_max_oid);
+    bg_saved_index = mymalloc((bg_max_oid + 1) * sizeof(int),
+			      M_OBJECT_TABLE);
+    for (oid = 0; oid <= bg_max_oid; oid++)
+	bg_saved_index[oid] = -1;
+    bg_phase = 0;
+    bg_next = 0;
+    bg_failed = 0;
+
+    TRY {
+	if (!(bg_tail = tmpfile()) || !(bg_saved = tmpfile()))
+	    RAISE(dbpriv_dbio_failed, 0);
+	begin_chunk(bg_file, DUMP_COMPRESSION_LEVEL);
+	write_db_header(bg_max_oid, bg_nprogs);
+	end_chunk(bg_file, DUMP_COMPRESSION_LEVEL);
+	dbpriv_set_dbio_output(bg_tail);
+	write_task_queue();
+	write_active_connections();
+	bg_out = begin_chunk(bg_file, DUMP_COMPRESSION_LEVEL);
+    }
+    EXCEPT(dbpriv_dbio_failed)
+	ok = 0;
+    ENDTRY;
+
+    if (!ok) {
+	log_perror("Trying to dump database");
+	fclose(bg_file);
+	remove(bg_temp_name);
+	end_background_dump();
+	return 0;
+    }
+    dbpriv_snapshotting = 1;
+    oklog("CHECKPOINTING: Writing %d objects in the background...\n",
+	  bg_max_oid + 1);
+    return 1;
+}
+
+int
+db_checkpoint_in_progress(void)
+{
+    return bg_file != 0;
+}
+
+int
+db_continue_checkpoint(void)
+{
+    struct timeval start, now;
+    volatile int done = 0, ok = 1;
+    int result, count = 0;
+
+    if (!bg_file) {
+	result = bg_result;
+	bg_result = 0;
+	return result;
+    }
+
+    gettimeofday(&start, 0);
+    TRY {
+	if (bg_failed)
+	    RAISE(dbpriv_dbio_failed, 0);
+	dbpriv_set_dbio_output(bg_out);
+	while (!done) {
+	    if (bg_next > bg_max_oid) {
+		end_chunk(bg_file, DUMP_COMPRESSION_LEVEL);
+		if (bg_phase == 0) {
+		    oklog("CHECKPOINTING: Done writing %d objects...\n",
+			  bg_max_oid + 1);
+		    oklog("CHECKPOINTING: Writing %d MOO verb programs...\n",
+			  bg_nprogs);
+		    bg_out = begin_chunk(bg_file, DUMP_COMPRESSION_LEVEL);
+		    bg_phase = 1;
+		    bg_next = 0;
+		    continue;
+		}
+		dbpriv_snapshotting = 0;
+		oklog("CHECKPOINTING: Done writing %d verb programs...\n",
+		      bg_nprogs);
+		oklog("CHECKPOINTING: Writing forked and suspended tasks "
+		      "and formerly active connections...\n");
+		dbpriv_write_chunk(bg_tail, DUMP_COMPRESSION_LEVEL);
+		done = 1;
+		break;
+	    }
+	    if (bg_saved_index[bg_next] >= 0) {
+		Saved_Slot *s = &bg_slots[bg_saved_index[bg_next]];
+
+		if (bg_phase == 0)
+		    copy_saved(s->object, s->programs);
+		else
+		    copy_saved(s->programs, s->end);
+	    } else if (bg_phase == 0)
+		write_object(bg_next);
+	    else
+		write_programs(0, bg_next, bg_next, 0);
+	    bg_next++;
+
+	    if (++count % 32 == 0) {
+		gettimeofday(&now, 0);
+		if ((now.tv_sec - start.tv_sec) * 1000
+		    + (now.tv_usec - start.tv_usec) / 1000
+		    >= BACKGROUND_CHECKPOINT_SLICE)
+		    break;
+	    }
+	}
+    }
+    EXCEPT(dbpriv_dbio_failed)
+	ok = 0;
+    ENDTRY;
+
+    if (!ok) {
+	log_perror("Trying to dump database");
+	fclose(bg_file);
+	remove(bg_temp_name);
+	errlog("Abandoning checkpoint attempt...\n");
+	end_background_dump();
+	return 1;
+    }
+    if (!done)
+	return 0;
+    result = commit_dump(bg_file, "CHECKPOINTING", bg_temp_name,
+			 dump_db_name, 0);
+    end_background_dump();
+    return result + 1;
+}
+
+#define background_dump_running() (bg_file != 0)
+
+#else				/* !BACKGROUND_CHECKPOINTS */
+
+#define background_dump_running() 0
+
+#endif				/* !BACKGROUND_CHECKPOINTS */
+
+/* Full dumps are written by several processes only where their exits
+ * can't be mistaken for a checkpointer's: in the checkpointer itself, and
+ * while shutting down.
+ */
+static int
+dump_workers(Dump_Reason reason)
+{
+#ifdef UNFORKED_CHECKPOINTS
+    if (reason == DUMP_CHECKPOINT)
+	return 1;
+#endif
+    return worker_count(CHECKPOINT_WORKERS);
+}
+
+static int
+dump_database(Dump_Reason reason)
+{
+    Stream *s = new_stream(100);
+    char *temp_name;
+    const char *final_name = dump_db_name;
+    FILE *f;
+    int success;
+    int incremental = 0;
+
+#ifdef BACKGROUND_CHECKPOINTS
+    if (reason != DUMP_CHECKPOINT)
+	abandon_background_dump();
+#endif
+    if (reason == DUMP_CHECKPOINT) {
+	int max_deltas = server_int_option("checkpoint_deltas", 0);
+
+	if (checkpoint_in_flight
+	    && (max_deltas > 0 || background_dump_running())) {
+	    errlog("CHECKPOINTING: Previous checkpoint still in progress\n");
+	    free_stream(s);
+	    return 0;
+	}
+	incremental = have_base && delta_count < max_deltas;
+    }
+    if (reason != DUMP_PANIC) {
+	/* Whatever the checkpoint doesn't capture goes in a new segment. */
+	redo_commit();
+	redo_close();
+	pending_redo_floor = redo_next_segment;
+	pending_redo_segment = (reason == DUMP_CHECKPOINT ? redo_open() : 0);
+	pending_epoch = dbpriv_dirty_epoch++;
+	pending_delta = incremental;
+    }
+
+  retryDumping:
+
+    stream_printf(s, "%s.#%d#", dump_db_name, dump_generation);
+    remove(reset_stream(s));	/* Remove previous checkpoint */
+
+    if (reason == DUMP_PANIC)
+	stream_printf(s, "%s.PANIC", dump_db_name);
+    else if (incremental) {
+	final_name = str_dup(aux_name(dump_db_name, "delta", delta_count + 1));
+	stream_printf(s, "%s#", final_name);
+    } else {
+	dump_generation++;
+	stream_printf(s, "%s.#%d#", dump_db_name, dump_generation);
+    }
+    temp_name = reset_stream(s);
+
+    oklog("%s on %s ...\n", reason_names[reason], temp_name);
+
+#if defined(BACKGROUND_CHECKPOINTS)
+    reset_command_history();
+    if (reason == DUMP_CHECKPOINT && !incremental) {
+	success = start_background_dump(temp_name);
+	free_stream(s);
+	if (success)
+	    checkpoint_in_flight = 1;
+	else
+	    checkpoint_done(0);
+	return success;
+    }
+#elif defined(UNFORKED_CHECKPOINTS)
+    reset_command_history();
+#else
+    if (reason == DUMP_CHECKPOINT) {
+	switch (fork_checkpointer()) {
+	case FORK_PARENT:
+	    reset_command_history();
+	    free_stream(s);
+	    if (incremental)
+		free_str(final_name);
+	    checkpoint_in_flight = 1;
+	    return 1;
+	case FORK_ERROR:
+	    free_stream(s);
+	    if (incremental)
+		free_str(final_name);
+	    checkpoint_done(0);
+	    return 0;
+	case FORK_CHILD:
+	    set_server_cmdline("(MOO checkpointer)");
+	    redo_abandon();
+	    break;
+	}
+    }
+#endif
+
+    success = 1;
+    if ((f = fopen(temp_name, "w")) != 0) {
+	int written;
+
+	dbpriv_set_dbio_output(f);
+	if (incremental) {
+	    if (!base_digest[0])
+		strcpy(base_digest, file_digest(dump_db_name));
+	    written = base_digest[0]
+		&& write_delta_file(reason_names[reason], base_digest,
+				    delta_count + 1);
+	} else if (reason == DUMP_PANIC)
+	    written = write_db_file(reason_names[reason], f, 1, 0);
+	else
+	    written = write_db_file(reason_names[reason], f,
+				    dump_workers(reason),
+				    DUMP_COMPRESSION_LEVEL);
+	if (!written) {
+	    log_perror("Trying to dump database");
+	    fclose(f);
+	    remove(temp_name);
+	    if (reason == DUMP_CHECKPOINT) {
+		errlog("Abandoning checkpoint attempt...\n");
+		success = 0;
+	    } else {
 		int retry_interval = 60;
 
 		errlog("Waiting %d seconds and retrying dump...\n",
@@ -611,30 +2145,33 @@ dump_database(Dump_Reason reason)
 		timer_sleep(retry_interval);
 		goto retryDumping;
 	    }
-	} else {
-	    fflush(f);
-	    fsync(fileno(f));
-	    fclose(f);
-	    oklog("%s on %s finished\n", reason_names[reason], temp_name);
-	    if (reason != DUMP_PANIC) {
-		remove(dump_db_name);
-		if (rename(temp_name, dump_db_name) != 0) {
-		    log_perror("Renaming temporary dump file");
-		    success = 0;
-		}
-	    }
-	}
+	} else
+	    success = commit_dump(f, reason_names[reason], temp_name,
+				  reason == DUMP_PANIC ? 0 : final_name,
+				  incremental);
     } else {
 	log_perror("Opening temporary dump file");
 	success = 0;
     }
 
     free_stream(s);
+    if (incremental)
+	free_str(final_name);
 
-#ifndef UNFORKED_CHECKPOINTS
-    if (reason == DUMP_CHECKPOINT)
+#if !defined(UNFORKED_CHECKPOINTS) && !defined(BACKGROUND_CHECKPOINTS)
+    if (reason == DUMP_CHECKPOINT) {
 	/* We're a child, so we'd better go away. */
+	sync_log();
 	exit(!success);
+    }
+#endif
+
+    if (reason != DUMP_PANIC)
+	checkpoint_done(success);
+#ifdef BACKGROUND_CHECKPOINTS
+    /* Reported like the background ones; see db_continue_checkpoint(). */
+    if (reason == DUMP_CHECKPOINT && success)
+	bg_result = 2;
 #endif
 
     return success;
@@ -649,7 +2186,52 @@ db_usage_string(void)
     return "input-db-file output-db-file";
 }
 
-static FILE *input_db;
+static int
+read_deltas_and_tail(void)
+{
+    char base[34], line[40];
+    FILE *f;
+    int seq;
+
+    base[0] = '\0';
+
+    for (seq = 1;
+	 (f = fopen(aux_name(input_db_name, "delta", seq), "r")) != 0;
+	 seq++) {
+	int n, redo;
+
+	if (!base[0])
+	    sprintf(base, "%s\n", file_digest(input_db_name));
+	dbpriv_set_dbio_input(f);
+	if (dbio_scanf(delta_header_format_string, &dbio_input_version) == 1)
+	    dbio_read_line(line, sizeof(line));
+	else
+	    line[0] = '\0';
+	if (!check_db_version(dbio_input_version)
+	    || strlen(base) < 2 || strcmp(line, base) != 0
+	    || dbio_scanf("%d\n%d\n", &n, &redo) != 2 || n != seq) {
+	    errlog("LOADING: Ignoring %s and later deltas, not made for %s\n",
+		   aux_name(input_db_name, "delta", seq), input_db_name);
+	    fclose(f);
+	    break;
+	}
+	oklog("LOADING: Replaying %s\n", aux_name(input_db_name, "delta", seq));
+	if (!read_delta_file(0)) {
+	    fclose(f);
+	    return 0;
+	}
+	if (input_db != program_source)
+	    fclose(input_db);
+	input_db = f;
+	loaded_redo_segment = redo;
+    }
+
+    if (!replay_redo_log())
+	return 0;
+
+    dbpriv_set_dbio_input(input_db);
+    return read_db_tail();
+}
 
 int
 db_initialize(int *pargc, char ***pargv)
@@ -664,7 +2246,8 @@ db_initialize(int *pargc, char ***pargv)
     *pargc -= 2;
     *pargv += 2;
 
-    if (!(f = fopen(input_db_name, "r"))) {
+    if (!(f = fopen(input_db_name, "r"))
+	|| !(f = dbpriv_uncompress_input(f))) {
 	fprintf(stderr, "Cannot open input database file: %s\n",
 		input_db_name);
 	return 0;
@@ -683,16 +2266,23 @@ db_load(void)
     str_intern_open(0);
 
     oklog("LOADING: %s\n", input_db_name);
-    if (!read_db_file()) {
+    if (!read_db_file() || !read_deltas_and_tail()) {
 	errlog("DB_LOAD: Cannot load database!\n");
 	return 0;
     }
     oklog("LOADING: %s done, will dump new database on %s\n",
 	  input_db_name, dump_db_name);
 
+    /* If the log was on at the last checkpoint, carry on with it now;
+     * otherwise there'd be no checkpoint to name the new segment.
+     */
+    if (loaded_redo_segment)
+	redo_open();
+
     str_intern_close();
 
-    fclose(input_db);
+    if (input_db != program_source)
+	fclose(input_db);
     return 1;
 }
 
@@ -704,6 +2294,7 @@ db_flush(enum db_flush_type type)
     switch (type) {
     case FLUSH_IF_FULL:
     case FLUSH_ONE_SECOND:
+	redo_commit();
 	success = 1;
 	break;
 
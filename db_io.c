@@ -24,6 +24,12 @@
 #include "my-stdarg.h"
 #include "my-stdio.h"
 #include "my-stdlib.h"
+#include "my-string.h"
+#include "my-unistd.h"
+#include "my-wait.h"
+#ifdef MOO_ZLIB
+#include <zlib.h>
+#endif
 
 #include "db_io.h"
 #include "db_private.h"
@@ -32,10 +38,12 @@
 #include "log.h"
 #include "numbers.h"
 #include "parser.h"
+#include "server.h"
 #include "storage.h"
 #include "streams.h"
 #include "structures.h"
 #include "str_intern.h"
+#include "sym_table.h"
 #include "unparse.h"
 #include "version.h"
 
@@ -50,6 +58,70 @@ dbpriv_set_dbio_input(FILE * f)
     input = f;
 }
 
+/* A database written with DUMP_COMPRESSION_LEVEL set is a series of gzip
+ * members (see dbpriv_write_chunk()).  If F holds one, it is inflated into
+ * a temporary file, which replaces it; otherwise F is returned, rewound.
+ * Returns null, with F closed, if the data can't be read.
+ */
+FILE *
+dbpriv_uncompress_input(FILE * f)
+{
+    int c1 = getc(f), c2 = getc(f);
+
+    rewind(f);
+    if (c1 != 0x1f || c2 != 0x8b)
+	return f;
+#ifdef MOO_ZLIB
+    {
+	unsigned char in[8192], out[8192];
+	FILE *tmp = tmpfile();
+	z_stream z;
+	size_t n;
+	int status = Z_OK;
+
+	memset(&z, 0, sizeof(z));
+	if (!tmp || inflateInit2(&z, 15 + 16) != Z_OK) {
+	    errlog("DBIO_UNCOMPRESS: Can't set up decompression\n");
+	    if (tmp)
+		fclose(tmp);
+	    fclose(f);
+	    return 0;
+	}
+	for (;;) {
+	    if (z.avail_in == 0) {
+		if ((n = fread(in, 1, sizeof(in), f)) == 0)
+		    break;
+		z.next_in = in;
+		z.avail_in = n;
+	    }
+	    z.next_out = out;
+	    z.avail_out = sizeof(out);
+	    status = inflate(&z, Z_NO_FLUSH);
+	    if ((status != Z_OK && status != Z_STREAM_END)
+		|| fwrite(out, 1, sizeof(out) - z.avail_out, tmp)
+		!= sizeof(out) - z.avail_out)
+		break;
+	    if (status == Z_STREAM_END)
+		inflateReset(&z);
+	}
+	inflateEnd(&z);
+	if (status != Z_STREAM_END || ferror(f) || fflush(tmp) != 0) {
+	    errlog("DBIO_UNCOMPRESS: Compressed database is damaged\n");
+	    fclose(tmp);
+	    tmp = 0;
+	} else
+	    rewind(tmp);
+	fclose(f);
+	return tmp;
+    }
+#else
+    errlog("DBIO_UNCOMPRESS: Database is compressed, "
+	   "but this server was built without zlib\n");
+    fclose(f);
+    return 0;
+#endif
+}
+
 void
 dbio_read_line(char *s, int n)
 {
@@ -255,6 +327,7 @@ dbio_read_var(void)
 
 struct state {
     char prev_char;
+    const char *text;		/* for text_getc() */
     const char *(*fmtr) (void *);
     void *data;
 };
@@ -313,6 +386,463 @@ dbio_read_program(DB_Version version, const char *(*fmtr) (void *), void *data)
     s.data = data;
     return parse_program(version, parser_client, &s);
 }
+
+const char *
+dbio_read_program_text(void)
+{
+    static Stream *s = 0;
+    char buffer[1024];
+    int at_bol = 1;
+    int len;
+
+    if (!s)
+	s = new_stream(1000);
+
+    for (;;) {
+	if (!fgets(buffer, sizeof(buffer), input)) {
+	    reset_stream(s);
+	    return 0;
+	}
+	/* Same end-of-verb marker as in my_getc() */
+	if (at_bol && buffer[0] == '.')
+	    break;
+	stream_add_string(s, buffer);
+	len = strlen(buffer);
+	at_bol = (len > 0 && buffer[len - 1] == '\n');
+    }
+
+    return str_dup(reset_stream(s));
+}
+
+int
+dbio_skip_program_text(long *offset)
+{
+    char buffer[1024];
+    int at_bol = 1;
+    int len, length = 0;
+
+    *offset = ftell(input);
+    for (;;) {
+	if (!fgets(buffer, sizeof(buffer), input))
+	    return -1;
+	if (at_bol && buffer[0] == '.')
+	    break;
+	len = strlen(buffer);
+	length += len;
+	at_bol = (len > 0 && buffer[len - 1] == '\n');
+    }
+
+    return length;
+}
+
+static int
+text_getc(void *data)
+{
+    struct state *s = data;
+
+    if (*s->text == '\0')
+	return EOF;
+    return (unsigned char) *s->text++;
+}
+
+static Parser_Client text_client =
+{my_error, my_warning, text_getc};
+
+static Program *
+compile_text(DB_Version version, Program_Source * src,
+	     const char *(*fmtr) (void *))
+{
+    struct state s;
+
+    s.fmtr = fmtr;
+    s.data = src->data;
+    s.text = src->text;
+    return parse_program(version, text_client, &s);
+}
+
+/* Programs travel from the compiling children to the server in a
+ * temporary file, in the host's own binary representation: for each
+ * program, its index, whether it parsed, and if so its bytecodes,
+ * literals and variable names.
+ */
+
+static void
+pack_bytes(FILE * f, const void *p, int n)
+{
+    fwrite(p, 1, n, f);
+}
+
+static void
+pack_int(FILE * f, int i)
+{
+    fwrite(&i, sizeof(i), 1, f);
+}
+
+static void
+pack_string(FILE * f, const char *s)
+{
+    int len = strlen(s);
+
+    pack_int(f, len);
+    pack_bytes(f, s, len);
+}
+
+static void
+pack_bytecodes(FILE * f, Bytecodes * bc)
+{
+    pack_bytes(f, &bc->numbytes_label, 1);
+    pack_bytes(f, &bc->numbytes_literal, 1);
+    pack_bytes(f, &bc->numbytes_fork, 1);
+    pack_bytes(f, &bc->numbytes_var_name, 1);
+    pack_bytes(f, &bc->numbytes_stack, 1);
+    pack_int(f, bc->size);
+    pack_int(f, bc->max_stack);
+    pack_bytes(f, bc->vector, bc->size);
+    pack_int(f, bc->num_lines);
+    pack_bytes(f, bc->lines, sizeof(Line_Entry) * bc->num_lines);
+}
+
+/* Returns 0 if the program can't be packed, so the server should compile
+ * it itself.
+ */
+static int
+packable(Program * prog)
+{
+    unsigned i;
+
+    for (i = 0; i < prog->num_literals; i++)
+	switch (prog->literals[i].type) {
+	case TYPE_INT:
+	case TYPE_OBJ:
+	case TYPE_ERR:
+	case TYPE_FLOAT:
+	case TYPE_STR:
+	    break;
+	default:
+	    return 0;
+	}
+    return 1;
+}
+
+static void
+pack_program(FILE * f, int index, Program * prog)
+{
+    unsigned i;
+
+    if (prog && !packable(prog))
+	return;
+
+    pack_int(f, index);
+    pack_int(f, prog != 0);
+    if (!prog)
+	return;
+
+    pack_int(f, prog->version);
+    pack_int(f, prog->first_lineno);
+    pack_bytecodes(f, &prog->main_vector);
+    pack_int(f, prog->fork_vectors_size);
+    for (i = 0; i < prog->fork_vectors_size; i++)
+	pack_bytecodes(f, &prog->fork_vectors[i]);
+    pack_int(f, prog->num_literals);
+    for (i = 0; i < prog->num_literals; i++) {
+	Var v = prog->literals[i];
+
+	pack_int(f, v.type);
+	switch (v.type) {
+	case TYPE_INT:
+	    pack_int(f, v.v.num);
+	    break;
+	case TYPE_OBJ:
+	    pack_int(f, v.v.obj);
+	    break;
+	case TYPE_ERR:
+	    pack_int(f, v.v.err);
+	    break;
+	case TYPE_FLOAT:
+	    pack_bytes(f, v.v.fnum, sizeof(double));
+	    break;
+	case TYPE_STR:
+	    pack_string(f, v.v.str);
+	    break;
+	}
+    }
+    pack_int(f, prog->num_var_names);
+    for (i = first_user_slot(prog->version); i < prog->num_var_names; i++)
+	pack_string(f, prog->var_names[i]);
+}
+
+static int
+unpack_bytes(FILE * f, void *p, int n)
+{
+    return fread(p, 1, n, f) == n;
+}
+
+static int
+unpack_int(FILE * f, int *i)
+{
+    return fread(i, sizeof(*i), 1, f) == 1;
+}
+
+static char *
+unpack_string(FILE * f)
+{
+    int len;
+    char *s;
+
+    if (!unpack_int(f, &len) || len < 0)
+	return 0;
+    s = mymalloc(len + 1, M_STRING);
+    if (!unpack_bytes(f, s, len)) {
+	free_str(s);
+	return 0;
+    }
+    s[len] = '\0';
+    return s;
+}
+
+static int
+unpack_bytecodes(FILE * f, Bytecodes * bc)
+{
+    int size, max_stack, num_lines;
+
+    bc->vector = 0;
+    bc->lines = 0;
+    if (!unpack_bytes(f, &bc->numbytes_label, 1)
+	|| !unpack_bytes(f, &bc->numbytes_literal, 1)
+	|| !unpack_bytes(f, &bc->numbytes_fork, 1)
+	|| !unpack_bytes(f, &bc->numbytes_var_name, 1)
+	|| !unpack_bytes(f, &bc->numbytes_stack, 1)
+	|| !unpack_int(f, &size) || size <= 0
+	|| !unpack_int(f, &max_stack))
+	return 0;
+    bc->size = size;
+    bc->max_stack = max_stack;
+    bc->vector = mymalloc(size, M_BYTECODES);
+    if (!unpack_bytes(f, bc->vector, size)
+	|| !unpack_int(f, &num_lines) || num_lines <= 0)
+	return 0;
+    bc->num_lines = num_lines;
+    bc->lines = mymalloc(sizeof(Line_Entry) * num_lines, M_BYTECODES);
+    return unpack_bytes(f, bc->lines, sizeof(Line_Entry) * num_lines);
+}
+
+/* Rebuilds a program as the code generator would have built it here,
+ * interning its string literals and sharing the built-in variable names.
+ * Returns null on a short or garbled file.
+ */
+static Program *
+unpack_program(FILE * f)
+{
+    Program *prog = new_program();
+    Names *builtins;
+    int version, first_lineno, n, first;
+    unsigned i;
+
+    prog->main_vector.vector = 0;
+    prog->main_vector.lines = 0;
+    prog->fork_vectors_size = prog->num_literals = prog->num_var_names = 0;
+    prog->fork_vectors = 0;
+    prog->literals = 0;
+    prog->var_names = 0;
+
+    if (!unpack_int(f, &version) || !check_db_version(version)
+	|| !unpack_int(f, &first_lineno)
+	|| !unpack_bytecodes(f, &prog->main_vector)
+	|| !unpack_int(f, &n) || n < 0)
+	goto fail;
+    prog->version = version;
+    prog->first_lineno = first_lineno;
+
+    if (n > 0) {
+	prog->fork_vectors = mymalloc(n * sizeof(Bytecodes), M_FORK_VECTORS);
+	for (i = 0; i < n; i++) {
+	    prog->fork_vectors[i].vector = 0;
+	    prog->fork_vectors[i].lines = 0;
+	}
+	prog->fork_vectors_size = n;
+	for (i = 0; i < n; i++)
+	    if (!unpack_bytecodes(f, &prog->fork_vectors[i]))
+		goto fail;
+    }
+    if (!unpack_int(f, &n) || n < 0)
+	goto fail;
+    if (n > 0) {
+	prog->literals = mymalloc(n * sizeof(Var), M_LIT_LIST);
+	for (i = 0; i < n; i++) {
+	    Var *v = &prog->literals[i];
+	    int type;
+	    double d;
+	    char *s;
+
+	    if (!unpack_int(f, &type))
+		goto fail;
+	    v->type = type;
+	    switch (type) {
+	    case TYPE_INT:
+		if (!unpack_int(f, &v->v.num))
+		    goto fail;
+		break;
+	    case TYPE_OBJ:
+		if (!unpack_int(f, &v->v.obj))
+		    goto fail;
+		break;
+	    case TYPE_ERR:
+		if (!unpack_int(f, &type))
+		    goto fail;
+		v->v.err = type;
+		break;
+	    case TYPE_FLOAT:
+		if (!unpack_bytes(f, &d, sizeof(d)))
+		    goto fail;
+		*v = new_float(d);
+		break;
+	    case TYPE_STR:
+		if (!(s = unpack_string(f)))
+		    goto fail;
+		/* as in code_gen.c's add_literal() */
+		v->v.str = str_intern(s);
+		free_str(s);
+		s = (char *) v->v.str;
+		v->v.str = str_intern_ident(s);
+		free_str(s);
+		break;
+	    default:
+		goto fail;
+	    }
+	    prog->num_literals++;
+	}
+    }
+
+    first = first_user_slot(prog->version);
+    if (!unpack_int(f, &n) || n < first)
+	goto fail;
+    prog->var_names = mymalloc(n * sizeof(char *), M_NAMES);
+    builtins = new_builtin_names(prog->version);
+    for (i = 0; i < first; i++)
+	prog->var_names[i] = builtins->names[i];
+    myfree(builtins->names, M_NAMES);
+    myfree(builtins, M_NAMES);
+    prog->num_var_names = first;
+    for (i = first; i < n; i++) {
+	if (!(prog->var_names[i] = unpack_string(f)))
+	    goto fail;
+	prog->num_var_names++;
+    }
+
+    return prog;
+
+  fail:
+    if (!prog->main_vector.vector)
+	prog->main_vector.vector = mymalloc(1, M_BYTECODES);
+    for (i = 0; i < prog->fork_vectors_size; i++)
+	if (!prog->fork_vectors[i].vector)
+	    prog->fork_vectors[i].vector = mymalloc(1, M_BYTECODES);
+    if (!prog->var_names)
+	prog->var_names = mymalloc(sizeof(char *), M_NAMES);
+    free_program(prog);
+    return 0;
+}
+
+#if HAVE_WAITPID
+/* Forks WORKERS - 1 children to compile every WORKERS-th source, starting
+ * from their own number, while the server does the ones from 0.  Each
+ * child packs its programs into its own temporary file and, once that is
+ * complete, sends its pid down a pipe; when the pipe shows end of file,
+ * all of them have exited.  Anything a child didn't deliver is left for
+ * the server to compile itself.  Returns the number of processes used.
+ */
+static int
+compile_in_children(DB_Version version, Program_Source * sources, int n,
+		    const char *(*fmtr) (void *), int workers, char *done)
+{
+    FILE **files;
+    int fds[2];
+    pid_t pid;
+    int i, w, index, ok;
+    int used = 1;
+
+    if (pipe(fds) < 0) {
+	log_perror("Creating pipe for verb compilers");
+	return 1;
+    }
+    files = mymalloc(workers * sizeof(FILE *), M_STRUCT);
+    for (w = 1; w < workers; w++) {
+	if (!(files[w] = tmpfile()))
+	    continue;
+	switch (fork_server("verb compiler")) {
+	case FORK_CHILD:
+	    close(fds[0]);
+	    for (i = w; i < n; i += workers)
+		pack_program(files[w], i,
+			     compile_text(version, &sources[i], fmtr));
+	    pid = getpid();
+	    if (fflush(files[w]) != 0
+		|| write(fds[1], &pid, sizeof(pid)) != sizeof(pid))
+		_exit(1);
+	    _exit(0);
+	case FORK_PARENT:
+	    used++;
+	    break;
+	case FORK_ERROR:
+	    fclose(files[w]);
+	    files[w] = 0;
+	    break;
+	}
+    }
+    close(fds[1]);
+
+    for (i = 0; i < n; i += workers) {
+	sources[i].program = compile_text(version, &sources[i], fmtr);
+	done[i] = 1;
+    }
+
+    while (read(fds[0], &pid, sizeof(pid)) == sizeof(pid))
+	waitpid(pid, 0, 0);
+    close(fds[0]);
+
+    for (w = 1; w < workers; w++) {
+	if (!files[w])
+	    continue;
+	rewind(files[w]);
+	while (unpack_int(files[w], &index) && unpack_int(files[w], &ok)
+	       && index >= 0 && index < n && !done[index]) {
+	    if (ok && !(sources[index].program = unpack_program(files[w])))
+		break;
+	    done[index] = 1;
+	}
+	fclose(files[w]);
+    }
+    myfree(files, M_STRUCT);
+
+    return used;
+}
+#endif
+
+int
+dbio_compile_programs(DB_Version version, Program_Source * sources, int n,
+		      const char *(*fmtr) (void *), int workers)
+{
+    char *done = mymalloc(n + 1, M_STRUCT);
+    int i, used = 1;
+
+    memset(done, 0, n);
+    for (i = 0; i < n; i++)
+	sources[i].program = 0;
+
+#if HAVE_WAITPID
+    if (workers > n / 16)
+	workers = n / 16;
+    if (workers > 1)
+	used = compile_in_children(version, sources, n, fmtr, workers, done);
+#endif
+
+    for (i = 0; i < n; i++)
+	if (!done[i])
+	    sources[i].program = compile_text(version, &sources[i], fmtr);
+    myfree(done, M_STRUCT);
+
+    return used;
+}
 
 
 /*********** Output ***********/
@@ -327,6 +857,56 @@ dbpriv_set_dbio_output(FILE * f)
     output = f;
 }
 
+/* Appends the whole of F to the output, as is for LEVEL 0 or as one gzip
+ * member compressed at LEVEL (1-9) otherwise.  Members can be written
+ * separately and simply concatenated: they decompress as one stream.
+ */
+void
+dbpriv_write_chunk(FILE * f, int level)
+{
+    unsigned char in[8192];
+    size_t n;
+    int ok = 1;
+
+    if (fflush(f) != 0)
+	RAISE(dbpriv_dbio_failed, 0);
+    rewind(f);
+#ifdef MOO_ZLIB
+    if (level > 0) {
+	unsigned char out[8192];
+	z_stream z;
+	int flush;
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK)
+	    RAISE(dbpriv_dbio_failed, 0);
+	do {
+	    n = fread(in, 1, sizeof(in), f);
+	    flush = n < sizeof(in) ? Z_FINISH : Z_NO_FLUSH;
+	    z.next_in = in;
+	    z.avail_in = n;
+	    do {
+		z.next_out = out;
+		z.avail_out = sizeof(out);
+		deflate(&z, flush);
+		n = sizeof(out) - z.avail_out;
+		if (fwrite(out, 1, n, output) != n)
+		    ok = 0;
+	    } while (ok && z.avail_out == 0);
+	} while (ok && flush != Z_FINISH);
+	deflateEnd(&z);
+	if (!ok || ferror(f))
+	    RAISE(dbpriv_dbio_failed, 0);
+	return;
+    }
+#endif
+    while (ok && (n = fread(in, 1, sizeof(in), f)) > 0)
+	ok = fwrite(in, 1, n, output) == n;
+    if (!ok || ferror(f))
+	RAISE(dbpriv_dbio_failed, 0);
+}
+
 void
 dbio_printf(const char *format,...)
 {
@@ -68,6 +68,38 @@ extern Program *dbio_read_program(DB_Version version,
 				 * be the required string.
 				 */
 
+extern const char *dbio_read_program_text(void);
+				/* Reads the source of one program, through its
+				 * terminating "." line, without compiling it.
+				 * The caller should free_str() the result.
+				 * Returns null at end of file.
+				 */
+
+extern int dbio_skip_program_text(long *offset);
+				/* Like dbio_read_program_text(), but only
+				 * finds the source: sets *OFFSET to where it
+				 * starts in the input file and returns its
+				 * length in bytes, or -1 at end of file.
+				 */
+
+typedef struct {
+    const char *text;		/* from dbio_read_program_text() */
+    void *data;			/* for FMTR, as in dbio_read_program() */
+    Program *program;		/* the result, or null if it didn't parse */
+} Program_Source;
+
+extern int dbio_compile_programs(DB_Version version,
+				 Program_Source * sources, int n,
+				 const char *(*fmtr) (void *), int workers);
+				/* Compiles each of the N SOURCES.  With
+				 * WORKERS > 1, up to that many - 1 forked
+				 * children share the work, each handing its
+				 * programs back in a temporary file; the
+				 * results are the same as compiling them one
+				 * by one.  Returns the number of processes
+				 * that took part.
+				 */
+
 
 /*********** Output ***********/
 
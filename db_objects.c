@@ -23,6 +23,7 @@
 #include "db.h"
 #include "db_private.h"
 #include "list.h"
+#include "options.h"
 #include "program.h"
 #include "storage.h"
 #include "utils.h"
@@ -31,6 +32,20 @@ static Object **objects;
 static int num_objects = 0;
 static int max_objects = 0;
 
+/* For each object slot, the epoch in which it last changed; see
+ * dbpriv_dirty() and the incremental checkpoints in db_file.c.
+ */
+static unsigned *slot_epochs;
+unsigned dbpriv_dirty_epoch = 1;
+
+/* While the redo log is on, each slot dirtied in the current epoch is
+ * also listed here, once, until the log commits it.
+ */
+int dbpriv_journaling = 0;
+static Objid *journal;
+static int journal_length = 0;
+static int journal_max = 0;
+
 static Var all_users;
 
 
@@ -60,8 +75,69 @@ db_last_used_objid(void)
 void
 db_reset_last_used_objid(void)
 {
-    while (!objects[num_objects - 1])
+    while (!objects[num_objects - 1]) {
+	dbpriv_dirty(num_objects - 1);
 	num_objects--;
+    }
+}
+
+void
+dbpriv_dirty(Objid oid)
+{
+    if (oid < 0 || oid >= num_objects
+	|| slot_epochs[oid] == dbpriv_dirty_epoch)
+	return;
+
+#ifdef BACKGROUND_CHECKPOINTS
+    if (dbpriv_snapshotting)
+	dbpriv_snapshot_object(oid);
+#endif
+    slot_epochs[oid] = dbpriv_dirty_epoch;
+    if (dbpriv_journaling) {
+	if (journal_length >= journal_max) {
+	    Objid *new;
+	    int i;
+
+	    journal_max = journal_max ? journal_max * 2 : 100;
+	    new = mymalloc(journal_max * sizeof(Objid), M_OBJECT_TABLE);
+	    for (i = 0; i < journal_length; i++)
+		new[i] = journal[i];
+	    if (journal)
+		myfree(journal, M_OBJECT_TABLE);
+	    journal = new;
+	}
+	journal[journal_length++] = oid;
+    }
+}
+
+void
+dbpriv_dirty_tree(Objid oid)
+{
+    Objid c;
+
+    dbpriv_dirty(oid);
+    for (c = objects[oid]->child; c != NOTHING; c = objects[c]->sibling)
+	dbpriv_dirty_tree(c);
+}
+
+Objid *
+dbpriv_journal(int *count)
+{
+    *count = journal_length;
+    return journal;
+}
+
+void
+dbpriv_clear_journal(void)
+{
+    journal_length = 0;
+    dbpriv_dirty_epoch++;
+}
+
+unsigned
+dbpriv_slot_epoch(Objid oid)
+{
+    return slot_epochs[oid];
 }
 
 static void
@@ -70,18 +146,27 @@ ensure_new_object(void)
     if (max_objects == 0) {
 	max_objects = 100;
 	objects = mymalloc(max_objects * sizeof(Object *), M_OBJECT_TABLE);
+	slot_epochs = mymalloc(max_objects * sizeof(unsigned), M_OBJECT_TABLE);
     }
     if (num_objects >= max_objects) {
 	int i;
 	Object **new;
+	unsigned *new_epochs;
 
 	new = mymalloc(max_objects * 2 * sizeof(Object *), M_OBJECT_TABLE);
-	for (i = 0; i < max_objects; i++)
+	new_epochs = mymalloc(max_objects * 2 * sizeof(unsigned),
+			      M_OBJECT_TABLE);
+	for (i = 0; i < max_objects; i++) {
 	    new[i] = objects[i];
+	    new_epochs[i] = slot_epochs[i];
+	}
 	myfree(objects, M_OBJECT_TABLE);
+	myfree(slot_epochs, M_OBJECT_TABLE);
 	objects = new;
+	slot_epochs = new_epochs;
 	max_objects *= 2;
     }
+    slot_epochs[num_objects] = 0;
 }
 
 Object *
@@ -92,6 +177,7 @@ dbpriv_new_object(void)
     ensure_new_object();
     o = objects[num_objects] = mymalloc(sizeof(Object), M_OBJECT);
     o->id = num_objects;
+    o->contents_version = 0;
     num_objects++;
 
     return o;
@@ -112,6 +198,8 @@ db_create_object(void)
 
     o = dbpriv_new_object();
     oid = o->id;
+    dbpriv_dirty(oid);
+    dbpriv_invalidate_watched_properties();
 
     o->name = str_dup("");
     o->flags = 0;
@@ -119,6 +207,7 @@ db_create_object(void)
     o->location = o->contents = o->next = NOTHING;
 
     o->propval = 0;
+    o->propsparse = 0;
 
     o->propdefs.max_length = 0;
     o->propdefs.cur_length = 0;
@@ -137,6 +226,7 @@ db_destroy_object(Objid oid)
     int i;
 
     db_priv_affected_callable_verb_lookup();
+    dbpriv_invalidate_watched_properties();
 
     if (!o)
 	panic("DB_DESTROY_OBJECT: Invalid object!");
@@ -152,21 +242,20 @@ db_destroy_object(Objid oid)
 	t.v.obj = oid;
 	all_users = setremove(all_users, t);
     }
+    dbpriv_dirty(oid);
     free_str(o->name);
 
-    for (i = 0; i < o->propdefs.cur_length; i++) {
-	/* As an orphan, the only properties on this object are the ones
-	 * defined on it directly, so these two arrays must be the same length.
-	 */
+    /* As an orphan, the only properties on this object are the ones
+     * defined on it directly, so these two arrays must be the same length.
+     */
+    for (i = 0; i < o->propdefs.cur_length; i++)
 	free_str(o->propdefs.l[i].name);
-	free_var(o->propval[i].var);
-    }
-    if (o->propval)
-	myfree(o->propval, M_PVAL);
+    dbpriv_free_propvals(o, o->propdefs.cur_length);
     if (o->propdefs.l)
 	myfree(o->propdefs.l, M_PROPDEF);
 
     for (v = o->verbdefs; v; v = w) {
+	dbpriv_forget_lazy_program(v);
 	if (v->program)
 	    free_program(v->program);
 	free_str(v->name);
@@ -178,6 +267,100 @@ db_destroy_object(Objid oid)
     objects[oid] = 0;
 }
 
+void
+dbpriv_release_object(Objid oid, int nslots)
+{
+    Object *o = objects[oid];
+    Verbdef *v, *w;
+    int i;
+
+    if (!o)
+	return;
+
+    free_str(o->name);
+    for (i = 0; i < o->propdefs.cur_length; i++)
+	free_str(o->propdefs.l[i].name);
+    if (o->propdefs.l)
+	myfree(o->propdefs.l, M_PROPDEF);
+    dbpriv_free_propvals(o, nslots);
+    for (v = o->verbdefs; v; v = w) {
+	dbpriv_forget_lazy_program(v);
+	if (v->program)
+	    free_program(v->program);
+	free_str(v->name);
+	w = v->next;
+	myfree(v, M_VERBDEF);
+    }
+
+    myfree(o, M_OBJECT);
+    objects[oid] = 0;
+}
+
+Object *
+dbpriv_new_object_at(Objid oid)
+{
+    Object *o;
+
+    while (num_objects < oid)
+	dbpriv_new_recycled_object();
+    if (oid == num_objects)
+	return dbpriv_new_object();
+    if (oid < 0 || objects[oid])
+	return 0;
+
+    o = objects[oid] = mymalloc(sizeof(Object), M_OBJECT);
+    o->id = oid;
+    o->contents_version = 0;
+
+    return o;
+}
+
+int
+dbpriv_set_last_used_objid(Objid oid)
+{
+    Objid i;
+
+    for (i = oid + 1; i < num_objects; i++)
+	if (objects[i])
+	    return 0;
+    num_objects = oid + 1;
+
+    return 1;
+}
+
+/* Reports whether OID or any of its verbs or property values is owned by
+ * OLD or NEW; with FIX set, also changes those owned by NEW to NOTHING and
+ * those owned by OLD to NEW.
+ */
+static int
+fix_owners(Objid oid, Objid old, Objid new, int fix)
+{
+    Object *o = objects[oid];
+    Verbdef *v;
+    Objid *p;
+    int i, count, changed = 0;
+
+#define FIX_OWNER(owner) \
+    if ((owner) == new || (owner) == old) { \
+	if (fix) \
+	    (owner) = ((owner) == new ? NOTHING : new); \
+	changed = 1; \
+    }
+
+    FIX_OWNER(o->owner);
+    for (v = o->verbdefs; v; v = v->next)
+	FIX_OWNER(v->owner);
+    count = dbpriv_count_properties(oid);
+    for (i = 0; i < count; i++) {
+	p = dbpriv_propval_owner(o, i);
+	FIX_OWNER(*p);
+    }
+
+#undef FIX_OWNER
+
+    return changed;
+}
+
 Objid
 db_renumber_object(Objid old)
 {
@@ -185,10 +368,13 @@ db_renumber_object(Objid old)
     Object *o;
 
     db_priv_affected_callable_verb_lookup();
+    dbpriv_invalidate_watched_properties();
 
     for (new = 0; new < old; new++) {
 	if (objects[new] == 0) {
 	    /* Change the identity of the object. */
+	    dbpriv_dirty(old);
+	    dbpriv_dirty(new);
 	    o = objects[new] = objects[old];
 	    objects[old] = 0;
 	    objects[new]->id = new;
@@ -199,16 +385,21 @@ db_renumber_object(Objid old)
 
 		if (o->parent != NOTHING) {
 		    oidp = &objects[o->parent]->child;
-		    while (*oidp != old && *oidp != NOTHING)
+		    dbpriv_dirty(o->parent);
+		    while (*oidp != old && *oidp != NOTHING) {
+			dbpriv_dirty(*oidp);
 			oidp = &objects[*oidp]->sibling;
+		    }
 		    if (*oidp == NOTHING)
 			panic("Object not in parent's children list");
 		    *oidp = new;
 		}
 		for (oid = o->child;
 		     oid != NOTHING;
-		     oid = objects[oid]->sibling)
+		     oid = objects[oid]->sibling) {
+		    dbpriv_dirty(oid);
 		    objects[oid]->parent = new;
+		}
 	    }
 
 	    /* Fix up the location/contents hierarchy */
@@ -217,16 +408,21 @@ db_renumber_object(Objid old)
 
 		if (o->location != NOTHING) {
 		    oidp = &objects[o->location]->contents;
-		    while (*oidp != old && *oidp != NOTHING)
+		    dbpriv_dirty(o->location);
+		    while (*oidp != old && *oidp != NOTHING) {
+			dbpriv_dirty(*oidp);
 			oidp = &objects[*oidp]->next;
+		    }
 		    if (*oidp == NOTHING)
 			panic("Object not in location's contents list");
 		    *oidp = new;
 		}
 		for (oid = o->contents;
 		     oid != NOTHING;
-		     oid = objects[oid]->next)
+		     oid = objects[oid]->next) {
+		    dbpriv_dirty(oid);
 		    objects[oid]->location = new;
+		}
 	    }
 
 	    /* Fix up the list of users, if necessary */
@@ -236,6 +432,7 @@ db_renumber_object(Objid old)
 		for (i = 1; i <= all_users.v.list[0].v.num; i++)
 		    if (all_users.v.list[i].v.obj == old) {
 			all_users.v.list[i].v.obj = new;
+			list_hash_slot(all_users.v.list) = 0;
 			break;
 		    }
 	    }
@@ -243,34 +440,11 @@ db_renumber_object(Objid old)
 	    {
 		Objid oid;
 
-		for (oid = 0; oid < num_objects; oid++) {
-		    Object *o = objects[oid];
-		    Verbdef *v;
-		    Pval *p;
-		    int i, count;
-
-		    if (!o)
-			continue;
-
-		    if (o->owner == new)
-			o->owner = NOTHING;
-		    else if (o->owner == old)
-			o->owner = new;
-
-		    for (v = o->verbdefs; v; v = v->next)
-			if (v->owner == new)
-			    v->owner = NOTHING;
-			else if (v->owner == old)
-			    v->owner = new;
-
-		    count = dbpriv_count_properties(oid);
-		    p = o->propval;
-		    for (i = 0; i < count; i++)
-			if (p[i].owner == new)
-			    p[i].owner = NOTHING;
-			else if (p[i].owner == old)
-			    p[i].owner = new;
-		}
+		for (oid = 0; oid < num_objects; oid++)
+		    if (objects[oid] && fix_owners(oid, old, new, 0)) {
+			dbpriv_dirty(oid);
+			fix_owners(oid, old, new, 1);
+		    }
 	    }
 
 	    return new;
@@ -303,9 +477,7 @@ db_object_bytes(Objid oid)
 	count += memo_strlen(o->propdefs.l[i].name) + 1;
 
     len = dbpriv_count_properties(oid);
-    count += (sizeof(Pval) - sizeof(Var)) * len;
-    for (i = 0; i < len; i++)
-	count += value_bytes(o->propval[i].var);
+    count += dbpriv_propval_bytes(o, len);
 
     return count;
 }
@@ -322,6 +494,7 @@ db_object_owner(Objid oid)
 void
 db_set_object_owner(Objid oid, Objid owner)
 {
+    dbpriv_dirty(oid);
     objects[oid]->owner = owner;
 }
 
@@ -336,9 +509,12 @@ db_set_object_name(Objid oid, const char *name)
 {
     Object *o = objects[oid];
 
+    dbpriv_dirty(oid);
     if (o->name)
 	free_str(o->name);
     o->name = name;
+    if (valid(o->location))
+	objects[o->location]->contents_version++;
 }
 
 Objid
@@ -373,31 +549,37 @@ db_for_all_children(Objid oid, int (*func) (void *, Objid), void *data)
 
 #define LL_REMOVE(where, listname, what, nextname) { \
     Objid lid; \
-    if (objects[where]->listname == what) \
+    if (objects[where]->listname == what) { \
+	dbpriv_dirty(where); \
 	objects[where]->listname = objects[what]->nextname; \
-    else { \
+    } else { \
 	for (lid = objects[where]->listname; lid != NOTHING; \
 	      lid = objects[lid]->nextname) { \
 	    if (objects[lid]->nextname == what) { \
+		dbpriv_dirty(lid); \
 		objects[lid]->nextname = objects[what]->nextname; \
 		break; \
 	    } \
 	} \
     } \
+    dbpriv_dirty(what); \
     objects[what]->nextname = NOTHING; \
 }
 
 #define LL_APPEND(where, listname, what, nextname) { \
     Objid lid; \
     if (objects[where]->listname == NOTHING) { \
+	dbpriv_dirty(where); \
 	objects[where]->listname = what; \
     } else { \
 	for (lid = objects[where]->listname; \
 	     objects[lid]->nextname != NOTHING; \
 	     lid = objects[lid]->nextname) \
 	    ; \
+	dbpriv_dirty(lid); \
 	objects[lid]->nextname = what; \
     } \
+    dbpriv_dirty(what); \
     objects[what]->nextname = NOTHING; \
 }
 
@@ -408,6 +590,8 @@ db_change_parent(Objid oid, Objid parent)
 
     if (!dbpriv_check_properties_for_chparent(oid, parent))
 	return 0;
+    dbpriv_dirty_tree(oid);
+    dbpriv_invalidate_watched_properties();
 
     if (objects[oid]->child == NOTHING && objects[oid]->verbdefs == NULL) {
 	/* Since this object has no children and no verbs, we know that it
@@ -430,6 +614,7 @@ db_change_parent(Objid oid, Objid parent)
     if (parent != NOTHING)
 	LL_APPEND(parent, child, oid, sibling);
 
+    dbpriv_dirty(oid);
     objects[oid]->parent = parent;
     dbpriv_fix_properties_after_chparent(oid, old_parent);
 
@@ -471,15 +656,25 @@ db_change_location(Objid oid, Objid location)
 {
     Objid old_location = objects[oid]->location;
 
-    if (valid(old_location))
+    if (valid(old_location)) {
 	LL_REMOVE(old_location, contents, oid, next);
-
-    if (valid(location))
+	objects[old_location]->contents_version++;
+    }
+    if (valid(location)) {
 	LL_APPEND(location, contents, oid, next);
+	objects[location]->contents_version++;
+    }
 
+    dbpriv_dirty(oid);
     objects[oid]->location = location;
 }
 
+unsigned
+db_contents_version(Objid oid)
+{
+    return objects[oid]->contents_version;
+}
+
 int
 db_object_has_flag(Objid oid, db_object_flag f)
 {
@@ -489,6 +684,7 @@ db_object_has_flag(Objid oid, db_object_flag f)
 void
 db_set_object_flag(Objid oid, db_object_flag f)
 {
+    dbpriv_dirty(oid);
     objects[oid]->flags |= (1 << f);
     if (f == FLAG_USER) {
 	Var v;
@@ -502,6 +698,7 @@ db_set_object_flag(Objid oid, db_object_flag f)
 void
 db_clear_object_flag(Objid oid, db_object_flag f)
 {
+    dbpriv_dirty(oid);
     objects[oid]->flags &= ~(1 << f);
     if (f == FLAG_USER) {
 	Var v;
@@ -20,11 +20,14 @@
  *****************************************************************************/
 
 #include "config.h"
+#include "db.h"
 #include "exceptions.h"
+#include "options.h"
 #include "program.h"
 #include "structures.h"
 
 typedef struct Verbdef Verbdef;
+typedef struct Lazy_Program Lazy_Program;
 
 struct Verbdef {
     const char *name;
@@ -33,6 +36,11 @@ struct Verbdef {
     short perms;
     short prep;
     Verbdef *next;
+#ifdef LAZY_PROGRAMS
+    Lazy_Program *lazy;		/* where its source is in the DB file, if it
+				 * hasn't changed since loading; PROGRAM is
+				 * null until it is first used */
+#endif
 };
 
 typedef struct Proplist Proplist;
@@ -55,6 +63,25 @@ typedef struct Pval {
     short perms;
 } Pval;
 
+/* Sparse property values, used instead of a dense Pval array when most
+ * of an object's slots are clear.  Every slot keeps its owner and perms
+ * in `meta'; only slots whose value is not clear have a Var in `vals',
+ * packed in slot order and found by counting the bits set in `present'
+ * below the slot.
+ */
+typedef struct Pmeta {
+    Objid owner;
+    short perms;
+} Pmeta;
+
+typedef struct Psparse {
+    int nslots;
+    int nvals;
+    unsigned *present;
+    Pmeta *meta;
+    Var *vals;
+} Psparse;
+
 typedef struct Object {
     Objid id;
     Objid owner;
@@ -69,10 +96,12 @@ typedef struct Object {
 
     const char *name;
     int flags;
+    unsigned contents_version;	/* see db_contents_version() */
 
     Verbdef *verbdefs;
     Proplist propdefs;
-    Pval *propval;
+    Pval *propval;		/* null whenever propsparse isn't */
+    Psparse *propsparse;
 } Object;
 
 /*********** Verb cache support ***********/
@@ -97,6 +126,17 @@ extern void db_priv_affected_callable_verb_lookup(void);
 #define db_priv_affected_callable_verb_lookup() 
 #endif
 
+/*********** Watched properties ***********/
+
+extern void dbpriv_invalidate_watched_properties(void);
+				/* Advances the generation returned by
+				 * db_property_watch_generation().  Must be
+				 * called whenever anything that could change
+				 * the result of a property lookup other than
+				 * the value of a single property is modified:
+				 * propdefs, parentage, or object validity.
+				 */
+
 /*********** Objects ***********/
 
 extern void dbpriv_set_all_users(Var);
@@ -116,6 +156,24 @@ extern void dbpriv_new_recycled_object(void);
 				 * using up the next available object number.
 				 */
 
+extern Object *dbpriv_new_object_at(Objid oid);
+				/* Like dbpriv_new_object(), but for the given
+				 * slot, which must be empty or past the end;
+				 * any slots in between are left empty.
+				 * Returns null if the slot is in use.
+				 */
+
+extern void dbpriv_release_object(Objid oid, int nslots);
+				/* Frees the object in OID's slot, which has
+				 * NSLOTS property values, and empties the
+				 * slot, without touching any other object.
+				 */
+
+extern int dbpriv_set_last_used_objid(Objid oid);
+				/* Forgets the (empty) slots above OID; returns
+				 * false if any of them holds an object.
+				 */
+
 extern Object *dbpriv_find_object(Objid);
 				/* Returns 0 if given object is not valid.
 				 */
@@ -142,6 +200,73 @@ extern void dbpriv_fix_properties_after_chparent(Objid oid,
 				 * appropriate for its new parent.
 				 */
 
+extern Var dbpriv_propval_value(Object *o, int n);
+extern Objid *dbpriv_propval_owner(Object *o, int n);
+extern short *dbpriv_propval_perms(Object *o, int n);
+				/* Accessors for property slot N of O, whichever
+				 * way its values are stored.  The value is not
+				 * var_ref()'d, and is TYPE_CLEAR for a clear
+				 * slot.
+				 */
+
+extern void dbpriv_expand_propvals(Object *o);
+extern void dbpriv_compact_propvals(Object *o, int nslots);
+				/* Convert O's NSLOTS property values between
+				 * the dense Pval array and the sparse layout.
+				 * Compacting does nothing unless enough of the
+				 * slots are clear for it to pay.
+				 */
+
+extern void dbpriv_free_propvals(Object *o, int nslots);
+
+extern int dbpriv_propval_bytes(Object *o, int nslots);
+				/* Bytes used by O's property value storage,
+				 * including the values themselves.
+				 */
+
+/*********** Dirty tracking ***********/
+
+extern unsigned dbpriv_dirty_epoch;
+				/* Bumped at the start of each checkpoint and
+				 * at each redo log commit.
+				 */
+
+extern void dbpriv_dirty(Objid oid);
+				/* Records that the slot for OID changes in the
+				 * current epoch.  Every mutator of the db
+				 * layer calls this for each object it touches,
+				 * before touching it, so incremental
+				 * checkpoints know what to write and a
+				 * background checkpoint can save the old
+				 * version first.
+				 */
+extern void dbpriv_dirty_tree(Objid oid);
+				/* Calls dbpriv_dirty() for OID and all of its
+				 * descendants, ahead of a change to OID that
+				 * alters how they are all written (such as
+				 * their number of property values).
+				 */
+
+extern unsigned dbpriv_slot_epoch(Objid oid);
+
+extern int dbpriv_journaling;
+extern Objid *dbpriv_journal(int *count);
+				/* While DBPRIV_JOURNALING is set, the slots
+				 * dirtied since the last call to
+				 * dbpriv_clear_journal(), each listed once, in
+				 * no particular order.
+				 */
+extern void dbpriv_clear_journal(void);
+				/* Empties the journal and starts a new epoch.
+				 */
+
+extern int dbpriv_snapshotting;
+extern void dbpriv_snapshot_object(Objid oid);
+				/* While DBPRIV_SNAPSHOTTING is set,
+				 * dbpriv_dirty() calls this with the old state
+				 * of each slot as it first changes in an epoch.
+				 */
+
 /*********** Verbs ***********/
 
 extern void dbpriv_build_prep_table(void);
@@ -150,6 +275,33 @@ extern void dbpriv_build_prep_table(void);
 				 * prepositional-phrase matching table.
 				 */
 
+#ifdef LAZY_PROGRAMS
+struct Lazy_Program {
+    long offset;		/* of the verb's source in the DB file */
+    int length;
+    Verbdef *verbdef;
+    Lazy_Program *prev, *next;	/* see db_verb_program() */
+};
+
+extern void dbpriv_set_lazy_program(Verbdef *, long offset, int length);
+				/* Records that V's program is the LENGTH bytes
+				 * of source at OFFSET in the DB file, to be
+				 * compiled when it is first used.
+				 */
+extern void dbpriv_forget_lazy_program(Verbdef *);
+				/* Called before V's program is replaced or V
+				 * is freed.
+				 */
+extern Program *dbpriv_load_program(db_verb_handle, Lazy_Program *);
+				/* Compiles the source L points to, or returns
+				 * null if it can't be read or doesn't parse.
+				 */
+#define dbpriv_has_program(v)	((v)->program || (v)->lazy)
+#else
+#define dbpriv_forget_lazy_program(v)
+#define dbpriv_has_program(v)	((v)->program != 0)
+#endif
+
 /*********** DBIO ***********/
 
 extern Exception dbpriv_dbio_failed;
@@ -160,6 +312,18 @@ extern Exception dbpriv_dbio_failed;
 extern void dbpriv_set_dbio_input(FILE *);
 extern void dbpriv_set_dbio_output(FILE *);
 
+extern FILE *dbpriv_uncompress_input(FILE *);
+				/* Returns an uncompressed copy of a DB file
+				 * written with compressed chunks, the file
+				 * itself if it isn't compressed, or null
+				 * (closing it) on failure.
+				 */
+extern void dbpriv_write_chunk(FILE *, int level);
+				/* Appends the file's contents to the output,
+				 * gzip-compressed if LEVEL > 0.  Raises
+				 * dbpriv_dbio_failed on failure.
+				 */
+
 /* 
  * $Log$
  * Revision 1.4  1998/12/14 13:17:37  nop
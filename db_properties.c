@@ -22,8 +22,10 @@
 #include "config.h"
 #include "db.h"
 #include "db_private.h"
+#include "db_tune.h"
 #include "list.h"
 #include "storage.h"
+#include "str_intern.h"
 #include "utils.h"
 
 Propdef
@@ -31,8 +33,8 @@ dbpriv_new_propdef(const char *name)
 {
     Propdef newprop;
 
-    newprop.name = str_ref(name);
-    newprop.hash = str_hash(name);
+    newprop.name = str_intern_ident(name);
+    newprop.hash = str_ident_hash(newprop.name);
     return newprop;
 }
 
@@ -48,6 +50,242 @@ dbpriv_count_properties(Objid oid)
     return nprops;
 }
 
+/*********** Property value storage ***********/
+
+/* Objects with fewer slots than this, or with fewer than
+ * SPARSE_CLEAR_PERCENT of them clear, keep a dense Pval array.
+ */
+#define SPARSE_MIN_SLOTS	4
+#define SPARSE_CLEAR_PERCENT	50
+
+#define PBITS			(8 * sizeof(unsigned))
+#define PWORDS(n)		(((n) + PBITS - 1) / PBITS)
+#define PBIT(n)			(1u << ((n) % PBITS))
+
+static int sparse_objects = 0;
+
+static int
+bits_below(const unsigned *bits, int n)
+{
+    int count = 0, i;
+    unsigned w;
+
+    for (i = 0; i < n / PBITS; i++)
+	for (w = bits[i]; w; w &= w - 1)
+	    count++;
+    if (n % PBITS)
+	for (w = bits[i] & (PBIT(n) - 1); w; w &= w - 1)
+	    count++;
+
+    return count;
+}
+
+static int
+sparse_size(int nslots, int nvals)
+{
+    return sizeof(Psparse) + nvals * sizeof(Var)
+	+ nslots * sizeof(Pmeta) + PWORDS(nslots) * sizeof(unsigned);
+}
+
+static Psparse *
+new_sparse(int nslots, int nvals)
+{
+    Psparse *s = mymalloc(sparse_size(nslots, nvals), M_PVAL);
+    int i;
+
+    /* one block: header, then values, metadata, and bitmap, in order of
+     * decreasing alignment */
+    s->nslots = nslots;
+    s->nvals = nvals;
+    s->vals = (Var *) (s + 1);
+    s->meta = (Pmeta *) (s->vals + nvals);
+    s->present = (unsigned *) (s->meta + nslots);
+    for (i = 0; i < PWORDS(nslots); i++)
+	s->present[i] = 0;
+
+    return s;
+}
+
+void
+dbpriv_compact_propvals(Object *o, int nslots)
+{
+    Pval *pv = o->propval;
+    Psparse *s;
+    int i, k, nvals;
+
+    if (!pv || nslots < SPARSE_MIN_SLOTS)
+	return;
+    for (i = nvals = 0; i < nslots; i++)
+	if (pv[i].var.type != TYPE_CLEAR)
+	    nvals++;
+    if ((nslots - nvals) * 100 < nslots * SPARSE_CLEAR_PERCENT)
+	return;
+
+    s = new_sparse(nslots, nvals);
+    for (i = k = 0; i < nslots; i++) {
+	s->meta[i].owner = pv[i].owner;
+	s->meta[i].perms = pv[i].perms;
+	if (pv[i].var.type != TYPE_CLEAR) {
+	    s->present[i / PBITS] |= PBIT(i);
+	    s->vals[k++] = pv[i].var;
+	}
+    }
+    myfree(pv, M_PVAL);
+    o->propval = 0;
+    o->propsparse = s;
+    sparse_objects++;
+}
+
+void
+dbpriv_expand_propvals(Object *o)
+{
+    Psparse *s = o->propsparse;
+    Pval *pv;
+    int i, k;
+
+    if (!s)
+	return;
+
+    pv = mymalloc(s->nslots * sizeof(Pval), M_PVAL);
+    for (i = k = 0; i < s->nslots; i++) {
+	pv[i].owner = s->meta[i].owner;
+	pv[i].perms = s->meta[i].perms;
+	if (s->present[i / PBITS] & PBIT(i))
+	    pv[i].var = s->vals[k++];
+	else
+	    pv[i].var.type = TYPE_CLEAR;
+    }
+    myfree(s, M_PVAL);
+    o->propsparse = 0;
+    o->propval = pv;
+    sparse_objects--;
+}
+
+Var
+dbpriv_propval_value(Object *o, int n)
+{
+    Psparse *s = o->propsparse;
+    Var v;
+
+    if (!s)
+	return o->propval[n].var;
+    if (s->present[n / PBITS] & PBIT(n))
+	return s->vals[bits_below(s->present, n)];
+    v.type = TYPE_CLEAR;
+    return v;
+}
+
+Objid *
+dbpriv_propval_owner(Object *o, int n)
+{
+    return o->propsparse ? &o->propsparse->meta[n].owner
+	: &o->propval[n].owner;
+}
+
+short *
+dbpriv_propval_perms(Object *o, int n)
+{
+    return o->propsparse ? &o->propsparse->meta[n].perms
+	: &o->propval[n].perms;
+}
+
+static void
+set_propval_value(Object *o, int n, Var value)
+{
+    Psparse *s = o->propsparse;
+
+    dbpriv_dirty(o->id);
+    if (s) {
+	int present = (s->present[n / PBITS] & PBIT(n)) != 0;
+
+	if (present && value.type != TYPE_CLEAR) {
+	    Var *p = s->vals + bits_below(s->present, n);
+
+	    free_var(*p);
+	    *p = value;
+	    return;
+	} else if (!present && value.type == TYPE_CLEAR)
+	    return;
+	dbpriv_expand_propvals(o);
+    }
+    free_var(o->propval[n].var);
+    o->propval[n].var = value;
+    if (value.type == TYPE_CLEAR)
+	dbpriv_compact_propvals(o, dbpriv_count_properties(o->id));
+}
+
+void
+dbpriv_free_propvals(Object *o, int nslots)
+{
+    int i;
+
+    if (o->propsparse) {
+	for (i = 0; i < o->propsparse->nvals; i++)
+	    free_var(o->propsparse->vals[i]);
+	myfree(o->propsparse, M_PVAL);
+	o->propsparse = 0;
+	sparse_objects--;
+    } else if (o->propval) {
+	for (i = 0; i < nslots; i++)
+	    free_var(o->propval[i].var);
+	myfree(o->propval, M_PVAL);
+	o->propval = 0;
+    }
+}
+
+int
+dbpriv_propval_bytes(Object *o, int nslots)
+{
+    Psparse *s = o->propsparse;
+    int i, count;
+
+    if (s) {
+	count = sparse_size(s->nslots, 0);
+	for (i = 0; i < s->nvals; i++)
+	    count += value_bytes(s->vals[i]);
+    } else {
+	count = (sizeof(Pval) - sizeof(Var)) * nslots;
+	for (i = 0; i < nslots; i++)
+	    count += value_bytes(o->propval[i].var);
+    }
+
+    return count;
+}
+
+Var
+db_propval_stats(void)
+{
+    Var r;
+    Objid oid;
+    Object *o;
+    int i, nslots;
+    int dense = 0, dense_bytes = 0, sparse_bytes = 0, sparse_as_dense = 0;
+
+    for (oid = 0; oid <= db_last_used_objid(); oid++) {
+	if (!(o = dbpriv_find_object(oid)))
+	    continue;
+	if (o->propsparse) {
+	    nslots = o->propsparse->nslots;
+	    sparse_bytes += sparse_size(nslots, o->propsparse->nvals);
+	    sparse_as_dense += nslots * sizeof(Pval);
+	} else if (o->propval) {
+	    dense++;
+	    dense_bytes += dbpriv_count_properties(oid) * sizeof(Pval);
+	}
+    }
+
+    r = new_list(5);
+    for (i = 1; i <= 5; i++)
+	r.v.list[i].type = TYPE_INT;
+    r.v.list[1].v.num = dense;
+    r.v.list[2].v.num = dense_bytes;
+    r.v.list[3].v.num = sparse_objects;
+    r.v.list[4].v.num = sparse_bytes;
+    r.v.list[5].v.num = sparse_as_dense;
+
+    return r;
+}
+
 static int
 property_defined_at_or_below(const char *pname, int phash, Objid oid)
 {
@@ -83,6 +321,8 @@ insert_prop(Objid oid, int pos, Pval pval)
     new_propval = mymalloc(nprops * sizeof(Pval), M_PVAL);
 
     o = dbpriv_find_object(oid);
+    dbpriv_expand_propvals(o);
+    dbpriv_dirty(oid);
 
     for (i = 0; i < pos; i++)
 	new_propval[i] = o->propval[i];
@@ -98,6 +338,7 @@ insert_prop(Objid oid, int pos, Pval pval)
     if (o->propval)
 	myfree(o->propval, M_PVAL);
     o->propval = new_propval;
+    dbpriv_compact_propvals(o, nprops);
 }
 
 static void
@@ -159,6 +400,8 @@ db_add_propdef(Objid oid, const char *pname, Var value, Objid owner,
     if (is_reserved_property(pname))
 	return 0;
 
+    dbpriv_invalidate_watched_properties();
+    dbpriv_dirty_tree(oid);
     o = dbpriv_find_object(oid);
     if (o->propdefs.cur_length == o->propdefs.max_length) {
 	Propdef *old_props = o->propdefs.l;
@@ -207,9 +450,11 @@ db_rename_propdef(Objid oid, const char *old, const char *new)
 		|| property_defined_at_or_below(new, str_hash(new), oid))
 		    return 0;
 	    }
+	    dbpriv_invalidate_watched_properties();
+	    dbpriv_dirty(oid);
 	    free_str(props->l[i].name);
-	    props->l[i].name = str_ref(new);
-	    props->l[i].hash = str_hash(new);
+	    props->l[i].name = str_intern_ident(new);
+	    props->l[i].hash = str_ident_hash(props->l[i].name);
 
 	    return 1;
 	}
@@ -228,6 +473,8 @@ remove_prop(Objid oid, int pos)
     o = dbpriv_find_object(oid);
     nprops = dbpriv_count_properties(oid);
 
+    dbpriv_expand_propvals(o);
+    dbpriv_dirty(oid);
     free_var(o->propval[pos].var);	/* free deleted property */
 
     if (nprops) {
@@ -242,6 +489,7 @@ remove_prop(Objid oid, int pos)
     if (o->propval)
 	myfree(o->propval, M_PVAL);
     o->propval = new_propval;
+    dbpriv_compact_propvals(o, nprops);
 }
 
 static void
@@ -273,6 +521,8 @@ db_delete_propdef(Objid oid, const char *pname)
 
 	p = props->l[i];
 	if (p.hash == hash && !mystrcasecmp(p.name, pname)) {
+	    dbpriv_invalidate_watched_properties();
+	    dbpriv_dirty_tree(oid);
 	    if (p.name)
 		free_str(p.name);
 
@@ -395,8 +645,8 @@ get_bi_value(db_prop_handle h, Var * value)
     }
 }
 
-db_prop_handle
-db_find_property(Objid oid, const char *name, Var * value)
+static db_prop_handle
+find_property(Objid oid, const char *name, int hash, Var * value)
 {
     static struct {
 	const char *name;
@@ -410,7 +660,6 @@ db_find_property(Objid oid, const char *name, Var * value)
     static int ptable_init = 0;
     int i, n;
     db_prop_handle h;
-    int hash = str_hash(name);
     Object *o;
 
     if (!ptable_init) {
@@ -440,24 +689,29 @@ db_find_property(Objid oid, const char *name, Var * value)
 	int length = props->cur_length;
 
 	for (i = 0; i < length; i++, n++) {
-	    if (defs[i].hash == hash
-		&& !mystrcasecmp(defs[i].name, name)) {
-		Pval *prop;
-
-		h.definer = o->id;
-		o = dbpriv_find_object(oid);
-		prop = h.ptr = o->propval + n;
-
-		if (value) {
-		    while (prop->var.type == TYPE_CLEAR) {
-			n -= o->propdefs.cur_length;
-			o = dbpriv_find_object(o->parent);
-			prop = o->propval + n;
-		    }
-		    *value = prop->var;
+	    if (defs[i].name == name)
+		ident_ptr_hits++;
+	    else if (defs[i].hash == hash
+		     && !mystrcasecmp(defs[i].name, name))
+		ident_cmp_hits++;
+	    else
+		continue;
+
+	    h.definer = o->id;
+	    o = dbpriv_find_object(oid);
+	    h.ptr = o;
+	    h.index = n;
+
+	    if (value) {
+		Var v;
+
+		while ((v = dbpriv_propval_value(o, n)).type == TYPE_CLEAR) {
+		    n -= o->propdefs.cur_length;
+		    o = dbpriv_find_object(o->parent);
 		}
-		return h;
+		*value = v;
 	    }
+	    return h;
 	}
     }
 
@@ -465,6 +719,103 @@ db_find_property(Objid oid, const char *name, Var * value)
     return h;
 }
 
+db_prop_handle
+db_find_property(Objid oid, const char *name, Var * value)
+{
+    return find_property(oid, name, str_hash(name), value);
+}
+
+db_prop_handle
+db_find_property2(Objid oid, const char *name, Var * value)
+{
+    return find_property(oid, name, str_ident_hash(name), value);
+}
+
+/* Properties watched on behalf of server-side caches; see
+ * db_watch_property() in db.h.  A property is identified by its defining
+ * object and its position among that object's own propdefs; the list is
+ * emptied whenever the generation advances.
+ */
+typedef struct {
+    Objid definer;
+    int pos;
+} Watched_Prop;
+
+static Watched_Prop *watched_props = 0;
+static int num_watched_props = 0, max_watched_props = 0;
+static unsigned watch_generation = 1;
+
+static int
+definer_pos(db_prop_handle h)
+{
+    Object *o = h.ptr;
+    int n = h.index;
+
+    while (o->id != h.definer) {
+	n -= o->propdefs.cur_length;
+	o = dbpriv_find_object(o->parent);
+    }
+    return n;
+}
+
+void
+dbpriv_invalidate_watched_properties(void)
+{
+    num_watched_props = 0;
+    watch_generation++;
+}
+
+void
+db_watch_property(db_prop_handle h)
+{
+    int i, pos;
+
+    if (!h.ptr || h.built_in)
+	return;
+    pos = definer_pos(h);
+    for (i = 0; i < num_watched_props; i++)
+	if (watched_props[i].definer == h.definer
+	    && watched_props[i].pos == pos)
+	    return;
+    if (num_watched_props == max_watched_props) {
+	Watched_Prop *old = watched_props;
+	int new_size = (max_watched_props == 0
+			? 16 : 2 * max_watched_props);
+
+	watched_props = mymalloc(new_size * sizeof(Watched_Prop), M_STRUCT);
+	for (i = 0; i < num_watched_props; i++)
+	    watched_props[i] = old[i];
+	max_watched_props = new_size;
+	if (old)
+	    myfree(old, M_STRUCT);
+    }
+    watched_props[num_watched_props].definer = h.definer;
+    watched_props[num_watched_props].pos = pos;
+    num_watched_props++;
+}
+
+unsigned
+db_property_watch_generation(void)
+{
+    return watch_generation;
+}
+
+static void
+check_watched_property(db_prop_handle h)
+{
+    int i, pos = -1;
+
+    for (i = 0; i < num_watched_props; i++)
+	if (watched_props[i].definer == h.definer) {
+	    if (pos < 0)
+		pos = definer_pos(h);
+	    if (watched_props[i].pos == pos) {
+		dbpriv_invalidate_watched_properties();
+		return;
+	    }
+	}
+}
+
 Var
 db_property_value(db_prop_handle h)
 {
@@ -472,11 +823,8 @@ db_property_value(db_prop_handle h)
 
     if (h.built_in)
 	get_bi_value(h, &value);
-    else {
-	Pval *prop = h.ptr;
-
-	value = prop->var;
-    }
+    else
+	value = dbpriv_propval_value(h.ptr, h.index);
 
     return value;
 }
@@ -485,10 +833,9 @@ void
 db_set_property_value(db_prop_handle h, Var value)
 {
     if (!h.built_in) {
-	Pval *prop = h.ptr;
-
-	free_var(prop->var);
-	prop->var = value;
+	if (num_watched_props)
+	    check_watched_property(h);
+	set_propval_value(h.ptr, h.index, value);
     } else {
 	Objid oid = *((Objid *) h.ptr);
 	db_object_flag flag;
@@ -542,11 +889,8 @@ db_property_owner(db_prop_handle h)
     if (h.built_in) {
 	panic("Built-in property in DB_PROPERTY_OWNER!");
 	return NOTHING;
-    } else {
-	Pval *prop = h.ptr;
-
-	return prop->owner;
-    }
+    } else
+	return *dbpriv_propval_owner(h.ptr, h.index);
 }
 
 void
@@ -555,9 +899,8 @@ db_set_property_owner(db_prop_handle h, Objid oid)
     if (h.built_in)
 	panic("Built-in property in DB_SET_PROPERTY_OWNER!");
     else {
-	Pval *prop = h.ptr;
-
-	prop->owner = oid;
+	dbpriv_dirty(((Object *) h.ptr)->id);
+	*dbpriv_propval_owner(h.ptr, h.index) = oid;
     }
 }
 
@@ -567,11 +910,8 @@ db_property_flags(db_prop_handle h)
     if (h.built_in) {
 	panic("Built-in property in DB_PROPERTY_FLAGS!");
 	return 0;
-    } else {
-	Pval *prop = h.ptr;
-
-	return prop->perms;
-    }
+    } else
+	return *dbpriv_propval_perms(h.ptr, h.index);
 }
 
 void
@@ -580,9 +920,8 @@ db_set_property_flags(db_prop_handle h, unsigned flags)
     if (h.built_in)
 	panic("Built-in property in DB_SET_PROPERTY_FLAGS!");
     else {
-	Pval *prop = h.ptr;
-
-	prop->perms = flags;
+	dbpriv_dirty(((Object *) h.ptr)->id);
+	*dbpriv_propval_perms(h.ptr, h.index) = flags;
     }
 }
 
@@ -606,6 +945,8 @@ fix_props(Objid oid, int parent_local, int old, int new, int common)
 
     local += me->propdefs.cur_length;
 
+    dbpriv_expand_propvals(me);
+    dbpriv_dirty(oid);
     for (i = local; i < local + old; i++)
 	free_var(me->propval[i].var);
 
@@ -616,11 +957,12 @@ fix_props(Objid oid, int parent_local, int old, int new, int common)
 	for (i = 0; i < new; i++) {
 	    Pval pv;
 
-	    pv = parent->propval[parent_local + i];
-	    new_propval[local + i] = pv;
-	    new_propval[local + i].var.type = TYPE_CLEAR;
+	    pv.var.type = TYPE_CLEAR;
+	    pv.owner = *dbpriv_propval_owner(parent, parent_local + i);
+	    pv.perms = *dbpriv_propval_perms(parent, parent_local + i);
 	    if (pv.perms & PF_CHOWN)
-		new_propval[local + i].owner = me->owner;
+		pv.owner = me->owner;
+	    new_propval[local + i] = pv;
 	}
 	for (i = 0; i < common; i++)
 	    new_propval[local + new + i] = me->propval[local + old + i];
@@ -630,6 +972,7 @@ fix_props(Objid oid, int parent_local, int old, int new, int common)
     if (me->propval)
 	myfree(me->propval, M_PVAL);
     me->propval = new_propval;
+    dbpriv_compact_propvals(me, local + new + common);
 
     for (c = me->child; c != NOTHING; c = dbpriv_find_object(c)->sibling)
 	fix_props(c, local, old, new, common);
@@ -4,3 +4,5 @@
 
 extern void db_log_cache_stats(void);
 extern Var db_verb_cache_stats(void);
+extern Var db_propval_stats(void);
+extern Var db_program_stats(void);
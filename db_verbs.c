@@ -32,6 +32,7 @@
 #include "parse_cmd.h"
 #include "program.h"
 #include "storage.h"
+#include "str_intern.h"
 #include "utils.h"
 
 
@@ -203,6 +204,7 @@ db_add_verb(Objid oid, const char *vnames, Objid owner, unsigned flags,
     int count;
 
     db_priv_affected_callable_verb_lookup();
+    dbpriv_dirty(oid);
 
     newv = mymalloc(sizeof(Verbdef), M_VERBDEF);
     newv->name = vnames;
@@ -211,6 +213,9 @@ db_add_verb(Objid oid, const char *vnames, Objid owner, unsigned flags,
     newv->prep = prep;
     newv->next = 0;
     newv->program = 0;
+#ifdef LAZY_PROGRAMS
+    newv->lazy = 0;
+#endif
     if (o->verbdefs) {
 	for (v = o->verbdefs, count = 2; v->next; v = v->next, ++count);
 	v->next = newv;
@@ -277,6 +282,7 @@ db_delete_verb(db_verb_handle vh)
     Verbdef *vv;
 
     db_priv_affected_callable_verb_lookup();
+    dbpriv_dirty(oid);
 
     vv = o->verbdefs;
     if (vv == v)
@@ -287,6 +293,7 @@ db_delete_verb(db_verb_handle vh)
 	vv->next = v->next;
     }
 
+    dbpriv_forget_lazy_program(v);
     if (v->program)
 	free_program(v->program);
     if (v->name)
@@ -491,7 +498,7 @@ db_find_callable_verb(Objid oid, const char *verb)
     for (vc = vc_table[bucket]; vc; vc = vc->next) {
 	if (hash == vc->hash
 	    && first_parent_with_verbs == vc->oid_key
-	    && !mystrcasecmp(verb, vc->verbname)) {
+	    && (verb == vc->verbname || !mystrcasecmp(verb, vc->verbname))) {
 	    /* we haaave a winnaaah */
 	    if (vc->h.verbdef) {
 		verbcache_hit++;
@@ -520,7 +527,14 @@ db_find_callable_verb(Objid oid, const char *verb)
 
     new_vc->hash = hash;
     new_vc->oid_key = first_parent_with_verbs;
-    new_vc->verbname = str_dup(verb);
+    {
+	/* share the key with the literal that named it, if any, so the
+	 * next lookup from that program matches by pointer */
+	const char *name = str_dup(verb);
+
+	new_vc->verbname = (char *) str_intern_ident(name);
+	free_str(name);
+    }
     new_vc->h.verbdef = NULL;
     new_vc->next = vc_table[bucket];
     vc_table[bucket] = new_vc;
@@ -658,6 +672,7 @@ db_set_verb_names(db_verb_handle vh, const char *names)
     db_priv_affected_callable_verb_lookup();
 
     if (h) {
+	dbpriv_dirty(h->definer);
 	if (h->verbdef->name)
 	    free_str(h->verbdef->name);
 	h->verbdef->name = names;
@@ -682,9 +697,10 @@ db_set_verb_owner(db_verb_handle vh, Objid owner)
 {
     handle *h = (handle *) vh.ptr;
 
-    if (h)
+    if (h) {
+	dbpriv_dirty(h->definer);
 	h->verbdef->owner = owner;
-    else
+    } else
 	panic("DB_SET_VERB_OWNER: Null handle!");
 }
 
@@ -708,12 +724,134 @@ db_set_verb_flags(db_verb_handle vh, unsigned flags)
     db_priv_affected_callable_verb_lookup();
 
     if (h) {
+	dbpriv_dirty(h->definer);
 	h->verbdef->perms &= ~PERMMASK;
 	h->verbdef->perms |= flags;
     } else
 	panic("DB_SET_VERB_FLAGS: Null handle!");
 }
 
+#ifdef LAZY_PROGRAMS
+
+/*********** Programs loaded on demand ***********/
+
+/* Each verb whose program came from the DB file and hasn't been changed
+ * since remembers where its source is, and is compiled the first time
+ * db_verb_program() is asked for it.  Loaded ones are kept on a list,
+ * least recently used first; beyond LAZY_PROGRAM_CACHE of them, the
+ * oldest are unloaded again.  That only drops the verb's reference: a
+ * program shared with other verbs (see program_dedup()) or still being
+ * run by a task is freed when they let go of it too.
+ */
+
+static Lazy_Program loaded = {0, 0, 0, &loaded, &loaded};
+
+static int lazy_programs = 0;
+static int lazy_loaded = 0;
+static int lazy_faults = 0;
+static int lazy_evictions = 0;
+
+static void
+lazy_unlink(Lazy_Program * l)
+{
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+    l->prev = l->next = l;
+}
+
+static void
+lazy_append(Lazy_Program * l)
+{
+    l->prev = loaded.prev;
+    l->next = &loaded;
+    loaded.prev->next = l;
+    loaded.prev = l;
+}
+
+void
+dbpriv_set_lazy_program(Verbdef * v, long offset, int length)
+{
+    Lazy_Program *l = mymalloc(sizeof(Lazy_Program), M_VERBDEF);
+
+    l->offset = offset;
+    l->length = length;
+    l->verbdef = v;
+    l->prev = l->next = l;
+    v->lazy = l;
+    lazy_programs++;
+}
+
+void
+dbpriv_forget_lazy_program(Verbdef * v)
+{
+    Lazy_Program *l = v->lazy;
+
+    if (!l)
+	return;
+    if (v->program)
+	lazy_loaded--;
+    lazy_unlink(l);
+    myfree(l, M_VERBDEF);
+    v->lazy = 0;
+    lazy_programs--;
+}
+
+static void
+evict_programs(void)
+{
+    Lazy_Program *l;
+
+    while (lazy_loaded > LAZY_PROGRAM_CACHE) {
+	l = loaded.next;
+	free_program(l->verbdef->program);
+	l->verbdef->program = 0;
+	lazy_unlink(l);
+	lazy_loaded--;
+	lazy_evictions++;
+    }
+}
+
+static Program *
+lazy_program(db_verb_handle vh, Verbdef * v)
+{
+    Lazy_Program *l = v->lazy;
+    Program *p;
+
+    if (v->program) {
+	lazy_unlink(l);
+	lazy_append(l);
+	return v->program;
+    }
+    if (!(p = dbpriv_load_program(vh, l)))
+	return null_program();
+    v->program = program_dedup(p);
+    lazy_append(l);
+    lazy_loaded++;
+    lazy_faults++;
+    if (LAZY_PROGRAM_CACHE > 0)
+	evict_programs();	/* never this one, which is the newest */
+    return v->program;
+}
+
+Var
+db_program_stats(void)
+{
+    Var r;
+    int i;
+
+    r = new_list(4);
+    for (i = 1; i <= 4; i++)
+	r.v.list[i].type = TYPE_INT;
+    r.v.list[1].v.num = lazy_programs;
+    r.v.list[2].v.num = lazy_loaded;
+    r.v.list[3].v.num = lazy_faults;
+    r.v.list[4].v.num = lazy_evictions;
+
+    return r;
+}
+
+#endif				/* LAZY_PROGRAMS */
+
 Program *
 db_verb_program(db_verb_handle vh)
 {
@@ -722,6 +860,10 @@ db_verb_program(db_verb_handle vh)
     if (h) {
 	Program *p = h->verbdef->program;
 
+#ifdef LAZY_PROGRAMS
+	if (h->verbdef->lazy)
+	    return lazy_program(vh, h->verbdef);
+#endif
 	return p ? p : null_program();
     }
     panic("DB_VERB_PROGRAM: Null handle!");
@@ -738,9 +880,11 @@ db_set_verb_program(db_verb_handle vh, Program * program)
     /* db_priv_affected_callable_verb_lookup(); */
 
     if (h) {
+	dbpriv_dirty(h->definer);
+	dbpriv_forget_lazy_program(h->verbdef);
 	if (h->verbdef->program)
 	    free_program(h->verbdef->program);
-	h->verbdef->program = program;
+	h->verbdef->program = program_dedup(program);
     } else
 	panic("DB_SET_VERB_PROGRAM: Null handle!");
 }
@@ -768,6 +912,7 @@ db_set_verb_arg_specs(db_verb_handle vh,
     db_priv_affected_callable_verb_lookup();
 
     if (h) {
+	dbpriv_dirty(h->definer);
 	h->verbdef->perms = ((h->verbdef->perms & PERMMASK)
 			     | (dobj << DOBJSHIFT)
 			     | (iobj << IOBJSHIFT));
@@ -988,15 +988,13 @@ find_hot_node(Stmt * stmt)
     return 0;
 }
 
-unsigned
-find_line_number(Program * prog, int vector, unsigned pc)
+/* Counts lines in the decompiled text of PROG to find the one holding PC;
+ * only needed for programs whose vectors come without a line table.
+ */
+static unsigned
+decompiled_line_number(Program * prog, int vector, unsigned pc)
 {
-    Stmt *tree;
-
-    if (prog->cached_lineno_pc == pc && prog->cached_lineno_vec == vector)
-	return prog->cached_lineno;
-
-    tree = program_to_tree(prog, MAIN_VECTOR, vector, pc);
+    Stmt *tree = program_to_tree(prog, MAIN_VECTOR, vector, pc);
 
     lineno = prog->first_lineno;
     find_hot_node(tree);
@@ -1005,12 +1003,32 @@ find_line_number(Program * prog, int vector, unsigned pc)
     if (!hot_node && hot_position != DONE)
 	panic("Can't do job in FIND_LINE_NUMBER!");
 
-    prog->cached_lineno_vec = vector;
-    prog->cached_lineno_pc = pc;
-    prog->cached_lineno = lineno;
     return lineno;
 }
 
+unsigned
+find_line_number(Program * prog, int vector, unsigned pc)
+{
+    Bytecodes *bc = (vector == MAIN_VECTOR ? &prog->main_vector
+		     : &prog->fork_vectors[vector]);
+    unsigned lo = 0, hi = bc->num_lines;
+
+    if (hi == 0)
+	return decompiled_line_number(prog, vector, pc);
+
+    /* Find the last entry at or before PC; the first is always at 0. */
+    while (hi - lo > 1) {
+	unsigned mid = lo + (hi - lo) / 2;
+
+	if (bc->lines[mid].pc <= pc)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+
+    return prog->first_lineno + bc->lines[lo].line;
+}
+
 char rcsid_decompile[] = "$Id$";
 
 /* 
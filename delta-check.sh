@@ -0,0 +1,31 @@
+#!/bin/sh
+
+# Usage: delta-check.sh base-db reference-db
+#
+# Loads base-db together with any base-db.delta.N files in emergency mode,
+# writes it straight back out as a full database, and compares the result
+# with reference-db, a full dump taken at the time of the last delta.
+# Exits 0 iff the replayed database is byte-identical to the reference.
+
+if [ $# -ne 2 ]; then
+	echo 'Usage: delta-check.sh base-db reference-db'
+	exit 1
+fi
+
+out=${TMPDIR:-/tmp}/delta-check.$$
+trap 'rm -f $out $out.log' 0
+
+echo quit | ./moo -e -l $out.log "$1" $out > /dev/null 2>&1
+if [ ! -r $out ]; then
+	echo "Cannot load $1:"
+	grep -E 'LOADING|PANIC|READ' $out.log
+	exit 1
+fi
+
+grep 'Replaying' $out.log | sed 's/^.*LOADING: //'
+if cmp -s $out "$2"; then
+	echo "Replayed database matches $2"
+else
+	echo "Replayed database differs from $2"
+	exit 1
+fi
@@ -15,37 +15,229 @@
     Pavel@Xerox.Com
  *****************************************************************************/
 
+#include "my-string.h"
+
 #include "config.h"
 #include "eval_env.h"
+#include "list.h"
 #include "storage.h"
 #include "structures.h"
 #include "sym_table.h"
 #include "utils.h"
 
 /*
- * Keep a pool of rt_envs big enough to hold NUM_READY_VARS variables to
- * avoid lots of malloc/free.
+ * Activation frames (rt_envs and rt_stacks) come from two places.
+ *
+ * The running task bump-allocates its frames out of a single contiguous
+ * arena.  Activations are strictly LIFO while the interpreter runs, so
+ * freeing a frame just drops the arena top back down to it; call_verb()
+ * allocates a verb's rt_env and rt_stack as one block.
+ *
+ * Frames that must outlive the current run (forked tasks, suspended tasks,
+ * and anything read from the DB) live in per-size-class slabs instead;
+ * suspend_task() migrates a task's arena frames into slabs before the
+ * arena is handed to the next task.  Requests bigger than the largest
+ * class go straight to mymalloc().
  */
-static Var *ready_size_rt_envs;
+
+#define FRAME_ARENA_VARS	16384
+#define FRAME_SLAB_HUNK		8192	/* bytes per slab refill */
+
+static const unsigned frame_class_size[] = {8, 16, 32, 64, 128};
+#define FRAME_CLASSES	Arraysize(frame_class_size)
+
+static Var *frame_arena, *frame_arena_top, *frame_arena_end;
+static Var *frame_free_list[FRAME_CLASSES];
+
+static struct {
+    unsigned arena_allocs, arena_overflows, arena_peak;
+    unsigned slab_allocs, large_allocs, detached;
+    unsigned nused[FRAME_CLASSES], nfree[FRAME_CLASSES];
+} frame_stats;
+
+static inline int
+in_frame_arena(Var * p)
+{
+    return p >= frame_arena && p < frame_arena_end;
+}
+
+static inline int
+frame_class(unsigned size)
+{
+    int i;
+
+    for (i = 0; i < FRAME_CLASSES; i++)
+	if (size <= frame_class_size[i])
+	    return i;
+    return -1;
+}
+
+static void
+refill_frame_class(int c)
+{
+    unsigned bsize = frame_class_size[c] * sizeof(Var);
+    unsigned n = MAX(FRAME_SLAB_HUNK / bsize, 4);
+    char *hunk = mymalloc(n * bsize, M_RT_FRAME);
+
+    while (n--) {
+	Var *b = (Var *) (hunk + n * bsize);
+
+	b[0].v.list = frame_free_list[c];
+	frame_free_list[c] = b;
+	frame_stats.nfree[c]++;
+    }
+}
 
 Var *
-new_rt_env(unsigned size)
+alloc_slab_vars(unsigned size)
 {
+    int c = frame_class(size);
     Var *ret;
-    unsigned i;
 
-    if (size <= NUM_READY_VARS && ready_size_rt_envs) {
-	ret = ready_size_rt_envs;
-	ready_size_rt_envs = ret[0].v.list;
-    } else
-	ret = mymalloc(MAX(size, NUM_READY_VARS) * sizeof(Var), M_RT_ENV);
+    if (c < 0) {
+	frame_stats.large_allocs++;
+	return mymalloc(size * sizeof(Var), M_RT_ENV);
+    }
+    if (!frame_free_list[c])
+	refill_frame_class(c);
+    ret = frame_free_list[c];
+    frame_free_list[c] = ret[0].v.list;
+    frame_stats.nfree[c]--;
+    frame_stats.nused[c]++;
+    frame_stats.slab_allocs++;
+    return ret;
+}
 
-    for (i = 0; i < size; i++)
-	ret[i].type = TYPE_NONE;
+static void
+init_frame_arena(void)
+{
+    frame_arena = mymalloc(FRAME_ARENA_VARS * sizeof(Var), M_RT_FRAME);
+    frame_arena_top = frame_arena;
+    frame_arena_end = frame_arena + FRAME_ARENA_VARS;
+}
 
+Var *
+alloc_frame_vars(unsigned size)
+{
+    Var *ret;
+
+    if (size == 0)
+	size = 1;
+    if (!frame_arena)
+	init_frame_arena();
+    if (frame_arena_end - frame_arena_top < size) {
+	frame_stats.arena_overflows++;
+	return alloc_slab_vars(size);
+    }
+    ret = frame_arena_top;
+    frame_arena_top += size;
+    if (frame_arena_top - frame_arena > frame_stats.arena_peak)
+	frame_stats.arena_peak = frame_arena_top - frame_arena;
+    frame_stats.arena_allocs++;
     return ret;
 }
 
+void
+free_frame_vars(Var * p, unsigned size)
+{
+    int c;
+
+    if (in_frame_arena(p)) {
+	/* Everything above a dead frame is dead too. */
+	if (p < frame_arena_top)
+	    frame_arena_top = p;
+    } else if ((c = frame_class(size ? size : 1)) < 0)
+	myfree(p, M_RT_ENV);
+    else {
+	p[0].v.list = frame_free_list[c];
+	frame_free_list[c] = p;
+	frame_stats.nused[c]--;
+	frame_stats.nfree[c]++;
+    }
+}
+
+Var *
+detach_frame_vars(Var * p, unsigned size, unsigned in_use)
+{
+    Var *ret;
+
+    if (!in_frame_arena(p))
+	return p;
+    ret = alloc_slab_vars(size ? size : 1);
+    memcpy(ret, p, in_use * sizeof(Var));
+    frame_stats.detached++;
+    return ret;
+}
+
+void
+reset_frame_arena(void)
+{
+    frame_arena_top = frame_arena;
+}
+
+Var
+frame_usage(void)
+{
+    Var r, l;
+    int i;
+
+    r = new_list(7);
+    for (i = 1; i <= 6; i++)
+	r.v.list[i].type = TYPE_INT;
+    r.v.list[1].v.num = frame_stats.arena_allocs;
+    r.v.list[2].v.num = frame_stats.slab_allocs;
+    r.v.list[3].v.num = frame_stats.large_allocs;
+    r.v.list[4].v.num = frame_stats.arena_overflows;
+    r.v.list[5].v.num = frame_stats.detached;
+    r.v.list[6].v.num = frame_stats.arena_peak * sizeof(Var);
+
+    l = r.v.list[7] = new_list(FRAME_CLASSES);
+    for (i = 0; i < FRAME_CLASSES; i++) {
+	Var c = l.v.list[i + 1] = new_list(3);
+
+	c.v.list[1].type = c.v.list[2].type = c.v.list[3].type = TYPE_INT;
+	c.v.list[1].v.num = frame_class_size[i] * sizeof(Var);
+	c.v.list[2].v.num = frame_stats.nused[i];
+	c.v.list[3].v.num = frame_stats.nfree[i];
+    }
+    return r;
+}
+
+static inline Var *
+clear_rt_env(Var * env, unsigned size)
+{
+    unsigned i;
+
+    for (i = 0; i < size; i++)
+	env[i].type = TYPE_NONE;
+
+    return env;
+}
+
+Var *
+new_rt_env(unsigned size)
+{
+    return clear_rt_env(alloc_slab_vars(size ? size : 1), size);
+}
+
+Var *
+new_frame(unsigned env_size, unsigned stack_size, Var ** stack)
+{
+    Var *env;
+
+    if (!frame_arena)
+	init_frame_arena();
+    if (frame_arena_end - frame_arena_top >= env_size + stack_size) {
+	env = alloc_frame_vars(env_size + stack_size);
+	*stack = env + env_size;
+    } else {
+	/* Pieces of a slab block can't be freed separately. */
+	env = alloc_frame_vars(env_size);
+	*stack = alloc_frame_vars(stack_size);
+    }
+    return clear_rt_env(env, env_size);
+}
+
 void
 free_rt_env(Var * rt_env, unsigned size)
 {
@@ -54,11 +246,7 @@ free_rt_env(Var * rt_env, unsigned size)
     for (i = 0; i < size; i++)
 	free_var(rt_env[i]);
 
-    if (size <= NUM_READY_VARS) {
-	rt_env[0].v.list = ready_size_rt_envs;
-	ready_size_rt_envs = rt_env;
-    } else
-	myfree((void *) rt_env, M_RT_ENV);
+    free_frame_vars(rt_env, size);
 }
 
 Var *
@@ -23,9 +23,19 @@
 #include "version.h"
 
 extern Var *new_rt_env(unsigned size);
+extern Var *new_frame(unsigned env_size, unsigned stack_size,
+		      Var ** stack);
 extern void free_rt_env(Var * rt_env, unsigned size);
 extern Var *copy_rt_env(Var * from, unsigned size);
 
+/* Raw frame storage; see the comment in eval_env.c */
+extern Var *alloc_frame_vars(unsigned size);
+extern Var *alloc_slab_vars(unsigned size);
+extern void free_frame_vars(Var * p, unsigned size);
+extern Var *detach_frame_vars(Var * p, unsigned size, unsigned in_use);
+extern void reset_frame_arena(void);
+extern Var frame_usage(void);
+
 void set_rt_env_obj(Var * env, int slot, Objid o);
 void set_rt_env_str(Var * env, int slot, const char *s);
 void set_rt_env_var(Var * env, int slot, Var v);
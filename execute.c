@@ -76,40 +76,43 @@ typedef enum {			/* Reasons for executing a FINALLY handler */
 } Finally_Reason;
 
 /*
- * Keep a pool of the common size rt_stacks around to avoid beating up on
- * malloc.  This doesn't really need tuning.  Most rt_stacks will be less
- * than size 10.  I rounded up to a size which won't waste a lot of space
- * with a powers-of-two malloc (while leaving some room for mymalloc
- * overhead, if any).
+ * rt_stacks share frame storage with rt_envs; see eval_env.c.  A fresh
+ * activation gets both from the running task's arena in one block.
  */
-static Var *rt_stack_quick;
-#define RT_STACK_QUICKSIZE	15
-
 static void
 alloc_rt_stack(activation * a, int size)
 {
-    Var *res;
-
-    if (size <= RT_STACK_QUICKSIZE && rt_stack_quick) {
-	res = rt_stack_quick;
-	rt_stack_quick = rt_stack_quick[0].v.list;
-    } else {
-	res = mymalloc(MAX(size, RT_STACK_QUICKSIZE) * sizeof(Var), M_RT_STACK);
-    }
-    a->base_rt_stack = a->top_rt_stack = res;
+    a->base_rt_stack = a->top_rt_stack = alloc_frame_vars(size);
     a->rt_stack_size = size;
 }
 
 static void
 free_rt_stack(activation * a)
 {
-    Var *stack = a->base_rt_stack;
+    free_frame_vars(a->base_rt_stack, a->rt_stack_size);
+}
 
-    if (a->rt_stack_size <= RT_STACK_QUICKSIZE) {
-	stack[0].v.list = rt_stack_quick;
-	rt_stack_quick = stack;
-    } else
-	myfree(stack, M_RT_STACK);
+static Var *
+alloc_frame(activation * a, int stack_size)
+{
+    a->rt_env = new_frame(a->prog->num_var_names, stack_size,
+			  &a->base_rt_stack);
+    a->top_rt_stack = a->base_rt_stack;
+    a->rt_stack_size = stack_size;
+    return a->rt_env;
+}
+
+/* Move an activation's frame out of the arena so it can outlive this run. */
+static void
+detach_activ_frame(activation * a)
+{
+    int in_use = a->top_rt_stack - a->base_rt_stack;
+
+    a->rt_env = detach_frame_vars(a->rt_env, a->prog->num_var_names,
+				  a->prog->num_var_names);
+    a->base_rt_stack = detach_frame_vars(a->base_rt_stack,
+					 a->rt_stack_size, in_use);
+    a->top_rt_stack = a->base_rt_stack + in_use;
 }
 
 void
@@ -205,6 +208,9 @@ suspend_task(package p)
     e = (*p.u.susp.proc) (the_vm, p.u.susp.data);
     if (e != E_NONE)
 	free_vm(the_vm, 0);
+    else
+	for (i = 0; i <= the_vm->top_activ_stack; i++)
+	    detach_activ_frame(&the_vm->activ_stack[i]);
     return e;
 }
 
@@ -647,14 +653,12 @@ call_verb2(Objid this, const char *vname, Var args, int do_pass)
 
     db_free_verb_handle(h);
 
-    alloc_rt_stack(&RUN_ACTIV, program->main_vector.max_stack);
+    env = alloc_frame(&RUN_ACTIV, program->main_vector.max_stack);
     RUN_ACTIV.pc = 0;
     RUN_ACTIV.error_pc = 0;
     RUN_ACTIV.bi_func_pc = 0;
     RUN_ACTIV.temp.type = TYPE_NONE;
 
-    RUN_ACTIV.rt_env = env = new_rt_env(RUN_ACTIV.prog->num_var_names);
-
     fill_in_rt_consts(env, program->version);
 
     set_rt_env_obj(env, SLOT_THIS, this);
@@ -1457,7 +1461,7 @@ do {								\
 		} else {
 		    db_prop_handle h;
 
-		    h = db_find_property(obj.v.obj, propname.v.str, &prop);
+		    h = db_find_property2(obj.v.obj, propname.v.str, &prop);
 		    free_var(propname);
 		    free_var(obj);
 		    if (!h.ptr)
@@ -1487,7 +1491,7 @@ do {								\
 		else {
 		    db_prop_handle h;
 
-		    h = db_find_property(obj.v.obj, propname.v.str, &prop);
+		    h = db_find_property2(obj.v.obj, propname.v.str, &prop);
 		    if (!h.ptr)
 			PUSH_ERROR(E_PROPNF);
 		    else if (h.built_in
@@ -1524,7 +1528,7 @@ do {								\
 		    enum error err = E_NONE;
 		    Objid progr = RUN_ACTIV.progr;
 
-		    h = db_find_property(obj.v.obj, propname.v.str, 0);
+		    h = db_find_property2(obj.v.obj, propname.v.str, 0);
 		    if (!h.ptr)
 			err = E_PROPNF;
 		    else {
@@ -2246,6 +2250,8 @@ run_interpreter(char raise, enum error e,
     interpreter_is_running = 1;
     ret = run(raise, e, result);
     interpreter_is_running = 0;
+    /* Every frame has now been freed or detached by suspend_task(). */
+    reset_frame_arena();
     args = handler_verb_args;
 
     cancel_timer(task_alarm_id);
@@ -2327,9 +2333,6 @@ do_task(Program * prog, int which_vector, Var * result, int is_fg, int do_db_tra
     RUN_ACTIV.prog = program_ref(prog);
 
     root_activ_vector = which_vector;	/* main or which of the forked */
-    alloc_rt_stack(&RUN_ACTIV, (which_vector == MAIN_VECTOR
-				? prog->main_vector.max_stack
-			  : prog->fork_vectors[which_vector].max_stack));
 
     RUN_ACTIV.pc = 0;
     RUN_ACTIV.error_pc = 0;
@@ -2390,7 +2393,8 @@ do_server_program_task(Objid this, const char *verb, Var args, Objid vloc,
     check_activ_stack_size(current_max_stack_size());
     top_activ_stack = 0;
 
-    RUN_ACTIV.rt_env = env = new_rt_env(program->num_var_names);
+    RUN_ACTIV.prog = program;
+    env = alloc_frame(&RUN_ACTIV, program->main_vector.max_stack);
     RUN_ACTIV.this = this;
     RUN_ACTIV.player = player;
     RUN_ACTIV.progr = progr;
@@ -2423,7 +2427,8 @@ do_input_task(Objid user, Parsed_Command * pc, Objid this, db_verb_handle vh)
     check_activ_stack_size(current_max_stack_size());
     top_activ_stack = 0;
 
-    RUN_ACTIV.rt_env = env = new_rt_env(prog->num_var_names);
+    RUN_ACTIV.prog = prog;
+    env = alloc_frame(&RUN_ACTIV, prog->main_vector.max_stack);
     RUN_ACTIV.this = this;
     RUN_ACTIV.player = user;
     RUN_ACTIV.progr = db_verb_owner(vh);
@@ -2455,6 +2460,9 @@ do_forked_task(Program * prog, Var * rt_env, activation a, int f_id)
 
     RUN_ACTIV = a;
     RUN_ACTIV.rt_env = rt_env;
+    alloc_rt_stack(&RUN_ACTIV, (f_id == MAIN_VECTOR
+				? prog->main_vector.max_stack
+				: prog->fork_vectors[f_id].max_stack));
 
     return do_task(prog, f_id, 0, 0/*bg*/, 1/*traceback*/);
 }
@@ -2470,7 +2478,7 @@ setup_activ_for_eval(Program * prog)
 
     RUN_ACTIV.prog = prog;
 
-    RUN_ACTIV.rt_env = env = new_rt_env(prog->num_var_names);
+    env = alloc_frame(&RUN_ACTIV, prog->main_vector.max_stack);
     fill_in_rt_consts(env, prog->version);
     set_rt_env_obj(env, SLOT_PLAYER, CALLER_ACTIV.player);
     set_rt_env_obj(env, SLOT_CALLER, CALLER_ACTIV.this);
@@ -2491,7 +2499,6 @@ setup_activ_for_eval(Program * prog)
     RUN_ACTIV.verb = str_dup("");
     RUN_ACTIV.verbname = str_dup("Input to EVAL");
     RUN_ACTIV.debug = 1;
-    alloc_rt_stack(&RUN_ACTIV, RUN_ACTIV.prog->main_vector.max_stack);
     RUN_ACTIV.pc = 0;
     RUN_ACTIV.error_pc = 0;
     RUN_ACTIV.temp.type = TYPE_NONE;
@@ -2958,7 +2965,8 @@ read_activ(activation * a, int which_vector)
     max_stack = (which_vector == MAIN_VECTOR
 		 ? a->prog->main_vector.max_stack
 		 : a->prog->fork_vectors[which_vector].max_stack);
-    alloc_rt_stack(a, max_stack);
+    a->base_rt_stack = alloc_slab_vars(max_stack);
+    a->rt_stack_size = max_stack;
 
     if (dbio_scanf("%d rt_stack slots in use\n", &stack_in_use) != 1) {
 	errlog("READ_ACTIV: Bad stack_in_use number\n");
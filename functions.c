@@ -23,6 +23,7 @@
 #include "functions.h"
 #include "list.h"
 #include "log.h"
+#include "program.h"
 #include "server.h"
 #include "storage.h"
 #include "streams.h"
@@ -115,6 +116,7 @@ register_common(const char *name, int minargs, int maxargs, bf_type func,
     bf_table[top_bf_table].read = read;
     bf_table[top_bf_table].write = write;
     bf_table[top_bf_table].protected = 0;
+    flush_cached_programs();
 
     if (num_arg_types > 0)
 	bf_table[top_bf_table].prototype =
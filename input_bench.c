@@ -0,0 +1,150 @@
+/* Input throughput benchmark.
+ *
+ * Connects to a server over TCP, sends LOGIN-LINE (which should log the
+ * connection in as some player), then LINES lines of LENGTH characters, and
+ * reports how many lines per second the server took in.  The lines are the
+ * intrinsic `PREFIX' command, which the server handles without running any
+ * MOO code, so what is measured is reading, line framing and queueing of
+ * input.  The last line sets the prefix to a marker and is followed by one
+ * unknown command; the clock stops when the marker comes back.
+ */
+
+#include <errno.h>
+#include "my-in.h"
+#include "my-inet.h"
+#include "my-socket.h"
+#include "my-stdio.h"
+#include "my-stdlib.h"
+#include "my-string.h"
+#include "my-sys-time.h"
+#include "my-types.h"
+#include "my-unistd.h"
+
+#include "config.h"
+
+#define MARKER "input-bench-done"
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+	    "Usage: %s [-n lines] [-l length] address port [login-line]\n",
+	    prog);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *login = "connect";
+    int lines = 100000, length = 40;
+    struct sockaddr_in address;
+    struct timeval start, end;
+    char *data, *ptr, *seen;
+    int s, i, size, sent, nseen, done;
+    double secs;
+
+    while (argc > 2 && argv[1][0] == '-') {
+	if (!strcmp(argv[1], "-n"))
+	    lines = atoi(argv[2]);
+	else if (!strcmp(argv[1], "-l"))
+	    length = atoi(argv[2]);
+	else
+	    usage(argv[0]);
+	argc -= 2;
+	argv += 2;
+    }
+    if (argc < 3 || argc > 4 || lines <= 0 || length < 7)
+	usage(argv[0]);
+    if (argc == 4)
+	login = argv[3];
+
+    size = strlen(login) + 1 + lines * (length + 1) + strlen(MARKER) + 40;
+    data = malloc(size);
+    seen = malloc(65536);
+    if (!data || !seen) {
+	perror("malloc");
+	exit(1);
+    }
+    ptr = data;
+    ptr += sprintf(ptr, "%s\n", login);
+    for (i = 0; i < lines; i++) {
+	memcpy(ptr, "PREFIX ", 7);
+	memset(ptr + 7, 'x', length - 7);
+	ptr[length] = '\n';
+	ptr += length + 1;
+    }
+    ptr += sprintf(ptr, "PREFIX %s\ninput-bench-huh\n", MARKER);
+    size = ptr - data;
+
+    if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+	perror("socket");
+	exit(1);
+    }
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr(argv[1]);
+    address.sin_port = htons(atoi(argv[2]));
+    if (connect(s, (struct sockaddr *) &address, sizeof(address)) < 0) {
+	perror("connect");
+	exit(1);
+    }
+    gettimeofday(&start, 0);
+
+    sent = nseen = done = 0;
+    while (!done) {
+	fd_set input, output;
+
+	FD_ZERO(&input);
+	FD_ZERO(&output);
+	FD_SET(s, &input);
+	if (sent < size)
+	    FD_SET(s, &output);
+
+	if (select(s + 1, (void *) &input, (void *) &output, 0, 0) < 0) {
+	    if (errno != EINTR) {
+		perror("select");
+		exit(1);
+	    }
+	    continue;
+	}
+	if (FD_ISSET(s, &output)) {
+	    int count = write(s, data + sent, size - sent);
+
+	    if (count < 0 && errno != EINTR) {
+		perror("write");
+		exit(1);
+	    } else if (count > 0)
+		sent += count;
+	}
+	if (FD_ISSET(s, &input)) {
+	    int count = read(s, seen + nseen, 65535 - nseen);
+
+	    if (count <= 0) {
+		fprintf(stderr, "Connection closed by server\n");
+		exit(1);
+	    }
+	    nseen += count;
+	    seen[nseen] = '\0';
+	    if (strstr(seen, MARKER))
+		done = 1;
+	    else if (nseen > 32768) {
+		/* Keep just enough to find a marker split across reads */
+		int keep = strlen(MARKER);
+
+		memmove(seen, seen + nseen - keep, keep);
+		nseen = keep;
+	    }
+	}
+    }
+
+    gettimeofday(&end, 0);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%d lines of %d bytes in %.3f seconds: %.0f lines/second\n",
+	   lines, length, secs, lines / secs);
+
+    close(s);
+    return 0;
+}
+
+char rcsid_input_bench[] = "$Id$";
@@ -16,6 +16,7 @@
  *****************************************************************************/
 
 #include "my-ctype.h"
+#include "my-stdio.h"
 #include "my-string.h"
 
 #include "bf_register.h"
@@ -88,6 +89,20 @@ ismember(Var lhs, Var rhs, int case_matters)
 {
     int i;
 
+    if (lhs.type == TYPE_STR || lhs.type == TYPE_LIST) {
+	/* The elements keep their hashes, so searching the same list again
+	 * only looks inside the ones that could match. */
+	unsigned hash = var_hash(lhs);
+
+	for (i = 1; i <= rhs.v.list[0].v.num; i++) {
+	    Var v = rhs.v.list[i];
+
+	    if (v.type == lhs.type && var_hash(v) == hash
+		&& equality(lhs, v, case_matters))
+		return i;
+	}
+	return 0;
+    }
     for (i = 1; i <= rhs.v.list[0].v.num; i++) {
 	if (equality(lhs, rhs.v.list[i], case_matters)) {
 	    return i;
@@ -101,6 +116,7 @@ listset(Var list, Var value, int pos)
 {
     free_var(list.v.list[pos]);
     list.v.list[pos] = value;
+    list_hash_slot(list.v.list) = 0;
     return list;
 }
 
@@ -115,6 +131,7 @@ doinsert(Var list, Var value, int pos)
 	list.v.list = (Var *) myrealloc(list.v.list, (size + 1) * sizeof(Var), M_LIST);
 	list.v.list[0].v.num = size;
 	list.v.list[pos] = value;
+	list_hash_slot(list.v.list) = 0;
 	return list;
     }
     new = new_list(size);
@@ -1006,6 +1023,31 @@ bf_value_bytes(Var arglist, Byte next, void *vdata, Objid progr)
     return make_var_pack(r);
 }
 
+/* value_hash(v, "fast"): var_hash(v) in hex, with no unparsing.  Values
+ * that are == hash the same, so strings differing only in case do too.
+ */
+static int
+fast_value_hash(Var arglist, package * p)
+{
+    char buf[9];
+    unsigned h;
+    Var r;
+
+    if (arglist.v.list[0].v.num < 2
+	|| mystrcasecmp(arglist.v.list[2].v.str, "fast"))
+	return 0;
+    h = var_hash(arglist.v.list[1]);
+    h ^= h >> 16;		/* spread short strings' hashes out */
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    sprintf(buf, "%08x", h);
+    free_var(arglist);
+    r.type = TYPE_STR;
+    r.v.str = str_dup(buf);
+    *p = make_var_pack(r);
+    return 1;
+}
+
 #ifdef MOO_GCRYPT
 
 /* this is here because someone made stream exceptions private  --ljr */
@@ -1016,8 +1058,11 @@ package
 bf_value_hash(Var arglist, Byte next, void *vdata, Objid progr)
 {
     package p;
-    Stream *s = new_stream(100);
+    Stream *s;
 
+    if (fast_value_hash(arglist, &p))
+	return p;
+    s = new_stream(100);
     TRY_STREAM {
 	Var r;
 
@@ -1085,8 +1130,18 @@ static package
 bf_value_hash(Var arglist, Byte next, void *vdata, Objid progr)
 {
     package p;
-    Stream *s = new_stream(100);
+    Stream *s;
+
+    if (fast_value_hash(arglist, &p))
+	return p;
+    if (arglist.v.list[0].v.num > 1
+	&& mystrcasecmp(arglist.v.list[2].v.str, "md5")) {
+	Var v = var_ref(arglist.v.list[2]);
 
+	free_var(arglist);
+	return make_raise_pack(E_INVIND, "Unknown hash algorithm", v);
+    }
+    s = new_stream(100);
     TRY_STREAM {
 	Var r;
 
@@ -1240,7 +1295,7 @@ register_list(void)
 {
     register_function("value_bytes", 1, 1, bf_value_bytes, TYPE_ANY);
 #ifndef MOO_GCRYPT
-    register_function("value_hash", 1, 1, bf_value_hash, TYPE_ANY);
+    register_function("value_hash", 1, 2, bf_value_hash, TYPE_ANY, TYPE_STR);
     register_function("string_hash", 1, 1, bf_string_hash, TYPE_STR);
     register_function("binary_hash", 1, 1, bf_binary_hash, TYPE_STR);
 #endif
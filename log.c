@@ -15,17 +15,25 @@
     Pavel@Xerox.Com
  *****************************************************************************/
 
+#include "my-types.h"
 #include <errno.h>
+#include "my-fcntl.h"
+#include "my-signal.h"
+#include "my-stat.h"
 #include "my-stdarg.h"
 #include "my-stdio.h"
 #include "my-string.h"
+#include "my-sys-time.h"
 #include "my-time.h"
+#include "my-unistd.h"
 
 #include "bf_register.h"
 #include "config.h"
 #include "functions.h"
+#include "list.h"
 #include "log.h"
 #include "options.h"
+#include "server.h"
 #include "storage.h"
 #include "streams.h"
 #include "utils.h"
@@ -47,6 +55,370 @@ int log_report_progress_cktime()
     return ((now >= log_prev + 2) && (log_prev = now, 1));
 }
 
+/* Returns the date and time as they appear at the front of each log line,
+ * formatting them afresh only when the second has changed.
+ */
+static const char *
+log_timestamp(time_t now)
+{
+    static time_t stamp_time = -1;
+    static char stamp[16];
+
+    if (now != stamp_time) {
+	char *nowstr = ctime(&now);
+
+	memcpy(stamp, nowstr + 4, 15);	/* skip the day of week and year */
+	stamp[15] = '\0';
+	stamp_time = now;
+    }
+    return stamp;
+}
+
+#if LOG_BUFFER_SIZE > 0
+
+#ifdef EAGAIN
+static int eagain = EAGAIN;
+#else
+static int eagain = -1;
+#endif
+
+#ifdef EWOULDBLOCK
+static int ewouldblock = EWOULDBLOCK;
+#else
+static int ewouldblock = -1;
+#endif
+
+/* While there is a log writer (see start_log_writer()), lines are sent down
+ * the non-blocking pipe LOG_TO.  Whatever the pipe won't take at once waits
+ * in PENDING, and lines that don't fit there either are dropped.  A child
+ * process that logs uses the same pipe, but not its parent's PENDING, and
+ * must leave the pipe's flags alone.
+ */
+static const char *log_name = 0;
+static int log_to = -1, log_ack = -1;
+static pid_t writer_parent, pending_owner;
+static char *pending = 0;
+static int pending_length = 0, pending_peak = 0;
+static int log_dropped = 0, log_dropped_total = 0;
+
+/* Gives up on the writer, writing the log file directly from now on. */
+static void
+stop_log_writer(void)
+{
+    close(log_to);
+    close(log_ack);
+    log_to = log_ack = -1;
+
+    if ((log_file = fopen(log_name, "a")) != 0 && pending_length > 0) {
+	fwrite(pending, 1, pending_length, log_file);
+	fflush(log_file);
+    }
+    pending_length = 0;
+}
+
+/* Sends as much of PENDING as the pipe will take. */
+static void
+write_pending(void)
+{
+    int sent = 0, count;
+
+    while (sent < pending_length) {
+	count = write(log_to, pending + sent, pending_length - sent);
+	if (count > 0)
+	    sent += count;
+	else if (count < 0 && errno == EINTR)
+	    continue;
+	else if (count < 0 && (errno == eagain || errno == ewouldblock))
+	    break;
+	else {			/* the writer has died */
+	    pending_length -= sent;
+	    memmove(pending, pending + sent, pending_length);
+	    stop_log_writer();
+	    errlog("LOG: Log writer has died; writing the log directly\n");
+	    return;
+	}
+    }
+    pending_length -= sent;
+    memmove(pending, pending + sent, pending_length);
+}
+
+/* Waits, for at most a second, until the pipe has room again. */
+static void
+wait_for_writer(void)
+{
+#if HAVE_SELECT
+    fd_set writable;
+    struct timeval tv;
+
+    FD_ZERO(&writable);
+    FD_SET(log_to, &writable);
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    select(log_to + 1, 0, &writable, 0, &tv);
+#else
+    sleep(1);
+#endif
+}
+
+static int
+add_pending(const char *text, int length)
+{
+    if (!pending)
+	pending = mymalloc(LOG_BUFFER_SIZE, M_STRING);
+    if (pending_length + length > LOG_BUFFER_SIZE)
+	return 0;
+    memcpy(pending + pending_length, text, length);
+    pending_length += length;
+    return 1;
+}
+
+/* Once there's room, says how many lines were dropped. */
+static void
+note_dropped(int room_to_spare)
+{
+    char note[100];
+
+    sprintf(note, "%s: *** LOG: %d line%s dropped\n",
+	    log_timestamp(time(0)), log_dropped, log_dropped == 1 ? "" : "s");
+    if (pending_length + (int) strlen(note) + room_to_spare
+	<= LOG_BUFFER_SIZE) {
+	add_pending(note, strlen(note));
+	log_dropped = 0;
+    }
+}
+
+static void
+send_log(const char *line, int length)
+{
+    if (getpid() != pending_owner) {	/* we're a newly forked child */
+	pending_owner = getpid();
+	pending_length = log_dropped = 0;
+    }
+    if (pending_length > 0)
+	write_pending();
+    if (log_to < 0) {
+	fwrite(line, 1, length, log_file ? log_file : stderr);
+	fflush(log_file ? log_file : stderr);
+	return;
+    }
+    if (log_dropped)
+	note_dropped(length);
+    if (log_dropped || !add_pending(line, length)) {
+	log_dropped++;
+	log_dropped_total++;
+    }
+    write_pending();
+    if (pending_length > pending_peak)
+	pending_peak = pending_length;
+}
+
+/* The log writer process: copies everything from the server into the log
+ * file until the server goes away or sends a NUL, which asks the writer to
+ * acknowledge and exit.
+ */
+static int writer_fd;
+static off_t writer_size;
+
+static void
+write_all(const char *text, int length)
+{
+    int count;
+
+    while (length > 0) {
+	count = write(writer_fd, text, length);
+	if (count < 0 && errno == EINTR)
+	    continue;
+	if (count <= 0)
+	    return;		/* nowhere left to complain to */
+	text += count;
+	length -= count;
+	writer_size += count;
+    }
+}
+
+#ifdef LOG_ROTATE_SIZE
+static void
+rotate_log(void)
+{
+    char *from = mymalloc(strlen(log_name) + 20, M_STRING);
+    char *to = mymalloc(strlen(log_name) + 20, M_STRING);
+    int i, fd;
+
+    for (i = LOG_ROTATE_KEEP - 1; i >= 1; i--) {
+	sprintf(from, "%s.%d", log_name, i);
+	sprintf(to, "%s.%d", log_name, i + 1);
+	rename(from, to);
+    }
+    sprintf(to, "%s.1", log_name);
+    rename(log_name, to);
+    if ((fd = open(log_name, O_WRONLY | O_APPEND | O_CREAT, 0666)) >= 0) {
+	close(writer_fd);
+	writer_fd = fd;
+	writer_size = 0;
+    }
+    myfree(from, M_STRING);
+    myfree(to, M_STRING);
+}
+#endif
+
+static void
+write_log(const char *text, int length)
+{
+#ifdef LOG_ROTATE_SIZE
+    while (writer_size + length >= LOG_ROTATE_SIZE) {
+	/* Rotate at the end of the line that reaches the limit */
+	off_t room = LOG_ROTATE_SIZE - writer_size;
+	int n = room > 0 ? (int) room : 0;
+
+	while (n > 0 && text[n - 1] != '\n')
+	    n--;
+	if (n == 0) {
+	    n = room > 0 ? (int) room : 0;
+	    while (n < length && text[n] != '\n')
+		n++;
+	    if (n++ == length)
+		break;		/* no whole line here yet */
+	}
+	write_all(text, n);
+	rotate_log();
+	text += n;
+	length -= n;
+    }
+#endif
+    write_all(text, length);
+}
+
+static void
+log_writer(int to_server, int from_server)
+{
+    static char buffer[65536];
+    struct stat st;
+    char *end;
+    int count;
+
+    set_server_cmdline("(MOO log writer)");
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    writer_fd = fileno(log_file);
+    writer_size = fstat(writer_fd, &st) == 0 ? st.st_size : 0;
+    while ((count = read(from_server, buffer, sizeof(buffer))) != 0) {
+	if (count < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	if ((end = memchr(buffer, '\0', count)) != 0) {
+	    write_log(buffer, end - buffer);
+	    write(to_server, "", 1);
+	    break;
+	}
+	write_log(buffer, count);
+    }
+    _exit(0);
+}
+
+#endif				/* LOG_BUFFER_SIZE > 0 */
+
+void
+start_log_writer(const char *name)
+{
+#if LOG_BUFFER_SIZE > 0
+    int flags;
+
+    if (!log_file)
+	return;
+    fflush(log_file);
+    log_name = str_dup(name);
+    if (!spawn_pipe(log_writer, &log_to, &log_ack)) {
+	errlog("LOG: Can't start log writer; writing the log directly\n");
+	log_to = log_ack = -1;
+	return;
+    }
+    if ((flags = fcntl(log_to, F_GETFL, 0)) >= 0)
+	fcntl(log_to, F_SETFL, flags | NONBLOCK_FLAG);
+    signal(SIGPIPE, SIG_IGN);
+    fclose(log_file);
+    log_file = 0;
+    writer_parent = pending_owner = getpid();
+#endif
+}
+
+void
+flush_log(void)
+{
+#if LOG_BUFFER_SIZE > 0
+    if (log_to >= 0 && getpid() == pending_owner) {
+	if (log_dropped)
+	    note_dropped(0);
+	if (pending_length > 0)
+	    write_pending();
+    }
+#endif
+}
+
+void
+sync_log(void)
+{
+#if LOG_BUFFER_SIZE > 0
+    int flags;
+    char c;
+    time_t give_up;
+
+    if (log_to < 0)
+	return;
+    if (getpid() == writer_parent) {
+	/* The server is going away: wait for the writer to finish, then take
+	 * over.  Nobody else may make the pipe blocking, since its flags are
+	 * shared with every forked child.
+	 */
+	if ((flags = fcntl(log_to, F_GETFL, 0)) >= 0)
+	    fcntl(log_to, F_SETFL, flags & ~NONBLOCK_FLAG);
+	write_pending();
+	if (log_to >= 0 && write(log_to, "", 1) == 1)
+	    read(log_ack, &c, 1);
+	if (log_to >= 0)
+	    stop_log_writer();
+	return;
+    }
+    if (getpid() != pending_owner) {
+	pending_owner = getpid();
+	pending_length = log_dropped = 0;
+    }
+    if (log_dropped)
+	note_dropped(0);
+    write_pending();
+    give_up = time(0) + 10;
+    while (log_to >= 0 && pending_length > 0) {
+	if (time(0) >= give_up) {
+	    /* The writer seems to be stuck; don't wait for it forever. */
+	    stop_log_writer();
+	    break;
+	}
+	wait_for_writer();
+	write_pending();
+    }
+#endif
+}
+
+Var
+log_stats(void)
+{
+    Var r = new_list(3);
+
+    r.v.list[1].type = r.v.list[2].type = r.v.list[3].type = TYPE_INT;
+#if LOG_BUFFER_SIZE > 0
+    r.v.list[1].v.num = pending_length;
+    r.v.list[2].v.num = pending_peak;
+    r.v.list[3].v.num = log_dropped_total;
+#else
+    r.v.list[1].v.num = r.v.list[2].v.num = r.v.list[3].v.num = 0;
+#endif
+    return r;
+}
+
 static void
 do_log(const char *fmt, va_list args, const char *prefix)
 {
@@ -54,12 +426,34 @@ do_log(const char *fmt, va_list args, const char *prefix)
 
     log_prev = time(0);
     log_pcount = 5000;
-    if (log_file) {
-	char *nowstr = ctime(&log_prev);
+#if LOG_BUFFER_SIZE > 0
+    if (log_to >= 0) {
+	static char *line = 0;
+	static int line_size = 0;
+	int length, count;
+	va_list copy;
 
-	nowstr[19] = '\0';	/* kill the year and newline at the end */
+	if (!line)
+	    line = mymalloc(line_size = 1024, M_STRING);
+	length = sprintf(line, "%s: %s", log_timestamp(log_prev), prefix);
+	va_copy(copy, args);
+	count = vsnprintf(line + length, line_size - length, fmt, copy);
+	va_end(copy);
+	if (count >= line_size - length) {
+	    myfree(line, M_STRING);
+	    line_size = length + count + 1;
+	    line = mymalloc(line_size, M_STRING);
+	    length = sprintf(line, "%s: %s", log_timestamp(log_prev), prefix);
+	    vsnprintf(line + length, count + 1, fmt, args);
+	}
+	if (count > 0)
+	    send_log(line, length + count);
+	return;
+    }
+#endif
+    if (log_file) {
 	f = log_file;
-	fprintf(f, "%s: %s", nowstr + 4, prefix);	/* skip the day of week */
+	fprintf(f, "%s: %s", log_timestamp(log_prev), prefix);
     } else
 	f = stderr;
 
@@ -124,13 +518,8 @@ void
 add_command_to_history(Objid player, const char *command)
 {
 #ifdef LOG_COMMANDS
-    time_t now = time(0);
-    char *nowstr = ctime(&now);
-
-    nowstr[19] = '\0';		/* kill the year and newline at the end */
     stream_printf(command_history, "%s: #%d: %s\n",
-		  nowstr + 4,	/* skip day of week */
-		  player, command);
+		  log_timestamp(time(0)), player, command);
 #endif				/* LOG_COMMANDS */
 }
 
@@ -21,6 +21,18 @@
 #include "structures.h"
 
 extern void set_log_file(FILE *);
+extern void start_log_writer(const char *name);
+				/* Hands the log file, called NAME, to a
+				 * separate writer process (see
+				 * LOG_BUFFER_SIZE in options.h). */
+extern void flush_log(void);
+				/* Sends on any log lines held back because
+				 * the writer was busy. */
+extern void sync_log(void);
+				/* Waits until everything logged so far has
+				 * been written, and makes later logging
+				 * synchronous; for panics and shutdown. */
+extern Var log_stats(void);
 
 extern void oklog(const char *,...);
 extern void errlog(const char *,...);
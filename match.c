@@ -28,15 +28,18 @@
 #include "unparse.h"
 #include "utils.h"
 #include "list.h"
+#include "options.h"
 #include "tasks.h"
 
 static Var *
-aliases(Objid oid)
+aliases(Objid oid, db_prop_handle * hp)
 {
     Var value;
     db_prop_handle h;
 
     h = db_find_property(oid, "aliases", &value);
+    if (hp)
+	*hp = h;
     if (!h.ptr || value.type != TYPE_LIST) {
 	/* Simulate a pointer to an empty list */
 	return &zero;
@@ -50,11 +53,31 @@ struct match_data {
     Objid exact, partial;
 };
 
+/* Notes that NAME, a name or alias of OID, begins with the name being
+ * matched.  Returns true if this makes an exact match ambiguous.
+ */
+static int
+match_name(struct match_data *d, Objid oid, const char *name)
+{
+    if (name[d->lname] == '\0') {	/* exact match */
+	if (d->exact == NOTHING || d->exact == oid)
+	    d->exact = oid;
+	else
+	    return 1;
+    } else {			/* partial match */
+	if (d->partial == FAILED_MATCH || d->partial == oid)
+	    d->partial = oid;
+	else
+	    d->partial = AMBIGUOUS;
+    }
+    return 0;
+}
+
 static int
 match_proc(void *data, Objid oid)
 {
     struct match_data *d = data;
-    Var *names = aliases(oid);
+    Var *names = aliases(oid, 0);
     int i;
     const char *name;
 
@@ -66,24 +89,194 @@ match_proc(void *data, Objid oid)
 	else
 	    name = names[i].v.str;
 
-	if (!mystrncasecmp(name, d->name, d->lname)) {
-	    if (name[d->lname] == '\0') {	/* exact match */
-		if (d->exact == NOTHING || d->exact == oid)
-		    d->exact = oid;
-		else
-		    return 1;
-	    } else {		/* partial match */
-		if (d->partial == FAILED_MATCH || d->partial == oid)
-		    d->partial = oid;
-		else
-		    d->partial = AMBIGUOUS;
-	    }
+	if (!mystrncasecmp(name, d->name, d->lname)
+	    && match_name(d, oid, name))
+	    return 1;
+    }
+
+    return 0;
+}
+
+/* For locations holding at least MATCH_INDEX_MIN objects, the names and
+ * aliases of the contents are kept in an array sorted without regard to
+ * case, so that all of the names beginning with a given string are found
+ * together by binary search.  An index is rebuilt when its location's
+ * contents version changes; all of them are dropped when the property watch
+ * generation does (which covers writes to any `aliases' property), or when
+ * there are more than INDEX_LIMIT of them.
+ */
+
+#define INDEX_BUCKETS	64
+#define INDEX_LIMIT	512
+
+typedef struct {
+    const char *name;
+    Objid oid;
+} Index_Entry;
+
+typedef struct Name_Index {
+    struct Name_Index *next;
+    Objid loc;
+    unsigned version;
+    int count;
+    Index_Entry *entries;
+} Name_Index;
+
+static Name_Index *name_indexes[INDEX_BUCKETS];
+static int name_index_count = 0;
+static unsigned name_index_generation = 0;
+
+static void
+free_index_entries(Name_Index * x)
+{
+    int i;
+
+    for (i = 0; i < x->count; i++)
+	free_str(x->entries[i].name);
+    if (x->entries)
+	myfree(x->entries, M_STRUCT);
+    x->entries = 0;
+    x->count = 0;
+}
+
+static void
+flush_name_indexes(void)
+{
+    int i;
+
+    for (i = 0; i < INDEX_BUCKETS; i++) {
+	Name_Index *x, *next;
+
+	for (x = name_indexes[i]; x; x = next) {
+	    next = x->next;
+	    free_index_entries(x);
+	    myfree(x, M_STRUCT);
+	}
+	name_indexes[i] = 0;
+    }
+    name_index_count = 0;
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+    return mystrcasecmp(((const Index_Entry *) a)->name,
+			((const Index_Entry *) b)->name);
+}
+
+struct index_data {
+    Index_Entry *entries;
+    int count, max;
+};
+
+static void
+add_entry(struct index_data *d, Objid oid, const char *name)
+{
+    if (d->count == d->max) {
+	Index_Entry *old = d->entries;
+
+	d->max = d->max ? 2 * d->max : 32;
+	d->entries = mymalloc(d->max * sizeof(Index_Entry), M_STRUCT);
+	if (old) {
+	    memcpy(d->entries, old, d->count * sizeof(Index_Entry));
+	    myfree(old, M_STRUCT);
 	}
     }
+    d->entries[d->count].name = str_ref(name);
+    d->entries[d->count].oid = oid;
+    d->count++;
+}
+
+static int
+index_proc(void *data, Objid oid)
+{
+    struct index_data *d = data;
+    db_prop_handle h;
+    Var *names = aliases(oid, &h);
+    int i;
+
+    db_watch_property(h);
+    add_entry(d, oid, db_object_name(oid));
+    for (i = 1; i <= names[0].v.num; i++)
+	if (names[i].type == TYPE_STR)
+	    add_entry(d, oid, names[i].v.str);
 
     return 0;
 }
 
+static Name_Index *
+find_name_index(Objid loc)
+{
+    Name_Index *x, **bucket;
+    struct index_data d;
+
+    if (name_index_generation != db_property_watch_generation()
+	|| name_index_count >= INDEX_LIMIT) {
+	flush_name_indexes();
+	name_index_generation = db_property_watch_generation();
+    }
+    bucket = &name_indexes[(unsigned) loc % INDEX_BUCKETS];
+    for (x = *bucket; x; x = x->next)
+	if (x->loc == loc)
+	    break;
+    if (x && x->version == db_contents_version(loc))
+	return x;
+
+    if (!x) {
+	if (db_count_contents(loc) < MATCH_INDEX_MIN)
+	    return 0;
+	x = mymalloc(sizeof(Name_Index), M_STRUCT);
+	x->loc = loc;
+	x->count = 0;
+	x->entries = 0;
+	x->next = *bucket;
+	*bucket = x;
+	name_index_count++;
+    } else
+	free_index_entries(x);
+
+    d.entries = 0;
+    d.count = d.max = 0;
+    db_for_all_contents(loc, index_proc, &d);
+    if (d.count > 0)
+	qsort(d.entries, d.count, sizeof(Index_Entry), compare_entries);
+    x->entries = d.entries;
+    x->count = d.count;
+    x->version = db_contents_version(loc);
+
+    return x;
+}
+
+static int
+match_index(Name_Index * x, struct match_data *d)
+{
+    int lo = 0, hi = x->count;
+
+    while (lo < hi) {		/* find the first name >= d->name */
+	int mid = (lo + hi) / 2;
+
+	if (mystrcasecmp(x->entries[mid].name, d->name) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    /* Names equal to d->name sort before the longer ones it begins, so once
+     * past them with an exact match, or with two partial ones, we're done.
+     */
+    for (; lo < x->count; lo++) {
+	Index_Entry *e = &x->entries[lo];
+
+	if (mystrncasecmp(e->name, d->name, d->lname))
+	    break;
+	if (e->name[d->lname] != '\0'
+	    && (d->exact != NOTHING || d->partial == AMBIGUOUS))
+	    break;
+	if (match_name(d, e->oid, e->name))
+	    return 1;
+    }
+    return 0;
+}
+
 static Objid
 match_contents(Objid player, const char *name)
 {
@@ -102,9 +295,14 @@ match_contents(Objid player, const char *name)
     loc = db_object_location(player);
 
     for (oid = player, step = 0; step < 2; oid = loc, step++) {
+	Name_Index *x;
+
 	if (!valid(oid))
 	    continue;
-	if (db_for_all_contents(oid, match_proc, &d))
+	if (MATCH_INDEX_MIN > 0 && (x = find_name_index(oid))) {
+	    if (match_index(x, &d))
+		return AMBIGUOUS;
+	} else if (db_for_all_contents(oid, match_proc, &d))
 	    /* We only abort the enumeration for exact ambiguous matches... */
 	    return AMBIGUOUS;
     }
@@ -46,8 +46,6 @@
 
 #include "options.h"
 
-#ifndef MOO_GCRYPT
-
 #include "my-string.h"
 
 #include "md5.h"
@@ -326,8 +324,6 @@ md5_Final(md5ctx_t * context, uint8 digest[16])
     memset((char *) context, 0, sizeof(*context));
 }
 
-#endif /* MOO_GCRYPT */
-
 /* 
  * $Log$
  * Revision 1.3  1998/12/14 13:18:04  nop
@@ -17,8 +17,9 @@
 
 /* This module provides IP host name lookup with timeouts.  Because
  * longjmps out of name lookups corrupt some UNIX name lookup modules, this
- * module uses a subprocess to do the name lookup.  On any failure, the
- * subprocess is restarted.
+ * module uses subprocesses to do the name lookup.  On any failure, the
+ * subprocess is restarted.  Several lookups may be in progress at once, and
+ * recent answers are cached in the server.
  */
 
 #include "options.h"
@@ -35,82 +36,25 @@
 #include "my-socket.h"		/* AF_INET */
 #include "my-wait.h"
 #include "my-string.h"
+#include "my-sys-time.h"	/* select(), struct timeval */
 #include <errno.h>
 
 #include "config.h"
+#include "list.h"
 #include "log.h"
+#include "name_lookup.h"
+#include "net_mplex.h"
+#include "net_multi.h"
 #include "server.h"
 #include "storage.h"
+#include "structures.h"
 #include "timers.h"
+#include "utils.h"
 
 /******************************************************************************
  * Utilities
  *****************************************************************************/
 
-static pid_t
-spawn_pipe(void (*child_proc) (int to_parent, int from_parent),
-	   int *to_child, int *from_child)
-{
-    int pipe_to_child[2], pipe_from_child[2];
-    pid_t pid;
-
-    if (pipe(pipe_to_child) < 0) {
-	log_perror("SPAWNING: Couldn't create first pipe");
-    } else if (pipe(pipe_from_child) < 0) {
-	log_perror("SPAWNING: Couldn't create second pipe");
-	close(pipe_to_child[0]);
-	close(pipe_to_child[1]);
-    } else if ((pid = fork()) < 0) {
-	log_perror("SPAWNING: Couldn't fork middleman");
-	close(pipe_to_child[0]);
-	close(pipe_to_child[1]);
-	close(pipe_from_child[0]);
-	close(pipe_from_child[1]);
-    } else if (pid != 0) {	/* parent */
-	int status;
-
-	close(pipe_to_child[0]);
-	close(pipe_from_child[1]);
-	*to_child = pipe_to_child[1];
-	*from_child = pipe_from_child[0];
-
-	/* Cast to (void *) to avoid warnings on systems that misdeclare the
-	 * argument.
-	 */
-	wait((void *) &status);	/* wait for middleman to die */
-	if (status != 0) {
-	    errlog("SPAWNING: Middleman died with status %d!\n", status);
-	    close(pipe_to_child[1]);
-	    close(pipe_from_child[0]);
-	} else if (read(*from_child, &pid, sizeof(pid)) != sizeof(pid)) {
-	    errlog("SPAWNING: Bad read() for pid\n");
-	    close(pipe_to_child[1]);
-	    close(pipe_from_child[0]);
-	} else {
-	    return pid;
-	}
-    } else {			/* middleman */
-	close(pipe_to_child[1]);
-	close(pipe_from_child[0]);
-	if ((pid = fork()) < 0) {
-	    log_perror("SPAWNING: Couldn't fork child");
-	    exit(1);
-	} else if (pid != 0) {	/* still the middleman */
-	    if (write(pipe_from_child[1], &pid, sizeof(pid)) != sizeof(pid))
-	    {
-		log_perror("SPAWNING: Write to child pipe failed");
-		exit(1);
-	    }
-	    exit(0);
-	} else {		/* finally, the child */
-	    (*child_proc) (pipe_from_child[1], pipe_to_child[0]);
-	    exit(0);
-	}
-    }
-
-    return 0;
-}
-
 static void
 ensure_buffer(char **buffer, int *buflen, int len)
 {
@@ -149,6 +93,26 @@ struct request {
     } u;
 };
 
+/* Between the server and the intermediary, each request carries an id, which
+ * comes back with its answer; answers come back in whatever order they are
+ * ready.  A REQ_ADDR_FROM_NAME request is followed by REQ.U.LENGTH bytes of
+ * host name, and every reply by LENGTH bytes of host name.  URGENT requests,
+ * the ones the server is waiting on, go ahead of all the others.
+ */
+struct tagged_request {
+    unsigned id;
+    int urgent;
+    struct request req;
+};
+
+struct reply {
+    unsigned id;
+    unsigned32 addr;		/* REQ_ADDR_FROM_NAME; zero if not found */
+    int length;			/* REQ_NAME_FROM_ADDR; zero if not found */
+};
+
+#define MAX_LOOKUP_NAME 1024
+
 /******************************************************************************
  * Code that runs in the lookup process.
  *****************************************************************************/
@@ -218,22 +182,46 @@ lookup(int to_intermediary, int from_intermediary)
 
 /******************************************************************************
  * Code that runs in the intermediary process.
+ *
+ * The intermediary keeps a pool of NAME_LOOKUP_WORKERS lookup processes.
+ * Requests from the server are queued, urgent ones first, and handed to
+ * whichever lookup process is idle; each answer goes back to the server, tagged with its request's id,
+ * as soon as it is ready.  A lookup process that times out or dies is
+ * replaced and its request answered with a failure.  Answers are buffered
+ * here rather than written with blocking writes, so that the intermediary
+ * never stops reading requests; the server may therefore write to it freely.
  *****************************************************************************/
 
-static int to_lookup, from_lookup;
-static pid_t lookup_pid;
+typedef struct job {
+    struct job *next;
+    struct tagged_request treq;
+    char *name;			/* REQ_ADDR_FROM_NAME only */
+} job;
+
+typedef struct {
+    pid_t pid;			/* zero if not running */
+    int to, from;
+    job *job;			/* request being looked up, if any */
+} worker;
+
+static worker workers[NAME_LOOKUP_WORKERS];
+static job *job_queue = 0, **job_queue_tail = &job_queue;
+static job **urgent_tail = &job_queue;	/* just after the last urgent job */
+
+static char *replies = 0;	/* answers not yet written to the server */
+static int replies_length = 0, replies_size = 0;
 
 static void
-restart_lookup(void)
+restart_worker(worker * w)
 {
-    if (lookup_pid) {
-	kill(lookup_pid, SIGKILL);
-	close(to_lookup);
-	close(from_lookup);
+    if (w->pid) {
+	kill(w->pid, SIGKILL);
+	close(w->to);
+	close(w->from);
 	oklog("NAME_LOOKUP: Killing old lookup process ...\n");
     }
-    lookup_pid = spawn_pipe(lookup, &to_lookup, &from_lookup);
-    if (lookup_pid)
+    w->pid = spawn_pipe(lookup, &w->to, &w->from);
+    if (w->pid)
 	oklog("NAME_LOOKUP: Started new lookup process\n");
     else
 	errlog("NAME_LOOKUP: Can't spawn lookup process; "
@@ -241,69 +229,237 @@ restart_lookup(void)
 }
 
 static void
-intermediary(int to_server, int from_server)
+flush_replies(int to_server)
+{
+    int count = write(to_server, replies, replies_length);
+
+    if (count < 0) {
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	    _exit(1);
+    } else if (count > 0) {
+	replies_length -= count;
+	memmove(replies, replies + count, replies_length);
+    }
+}
+
+static void
+send_reply(job * j, unsigned32 addr, const char *name, int length)
+{
+    struct reply r;
+    int needed;
+
+    r.id = j->treq.id;
+    r.addr = addr;
+    r.length = length;
+    needed = replies_length + sizeof(r) + length;
+    if (needed > replies_size) {
+	char *new;
+
+	replies_size = needed < 2 * replies_size ? 2 * replies_size : needed;
+	new = mymalloc(replies_size, M_STRING);
+	if (replies) {
+	    memcpy(new, replies, replies_length);
+	    myfree(replies, M_STRING);
+	}
+	replies = new;
+    }
+    memcpy(replies + replies_length, &r, sizeof(r));
+    memcpy(replies + replies_length + sizeof(r), name, length);
+    replies_length = needed;
+}
+
+static void
+free_job(job * j)
+{
+    if (j->name)
+	myfree(j->name, M_STRING);
+    myfree(j, M_NETWORK);
+}
+
+static void
+fail_job(job * j)
+{
+    send_reply(j, 0, "", 0);
+    free_job(j);
+}
+
+static void
+start_job(worker * w, job * j)
+{
+    if (write(w->to, &j->treq.req, sizeof(j->treq.req))
+	!= sizeof(j->treq.req)
+	|| (j->treq.req.kind == REQ_ADDR_FROM_NAME
+	    && write(w->to, j->name, j->treq.req.u.length)
+	    != j->treq.req.u.length)) {
+	restart_worker(w);
+	fail_job(j);
+    } else
+	w->job = j;
+}
+
+static void
+finish_job(worker * w)
 {
-    struct request req;
     static char *buffer = 0;
     static int buflen = 0;
-    int len;
+    job *j = w->job;
     unsigned32 addr;
+    int len;
 
-    set_server_cmdline("(MOO name-lookup master)");
-    signal(SIGPIPE, SIG_IGN);
-    restart_lookup();
-    for (;;) {
-	if (robust_read(from_server, &req, sizeof(req)) != sizeof(req))
-	    _exit(1);
-	if (req.kind == REQ_ADDR_FROM_NAME) {
-	    ensure_buffer(&buffer, &buflen, req.u.length);
-	    if (robust_read(from_server, buffer, req.u.length) != req.u.length)
-		_exit(1);
+    w->job = 0;
+    if (j->treq.req.kind == REQ_ADDR_FROM_NAME) {
+	if (robust_read(w->from, &addr, sizeof(addr)) != sizeof(addr)) {
+	    restart_worker(w);
+	    addr = 0;
 	}
-	if (!lookup_pid)	/* Restart lookup if it's died */
-	    restart_lookup();
-	if (lookup_pid) {	/* Only try to deal with lookup if alive */
-	    if (req.kind == REQ_ADDR_FROM_NAME) {
-		if (write(to_lookup, &req, sizeof(req)) != sizeof(req))
-		    goto lookup_dead;
-		if (write(to_lookup, buffer, req.u.length) != req.u.length)
-		    goto lookup_dead;
-		if (robust_read(from_lookup, &addr, sizeof(addr))
-		    != sizeof(addr)) {
-		  lookup_dead:
-		    restart_lookup();
-		    addr = 0;
-		}
-		if (write(to_server, &addr, sizeof(addr)) != sizeof(addr))
-		    _exit(1);
-	    } else {
-		if (write(to_lookup, &req, sizeof(req)) != sizeof(req))
-		    goto lookup_dead_B;
-		if (robust_read(from_lookup, &len, sizeof(len))
-		    != sizeof(len)) {
-		  lookup_dead_B:
-		    restart_lookup();
-		    len = 0;
-		} else {
-		    ensure_buffer(&buffer, &buflen, len);
-		    if (len > 0
-			&& robust_read(from_lookup, buffer, len) != len) {
-			restart_lookup();
-			len = 0;
-		    }
-		}
-		if (write(to_server, &len, sizeof(len)) != sizeof(len))
-		    _exit(1);
-		if (len > 0)
-		    if (write(to_server, buffer, len) != len)
-			_exit(1);
+	send_reply(j, addr, "", 0);
+    } else {
+	if (robust_read(w->from, &len, sizeof(len)) != sizeof(len)) {
+	    restart_worker(w);
+	    len = 0;
+	} else if (len < 0 || len > MAX_LOOKUP_NAME) {
+	    restart_worker(w);
+	    len = 0;
+	} else {
+	    ensure_buffer(&buffer, &buflen, len);
+	    if (len > 0 && robust_read(w->from, buffer, len) != len) {
+		restart_worker(w);
+		len = 0;
 	    }
-	} else {		/* Lookup dead and wouldn't restart ... */
-	    int failure = 0;
+	}
+	send_reply(j, 0, len ? buffer : "", len);
+    }
+    free_job(j);
+}
+
+static void
+queue_job(job * j)
+{
+    if (j->treq.urgent) {
+	j->next = *urgent_tail;
+	*urgent_tail = j;
+	if (job_queue_tail == urgent_tail)
+	    job_queue_tail = &j->next;
+	urgent_tail = &j->next;
+    } else {
+	j->next = 0;
+	*job_queue_tail = j;
+	job_queue_tail = &j->next;
+    }
+}
+
+static job *
+next_job(void)
+{
+    job *j = job_queue;
+
+    if (!(job_queue = j->next))
+	job_queue_tail = &job_queue;
+    if (urgent_tail == &j->next)
+	urgent_tail = &job_queue;
+    return j;
+}
+
+static void
+dispatch_jobs(void)
+{
+    int i, live = 0;
+
+    for (i = 0; i < NAME_LOOKUP_WORKERS && job_queue; i++) {
+	worker *w = &workers[i];
+	job *j;
+
+	if (!w->job) {
+	    if (!w->pid)	/* Restart lookup if it's died */
+		restart_worker(w);
+	    if (!w->pid)
+		continue;
+	    j = next_job();
+	    start_job(w, j);
+	}
+	live++;
+    }
+    if (!live)			/* Lookups dead and wouldn't restart ... */
+	while (job_queue)
+	    fail_job(next_job());
+}
+
+static void
+read_requests(int from_server)
+{
+    static char buffer[sizeof(struct tagged_request) + MAX_LOOKUP_NAME];
+    static int length = 0;
+    int count, used = 0;
+
+    count = read(from_server, buffer + length, sizeof(buffer) - length);
+    if (count <= 0) {
+	if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+			  || errno == EINTR))
+	    return;
+	_exit(1);
+    }
+    length += count;
 
-	    if (write(to_server, &failure, sizeof(failure)) != sizeof(failure))
+    for (;;) {
+	struct tagged_request treq;
+	int needed = sizeof(treq);
+	job *j;
+
+	if (length - used < needed)
+	    break;
+	memcpy(&treq, buffer + used, sizeof(treq));
+	if (treq.req.kind == REQ_ADDR_FROM_NAME) {
+	    if (treq.req.u.length > MAX_LOOKUP_NAME)
 		_exit(1);
+	    needed += treq.req.u.length;
+	    if (length - used < needed)
+		break;
+	}
+	j = mymalloc(sizeof(job), M_NETWORK);
+	j->treq = treq;
+	j->name = 0;
+	if (treq.req.kind == REQ_ADDR_FROM_NAME) {
+	    j->name = mymalloc(treq.req.u.length, M_STRING);
+	    memcpy(j->name, buffer + used + sizeof(treq), treq.req.u.length);
 	}
+	queue_job(j);
+	used += needed;
+    }
+    length -= used;
+    memmove(buffer, buffer + used, length);
+}
+
+static void
+intermediary(int to_server, int from_server)
+{
+    int i;
+
+    set_server_cmdline("(MOO name-lookup master)");
+    signal(SIGPIPE, SIG_IGN);
+    if (!network_set_nonblocking(to_server)
+	|| !network_set_nonblocking(from_server))
+	_exit(1);
+    for (i = 0; i < NAME_LOOKUP_WORKERS; i++)
+	restart_worker(&workers[i]);
+    for (;;) {
+	mplex_clear();
+	mplex_add_reader(from_server);
+	if (replies_length > 0)
+	    mplex_add_writer(to_server);
+	for (i = 0; i < NAME_LOOKUP_WORKERS; i++)
+	    if (workers[i].job)
+		mplex_add_reader(workers[i].from);
+	if (mplex_wait(60))
+	    continue;
+
+	if (mplex_is_readable(from_server))
+	    read_requests(from_server);
+	for (i = 0; i < NAME_LOOKUP_WORKERS; i++)
+	    if (workers[i].job && mplex_is_readable(workers[i].from))
+		finish_job(&workers[i]);
+	dispatch_jobs();
+	if (replies_length > 0)
+	    flush_replies(to_server);
     }
 }
 
@@ -315,11 +471,160 @@ intermediary(int to_server, int from_server)
 static int to_intermediary, from_intermediary;
 static int dead_intermediary = 0;
 
+/* A request sent to the intermediary and not yet answered.  KEY is the
+ * dotted-decimal address or the host name, and is also the cache key.
+ */
+typedef struct pending {
+    struct pending *next;
+    unsigned id;
+    int kind;
+    const char *key;
+    double start;
+    name_lookup_callback done;	/* both zero if someone is waiting for it */
+    name_lookup_addr_callback addr_done;
+    void *data;
+    int urgent;			/* sent as an urgent request */
+    int finished;		/* for waited-for requests: the answer */
+    const char *name;
+    unsigned32 addr;
+} pending;
 
-int
-initialize_name_lookup(void)
+static pending *all_pending = 0, **all_pending_tail = &all_pending;
+static unsigned next_request_id = 0;
+static int pending_count = 0;
+
+/* Answers held for name_lookup_ttl seconds ($server_options), or
+ * name_lookup_negative_ttl for failures (NAME empty or ADDR zero).
+ */
+typedef struct cache_entry {
+    struct cache_entry *next;
+    int kind;
+    const char *key;
+    const char *name;
+    unsigned32 addr;
+    time_t expires;
+} cache_entry;
+
+static cache_entry *name_cache[NAME_CACHE_SIZE > 0 ? NAME_CACHE_SIZE : 1];
+static int cache_count = 0;
+
+static int cache_hits = 0, cache_negative_hits = 0, cache_misses = 0;
+
+/* Round-trip times of answered requests: under 1ms, 10ms, 100ms, 1s, 10s,
+ * and longer.
+ */
+#define LATENCY_BUCKETS 6
+static int latency_counts[LATENCY_BUCKETS];
+
+static void
+free_cache_entry(cache_entry * e)
 {
-    return spawn_pipe(intermediary, &to_intermediary, &from_intermediary);
+    free_str(e->key);
+    if (e->name)
+	free_str(e->name);
+    myfree(e, M_NETWORK);
+}
+
+static cache_entry *
+cache_find(int kind, const char *key)
+{
+    cache_entry *e, **ee;
+    time_t now = time(0);
+
+    if (NAME_CACHE_SIZE <= 0)
+	return 0;
+    ee = &name_cache[str_hash(key) % NAME_CACHE_SIZE];
+    while ((e = *ee)) {
+	if (e->expires <= now) {
+	    *ee = e->next;
+	    free_cache_entry(e);
+	    cache_count--;
+	} else if (e->kind == kind && !mystrcasecmp(e->key, key))
+	    return e;
+	else
+	    ee = &e->next;
+    }
+    return 0;
+}
+
+static void
+cache_store(int kind, const char *key, const char *name, unsigned32 addr)
+{
+    int negative = (kind == REQ_NAME_FROM_ADDR ? !*name : addr == 0);
+    int ttl = negative
+	? server_int_option("name_lookup_negative_ttl",
+			    DEFAULT_NAME_LOOKUP_NEGATIVE_TTL)
+	: server_int_option("name_lookup_ttl", DEFAULT_NAME_LOOKUP_TTL);
+    cache_entry *e;
+    int i;
+
+    if (NAME_CACHE_SIZE <= 0 || ttl <= 0 || cache_find(kind, key))
+	return;
+    if (cache_count >= NAME_CACHE_SIZE) {
+	/* Drop whatever has expired, and then as much else as it takes to get
+	 * back to three-quarters full.
+	 */
+	time_t now = time(0);
+
+	for (i = 0; i < NAME_CACHE_SIZE; i++) {
+	    cache_entry **ee = &name_cache[i];
+
+	    while ((e = *ee))
+		if (e->expires <= now || cache_count >= NAME_CACHE_SIZE * 3 / 4) {
+		    *ee = e->next;
+		    free_cache_entry(e);
+		    cache_count--;
+		} else
+		    ee = &e->next;
+	}
+    }
+    e = mymalloc(sizeof(cache_entry), M_NETWORK);
+    e->kind = kind;
+    e->key = str_dup(key);
+    e->name = kind == REQ_NAME_FROM_ADDR ? str_dup(name) : 0;
+    e->addr = addr;
+    e->expires = time(0) + ttl;
+    i = str_hash(key) % NAME_CACHE_SIZE;
+    e->next = name_cache[i];
+    name_cache[i] = e;
+    cache_count++;
+}
+
+static const char *
+dotted_decimal(struct sockaddr_in *addr)
+{
+    static char decimal[20];
+    unsigned32 a = ntohl(addr->sin_addr.s_addr);
+
+    sprintf(decimal, "%u.%u.%u.%u",
+	    (unsigned) (a >> 24) & 0xff, (unsigned) (a >> 16) & 0xff,
+	    (unsigned) (a >> 8) & 0xff, (unsigned) a & 0xff);
+    return decimal;
+}
+
+static void
+answer(pending * p, const char *name, unsigned32 addr)
+{
+    double usecs = usec_now() - p->start, limit;
+    int i;
+
+    for (i = 0, limit = 1000; i < LATENCY_BUCKETS - 1 && usecs >= limit;
+	 i++, limit *= 10)
+	;
+    latency_counts[i]++;
+
+    if (p->done || p->addr_done) {
+	if (p->done)
+	    (*p->done) (p->data, *name ? name : p->key);
+	else
+	    (*p->addr_done) (p->data, addr);
+	free_str(p->key);
+	myfree(p, M_NETWORK);
+    } else {
+	p->finished = 1;
+	p->name = str_dup(name);
+	p->addr = addr;
+    }
 }
 
 static void
@@ -327,76 +632,347 @@ abandon_intermediary(const char *prefix)
 {
     errlog("LOOKUP_NAME: %s; presumed dead...\n", prefix);
     dead_intermediary = 1;
+    network_unregister_fd(from_intermediary);
     close(to_intermediary);
     close(from_intermediary);
+
+    /* Answer everything still outstanding with a failure */
+    while (all_pending) {
+	pending *p = all_pending;
+
+	all_pending = p->next;
+	pending_count--;
+	answer(p, "", 0);
+    }
+    all_pending_tail = &all_pending;
+}
+
+static void
+handle_reply(struct reply *r, const char *name)
+{
+    pending *p, **pp = &all_pending;
+
+    if (r->addr == 0xffffffff)
+	r->addr = 0;
+    while ((p = *pp))
+	if (p->id != r->id)
+	    pp = &p->next;
+	else {
+	    *pp = p->next;
+	    pending_count--;
+	    cache_store(p->kind, p->key, name, r->addr);
+	    answer(p, name, r->addr);
+	}
+    all_pending_tail = pp;
+}
+
+/* Read whatever answers the intermediary has sent.  The descriptor is left
+ * blocking, so this waits for at least one byte; call it only when some is
+ * expected.
+ */
+static void
+read_replies(void)
+{
+    static char buffer[16384];
+    static int length = 0;
+    int count, used = 0;
+
+    count = robust_read(from_intermediary, buffer + length,
+			sizeof(buffer) - length);
+    if (count <= 0) {
+	abandon_intermediary("LOOKUP_NAME: Read from intermediary failed");
+	length = 0;
+	return;
+    }
+    length += count;
+
+    for (;;) {
+	struct reply r;
+	char name[MAX_LOOKUP_NAME + 1];
+
+	if (length - used < sizeof(r))
+	    break;
+	memcpy(&r, buffer + used, sizeof(r));
+	if (r.length < 0 || r.length > MAX_LOOKUP_NAME) {
+	    abandon_intermediary("LOOKUP_NAME: Garbled reply from intermediary");
+	    length = 0;
+	    return;
+	}
+	if (length - used < sizeof(r) + r.length)
+	    break;
+	memcpy(name, buffer + used + sizeof(r), r.length);
+	name[r.length] = '\0';
+	used += sizeof(r) + r.length;
+	handle_reply(&r, name);
+	if (dead_intermediary)
+	    return;
+    }
+    length -= used;
+    memmove(buffer, buffer + used, length);
+}
+
+static void
+replies_readable(int fd, void *data)
+{
+    read_replies();
+}
+
+int
+initialize_name_lookup(void)
+{
+    if (!spawn_pipe(intermediary, &to_intermediary, &from_intermediary)) {
+	dead_intermediary = 1;
+	return 0;
+    }
+    network_register_fd(from_intermediary, replies_readable, 0, 0);
+    return 1;
+}
+
+/* Send a request to the intermediary, returning the record to wait on, or
+ * zero if the intermediary is (now) dead.  If the same lookup is already in
+ * progress, the new record just shares its answer.  Forward lookups are
+ * always made for a task that is suspended until they finish, so they go
+ * ahead of reverse lookups even when ADDR_DONE is given.
+ */
+static pending *
+send_request(int kind, const char *key, struct sockaddr_in *addr,
+	     unsigned timeout, name_lookup_callback done,
+	     name_lookup_addr_callback addr_done, void *data)
+{
+    struct tagged_request treq;
+    pending *p;
+
+    if (dead_intermediary)
+	return 0;
+
+    /* Someone waiting for the answer shouldn't share a request that may still
+     * be queued behind others.
+     */
+    for (p = all_pending; p; p = p->next)
+	if (p->kind == kind && !mystrcasecmp(p->key, key)
+	    && (done || p->urgent))
+	    break;
+    if (p) {
+	treq.id = p->id;
+	treq.urgent = p->urgent;
+    } else {
+	treq.id = ++next_request_id;
+	treq.urgent = !done;
+	treq.req.kind = kind;
+	treq.req.timeout = timeout;
+	if (kind == REQ_ADDR_FROM_NAME)
+	    treq.req.u.length = strlen(key);
+	else
+	    treq.req.u.address = *addr;
+	if (write(to_intermediary, &treq, sizeof(treq)) != sizeof(treq)
+	    || (kind == REQ_ADDR_FROM_NAME
+		&& write(to_intermediary, key, treq.req.u.length)
+		!= treq.req.u.length)) {
+	    abandon_intermediary("LOOKUP_NAME: Write to intermediary failed");
+	    return 0;
+	}
+    }
+
+    p = mymalloc(sizeof(pending), M_NETWORK);
+    p->next = 0;
+    p->id = treq.id;
+    p->kind = kind;
+    p->key = str_dup(key);
+    p->start = usec_now();
+    p->done = done;
+    p->addr_done = addr_done;
+    p->data = data;
+    p->urgent = treq.urgent;
+    p->finished = 0;
+    p->name = 0;
+    p->addr = 0;
+    *all_pending_tail = p;
+    all_pending_tail = &p->next;
+    pending_count++;
+    cache_misses++;
+    return p;
+}
+
+static void
+ignore_answer(void *data, const char *name)
+{
+}
+
+/* Wait for the answer to P, which must have been sent with no callback, for
+ * at most TIMEOUT seconds.  Returns true if it came; otherwise P is left to
+ * be freed when it does, and must not be touched again.
+ */
+static int
+await_answer(pending * p, unsigned timeout)
+{
+#if HAVE_SELECT
+    double deadline = usec_now() + (timeout > 0 ? timeout : 1) * 1000000.0;
+
+    while (!p->finished) {
+	double left = deadline - usec_now();
+	fd_set readable;
+	struct timeval tv;
+
+	if (left <= 0) {
+	    p->done = ignore_answer;
+	    return 0;
+	}
+	FD_ZERO(&readable);
+	FD_SET(from_intermediary, &readable);
+	tv.tv_sec = (long) (left / 1000000);
+	tv.tv_usec = (long) (left - tv.tv_sec * 1000000.0);
+	if (select(from_intermediary + 1, &readable, 0, 0, &tv) > 0)
+	    read_replies();
+    }
+#else
+    while (!p->finished)
+	read_replies();
+#endif
+    return 1;
+}
+
+static void
+free_pending(pending * p)
+{
+    free_str(p->key);
+    if (p->name)
+	free_str(p->name);
+    myfree(p, M_NETWORK);
+}
+
+static const char *
+cached_name(const char *key)
+{
+    cache_entry *e = cache_find(REQ_NAME_FROM_ADDR, key);
+
+    if (!e)
+	return 0;
+    if (*e->name) {
+	cache_hits++;
+	return e->name;
+    } else {
+	cache_negative_hits++;
+	return key;
+    }
 }
 
 const char *
 lookup_name_from_addr(struct sockaddr_in *addr, unsigned timeout)
 {
-    struct request req;
     static char *buffer = 0;
     static int buflen = 0;
-    int len;
-
-    if (!dead_intermediary) {
-	req.kind = REQ_NAME_FROM_ADDR;
-	req.timeout = timeout;
-	req.u.address = *addr;
-	if (write(to_intermediary, &req, sizeof(req)) != sizeof(req))
-	    abandon_intermediary("LOOKUP_NAME: Write to intermediary failed");
-	else if (robust_read(from_intermediary, &len, sizeof(len))
-		 != sizeof(len))
-	    abandon_intermediary("LOOKUP_NAME: Read from intermediary failed");
-	else if (len != 0) {
-	    ensure_buffer(&buffer, &buflen, len + 1);
-	    if (robust_read(from_intermediary, buffer, len) != len)
-		abandon_intermediary("LOOKUP_NAME: "
-				   "Data-read from intermediary failed");
-	    else {
-		buffer[len] = '\0';
+    const char *key = dotted_decimal(addr);
+    const char *name = cached_name(key);
+    pending *p;
+
+    if (!name && (p = send_request(REQ_NAME_FROM_ADDR, key, addr, timeout,
+				   0, 0, 0))) {
+	if (await_answer(p, timeout)) {
+	    ensure_buffer(&buffer, &buflen, strlen(p->name) + 1);
+	    strcpy(buffer, p->name);
+	    free_pending(p);
+	    if (*buffer)
 		return buffer;
-	    }
 	}
-    }
+    } else if (name)
+	return name;
+
     /* Either the intermediary is presumed dead, or else it failed to produce
-     * a name; in either case, we must fall back on a the default, dotted-
+     * a name in time; in either case, we must fall back on a the default, dotted-
      * decimal notation.
      */
+    return key;
+}
 
-    {
-	static char decimal[20];
-	unsigned32 a = ntohl(addr->sin_addr.s_addr);
+const char *
+lookup_name_from_addr_async(struct sockaddr_in *addr, unsigned timeout,
+			    name_lookup_callback done, void *data)
+{
+    const char *key = dotted_decimal(addr);
+    const char *name = cached_name(key);
+
+    if (name)
+	return name;
+    if (send_request(REQ_NAME_FROM_ADDR, key, addr, timeout, done, 0, data))
+	return 0;
+    return key;
+}
 
-	sprintf(decimal, "%u.%u.%u.%u",
-		(unsigned) (a >> 24) & 0xff, (unsigned) (a >> 16) & 0xff,
-		(unsigned) (a >> 8) & 0xff, (unsigned) a & 0xff);
-	return decimal;
+/* Find NAME's address without asking the intermediary, if that can be done.
+ * Returns true and sets *ADDR (zero on failure) if so.
+ */
+static int
+known_addr(const char *name, unsigned32 * addr)
+{
+    cache_entry *e;
+
+    /* Numeric addresses should always work... */
+    *addr = inet_addr((void *) name);
+    if (*addr != 0xffffffff || dead_intermediary) {
+	if (*addr == 0xffffffff)
+	    *addr = 0;
+	return 1;
+    }
+    if ((e = cache_find(REQ_ADDR_FROM_NAME, name))) {
+	if (e->addr)
+	    cache_hits++;
+	else
+	    cache_negative_hits++;
+	*addr = e->addr;
+	return 1;
     }
+    *addr = 0;
+    return strlen(name) > MAX_LOOKUP_NAME;
 }
 
 unsigned32
 lookup_addr_from_name(const char *name, unsigned timeout)
 {
-    struct request req;
-    unsigned32 addr = 0;
+    unsigned32 addr;
+    pending *p;
+
+    if (known_addr(name, &addr))
+	return addr;
+    if (!(p = send_request(REQ_ADDR_FROM_NAME, name, 0, timeout, 0, 0, 0)))
+	return 0;
+    if (!await_answer(p, timeout))
+	return 0;
+    addr = p->addr;
+    free_pending(p);
+
+    return addr;
+}
 
-    if (dead_intermediary) {
-	/* Numeric addresses should always work... */
-	addr = inet_addr((void *) name);
-    } else {
-	req.kind = REQ_ADDR_FROM_NAME;
-	req.timeout = timeout;
-	req.u.length = strlen(name);
-	if (write(to_intermediary, &req, sizeof(req)) != sizeof(req)
-	    || write(to_intermediary, name, req.u.length) != req.u.length)
-	    abandon_intermediary("LOOKUP_ADDR: Write to intermediary failed");
-	else if (robust_read(from_intermediary, &addr, sizeof(addr))
-		 != sizeof(addr))
-	    abandon_intermediary("LOOKUP_ADDR: Read from intermediary failed");
+int
+lookup_addr_from_name_async(const char *name, unsigned timeout,
+			    unsigned32 * addr,
+			    name_lookup_addr_callback done, void *data)
+{
+    if (known_addr(name, addr))
+	return 1;
+    return !send_request(REQ_ADDR_FROM_NAME, name, 0, timeout, 0, done, data);
+}
+
+Var
+name_lookup_stats(void)
+{
+    Var r = new_list(6), h = new_list(LATENCY_BUCKETS);
+    int i;
+
+    for (i = 1; i <= 5; i++)
+	r.v.list[i].type = TYPE_INT;
+    r.v.list[1].v.num = cache_hits;
+    r.v.list[2].v.num = cache_negative_hits;
+    r.v.list[3].v.num = cache_misses;
+    r.v.list[4].v.num = cache_count;
+    r.v.list[5].v.num = pending_count;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+	h.v.list[i + 1].type = TYPE_INT;
+	h.v.list[i + 1].v.num = latency_counts[i];
     }
+    r.v.list[6] = h;
 
-    return addr == 0xffffffff ? 0 : addr;
+    return r;
 }
 
 #endif				/* NETWORK_PROTOCOL == NP_TCP */
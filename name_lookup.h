@@ -25,6 +25,8 @@
 #define Name_Lookup_H 1
 
 #include "config.h"
+#include "my-in.h"
+#include "structures.h"
 
 extern int initialize_name_lookup(void);
 				/* Initialize the module, returning true iff
@@ -39,6 +41,21 @@ extern unsigned32 lookup_addr_from_name(const char *name,
 				 * decimal address are translated properly.
 				 */
 
+typedef void (*name_lookup_addr_callback) (void *data, unsigned32 addr);
+
+extern int lookup_addr_from_name_async(const char *name, unsigned timeout,
+				       unsigned32 * addr,
+				       name_lookup_addr_callback done,
+				       void *data);
+				/* Like lookup_addr_from_name(), but without
+				 * waiting for an answer from the network: if
+				 * the address is already known (or no lookup
+				 * is possible), store it in *ADDR and return
+				 * true; otherwise return false and call DONE
+				 * with DATA and the address, zero if there is
+				 * none, once it is known.
+				 */
+
 extern const char *lookup_name_from_addr(struct sockaddr_in *addr,
 					 unsigned timeout);
 				/* Translate an internet address, contained
@@ -48,6 +65,29 @@ extern const char *lookup_name_from_addr(struct sockaddr_in *addr,
 				 * form.
 				 */
 
+typedef void (*name_lookup_callback) (void *data, const char *name);
+
+extern const char *lookup_name_from_addr_async(struct sockaddr_in *addr,
+					       unsigned timeout,
+					       name_lookup_callback done,
+					       void *data);
+				/* Like lookup_name_from_addr(), but without
+				 * waiting for an answer from the network: if
+				 * the name is cached (or no lookup is
+				 * possible), return it; otherwise return zero
+				 * and call DONE with DATA and the name once
+				 * it is known.  The name passed to DONE is
+				 * only valid during the call.
+				 */
+
+extern Var name_lookup_stats(void);
+				/* Return {cache hits, cached failures,
+				 * misses, cache entries, lookups in
+				 * progress, {counts of lookups answered in
+				 * under 1ms, 10ms, 100ms, 1s, 10s, and
+				 * longer}}.
+				 */
+
 #endif				/* Name_Lookup_H */
 
 /* 
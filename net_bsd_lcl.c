@@ -62,6 +62,7 @@ proto_initialize(struct proto *proto, Var * desc, int argc, char **argv)
     proto->pocket_size = 1;
     proto->believe_eof = 1;
     proto->eol_out_string = "\n";
+    proto->accept_batch = ACCEPT_BATCH;
 
     if (argc > 1)
 	return 0;
@@ -117,13 +118,20 @@ proto_make_listener(Var desc, int *fd, Var * canon, const char **name)
 int
 proto_listen(int fd)
 {
-    listen(fd, 5);
+    listen(fd, LISTEN_BACKLOG);
     return 1;
 }
 
+int
+proto_share_listener(int fd, int *new_fd)
+{
+    return 0;
+}
+
 enum proto_accept_error
 proto_accept_connection(int listener_fd, int *read_fd, int *write_fd,
-			const char **name)
+			const char **name,
+			proto_name_callback named, void *data)
 {
     int fd;
     static struct sockaddr_un address;
@@ -133,6 +141,9 @@ proto_accept_connection(int listener_fd, int *read_fd, int *write_fd,
     if (fd < 0) {
 	if (errno == EMFILE)
 	    return PA_FULL;
+	else if (errno == EAGAIN || errno == EWOULDBLOCK
+		 || errno == ECONNABORTED || errno == EINTR)
+	    return PA_EMPTY;
 	else {
 	    log_perror("Accepting new network connection");
 	    return PA_OTHER;
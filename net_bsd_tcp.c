@@ -37,6 +37,7 @@
 #include "net_proto.h"
 #include "options.h"
 #include "server.h"
+#include "storage.h"
 #include "streams.h"
 #include "timers.h"
 #include "utils.h"
@@ -57,6 +58,7 @@ proto_initialize(struct proto *proto, Var * desc, int argc, char **argv)
     proto->pocket_size = 1;
     proto->believe_eof = 1;
     proto->eol_out_string = "\r\n";
+    proto->accept_batch = ACCEPT_BATCH;
 
     if (!tcp_arguments(argc, argv, &port))
 	return 0;
@@ -93,6 +95,10 @@ proto_make_listener(Var desc, int *fd, Var * canon, const char **name)
 	close(s);
 	return E_QUOTA;
     }
+#if defined(SO_REUSEPORT) && LISTEN_SHARDS > 1
+    /* Failure here just means that proto_share_listener() will, too. */
+    setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (char *) &option, sizeof(option));
+#endif
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = bind_local_ip;
     address.sin_port = htons(port);
@@ -128,19 +134,73 @@ proto_make_listener(Var desc, int *fd, Var * canon, const char **name)
 int
 proto_listen(int fd)
 {
-    listen(fd, 5);
+    listen(fd, LISTEN_BACKLOG);
     return 1;
 }
 
+int
+proto_share_listener(int fd, int *new_fd)
+{
+#ifdef SO_REUSEPORT
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    int s, option = 1;
+
+    if (getsockname(fd, (struct sockaddr *) &address, &length) < 0) {
+	log_perror("Discovering listening socket address");
+	return 0;
+    }
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) {
+	log_perror("Creating shared listening socket");
+	return 0;
+    }
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR,
+		   (char *) &option, sizeof(option)) < 0
+	|| setsockopt(s, SOL_SOCKET, SO_REUSEPORT,
+		      (char *) &option, sizeof(option)) < 0
+	|| bind(s, (struct sockaddr *) &address, length) < 0) {
+	log_perror("Sharing listening socket");
+	close(s);
+	return 0;
+    }
+    *new_fd = s;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+typedef struct {
+    proto_name_callback named;
+    void *data;
+    int port;
+} naming;
+
+static void
+accept_named(void *data, const char *host_name)
+{
+    naming *n = data;
+    static Stream *s = 0;
+
+    if (!s)
+	s = new_stream(100);
+    stream_printf(s, "%s, port %d", host_name, n->port);
+    (*n->named) (n->data, reset_stream(s));
+    myfree(n, M_NETWORK);
+}
+
 enum proto_accept_error
 proto_accept_connection(int listener_fd, int *read_fd, int *write_fd,
-			const char **name)
+			const char **name,
+			proto_name_callback named, void *data)
 {
     int timeout = server_int_option("name_lookup_timeout", 5);
     int fd;
     int optval;
     struct sockaddr_in address;
     socklen_t addr_length = sizeof(address);
+    const char *host_name;
     static Stream *s = 0;
 
     if (!s)
@@ -150,6 +210,9 @@ proto_accept_connection(int listener_fd, int *read_fd, int *write_fd,
     if (fd < 0) {
 	if (errno == EMFILE)
 	    return PA_FULL;
+	else if (errno == EAGAIN || errno == EWOULDBLOCK
+		 || errno == ECONNABORTED || errno == EINTR)
+	    return PA_EMPTY;
 	else {
 	    log_perror("Accepting new network connection");
 	    return PA_OTHER;
@@ -158,9 +221,22 @@ proto_accept_connection(int listener_fd, int *read_fd, int *write_fd,
     optval = 1;
     setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
     *read_fd = *write_fd = fd;
-    stream_printf(s, "%s, port %d",
-		  lookup_name_from_addr(&address, timeout),
-		  (int) ntohs(address.sin_port));
+    if (named) {
+	naming *n = mymalloc(sizeof(naming), M_NETWORK);
+
+	n->named = named;
+	n->data = data;
+	n->port = ntohs(address.sin_port);
+	host_name = lookup_name_from_addr_async(&address, timeout,
+						accept_named, n);
+	if (!host_name) {
+	    *name = 0;
+	    return PA_OKAY;
+	}
+	myfree(n, M_NETWORK);
+    } else
+	host_name = lookup_name_from_addr(&address, timeout);
+    stream_printf(s, "%s, port %d", host_name, (int) ntohs(address.sin_port));
     *name = reset_stream(s);
     return PA_OKAY;
 }
@@ -180,56 +256,64 @@ proto_close_listener(int fd)
 
 #ifdef OUTBOUND_NETWORK
 
-#include "exceptions.h"
+#include "net_multi.h"
 #include "structures.h"
 
-static Exception timeout_exception;
-
-static void
-timeout_proc(Timer_ID id, Timer_Data data)
+static enum error
+connect_error(const char *what)
 {
-    RAISE(timeout_exception, 0);
+    if (errno == EADDRNOTAVAIL ||
+	errno == ECONNREFUSED ||
+	errno == ENETUNREACH ||
+	errno == EHOSTUNREACH ||
+	errno == ETIMEDOUT)
+	return E_INVARG;
+    log_perror(what);
+    return E_QUOTA;
 }
 
 enum error
-proto_open_connection(Var arglist, int *read_fd, int *write_fd,
-		      const char **local_name, const char **remote_name)
+proto_finish_connection(int fd, const char **local_name)
 {
-    /* These are `static' rather than `volatile' because I can't cope with
-     * getting all those nasty little parameter-passing rules right.  This
-     * function isn't recursive anyway, so it doesn't matter.
-     */
-    static const char *host_name;
-    static int port;
-    static Timer_ID id;
-    size_t length;
-    int s, result;
-    int timeout = server_int_option("name_lookup_timeout", 5);
+    struct sockaddr_in addr;
+    socklen_t length;
     int optval;
-    static struct sockaddr_in addr;
-    static Stream *st1 = 0, *st2 = 0;
+    static Stream *st = 0;
 
-    if (!outbound_network_enabled)
-	return E_PERM;
+    if (!st)
+	st = new_stream(20);
+
+    length = sizeof(optval);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &optval, &length) < 0)
+	optval = errno;
+    if (optval != 0) {
+	enum error e;
 
-    if (!st1) {
-	st1 = new_stream(20);
-	st2 = new_stream(50);
+	errno = optval;
+	e = connect_error("Connecting in proto_finish_connection");
+	close(fd);
+	return e;
     }
-    if (arglist.v.list[0].v.num != 2)
-	return E_ARGS;
-    else if (arglist.v.list[1].type != TYPE_STR ||
-	     arglist.v.list[2].type != TYPE_INT)
-	return E_TYPE;
+    optval = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
+    length = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *) &addr, &length) < 0) {
+	close(fd);
+	log_perror("Getting local name in proto_finish_connection");
+	return E_QUOTA;
+    }
+    stream_printf(st, "port %d", (int) ntohs(addr.sin_port));
+    *local_name = reset_stream(st);
 
-    host_name = arglist.v.list[1].v.str;
-    port = arglist.v.list[2].v.num;
+    return E_NONE;
+}
 
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = lookup_addr_from_name(host_name, timeout);
-    if (addr.sin_addr.s_addr == 0)
-	return E_INVARG;
+/* Start connecting to ADDR, returning as proto_open_connection() does. */
+static enum error
+start_connect(struct sockaddr_in *addr, int *read_fd, int *write_fd,
+	      const char **local_name)
+{
+    int s;
 
     s = socket(AF_INET, SOCK_STREAM, 0);
     if (s < 0) {
@@ -239,7 +323,7 @@ proto_open_connection(Var arglist, int *read_fd, int *write_fd,
     }
     
     if (bind_local_ip != INADDR_ANY) {
-	static struct sockaddr_in local_addr;
+	struct sockaddr_in local_addr;
 
 	local_addr.sin_family = AF_INET;
 	local_addr.sin_addr.s_addr = bind_local_ip;
@@ -256,46 +340,96 @@ proto_open_connection(Var arglist, int *read_fd, int *write_fd,
 	    return e;
 	}
     }	 
-    TRY {
-	id = set_timer(server_int_option("outbound_connect_timeout", 5),
-		       timeout_proc, 0);
-	result = connect(s, (struct sockaddr *) &addr, sizeof(addr));
-	cancel_timer(id);
-    }
-    EXCEPT(timeout_exception) {
-	result = -1;
-	errno = ETIMEDOUT;
-	reenable_timers();
-    }
-    ENDTRY;
-
-    if (result < 0) {
+    if (!network_set_nonblocking(s)) {
+	log_perror("Setting outbound connection non-blocking");
 	close(s);
-	if (errno == EADDRNOTAVAIL ||
-	    errno == ECONNREFUSED ||
-	    errno == ENETUNREACH ||
-	    errno == ETIMEDOUT)
-	    return E_INVARG;
-	log_perror("Connecting in proto_open_connection");
 	return E_QUOTA;
     }
-    optval = 1;
-    setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
-    length = sizeof(addr);
-    if (getsockname(s, (struct sockaddr *) &addr, &length) < 0) {
+    *read_fd = *write_fd = s;
+    *local_name = 0;
+
+    if (connect(s, (struct sockaddr *) addr, sizeof(*addr)) == 0)
+	return proto_finish_connection(s, local_name);
+    else if (errno == EINPROGRESS || errno == EINTR)
+	return E_NONE;		/* Finished later by the caller */
+    else {
+	enum error e = connect_error("Connecting in proto_open_connection");
+
 	close(s);
-	log_perror("Getting local name in proto_open_connection");
-	return E_QUOTA;
+	return e;
     }
-    *read_fd = *write_fd = s;
+}
 
-    stream_printf(st1, "port %d", (int) ntohs(addr.sin_port));
-    *local_name = reset_stream(st1);
+typedef struct {
+    struct sockaddr_in addr;
+    proto_open_callback opened;
+    void *data;
+} opening;
 
-    stream_printf(st2, "%s, port %d", host_name, port);
-    *remote_name = reset_stream(st2);
+static void
+open_looked_up(void *data, unsigned32 addr)
+{
+    opening *o = data;
+    int fd = -1;
+    const char *local_name = 0;
+    enum error e = E_INVARG;	/* as for a refused connection */
+
+    if (addr != 0) {
+	o->addr.sin_addr.s_addr = addr;
+	e = start_connect(&o->addr, &fd, &fd, &local_name);
+    }
+    (*o->opened) (o->data, e, fd, fd, local_name);
+    myfree(o, M_NETWORK);
+}
 
-    return E_NONE;
+enum error
+proto_open_connection(Var arglist, int *read_fd, int *write_fd,
+		      const char **local_name, const char **remote_name,
+		      proto_open_callback opened, void *data)
+{
+    const char *host_name;
+    int port;
+    int timeout = server_int_option("name_lookup_timeout", 5);
+    struct sockaddr_in addr;
+    static Stream *st = 0;
+
+    if (!outbound_network_enabled)
+	return E_PERM;
+
+    if (!st)
+	st = new_stream(50);
+    if (arglist.v.list[0].v.num != 2)
+	return E_ARGS;
+    else if (arglist.v.list[1].type != TYPE_STR ||
+	     arglist.v.list[2].type != TYPE_INT)
+	return E_TYPE;
+
+    host_name = arglist.v.list[1].v.str;
+    port = arglist.v.list[2].v.num;
+    stream_printf(st, "%s, port %d", host_name, port);
+    *remote_name = reset_stream(st);
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (opened) {
+	opening *o = mymalloc(sizeof(opening), M_NETWORK);
+
+	o->addr = addr;
+	o->opened = opened;
+	o->data = data;
+	if (!lookup_addr_from_name_async(host_name, timeout,
+					 &addr.sin_addr.s_addr,
+					 open_looked_up, o)) {
+	    *read_fd = *write_fd = -1;
+	    return E_NONE;
+	}
+	myfree(o, M_NETWORK);
+    } else
+	addr.sin_addr.s_addr = lookup_addr_from_name(host_name, timeout);
+    if (addr.sin_addr.s_addr == 0)
+	return E_INVARG;
+
+    return start_connect(&addr, read_fd, write_fd, local_name);
 }
 #endif				/* OUTBOUND_NETWORK */
 
@@ -24,7 +24,11 @@
 #include "my-stdio.h"
 #include "my-stdlib.h"
 #include "my-string.h"
+#include "my-time.h"
 #include "my-unistd.h"
+#ifdef MOO_ZLIB
+#include <zlib.h>
+#endif
 
 #include "config.h"
 #include "exceptions.h"
@@ -60,13 +64,29 @@ static int ewouldblock = -1;
 static int *pocket_descriptors = 0;	/* fds we keep around in case we need
 					 * one and no others are left... */
 
+/* Bytes of output, never changed once made, which may be queued on any
+ * number of connections at once; each text_block holds a reference.
+ */
+typedef struct out_chunk {
+    int refcount;
+    int length;
+    char data[1];
+} out_chunk;
+
 typedef struct text_block {
     struct text_block *next;
     int length;
-    char *buffer;
-    char *start;
+    out_chunk *chunk;
+    const char *start;		/* the part of chunk->data still to go */
 } text_block;
 
+/* Telnet output compression (the COMPRESS2 option, better known as MCCP
+ * version 2) needs zlib.
+ */
+#if defined(MOO_ZLIB) && NETWORK_PROTOCOL == NP_TCP
+#  define OUTPUT_COMPRESSION
+#endif
+
 typedef struct nhandle {
     struct nhandle *next, **prev;
     server_handle shandle;
@@ -83,6 +103,13 @@ typedef struct nhandle {
 #if NETWORK_PROTOCOL == NP_TCP
     int client_echo;
 #endif
+#ifdef OUTPUT_COMPRESSION
+    z_stream *zstream;		/* non-null while output is compressed */
+    char *zout;			/* bytes to write ahead of output_head */
+    int zout_start, zout_length, zout_size;
+    int compress_offered;	/* sent IAC WILL COMPRESS2, awaiting reply */
+    unsigned long zbytes_in, zbytes_out;
+#endif
 } nhandle;
 
 static nhandle *all_nhandles = 0;
@@ -90,12 +117,28 @@ static nhandle *all_nhandles = 0;
 typedef struct nlistener {
     struct nlistener *next, **prev;
     server_listener slistener;
-    int fd;
+    int fds[LISTEN_SHARDS];	/* fds[0] from proto_make_listener(), rest
+				 * from proto_share_listener() */
+    int nfds;
+    int batch;			/* most connections to accept per wakeup */
     const char *name;
+    int accepted, batches, full_batches, largest_batch;
+    double accept_call_usecs, max_accept_call_usecs;
 } nlistener;
 
 static nlistener *all_nlisteners = 0;
 
+/* A connection accepted while the protocol is still finding its name */
+typedef struct naccept {
+    struct naccept *next;
+    nlistener *l;		/* zero once the listener is closed */
+    int rfd, wfd;
+    const char *name;		/* zero until known */
+} naccept;
+
+static naccept *all_naccepts = 0, **all_naccepts_tail = &all_naccepts;
+static naccept *spare_naccept = 0;
+
 
 typedef struct {
     int fd;
@@ -171,23 +214,83 @@ add_registered_fds(void)
 static void
 check_registered_fds(void)
 {
-    fd_reg *reg;
+    int i;
 
-    for (reg = reg_fds; reg < reg_fds + max_reg_fds; reg++)
-	if (reg->fd != -1) {
-	    if (reg->readable && mplex_is_readable(reg->fd))
-		(*reg->readable) (reg->fd, reg->data);
-	    if (reg->writable && mplex_is_writable(reg->fd))
-		(*reg->writable) (reg->fd, reg->data);
-	}
+    /* Index rather than pointer, since a callback may register another
+     * descriptor and so move reg_fds.
+     */
+    for (i = 0; i < max_reg_fds; i++) {
+	fd_reg reg;
+
+	reg = reg_fds[i];
+	if (reg.fd == -1)
+	    continue;
+	if (reg.readable && mplex_is_readable(reg.fd))
+	    (*reg.readable) (reg.fd, reg.data);
+	if (reg.writable && reg_fds[i].fd == reg.fd
+	    && mplex_is_writable(reg.fd))
+	    (*reg.writable) (reg.fd, reg.data);
+    }
 }
 
 
+static out_chunk *
+new_out_chunk(const char *line, int line_length, int add_eol)
+{
+    int length = line_length + (add_eol ? eol_length : 0);
+    out_chunk *c = mymalloc(sizeof(out_chunk) - 1 + length, M_NETWORK);
+
+    c->refcount = 1;
+    c->length = length;
+    memcpy(c->data, line, line_length);
+    if (add_eol)
+	memcpy(c->data + line_length, proto.eol_out_string, eol_length);
+    return c;
+}
+
+static void
+release_out_chunk(out_chunk * c)
+{
+    if (--c->refcount == 0)
+	myfree(c, M_NETWORK);
+}
+
+/* Freed text_blocks are kept for reuse, so that queueing one chunk on many
+ * connections does not cost an allocation per connection.
+ */
+#define MAX_SPARE_TEXT_BLOCKS	1024
+
+static text_block *spare_text_blocks = 0;
+static int num_spare_text_blocks = 0;
+
+static text_block *
+new_text_block(out_chunk * c)
+{
+    text_block *b = spare_text_blocks;
+
+    if (b) {
+	spare_text_blocks = b->next;
+	num_spare_text_blocks--;
+    } else
+	b = mymalloc(sizeof(text_block), M_NETWORK);
+    c->refcount++;
+    b->chunk = c;
+    b->start = c->data;
+    b->length = c->length;
+    b->next = 0;
+    return b;
+}
+
 static void
 free_text_block(text_block * b)
 {
-    myfree(b->buffer, M_NETWORK);
-    myfree(b, M_NETWORK);
+    release_out_chunk(b->chunk);
+    if (num_spare_text_blocks < MAX_SPARE_TEXT_BLOCKS) {
+	b->next = spare_text_blocks;
+	spare_text_blocks = b;
+	num_spare_text_blocks++;
+    } else
+	myfree(b, M_NETWORK);
 }
 
 int
@@ -214,24 +317,247 @@ network_set_nonblocking(int fd)
 #endif
 }
 
+static int
+overflow_notice(nhandle * h, char *buf)
+{
+    sprintf(buf,
+	    "%s>> Network buffer overflow: %u line%s of output to you %s been lost <<%s",
+	    proto.eol_out_string,
+	    h->output_lines_flushed,
+	    h->output_lines_flushed == 1 ? "" : "s",
+	    h->output_lines_flushed == 1 ? "has" : "have",
+	    proto.eol_out_string);
+    return strlen(buf);
+}
+
+#ifdef OUTPUT_COMPRESSION
+
+/* Telnet codes from RFC 854, and the COMPRESS2 option number. */
+#define TN_IAC	255
+#define TN_WILL	251
+#define TN_DO	253
+#define TN_DONT	254
+#define TN_SB	250
+#define TN_SE	240
+#define TN_COMPRESS2	86
+
+/* While a connection's output is compressed, queued text blocks are deflated
+ * into the connection's `zout' buffer, which is then written as is.  Nothing
+ * more is deflated until that buffer has been written out, so it never holds
+ * much more than MAX_QUEUED_OUTPUT bytes; the usual discarding of old output
+ * still applies to the uncompressed queue behind it.
+ */
+#define ZOUT_KEEP_SIZE	16384	/* larger zout buffers are freed when empty */
+
+static char *
+zout_space(nhandle * h, int needed)
+{
+    /* Returns the end of the data in zout, with room for NEEDED more bytes */
+    if (h->zout_length == 0)
+	h->zout_start = 0;
+    if (h->zout_start + h->zout_length + needed > h->zout_size) {
+	if (h->zout_length + needed <= h->zout_size)
+	    memmove(h->zout, h->zout + h->zout_start, h->zout_length);
+	else {
+	    int size = h->zout_size ? h->zout_size : 4096;
+	    char *buf;
+
+	    while (size < h->zout_length + needed)
+		size *= 2;
+	    buf = mymalloc(size, M_NETWORK);
+	    if (h->zout) {
+		memcpy(buf, h->zout + h->zout_start, h->zout_length);
+		myfree(h->zout, M_NETWORK);
+	    }
+	    h->zout = buf;
+	    h->zout_size = size;
+	}
+	h->zout_start = 0;
+    }
+    return h->zout + h->zout_start + h->zout_length;
+}
+
+static void
+zout_add(nhandle * h, const char *data, int length)
+{
+    memcpy(zout_space(h, length), data, length);
+    h->zout_length += length;
+}
+
+static void
+deflate_output(nhandle * h, const char *data, int length, int flush)
+{
+    z_stream *z = h->zstream;
+
+    z->next_in = (Bytef *) data;
+    z->avail_in = length;
+    do {
+	char *out = zout_space(h, 1024);
+
+	z->next_out = (Bytef *) out;
+	z->avail_out = h->zout_size - (out - h->zout);
+	(void) deflate(z, flush);
+	h->zbytes_out += (char *) z->next_out - out;
+	h->zout_length += (char *) z->next_out - out;
+    } while (z->avail_in > 0 || z->avail_out == 0);
+    h->zbytes_in += length;
+}
+
+/* Moves everything queued for H into zout, deflated if COMPRESS and as is
+ * otherwise; returns true iff there was anything.
+ */
+static int
+take_queued_output(nhandle * h, int compress)
+{
+    text_block *b;
+    int any = 0;
+
+    if (h->output_lines_flushed > 0) {
+	char buf[100];
+	int length = overflow_notice(h, buf);
+
+	if (compress)
+	    deflate_output(h, buf, length, Z_NO_FLUSH);
+	else
+	    zout_add(h, buf, length);
+	h->output_lines_flushed = 0;
+	any = 1;
+    }
+    while ((b = h->output_head) != 0) {
+	if (compress)
+	    deflate_output(h, b->start, b->length, Z_NO_FLUSH);
+	else
+	    zout_add(h, b->start, b->length);
+	h->output_length -= b->length;
+	h->output_head = b->next;
+	free_text_block(b);
+	any = 1;
+    }
+    h->output_tail = &(h->output_head);
+    return any;
+}
+
+static int
+start_compression(nhandle * h)
+{
+    static char start_seq[5] =
+	{TN_IAC, TN_SB, TN_COMPRESS2, TN_IAC, TN_SE};
+    z_stream *z;
+
+    if (h->zstream)
+	return 1;
+    z = mymalloc(sizeof(z_stream), M_NETWORK);
+    memset(z, 0, sizeof(z_stream));
+    /* A smaller window and less memory than zlib's defaults, about 96K per
+     * connection instead of 256K, since there may be many connections.
+     */
+    if (deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 13, 7,
+		     Z_DEFAULT_STRATEGY) != Z_OK) {
+	errlog("START_COMPRESSION: Can't set up compression for %s\n",
+	       h->name);
+	myfree(z, M_NETWORK);
+	return 0;
+    }
+    /* Output queued so far goes out uncompressed, ahead of the marker */
+    (void) take_queued_output(h, 0);
+    zout_add(h, start_seq, sizeof(start_seq));
+    h->zstream = z;
+    h->compress_offered = 0;
+    return 1;
+}
+
+static void
+stop_compression(nhandle * h)
+{
+    if (!h->zstream)
+	return;
+    (void) take_queued_output(h, 1);
+    deflate_output(h, 0, 0, Z_FINISH);
+    deflateEnd(h->zstream);
+    myfree(h->zstream, M_NETWORK);
+    h->zstream = 0;
+}
+
+static int
+push_compressed_output(nhandle * h)
+{
+    int count;
+
+    /* Everything queued is compressed together and then flushed, so that
+     * the client can show all of it at once.
+     */
+    if (h->zstream && h->zout_length == 0 && take_queued_output(h, 1))
+	deflate_output(h, 0, 0, Z_SYNC_FLUSH);
+    while (h->zout_length > 0) {
+	count = write(h->wfd, h->zout + h->zout_start, h->zout_length);
+	if (count < 0)
+	    return (errno == eagain || errno == ewouldblock);
+	h->zout_start += count;
+	h->zout_length -= count;
+    }
+    if (h->zout_size > ZOUT_KEEP_SIZE) {
+	myfree(h->zout, M_NETWORK);
+	h->zout = 0;
+	h->zout_size = 0;
+    }
+    return 1;
+}
+
+/* Looks through the COUNT bytes of input in BUF for the client's answer to
+ * our offer of COMPRESS2, acting on it and removing it; returns the new
+ * count.  An answer split between two reads is not noticed.
+ */
+static int
+compression_reply(nhandle * h, char *buf, int count)
+{
+    char *p = buf, *end = buf + count;
+
+    while ((p = memchr(p, TN_IAC, end - p)) != 0 && end - p >= 3) {
+	unsigned char cmd = p[1];
+
+	if ((cmd == TN_DO || cmd == TN_DONT)
+	    && (unsigned char) p[2] == TN_COMPRESS2) {
+	    h->compress_offered = 0;
+	    if (cmd == TN_DO)
+		(void) start_compression(h);
+	    memmove(p, p + 3, end - p - 3);
+	    return count - 3;
+	}
+	p++;
+    }
+    return count;
+}
+
+static unsigned long
+byte_count(unsigned long n)
+{
+    return n > 2147483647UL ? 2147483647UL : n;
+}
+
+#  define output_pending(h)	((h)->output_head || (h)->zout_length > 0)
+#else
+#  define output_pending(h)	((h)->output_head)
+#endif				/* OUTPUT_COMPRESSION */
+
 static int
 push_output(nhandle * h)
 {
     text_block *b;
     int count;
 
+#ifdef OUTPUT_COMPRESSION
+    if (h->zstream || h->zout_length > 0) {
+	if (!push_compressed_output(h))
+	    return 0;
+	if (h->zstream || h->zout_length > 0)
+	    return 1;
+	/* Compression has ended; send what followed it as usual */
+    }
+#endif
     if (h->output_lines_flushed > 0) {
 	char buf[100];
-	int length;
-
-	sprintf(buf,
-		"%s>> Network buffer overflow: %u line%s of output to you %s been lost <<%s",
-		proto.eol_out_string,
-		h->output_lines_flushed,
-		h->output_lines_flushed == 1 ? "" : "s",
-		h->output_lines_flushed == 1 ? "has" : "have",
-		proto.eol_out_string);
-	length = strlen(buf);
+	int length = overflow_notice(h, buf);
+
 	count = write(h->wfd, buf, length);
 	if (count == length)
 	    h->output_lines_flushed = 0;
@@ -256,49 +582,99 @@ push_output(nhandle * h)
     return 1;
 }
 
+/* Input is read in chunks of up to INPUT_READ_SIZE bytes into one buffer
+ * shared by all connections; only a line left incomplete at the end of a
+ * chunk is kept, already filtered, in the connection's `input' stream.
+ */
+#define INPUT_READ_SIZE	16384
+
+static char input_ok[256];	/* characters kept in lines of input */
+
+static void
+init_input_ok(void)
+{
+    int c;
+
+    for (c = 0; c < 256; c++)
+	input_ok[c] = (isgraph(c) || c == ' ' || c == '\t');
+}
+
+/* Drops unwanted characters from [PTR, END) in place, returning the new
+ * end.  A backspace with nothing before it in the span deletes from S,
+ * which holds the start of the line.
+ */
+static char *
+filter_input(char *ptr, char *end, Stream * s)
+{
+    char *start = ptr, *w;
+
+    while (ptr < end && input_ok[(unsigned char) *ptr])
+	ptr++;
+    for (w = ptr; ptr < end; ptr++) {
+	unsigned char c = *ptr;
+
+	if (input_ok[c])
+	    *w++ = c;
+#ifdef INPUT_APPLY_BACKSPACE
+	else if (c == 0x08 || c == 0x7F) {
+	    if (w > start)
+		w--;
+	    else
+		stream_delete_char(s);
+	}
+#endif
+    }
+    return w;
+}
+
 static int
 pull_input(nhandle * h)
 {
     Stream *s = h->input;
     int count;
-    char buffer[1024];
+    static char buffer[INPUT_READ_SIZE + 1];
     char *ptr, *end;
 
-    if ((count = read(h->rfd, buffer, sizeof(buffer))) > 0) {
+    if ((count = read(h->rfd, buffer, INPUT_READ_SIZE)) > 0) {
 	if (h->binary) {
 	    stream_add_raw_bytes_to_binary(s, buffer, count);
 	    server_receive_line(h->shandle, reset_stream(s));
 	    h->last_input_was_CR = 0;
 	} else {
-	    for (ptr = buffer, end = buffer + count; ptr < end; ptr++) {
-		unsigned char c = *ptr;
-
-		if (c == '\r' || (c == '\n' && !h->last_input_was_CR)) {
-		    int fcount = stream_length(s);
-		    char *fptr = reset_stream(s);
-		    Stream *fs = new_stream(count + 1);
-		    int i;
-
-		    h->last_input_was_CR = (c == '\r');
-		    for (i = 0; i < fcount; ++i) {
-			c = fptr[i];
-
-			if (isgraph(c) || c == ' ' || c == '\t')
-			    stream_add_char(fs, c);
-#ifdef INPUT_APPLY_BACKSPACE
-			else if (c == 0x08 || c == 0x7F)
-			    stream_delete_char(fs);
+#ifdef OUTPUT_COMPRESSION
+	    if (h->compress_offered)
+		count = compression_reply(h, buffer, count);
 #endif
-		    }
-		    server_receive_line(h->shandle, stream_contents(fs));
-		    free_stream(fs);
-		}
-		else if (c == '\n')
+	    for (ptr = buffer, end = buffer + count; ptr < end;) {
+		char *nl = memchr(ptr, '\n', end - ptr);
+		char *eol = memchr(ptr, '\r', (nl ? nl : end) - ptr);
+		char *w;
+		int c;
+
+		if (!eol)
+		    eol = nl;
+		if (eol == ptr && *eol == '\n' && h->last_input_was_CR) {
+		    /* LF of a CR-LF pair */
 		    h->last_input_was_CR = 0;
-		else {
-		    stream_add_char(s, c);
+		    ptr++;
+		    continue;
+		}
+		c = eol ? *eol : 0;
+		w = filter_input(ptr, eol ? eol : end, s);
+		*w = '\0';	/* may overwrite *eol */
+		if (!eol) {
+		    /* Keep the start of the line for the next chunk */
+		    stream_add_string(s, ptr);
 		    h->last_input_was_CR = 0;
+		    break;
 		}
+		h->last_input_was_CR = (c == '\r');
+		if (stream_length(s) > 0) {
+		    stream_add_string(s, ptr);
+		    server_receive_line(h->shandle, reset_stream(s));
+		} else
+		    server_receive_line(h->shandle, ptr);
+		ptr = eol + 1;
 	    }
 	}
 	return 1;
@@ -343,6 +719,13 @@ new_nhandle(int rfd, int wfd, const char *local_name, const char *remote_name,
 #if NETWORK_PROTOCOL == NP_TCP
     h->client_echo = 1;
 #endif
+#ifdef OUTPUT_COMPRESSION
+    h->zstream = 0;
+    h->zout = 0;
+    h->zout_start = h->zout_length = h->zout_size = 0;
+    h->compress_offered = 0;
+    h->zbytes_in = h->zbytes_out = 0;
+#endif
 
     stream_printf(s, "%s %s %s",
 		  local_name, outbound ? "to" : "from", remote_name);
@@ -356,6 +739,9 @@ close_nhandle(nhandle * h)
 {
     text_block *b, *bb;
 
+#ifdef OUTPUT_COMPRESSION
+    stop_compression(h);
+#endif
     (void) push_output(h);
     *(h->prev) = h->next;
     if (h->next)
@@ -366,6 +752,10 @@ close_nhandle(nhandle * h)
 	free_text_block(b);
 	b = bb;
     }
+#ifdef OUTPUT_COMPRESSION
+    if (h->zout)
+	myfree(h->zout, M_NETWORK);
+#endif
     free_stream(h->input);
     proto_close_connection(h->rfd, h->wfd);
     free_str(h->name);
@@ -375,15 +765,25 @@ close_nhandle(nhandle * h)
 static void
 close_nlistener(nlistener * l)
 {
+    naccept *a;
+    int i;
+
     *(l->prev) = l->next;
     if (l->next)
 	l->next->prev = l->prev;
-    proto_close_listener(l->fd);
+    for (i = 0; i < l->nfds; i++)
+	proto_close_listener(l->fds[i]);
+    for (a = all_naccepts; a; a = a->next)
+	if (a->l == l)
+	    a->l = 0;
     free_str(l->name);
     myfree(l, M_NETWORK);
 }
 
-static void
+static int enqueue_output(network_handle nh, const char *line,
+			  int line_length, int add_eol, int flush_ok);
+
+static server_handle
 make_new_connection(server_listener sl, int rfd, int wfd,
 		    const char *local_name, const char *remote_name,
 		    int outbound)
@@ -392,7 +792,16 @@ make_new_connection(server_listener sl, int rfd, int wfd,
     network_handle nh;
 
     nh.ptr = h = new_nhandle(rfd, wfd, local_name, remote_name, outbound);
+#if defined(OUTPUT_COMPRESSION) && defined(OFFER_OUTPUT_COMPRESSION)
+    if (!outbound) {
+	static char offer[3] = {TN_IAC, TN_WILL, TN_COMPRESS2};
+
+	enqueue_output(nh, offer, sizeof(offer), 0, 1);
+	h->compress_offered = 1;
+    }
+#endif
     h->shandle = server_new_connection(sl, nh, outbound);
+    return h->shandle;
 }
 
 static void
@@ -414,44 +823,116 @@ get_pocket_descriptors()
 }
 
 static void
-accept_new_connection(nlistener * l)
+accept_named(void *data, const char *name)
+{
+    naccept *a = data;
+
+    a->name = str_dup(name);
+}
+
+/* Hand over the accepted connections whose names have come in.  This is not
+ * done in accept_named() itself, which may be called from anywhere.
+ */
+static void
+finish_accepts(void)
+{
+    naccept *a, **aa = &all_naccepts;
+
+    while ((a = *aa))
+	if (!a->name)
+	    aa = &a->next;
+	else {
+	    *aa = a->next;
+	    if (a->l)
+		make_new_connection(a->l->slistener, a->rfd, a->wfd,
+				    a->l->name, a->name, 0);
+	    else
+		proto_close_connection(a->rfd, a->wfd);
+	    free_str(a->name);
+	    myfree(a, M_NETWORK);
+	}
+    all_naccepts_tail = aa;
+}
+
+/* Accept up to L->batch waiting connections on FD, one of L's sockets.
+ * Stops early once there are none left, or when out of descriptors (after
+ * turning one connection away), since more would only be turned away too.
+ */
+static void
+accept_new_connections(nlistener * l, int fd)
 {
     network_handle nh;
     nhandle *h;
-    int rfd, wfd, i;
+    int rfd, wfd, i, count;
     const char *host_name;
+    double start, usecs;
+
+    for (count = 0; count < l->batch; count++) {
+	if (!spare_naccept)
+	    spare_naccept = mymalloc(sizeof(naccept), M_NETWORK);
+	spare_naccept->name = 0;
+	start = usec_now();
+	switch (proto_accept_connection(fd, &rfd, &wfd, &host_name,
+					accept_named, spare_naccept)) {
+	case PA_OKAY:
+	    usecs = usec_now() - start;
+	    l->accept_call_usecs += usecs;
+	    if (usecs > l->max_accept_call_usecs)
+		l->max_accept_call_usecs = usecs;
+	    l->accepted++;
+	    if (host_name)
+		make_new_connection(l->slistener, rfd, wfd, l->name,
+				    host_name, 0);
+	    else {
+		naccept *a = spare_naccept;
+
+		spare_naccept = 0;
+		a->next = 0;
+		a->l = l;
+		a->rfd = rfd;
+		a->wfd = wfd;
+		*all_naccepts_tail = a;
+		all_naccepts_tail = &a->next;
+	    }
+	    continue;
+
+	case PA_FULL:
+	    for (i = 0; i < proto.pocket_size; i++)
+		close(pocket_descriptors[i]);
+	    if (proto_accept_connection(fd, &rfd, &wfd, &host_name, 0, 0)
+		!= PA_OKAY)
+		errlog("Can't accept connection even by emptying pockets!\n");
+	    else {
+		nh.ptr = h = new_nhandle(rfd, wfd, l->name, host_name, 0);
+		server_refuse_connection(l->slistener, nh);
+		close_nhandle(h);
+	    }
+	    get_pocket_descriptors();
+	    break;
 
-    switch (proto_accept_connection(l->fd, &rfd, &wfd, &host_name)) {
-    case PA_OKAY:
-	make_new_connection(l->slistener, rfd, wfd, l->name, host_name, 0);
-	break;
+	case PA_EMPTY:
+	    break;
 
-    case PA_FULL:
-	for (i = 0; i < proto.pocket_size; i++)
-	    close(pocket_descriptors[i]);
-	if (proto_accept_connection(l->fd, &rfd, &wfd, &host_name) != PA_OKAY)
-	    errlog("Can't accept connection even by emptying pockets!\n");
-	else {
-	    nh.ptr = h = new_nhandle(rfd, wfd, l->name, host_name, 0);
-	    server_refuse_connection(l->slistener, nh);
-	    close_nhandle(h);
+	case PA_OTHER:
+	    /* Do nothing.  The protocol implementation has already logged it. */
+	    break;
 	}
-	get_pocket_descriptors();
 	break;
+    }
 
-    case PA_OTHER:
-	/* Do nothing.  The protocol implementation has already logged it. */
-	break;
+    if (count > 0) {
+	l->batches++;
+	if (count > l->largest_batch)
+	    l->largest_batch = count;
+	if (count == l->batch)
+	    l->full_batches++;
     }
 }
 
 static int
-enqueue_output(network_handle nh, const char *line, int line_length,
-	       int add_eol, int flush_ok)
+enqueue_chunk(nhandle * h, out_chunk * c, int flush_ok)
 {
-    nhandle *h = nh.ptr;
-    int length = line_length + (add_eol ? eol_length : 0);
-    char *buffer;
+    int length = c->length;
     text_block *block;
 
     if (h->output_length != 0
@@ -473,14 +954,7 @@ enqueue_output(network_handle nh, const char *line, int line_length,
 	if (h->output_head == 0)
 	    h->output_tail = &(h->output_head);
     }
-    buffer = (char *) mymalloc(length * sizeof(char), M_NETWORK);
-    block = (text_block *) mymalloc(sizeof(text_block), M_NETWORK);
-    memcpy(buffer, line, line_length);
-    if (add_eol)
-	memcpy(buffer + line_length, proto.eol_out_string, eol_length);
-    block->buffer = block->start = buffer;
-    block->length = length;
-    block->next = 0;
+    block = new_text_block(c);
     *(h->output_tail) = block;
     h->output_tail = &(block->next);
     h->output_length += length;
@@ -488,6 +962,17 @@ enqueue_output(network_handle nh, const char *line, int line_length,
     return 1;
 }
 
+static int
+enqueue_output(network_handle nh, const char *line, int line_length,
+	       int add_eol, int flush_ok)
+{
+    out_chunk *c = new_out_chunk(line, line_length, add_eol);
+    int result = enqueue_chunk(nh.ptr, c, flush_ok);
+
+    release_out_chunk(c);
+    return result;
+}
+
 
 /*************************
  * External entry points *
@@ -513,6 +998,7 @@ network_initialize(int argc, char **argv, Var * desc)
 
     eol_length = strlen(proto.eol_out_string);
     get_pocket_descriptors();
+    init_input_ok();
 
     /* we don't care about SIGPIPE, we notice it in mplex_wait() and write() */
     signal(SIGPIPE, SIG_IGN);
@@ -530,9 +1016,15 @@ network_make_listener(server_listener sl, Var desc,
 
     if (e == E_NONE) {
 	nl->ptr = l = mymalloc(sizeof(nlistener), M_NETWORK);
-	l->fd = fd;
+	l->fds[0] = fd;
+	for (l->nfds = 1; l->nfds < LISTEN_SHARDS; l->nfds++)
+	    if (!proto_share_listener(fd, &l->fds[l->nfds]))
+		break;
+	l->batch = 1;
 	l->slistener = sl;
 	l->name = str_dup(*name);
+	l->accepted = l->batches = l->full_batches = l->largest_batch = 0;
+	l->accept_call_usecs = l->max_accept_call_usecs = 0;
 	if (all_nlisteners)
 	    all_nlisteners->prev = &(l->next);
 	l->next = all_nlisteners;
@@ -546,8 +1038,51 @@ int
 network_listen(network_listener nl)
 {
     nlistener *l = nl.ptr;
+    int i, ok = 1;
 
-    return proto_listen(l->fd);
+    /* Draining a batch relies on the protocol returning PA_EMPTY rather than
+     * blocking, which in turn needs non-blocking listening sockets.
+     */
+    if (proto.accept_batch > 1) {
+	l->batch = proto.accept_batch;
+	for (i = 0; i < l->nfds; i++)
+	    if (!network_set_nonblocking(l->fds[i]))
+		l->batch = 1;
+    }
+    for (i = 0; i < l->nfds && ok; i++)
+	ok = proto_listen(l->fds[i]);
+    return ok;
+}
+
+Var
+network_listener_stats(network_listener nl)
+{
+    nlistener *l = nl.ptr;
+    static const char *names[] = {
+	"sockets", "accepted", "batches", "largest-batch", "full-batches",
+	"mean-accept-call-usecs", "max-accept-call-usecs"
+    };
+    int values[Arraysize(names)];
+    Var r, pair;
+    int i;
+
+    values[0] = l->nfds;
+    values[1] = l->accepted;
+    values[2] = l->batches;
+    values[3] = l->largest_batch;
+    values[4] = l->full_batches;
+    values[5] = l->accepted ? l->accept_call_usecs / l->accepted : 0;
+    values[6] = l->max_accept_call_usecs;
+
+    r = new_list(Arraysize(names));
+    for (i = 0; i < Arraysize(names); i++) {
+	r.v.list[i + 1] = pair = new_list(2);
+	pair.v.list[1].type = TYPE_STR;
+	pair.v.list[1].v.str = str_dup(names[i]);
+	pair.v.list[2].type = TYPE_INT;
+	pair.v.list[2].v.num = values[i];
+    }
+    return r;
 }
 
 int
@@ -563,12 +1098,37 @@ network_send_bytes(network_handle nh, const char *buffer, int buflen,
     return enqueue_output(nh, buffer, buflen, 0, flush_ok);
 }
 
+network_chunk
+network_line_chunk(const char *line)
+{
+    network_chunk nc;
+
+    nc.ptr = new_out_chunk(line, strlen(line), 1);
+    return nc;
+}
+
+int
+network_send_chunk(network_handle nh, network_chunk nc, int flush_ok)
+{
+    return enqueue_chunk(nh.ptr, nc.ptr, flush_ok);
+}
+
+void
+network_release_chunk(network_chunk nc)
+{
+    release_out_chunk(nc.ptr);
+}
+
 int
 network_buffered_output_length(network_handle nh)
 {
     nhandle *h = nh.ptr;
 
+#ifdef OUTPUT_COMPRESSION
+    return h->output_length + h->zout_length;
+#else
     return h->output_length;
+#endif
 }
 
 void
@@ -587,19 +1147,29 @@ network_resume_input(network_handle nh)
     h->input_suspended = 0;
 }
 
+#ifdef OUTBOUND_NETWORK
+static void expire_pconnects(void);
+#endif
+
 int
 network_process_io(int timeout)
 {
     nhandle *h, *hnext;
     nlistener *l;
+    int i;
 
+#ifdef OUTBOUND_NETWORK
+    expire_pconnects();
+#endif
+    finish_accepts();
     mplex_clear();
     for (l = all_nlisteners; l; l = l->next)
-	mplex_add_reader(l->fd);
+	for (i = 0; i < l->nfds; i++)
+	    mplex_add_reader(l->fds[i]);
     for (h = all_nhandles; h; h = h->next) {
 	if (!h->input_suspended)
 	    mplex_add_reader(h->rfd);
-	if (h->output_head)
+	if (output_pending(h))
 	    mplex_add_writer(h->wfd);
     }
     add_registered_fds();
@@ -608,8 +1178,9 @@ network_process_io(int timeout)
 	return 0;
     else {
 	for (l = all_nlisteners; l; l = l->next)
-	    if (mplex_is_readable(l->fd))
-		accept_new_connection(l);
+	    for (i = 0; i < l->nfds; i++)
+		if (mplex_is_readable(l->fds[i]))
+		    accept_new_connections(l, l->fds[i]);
 	for (h = all_nhandles; h; h = hnext) {
 	    hnext = h->next;
 	    if ((mplex_is_readable(h->rfd) && !pull_input(h))
@@ -619,6 +1190,7 @@ network_process_io(int timeout)
 	    }
 	}
 	check_registered_fds();
+	finish_accepts();
 	return 1;
     }
 }
@@ -656,11 +1228,29 @@ network_set_connection_binary(network_handle nh, int do_binary)
        /* No network-specific connection options */
 
 #elif NETWORK_PROTOCOL == NP_TCP
-#  define NETWORK_CO_TABLE(DEFINE, nh, value, _)		\
+#  ifdef OUTPUT_COMPRESSION
+#    define NETWORK_CO_TABLE(DEFINE, nh, value, _)		\
+       DEFINE(client-echo, _, TYPE_INT, num,			\
+	      ((nhandle *)nh.ptr)->client_echo,			\
+	      network_set_client_echo(nh, is_true(value));)	\
+       DEFINE(compress, _, TYPE_INT, num,			\
+	      ((nhandle *)nh.ptr)->zstream != 0,		\
+	      network_set_compression(nh, is_true(value));)	\
+       DEFINE(compressed-bytes, _, TYPE_INT, num,		\
+	      byte_count(((nhandle *)nh.ptr)->zbytes_out),	\
+	      return 0;)					\
+       DEFINE(uncompressed-bytes, _, TYPE_INT, num,		\
+	      byte_count(((nhandle *)nh.ptr)->zbytes_in),	\
+	      return 0;)					\
+
+#  else
+#    define NETWORK_CO_TABLE(DEFINE, nh, value, _)		\
        DEFINE(client-echo, _, TYPE_INT, num,			\
 	      ((nhandle *)nh.ptr)->client_echo,			\
 	      network_set_client_echo(nh, is_true(value));)	\
 
+#  endif
+
 void
 network_set_client_echo(network_handle nh, int is_on)
 {
@@ -683,6 +1273,19 @@ network_set_client_echo(network_handle nh, int is_on)
     enqueue_output(nh, telnet_cmd, 3, 0, 1);
 }
 
+#ifdef OUTPUT_COMPRESSION
+void
+network_set_compression(network_handle nh, int is_on)
+{
+    nhandle *h = nh.ptr;
+
+    if (is_on)
+	(void) start_compression(h);
+    else
+	stop_compression(h);
+}
+#endif
+
 #else /* NETWORK_PROTOCOL == NP_SINGLE */
 
 #  error "NP_SINGLE ???"
@@ -692,19 +1295,179 @@ network_set_client_echo(network_handle nh, int is_on)
 
 #ifdef OUTBOUND_NETWORK
 
+/* Outbound connections whose connect() is still in progress.  Each one's
+ * descriptor is registered for writing; when it becomes writable the attempt
+ * has either succeeded or failed, and proto_finish_connection() says which.
+ * Before that, while the remote address is still being looked up, RFD and
+ * WFD are -1 and the protocol calls connect_started() when it is known.
+ */
+typedef struct pconnect {
+    struct pconnect *next, **prev;
+    int rfd, wfd;
+    time_t deadline;
+    const char *remote_name;
+    server_listener sl;
+    network_connect_callback done;	/* zero once abandoned */
+    void *data;
+} pconnect;
+
+static pconnect *all_pconnects = 0;
+
+static void
+unlink_pconnect(pconnect * pc)
+{
+    if (pc->wfd >= 0)
+	network_unregister_fd(pc->wfd);
+    *(pc->prev) = pc->next;
+    if (pc->next)
+	pc->next->prev = pc->prev;
+}
+
+static void
+free_pconnect(pconnect * pc)
+{
+    free_str(pc->remote_name);
+    myfree(pc, M_NETWORK);
+}
+
+/* Give up on PC without calling its callback. */
+static void
+drop_pconnect(pconnect * pc)
+{
+    unlink_pconnect(pc);
+    if (pc->wfd < 0)		/* freed by connect_started() */
+	pc->done = 0;
+    else {
+	proto_close_connection(pc->rfd, pc->wfd);
+	free_pconnect(pc);
+    }
+}
+
+static void
+connect_writable(int fd, void *data)
+{
+    pconnect *pc = data;
+    const char *local_name;
+    enum error e;
+    server_handle sh;
+
+    unlink_pconnect(pc);
+    e = proto_finish_connection(pc->wfd, &local_name);
+    sh.ptr = 0;
+    if (e == E_NONE)
+	sh = make_new_connection(pc->sl, pc->rfd, pc->wfd,
+				 local_name, pc->remote_name, 1);
+    (*pc->done) (pc->data, e, sh);
+    free_pconnect(pc);
+}
+
+static void
+connect_started(void *data, enum error e, int rfd, int wfd,
+		const char *local_name)
+{
+    pconnect *pc = data;
+    server_handle sh;
+
+    if (!pc->done) {
+	if (e == E_NONE)
+	    proto_close_connection(rfd, wfd);
+	free_pconnect(pc);
+	return;
+    }
+    if (e == E_NONE && !local_name) {
+	pc->rfd = rfd;
+	pc->wfd = wfd;
+	pc->deadline = time(0)
+	    + server_int_option("outbound_connect_timeout", 5);
+	network_register_fd(wfd, 0, connect_writable, pc);
+	return;
+    }
+    unlink_pconnect(pc);
+    sh.ptr = 0;
+    if (e == E_NONE)
+	sh = make_new_connection(pc->sl, rfd, wfd,
+				 local_name, pc->remote_name, 1);
+    (*pc->done) (pc->data, e, sh);
+    free_pconnect(pc);
+}
+
+static void
+expire_pconnects(void)
+{
+    time_t now = time(0);
+    pconnect *pc, *next;
+
+    for (pc = all_pconnects; pc; pc = next) {
+	network_connect_callback done = pc->done;
+	void *data = pc->data;
+	server_handle sh;
+
+	next = pc->next;
+	if (now < pc->deadline)
+	    continue;
+	drop_pconnect(pc);
+	sh.ptr = 0;
+	(*done) (data, E_INVARG, sh);
+    }
+}
+
 enum error
-network_open_connection(Var arglist, server_listener sl)
+network_open_connection(Var arglist, server_listener sl,
+			network_connect_callback done, void *data)
 {
     int rfd, wfd;
     const char *local_name, *remote_name;
     enum error e;
+    pconnect *pc;
+
+    pc = mymalloc(sizeof(pconnect), M_NETWORK);
+    e = proto_open_connection(arglist, &rfd, &wfd, &local_name, &remote_name,
+			      connect_started, pc);
+    if (e != E_NONE) {
+	myfree(pc, M_NETWORK);
+	return e;
+    }
 
-    e = proto_open_connection(arglist, &rfd, &wfd, &local_name, &remote_name);
-    if (e == E_NONE)
-	make_new_connection(sl, rfd, wfd,
-			    local_name, remote_name, 1);
+    if (rfd >= 0 && local_name) {	/* Already connected */
+	server_handle sh;
 
-    return e;
+	myfree(pc, M_NETWORK);
+	sh = make_new_connection(sl, rfd, wfd, local_name, remote_name, 1);
+	(*done) (data, E_NONE, sh);
+	return E_NONE;
+    }
+    pc->rfd = rfd;
+    pc->wfd = wfd;
+    /* A lookup that takes too long fails just like a connection that does */
+    pc->deadline = time(0)
+	+ server_int_option(rfd < 0 ? "name_lookup_timeout"
+			    : "outbound_connect_timeout", 5);
+    pc->remote_name = str_dup(remote_name);
+    pc->sl = sl;
+    pc->done = done;
+    pc->data = data;
+
+    pc->prev = &all_pconnects;
+    pc->next = all_pconnects;
+    if (all_pconnects)
+	all_pconnects->prev = &(pc->next);
+    all_pconnects = pc;
+    if (wfd >= 0)
+	network_register_fd(wfd, 0, connect_writable, pc);
+
+    return E_NONE;
+}
+
+void
+network_abort_connection(void *data)
+{
+    pconnect *pc;
+
+    for (pc = all_pconnects; pc; pc = pc->next)
+	if (pc->data == data) {
+	    drop_pconnect(pc);
+	    return;
+	}
 }
 #endif
 
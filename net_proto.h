@@ -42,6 +42,12 @@ struct proto {
 				 * being available. */
     const char *eol_out_string;	/* The characters to add to the end of each
 				 * line of output on connections. */
+    int accept_batch;		/* Maximum number of connections to accept
+				 * from a listening point each time it is
+				 * found ready.  Must be 1 unless
+				 * proto_accept_connection() returns PA_EMPTY
+				 * rather than blocking when no connection is
+				 * waiting. */
 };
 
 extern const char *proto_name(void);
@@ -97,19 +103,32 @@ extern int proto_listen(int fd);
 				 * proto_make_listener().
 				 */
 
+extern int proto_share_listener(int fd, int *new_fd);
+				/* Make another listening point on the same
+				 * local address as FD, which was returned by
+				 * proto_make_listener(), such that the system
+				 * divides new connections between the two.
+				 * Returns true and sets *NEW_FD if successful,
+				 * false if that isn't possible.
+				 */
+
 
 enum proto_accept_error {
-    PA_OKAY, PA_FULL, PA_OTHER
+    PA_OKAY, PA_FULL, PA_EMPTY, PA_OTHER
 };
 
+typedef void (*proto_name_callback) (void *data, const char *name);
+
 extern enum proto_accept_error
  proto_accept_connection(int listener_fd,
 			 int *read_fd, int *write_fd,
-			 const char **name);
+			 const char **name,
+			 proto_name_callback named, void *data);
 				/* Accept a new connection on LISTENER_FD,
 				 * returning PA_OKAY if successful, PA_FULL if
 				 * unsuccessful only because there aren't
-				 * enough file descriptors available, and
+				 * enough file descriptors available, PA_EMPTY
+				 * if no connection was waiting, and
 				 * PA_OTHER for other failures (in which case a
 				 * message should have been output to the
 				 * server log).  LISTENER_FD was returned by a
@@ -119,14 +138,26 @@ extern enum proto_accept_error
 				 * and output for the new connection can be
 				 * done, and *NAME should be a human-readable
 				 * string identifying this connection.
+				 *
+				 * If NAMED is non-zero and finding the name
+				 * would take a while, *NAME may instead be set
+				 * to zero; the protocol then calls NAMED with
+				 * DATA and the name once it is known, and the
+				 * connection should not be used until then.
 				 */
 
 #ifdef OUTBOUND_NETWORK
 
+typedef void (*proto_open_callback) (void *data, enum error e,
+				     int read_fd, int write_fd,
+				     const char *local_name);
+
 extern enum error proto_open_connection(Var arglist,
 					int *read_fd, int *write_fd,
 					const char **local_name,
-					const char **remote_name);
+					const char **remote_name,
+					proto_open_callback opened,
+					void *data);
 				/* The given MOO arguments should be used as a
 				 * specification of a remote network connection
 				 * to be opened.  If the arguments are OK for
@@ -138,6 +169,29 @@ extern enum error proto_open_connection(Var arglist,
 				 * *REMOTE_NAME a string naming the remote
 				 * endpoint, and E_NONE returned.  Otherwise,
 				 * an appropriate error should be returned.
+				 *
+				 * If the connection attempt is still in
+				 * progress on return, *LOCAL_NAME is set to
+				 * zero instead; the caller should wait until
+				 * *WRITE_FD becomes writable and then call
+				 * proto_finish_connection().
+				 *
+				 * If OPENED is non-zero and finding the remote
+				 * address would take a while, *READ_FD and
+				 * *WRITE_FD may instead be set to -1; the
+				 * protocol then calls OPENED with DATA and
+				 * what proto_open_connection() would have
+				 * returned and set once the attempt has been
+				 * started (or has failed).  *REMOTE_NAME is
+				 * set in either case.
+				 */
+
+extern enum error proto_finish_connection(int fd, const char **local_name);
+				/* Complete a connection attempt left in
+				 * progress by proto_open_connection().  If it
+				 * succeeded, set *LOCAL_NAME as that function
+				 * would and return E_NONE.  Otherwise, close
+				 * FD and return an appropriate error.
 				 */
 
 #endif				/* OUTBOUND_NETWORK */
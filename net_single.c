@@ -21,9 +21,11 @@
 #include "my-unistd.h"
 
 #include "config.h"
+#include "list.h"
 #include "log.h"
 #include "network.h"
 #include "server.h"
+#include "storage.h"
 #include "streams.h"
 #include "structures.h"
 #include "utils.h"
@@ -80,6 +82,12 @@ network_listen(network_listener nl)
     return 1;
 }
 
+Var
+network_listener_stats(network_listener nl)
+{
+    return new_list(0);
+}
+
 int
 network_send_line(network_handle nh, const char *line, int flush_ok)
 {
@@ -100,6 +108,27 @@ network_send_bytes(network_handle nh, const char *buffer, int buflen,
     return 1;
 }
 
+network_chunk
+network_line_chunk(const char *line)
+{
+    network_chunk nc;
+
+    nc.ptr = (void *) str_dup(line);
+    return nc;
+}
+
+int
+network_send_chunk(network_handle nh, network_chunk nc, int flush_ok)
+{
+    return network_send_line(nh, nc.ptr, flush_ok);
+}
+
+void
+network_release_chunk(network_chunk nc)
+{
+    free_str(nc.ptr);
+}
+
 int
 network_buffered_output_length(network_handle nh)
 {
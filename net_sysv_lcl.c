@@ -125,6 +125,7 @@ proto_initialize(struct proto *proto, Var * desc, int argc, char **argv)
     proto->believe_eof = 0;
 #endif
     proto->eol_out_string = "\n";
+    proto->accept_batch = 1;
 
     if (argc > 1)
 	return 0;
@@ -205,9 +206,16 @@ proto_listen(int fd)
     return 0;
 }
 
+int
+proto_share_listener(int fd, int *new_fd)
+{
+    return 0;
+}
+
 enum proto_accept_error
 proto_accept_connection(int listener_fd, int *read_fd, int *write_fd,
-			const char **name)
+			const char **name,
+			proto_name_callback named, void *data)
 {
     /* There is input available on listener_fd; read up to 1K of it and try
      * to parse a line like this from it:
@@ -82,6 +82,7 @@ proto_initialize(struct proto *proto, Var * desc, int argc, char **argv)
     proto->pocket_size = 1;
     proto->believe_eof = 1;
     proto->eol_out_string = "\r\n";
+    proto->accept_batch = 1;
 
     if (!tcp_arguments(argc, argv, &port))
 	return 0;
@@ -163,6 +164,12 @@ proto_listen(int fd)
     return 1;
 }
 
+int
+proto_share_listener(int fd, int *new_fd)
+{
+    return 0;
+}
+
 static int
 set_rw_able(int fd)
 {
@@ -180,7 +187,8 @@ set_rw_able(int fd)
 
 enum proto_accept_error
 proto_accept_connection(int listener_fd, int *read_fd, int *write_fd,
-			const char **name)
+			const char **name,
+			proto_name_callback named, void *data)
 {
     int timeout = server_int_option("name_lookup_timeout", 5);
     int fd;
@@ -253,7 +261,8 @@ timeout_proc(Timer_ID id, Timer_Data data)
 
 enum error
 proto_open_connection(Var arglist, int *read_fd, int *write_fd,
-		      const char **local_name, const char **remote_name)
+		      const char **local_name, const char **remote_name,
+		      proto_open_callback opened, void *data)
 {
     /* These are `static' rather than `volatile' because I can't cope with
      * getting all those nasty little parameter-passing rules right.  This
@@ -359,6 +368,16 @@ proto_open_connection(Var arglist, int *read_fd, int *write_fd,
 
     return E_NONE;
 }
+
+enum error
+proto_finish_connection(int fd, const char **local_name)
+{
+    /* TLI connections are complete when proto_open_connection() returns,
+     * so there is never anything left to finish.
+     */
+    t_close(fd);
+    return E_QUOTA;
+}
 #endif				/* OUTBOUND_NETWORK */
 
 char rcsid_net_sysv_tcp[] = "$Id$";
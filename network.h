@@ -36,6 +36,10 @@ typedef struct {		/* Network's handle on a listening point */
     void *ptr;
 } network_listener;
 
+typedef struct {		/* Network's handle on a piece of output */
+    void *ptr;
+} network_chunk;
+
 #include "server.h"		/* Include this *after* defining the types */
 
 extern const char *network_protocol_name(void);
@@ -93,6 +97,12 @@ extern int network_listen(network_listener nl);
 				 * returning true iff this is now possible.
 				 */
 
+extern Var network_listener_stats(network_listener nl);
+				/* Return a list of {NAME, VALUE} pairs
+				 * describing how connections have been
+				 * accepted on the given listening point.
+				 */
+
 extern int network_send_line(network_handle nh, const char *line,
 			     int flush_ok);
 				/* The given line should be queued for output
@@ -124,6 +134,29 @@ extern int network_send_bytes(network_handle nh,
 				 * fail if FLUSH_OK is false.
 				 */
 
+extern network_chunk network_line_chunk(const char *line);
+				/* Returns the given line, with the bytes that
+				 * end a line added as for network_send_line(),
+				 * as a chunk of output that can be queued on
+				 * any number of connections by calls to
+				 * network_send_chunk() without being copied.
+				 * The caller must give the chunk back with
+				 * network_release_chunk() when done with it.
+				 */
+
+extern int network_send_chunk(network_handle nh, network_chunk nc,
+			      int flush_ok);
+				/* Queues the given chunk for output on the
+				 * specified connection, with FLUSH_OK and the
+				 * result as for network_send_line().
+				 */
+
+extern void network_release_chunk(network_chunk nc);
+				/* Gives back a chunk from network_line_chunk().
+				 * It is freed once all of the connections it
+				 * was queued on have written it.
+				 */
+
 extern int network_buffered_output_length(network_handle nh);
 				/* Returns the number of bytes of output
 				 * currently queued up on the given connection.
@@ -191,22 +224,38 @@ extern int network_set_connection_option(network_handle nh,
 #ifdef OUTBOUND_NETWORK
 #include "structures.h"
 
-extern enum error network_open_connection(Var arglist, server_listener sl);
+typedef void (*network_connect_callback) (void *data, enum error e,
+					  server_handle sh);
+
+extern enum error network_open_connection(Var arglist, server_listener sl,
+					  network_connect_callback done,
+					  void *data);
 				/* The given MOO arguments should be used as a
 				 * specification of a remote network connection
-				 * to be made.  If the arguments are OK and the
-				 * connection is successfully made, it should
-				 * be treated as if it were a normal connection
+				 * to be made.  If the arguments are bad or the
+				 * attempt fails at once, an appropriate error
+				 * is returned.  Otherwise E_NONE is returned
+				 * and the connection is completed without
+				 * blocking the server; when it is, DONE is
+				 * called with DATA and either E_NONE and the
+				 * server handle of the new connection, which
+				 * is treated as if it were a normal connection
 				 * accepted by the server (e.g., a network
-				 * handle should be created for it, the
-				 * function server_new_connection should be
-				 * called, etc.) and E_NONE should be returned.
-				 * Otherwise, some other appropriate error
-				 * value should be returned.  The caller of
-				 * this function is responsible for freeing the
-				 * MOO value in `arglist'.  This function need
-				 * not be supplied if OUTBOUND_NETWORK is not
-				 * defined.
+				 * handle is created for it, the function
+				 * server_new_connection is called, etc.), or
+				 * the error that ended the attempt.  DONE may
+				 * be called before this function returns.  SL
+				 * must remain valid until DONE is called.  The
+				 * caller of this function is responsible for
+				 * freeing the MOO value in `arglist'.  This
+				 * function need not be supplied if
+				 * OUTBOUND_NETWORK is not defined.
+				 */
+
+extern void network_abort_connection(void *data);
+				/* Give up on the connection attempt begun by
+				 * the call to network_open_connection() with
+				 * the given DATA; its DONE will not be called.
 				 */
 
 #endif
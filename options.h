@@ -27,6 +27,23 @@
 
 /* #define LOG_COMMANDS */
 
+/******************************************************************************
+ * When the server is given a log file (-l), the writing is done by a separate
+ * process, so that a slow or full disk holding the log cannot stall the
+ * server.  The server passes each line down a pipe; if the pipe is full, up to
+ * LOG_BUFFER_SIZE bytes are held in memory and further lines are dropped
+ * (and counted, with a note in the log once there is room again).  Set
+ * LOG_BUFFER_SIZE to 0 to have the server write the log itself, as it used to.
+ *
+ * Define LOG_ROTATE_SIZE to have the log file renamed to FILE.1 whenever it
+ * grows past that many bytes, and a new FILE started; older logs are moved to
+ * FILE.2 and so on, up to FILE.LOG_ROTATE_KEEP.
+ */
+
+#define LOG_BUFFER_SIZE		(1024 * 1024)
+/* #define LOG_ROTATE_SIZE	(64 * 1024 * 1024) */
+#define LOG_ROTATE_KEEP		5
+
 /******************************************************************************
  * The server normally forks a separate process to make database checkpoints;
  * the original process continues to service user commands as usual while the
@@ -41,6 +58,90 @@
 
 /* #define UNFORKED_CHECKPOINTS */
 
+/******************************************************************************
+ * Define BACKGROUND_CHECKPOINTS to have the server write each full checkpoint
+ * itself, without forking, in slices of at most BACKGROUND_CHECKPOINT_SLICE
+ * milliseconds between rounds of tasks.  The checkpoint still holds the
+ * database as it was when the checkpoint began: each object a task changes
+ * before it has been written has its old version set aside first.  The file
+ * and the #0:checkpoint_started/checkpoint_finished calls are the same as
+ * for forked checkpoints.  Incremental checkpoints are written on the spot.
+ */
+
+/* #define BACKGROUND_CHECKPOINTS */
+#define BACKGROUND_CHECKPOINT_SLICE 50
+
+/******************************************************************************
+ * At startup the server compiles every verb program in the database.  It
+ * forks up to LOAD_COMPILE_WORKERS - 1 child processes to share that work,
+ * each handing its compiled programs back through a temporary file; 0 means
+ * one process per online CPU, and 1 compiles everything in the server itself.
+ */
+
+#define LOAD_COMPILE_WORKERS 0
+
+/******************************************************************************
+ * Define LAZY_PROGRAMS to skip that compilation for databases in the current
+ * format: the server only notes where each verb's source is, keeps the file
+ * open, and compiles a program the first time the verb is called, listed or
+ * disassembled.  Verbs no one has changed are written back out by copying
+ * their source, so checkpoints never need to compile anything.  At most
+ * LAZY_PROGRAM_CACHE programs loaded this way are kept (0 means no limit);
+ * beyond that, the least recently used ones that no task is running are
+ * freed again.  A verb that doesn't parse is only reported when it is used.
+ * memory_usage("programs") returns {indexed, loaded, loads, evictions}.
+ */
+
+/* #define LAZY_PROGRAMS */
+#define LAZY_PROGRAM_CACHE 20000
+
+/******************************************************************************
+ * eval() and set_verb_code() keep the programs compiled from the last
+ * COMPILE_CACHE_SIZE different sources that parsed without errors, and use
+ * one again when the same source comes back; 0 turns this off.
+ * memory_usage("compiled") returns {entries, hits, misses, flushes}.
+ */
+
+#define COMPILE_CACHE_SIZE 500
+
+/******************************************************************************
+ * Each time around its main loop, the server runs ready tasks, taking each
+ * from whichever task queue has used the least time, until none are left or
+ * TASK_PASS_BUDGET milliseconds have gone by (0 means one task per pass),
+ * and only then waits for network activity again.  After every
+ * TASK_PASS_IO_INTERVAL tasks in a pass, it handles whatever network input
+ * and output is already pending, without waiting.  A pass also ends early
+ * for a shutdown or checkpoint.  memory_usage("tasks") returns {passes,
+ * tasks, most tasks in one pass}.
+ */
+
+#define TASK_PASS_BUDGET 20
+#define TASK_PASS_IO_INTERVAL 50
+
+/******************************************************************************
+ * A full dump of the database is split by object number into parts that are
+ * written at the same time by up to CHECKPOINT_WORKERS processes (forked by
+ * the checkpointer, or by the server at shutdown) and then concatenated; 0
+ * means one per online CPU.  If DUMP_COMPRESSION_LEVEL is between 1 and 9,
+ * each part is also gzip-compressed at that level, by the process writing it.
+ * The server reads compressed and uncompressed databases alike, but other
+ * tools will need to gunzip them first.  Compression requires zlib; see
+ * `./configure --with-zlib'.  Incremental checkpoints and panic dumps are
+ * always written uncompressed by a single process.
+ */
+
+#define CHECKPOINT_WORKERS 0
+#define DUMP_COMPRESSION_LEVEL 0
+
+/******************************************************************************
+ * With $server_options.redo_log set, the redo log kept between checkpoints is
+ * written by a separate process.  If that process falls more than
+ * REDO_BUFFER_SIZE bytes behind the server, the server stops logging until
+ * the next checkpoint.
+ */
+
+#define REDO_BUFFER_SIZE	(16 * 1024 * 1024)
+
 /******************************************************************************
  * If OUT_OF_BAND_PREFIX is defined as a non-empty string, then any lines of
  * input from any player that begin with that prefix will bypass both normal
@@ -206,6 +307,67 @@
 #define MAX_QUEUED_INPUT	MAX_QUEUED_OUTPUT
 #define DEFAULT_CONNECT_TIMEOUT	300
 
+/******************************************************************************
+ * LISTEN_BACKLOG is how many new connections the operating system may hold on
+ * each listening point until the server gets around to accepting them.  When
+ * a listening point is ready, the server accepts up to ACCEPT_BATCH of the
+ * waiting connections before going on (NS_SYSV protocols always take just
+ * one), so that a crowd reconnecting after a restart is let in quickly.
+ *
+ * If LISTEN_SHARDS is greater than 1 and the system supports SO_REUSEPORT,
+ * each TCP listening point is made of that many sockets bound to the same
+ * port, each with its own backlog; the kernel divides new connections among
+ * them.
+ *
+ * listeners(1) adds to each entry a list of {NAME, VALUE} pairs counting the
+ * connections accepted, the number of batches and how many stopped at
+ * ACCEPT_BATCH (leaving connections waiting), and the mean and greatest time
+ * spent in the accept call for one connection, in microseconds.  These times
+ * do not include how long a connection waited in the backlog.
+ */
+
+#define LISTEN_BACKLOG		128
+#define ACCEPT_BATCH		32
+#define LISTEN_SHARDS		1
+
+/******************************************************************************
+ * With NETWORK_PROTOCOL NP_TCP, host names are looked up by a pool of
+ * NAME_LOOKUP_WORKERS subprocesses, so that up to that many lookups proceed at
+ * once; an incoming connection is handed to the MOO once its host name is
+ * known (or the lookup has failed or timed out), while the server goes on
+ * with other work.  The server caches up to NAME_CACHE_SIZE answers (0 turns
+ * the cache off), keeping a name for DEFAULT_NAME_LOOKUP_TTL seconds and a
+ * failed lookup for DEFAULT_NAME_LOOKUP_NEGATIVE_TTL; these can be overridden
+ * by defining `name_lookup_ttl' and `name_lookup_negative_ttl' on
+ * $server_options.  memory_usage("names") returns {cache hits, cached
+ * failures, misses, cache entries, lookups in progress, {counts of lookups
+ * answered in under 1ms, 10ms, 100ms, 1s, 10s, and longer}}.
+ */
+
+#define NAME_LOOKUP_WORKERS		4
+#define NAME_CACHE_SIZE			1024
+#define DEFAULT_NAME_LOOKUP_TTL		3600
+#define DEFAULT_NAME_LOOKUP_NEGATIVE_TTL	60
+
+/******************************************************************************
+ * When the server is built with zlib (see `configure --with-zlib') and
+ * NETWORK_PROTOCOL is NP_TCP, the output on a connection can be compressed
+ * using the telnet COMPRESS2 option (MCCP version 2), which many MUD clients
+ * understand.  set_connection_option(CONN, "compress", 1) sends the telnet
+ * subnegotiation that starts the compressed stream and compresses everything
+ * after it; setting it to 0 ends the stream.  connection_options() reports
+ * "compressed-bytes" and "uncompressed-bytes", the amount of output after
+ * and before compression.
+ *
+ * If OFFER_OUTPUT_COMPRESSION is defined, the server also offers COMPRESS2
+ * (IAC WILL COMPRESS2) on every new inbound connection and starts compressing
+ * as soon as the client agrees (IAC DO COMPRESS2).  Leave it undefined if
+ * clients that do not speak telnet may connect, since they would see the
+ * three bytes of the offer.
+ */
+
+/* #define OFFER_OUTPUT_COMPRESSION */
+
  /******************************************************************************
  * The File I/O extension adds several new builtins that allow the
  * manipulation of files from MOO code. Please read FileioDocs.txt for more
@@ -253,6 +415,17 @@
 
 #define PATTERN_CACHE_SIZE	20
 
+/******************************************************************************
+ * When matching an object name typed in a command, the server looks at the
+ * names and aliases of everything the player holds and everything in the
+ * player's location.  For a player or location holding at least
+ * MATCH_INDEX_MIN objects, the server keeps those names sorted, so that the
+ * matching ones are found by binary search instead of by looking up the
+ * `aliases' property of every object.  Set it to 0 to always look them all up.
+ */
+
+#define MATCH_INDEX_MIN		20
+
 /******************************************************************************
  * Prior to 1.8.4 property lookups were required on every reference to a
  * built-in property due to the possibility of that property being protected.
@@ -320,6 +493,16 @@
  */
 /* #define MEMO_STRLEN */
 
+/******************************************************************************
+ * Small lists, strings, floats and task/network records are normally carved
+ * out of size-class slabs rather than obtained from malloc() one at a time,
+ * which is both faster and less wasteful for typical MOO workloads.  The
+ * per-class counts are returned by memory_usage().  Comment this out to
+ * send every allocation to the system malloc().
+ ******************************************************************************
+ */
+#define SLAB_ALLOCATOR /* */
+
 /******************************************************************************
  * Define this option to prevent certain property names from being added on
  * objects. Useful to ensure forward compatibility.
@@ -447,6 +630,30 @@
 #  endif
 #endif
 
+#if defined(UNFORKED_CHECKPOINTS) && defined(BACKGROUND_CHECKPOINTS)
+#  error You cannot define both UNFORKED_CHECKPOINTS and BACKGROUND_CHECKPOINTS
+#endif
+
+#if DUMP_COMPRESSION_LEVEL > 0 && !defined(MOO_ZLIB)
+#  error You cannot set DUMP_COMPRESSION_LEVEL without zlib
+#endif
+
+#if NAME_LOOKUP_WORKERS < 1
+#  error NAME_LOOKUP_WORKERS must be at least 1
+#endif
+
+#if LISTEN_SHARDS < 1 || ACCEPT_BATCH < 1
+#  error LISTEN_SHARDS and ACCEPT_BATCH must be at least 1
+#endif
+
+#if defined(LOG_ROTATE_SIZE) && (LOG_BUFFER_SIZE <= 0 || LOG_ROTATE_KEEP < 1)
+#  error LOG_ROTATE_SIZE needs a positive LOG_BUFFER_SIZE and LOG_ROTATE_KEEP
+#endif
+
+#if defined(OFFER_OUTPUT_COMPRESSION) && (!defined(MOO_ZLIB) || NETWORK_PROTOCOL != NP_TCP)
+#  error You cannot define OFFER_OUTPUT_COMPRESSION without zlib and NP_TCP
+#endif
+
 #if (NETWORK_PROTOCOL == NP_LOCAL || NETWORK_PROTOCOL == NP_SINGLE) && defined(OUTBOUND_NETWORK)
 #  error You cannot define "OUTBOUND_NETWORK" with that "NETWORK_PROTOCOL"
 #endif
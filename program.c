@@ -15,9 +15,15 @@
     Pavel@Xerox.Com
  *****************************************************************************/
 
+#include "my-string.h"
+#include "my-time.h"
+
 #include "ast.h"
 #include "exceptions.h"
+#include "execute.h"
 #include "list.h"
+#include "log.h"
+#include "options.h"
 #include "parser.h"
 #include "program.h"
 #include "storage.h"
@@ -31,9 +37,8 @@ new_program(void)
 
     p->ref_count = 1;
     p->first_lineno = 1;
-    p->cached_lineno = 1;
-    p->cached_lineno_pc = 0;
-    p->cached_lineno_vec = MAIN_VECTOR;
+    p->dedup_hash = 0;
+    p->dedup_next = 0;
     return p;
 }
 
@@ -73,9 +78,11 @@ program_bytes(Program * p)
     for (i = 0; i < p->num_literals; i++)
 	count += value_bytes(p->literals[i]);
 
+    count += sizeof(Line_Entry) * p->main_vector.num_lines;
     count += sizeof(Bytecodes) * p->fork_vectors_size;
     for (i = 0; i < p->fork_vectors_size; i++)
-	count += p->fork_vectors[i].size;
+	count += p->fork_vectors[i].size
+	    + sizeof(Line_Entry) * p->fork_vectors[i].num_lines;
 
     count += sizeof(const char *) * p->num_var_names;
     for (i = 0; i < p->num_var_names; i++)
@@ -84,6 +91,337 @@ program_bytes(Program * p)
     return count;
 }
 
+/*********** Program sharing ***********/
+
+/* Verbs copied with @copy compile to identical programs; program_dedup()
+ * keeps one copy of each.  The table doesn't hold references: a program
+ * leaves it when free_program() drops its last one.
+ */
+
+static Program **dedup_table = 0;
+static unsigned dedup_size = 0;
+static unsigned dedup_count = 0;
+
+static int dedup_programs = 0;
+static int dedup_shared = 0;
+static int dedup_bytes_saved = 0;
+static clock_t dedup_ticks = 0;
+
+#define DEDUP_TABLE_SIZE_INITIAL 1021
+
+static unsigned
+hash_bytes(unsigned h, const void *ptr, int n)
+{
+    const unsigned char *s = ptr;
+
+    while (n-- > 0)
+	h = h * 33 + *s++;
+
+    return h;
+}
+
+static unsigned
+hash_bytecodes(unsigned h, Bytecodes * bc)
+{
+    h = hash_bytes(h, &bc->size, sizeof(bc->size));
+    return hash_bytes(h, bc->vector, bc->size);
+}
+
+static unsigned
+hash_program(Program * p)
+{
+    unsigned h = p->version * 31 + p->first_lineno;
+    unsigned i;
+
+    h = hash_bytecodes(h, &p->main_vector);
+    for (i = 0; i < p->fork_vectors_size; i++)
+	h = hash_bytecodes(h, &p->fork_vectors[i]);
+    for (i = 0; i < p->num_literals; i++) {
+	Var v = p->literals[i];
+
+	h = h * 31 + v.type;
+	if (v.type == TYPE_STR)
+	    h = hash_bytes(h, v.v.str, memo_strlen(v.v.str));
+	else if (v.type == TYPE_FLOAT)
+	    h = hash_bytes(h, v.v.fnum, sizeof(double));
+	else
+	    h = hash_bytes(h, &v.v.num, sizeof(v.v.num));
+    }
+    for (i = 0; i < p->num_var_names; i++)
+	h = hash_bytes(h, p->var_names[i], memo_strlen(p->var_names[i]));
+
+    return h ? h : 1;
+}
+
+static int
+same_bytecodes(Bytecodes * a, Bytecodes * b)
+{
+    return (a->numbytes_label == b->numbytes_label
+	    && a->numbytes_literal == b->numbytes_literal
+	    && a->numbytes_fork == b->numbytes_fork
+	    && a->numbytes_var_name == b->numbytes_var_name
+	    && a->numbytes_stack == b->numbytes_stack
+	    && a->size == b->size
+	    && a->max_stack == b->max_stack
+	    && !memcmp(a->vector, b->vector, a->size));
+}
+
+static int
+same_program(Program * a, Program * b)
+{
+    unsigned i;
+
+    if (a->version != b->version
+	|| a->first_lineno != b->first_lineno
+	|| a->num_literals != b->num_literals
+	|| a->fork_vectors_size != b->fork_vectors_size
+	|| a->num_var_names != b->num_var_names
+	|| !same_bytecodes(&a->main_vector, &b->main_vector))
+	return 0;
+    for (i = 0; i < a->fork_vectors_size; i++)
+	if (!same_bytecodes(&a->fork_vectors[i], &b->fork_vectors[i]))
+	    return 0;
+    for (i = 0; i < a->num_literals; i++)
+	if (a->literals[i].type != b->literals[i].type	/* no int/float coercion */
+	    || !equality(a->literals[i], b->literals[i], 1))
+	    return 0;
+    for (i = 0; i < a->num_var_names; i++)
+	if (strcmp(a->var_names[i], b->var_names[i]))
+	    return 0;
+
+    return 1;
+}
+
+static void
+dedup_rehash(unsigned new_size)
+{
+    Program **new_table = mymalloc(new_size * sizeof(Program *), M_PROGRAM);
+    Program *p, *next;
+    unsigned i;
+
+    for (i = 0; i < new_size; i++)
+	new_table[i] = 0;
+    for (i = 0; i < dedup_size; i++)
+	for (p = dedup_table[i]; p; p = next) {
+	    next = p->dedup_next;
+	    p->dedup_next = new_table[p->dedup_hash % new_size];
+	    new_table[p->dedup_hash % new_size] = p;
+	}
+    if (dedup_table)
+	myfree(dedup_table, M_PROGRAM);
+    dedup_table = new_table;
+    dedup_size = new_size;
+}
+
+Program *
+program_dedup(Program * prog)
+{
+    clock_t start = clock();
+    Program *p;
+    unsigned hash;
+
+    if (prog->dedup_hash)	/* already in the table */
+	return prog;
+
+    dedup_programs++;
+    hash = hash_program(prog);
+    if (dedup_table)
+	for (p = dedup_table[hash % dedup_size]; p; p = p->dedup_next)
+	    if (p->dedup_hash == hash && same_program(p, prog)) {
+		dedup_shared++;
+		dedup_bytes_saved += program_bytes(prog);
+		free_program(prog);
+		dedup_ticks += clock() - start;
+		return program_ref(p);
+	    }
+
+    if (dedup_count >= dedup_size)
+	dedup_rehash(dedup_size ? dedup_size * 2 + 1
+		     : DEDUP_TABLE_SIZE_INITIAL);
+    prog->dedup_hash = hash;
+    prog->dedup_next = dedup_table[hash % dedup_size];
+    dedup_table[hash % dedup_size] = prog;
+    dedup_count++;
+    dedup_ticks += clock() - start;
+
+    return prog;
+}
+
+static void
+dedup_remove(Program * prog)
+{
+    Program **pp;
+
+    for (pp = &dedup_table[prog->dedup_hash % dedup_size]; *pp;
+	 pp = &(*pp)->dedup_next)
+	if (*pp == prog) {
+	    *pp = prog->dedup_next;
+	    dedup_count--;
+	    return;
+	}
+}
+
+void
+program_dedup_log(void)
+{
+    oklog("PROGRAMS: %d of %d shared, %d bytes saved, %d ms\n",
+	  dedup_shared, dedup_programs, dedup_bytes_saved,
+	  (int) (dedup_ticks * 1000 / CLOCKS_PER_SEC));
+}
+
+/*********** Compiled-code cache ***********/
+
+/* Tools call eval() and set_verb_code() with the same sources over and
+ * over; parse_list_as_cached_program() remembers the last
+ * COMPILE_CACHE_SIZE sources that compiled cleanly and hands out further
+ * references to their programs.  Programs are never changed once built,
+ * so sharing one is as good as compiling it again.  A source that calls a
+ * builtin by name compiles differently once that name is registered, so
+ * registering a function empties the cache.
+ */
+
+typedef struct Compiled {
+    struct Compiled *next;	/* in its hash chain */
+    struct Compiled *older, *newer;
+    unsigned hash;
+    Var source;			/* list of strings */
+    Program *program;
+} Compiled;
+
+static Compiled **compiled_table = 0;
+static unsigned compiled_size = 0;
+static unsigned compiled_count = 0;
+static Compiled compiled_lru;	/* .newer is the oldest entry */
+
+static int compiled_hits = 0;
+static int compiled_misses = 0;
+static int compiled_flushes = 0;
+
+static unsigned
+hash_source(Var code)
+{
+    unsigned h = current_db_version;
+    int i;
+
+    for (i = 1; i <= code.v.list[0].v.num; i++) {
+	const char *line = code.v.list[i].v.str;
+
+	h = hash_bytes(h, line, memo_strlen(line));
+	h = h * 33 + '\n';
+    }
+
+    return h;
+}
+
+static void
+compiled_unlink(Compiled * c)
+{
+    c->older->newer = c->newer;
+    c->newer->older = c->older;
+}
+
+static void
+compiled_push(Compiled * c)
+{
+    c->older = compiled_lru.older;
+    c->newer = &compiled_lru;
+    compiled_lru.older->newer = c;
+    compiled_lru.older = c;
+}
+
+static void
+compiled_remove(Compiled * c)
+{
+    Compiled **cc;
+
+    for (cc = &compiled_table[c->hash % compiled_size]; *cc != c;
+	 cc = &(*cc)->next)
+	;
+    *cc = c->next;
+    compiled_unlink(c);
+    compiled_count--;
+    free_var(c->source);
+    free_program(c->program);
+    myfree(c, M_PROGRAM);
+}
+
+Program *
+parse_list_as_cached_program(Var code, Var * errors)
+{
+    Program *prog;
+    Compiled *c;
+    unsigned hash;
+
+    if (COMPILE_CACHE_SIZE <= 0)
+	return parse_list_as_program(code, errors);
+
+    if (!compiled_table) {
+	unsigned i;
+
+	compiled_size = COMPILE_CACHE_SIZE | 1;
+	compiled_table = mymalloc(compiled_size * sizeof(Compiled *),
+				  M_PROGRAM);
+	for (i = 0; i < compiled_size; i++)
+	    compiled_table[i] = 0;
+	compiled_lru.older = compiled_lru.newer = &compiled_lru;
+    }
+
+    hash = hash_source(code);
+    for (c = compiled_table[hash % compiled_size]; c; c = c->next)
+	if (c->hash == hash && equality(c->source, code, 1)) {
+	    compiled_hits++;
+	    compiled_unlink(c);
+	    compiled_push(c);
+	    *errors = new_list(0);
+	    return program_ref(c->program);
+	}
+
+    compiled_misses++;
+    prog = parse_list_as_program(code, errors);
+    if (!prog || task_timed_out)
+	return prog;
+
+    if (compiled_count >= COMPILE_CACHE_SIZE)
+	compiled_remove(compiled_lru.newer);
+    c = mymalloc(sizeof(Compiled), M_PROGRAM);
+    c->hash = hash;
+    c->source = var_ref(code);
+    c->program = program_ref(prog);
+    c->next = compiled_table[hash % compiled_size];
+    compiled_table[hash % compiled_size] = c;
+    compiled_push(c);
+    compiled_count++;
+
+    return prog;
+}
+
+void
+flush_cached_programs(void)
+{
+    if (compiled_count == 0)
+	return;
+    compiled_flushes++;
+    while (compiled_count > 0)
+	compiled_remove(compiled_lru.newer);
+}
+
+Var
+cached_program_stats(void)
+{
+    Var r = new_list(4);
+
+    r.v.list[1].type = TYPE_INT;
+    r.v.list[1].v.num = compiled_count;
+    r.v.list[2].type = TYPE_INT;
+    r.v.list[2].v.num = compiled_hits;
+    r.v.list[3].type = TYPE_INT;
+    r.v.list[3].v.num = compiled_misses;
+    r.v.list[4].type = TYPE_INT;
+    r.v.list[4].v.num = compiled_flushes;
+
+    return r;
+}
+
 void
 free_program(Program * p)
 {
@@ -91,6 +429,8 @@ free_program(Program * p)
 
     p->ref_count--;
     if (p->ref_count == 0) {
+	if (p->dedup_hash)
+	    dedup_remove(p);
 
 	for (i = 0; i < p->num_literals; i++)
 	    /* can't be a list--strings and floats need to be freed, though. */
@@ -98,8 +438,11 @@ free_program(Program * p)
 	if (p->literals)
 	    myfree(p->literals, M_LIT_LIST);
 
-	for (i = 0; i < p->fork_vectors_size; i++)
+	for (i = 0; i < p->fork_vectors_size; i++) {
 	    myfree(p->fork_vectors[i].vector, M_BYTECODES);
+	    if (p->fork_vectors[i].lines)
+		myfree(p->fork_vectors[i].lines, M_BYTECODES);
+	}
 	if (p->fork_vectors_size)
 	    myfree(p->fork_vectors, M_FORK_VECTORS);
 
@@ -108,6 +451,8 @@ free_program(Program * p)
 	myfree(p->var_names, M_NAMES);
 
 	myfree(p->main_vector.vector, M_BYTECODES);
+	if (p->main_vector.lines)
+	    myfree(p->main_vector.lines, M_BYTECODES);
 
 	myfree(p, M_PROGRAM);
     }
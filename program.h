@@ -23,15 +23,28 @@
 
 typedef unsigned char Byte;
 
+/* The line numbers reported for errors are those of the program as
+ * decompiled (one statement per line), which the code generator works
+ * out as it goes.  A vector's table has an entry wherever the line
+ * changes: the line of the code from PC up to the next entry's PC,
+ * counted from the program's first_lineno.
+ */
+typedef struct {
+    unsigned pc;
+    unsigned line;
+} Line_Entry;
+
 typedef struct {
     Byte numbytes_label, numbytes_literal, numbytes_fork, numbytes_var_name,
      numbytes_stack;
     Byte *vector;
     unsigned size;
     unsigned max_stack;
+    unsigned num_lines;
+    Line_Entry *lines;
 } Bytecodes;
 
-typedef struct {
+typedef struct Program {
     DB_Version version;
     unsigned first_lineno;
     unsigned ref_count;
@@ -47,9 +60,8 @@ typedef struct {
     unsigned num_var_names;
     const char **var_names;
 
-    unsigned cached_lineno;
-    unsigned cached_lineno_pc;
-    int cached_lineno_vec;
+    unsigned dedup_hash;	/* see program_dedup() */
+    struct Program *dedup_next;
 } Program;
 
 #define MAIN_VECTOR 	-1	/* As opposed to an index into fork_vectors */
@@ -60,6 +72,23 @@ extern Program *program_ref(Program *);
 extern int program_bytes(Program *);
 extern void free_program(Program *);
 
+extern Program *program_dedup(Program *);
+				/* Returns a program identical to its argument
+				 * (bytecodes, literals and variable names),
+				 * sharing one already in use if there is one;
+				 * takes over the argument's reference.
+				 */
+extern void program_dedup_log(void);
+
+extern Program *parse_list_as_cached_program(Var code, Var * errors);
+				/* Like parse_list_as_program(), but reuses the
+				 * program from a recent call with the same
+				 * source; see COMPILE_CACHE_SIZE in options.h.
+				 */
+extern void flush_cached_programs(void);
+extern Var cached_program_stats(void);
+				/* {entries, hits, misses, flushes} */
+
 #endif				/* !Program_H */
 
 /* 
@@ -28,10 +28,16 @@ fi
 if [ -r $1.db.new ]; then
 	mv $1.db $1.db.old
 	mv $1.db.new $1.db
+	rm -f $1.db.delta.* $1.db.redo.*
 	rm -f $1.db.old.gz
 	gzip $1.db.old &
 fi
 
+# Deltas and redo log segments go along with the database they follow.
+for f in $1.db.new.delta.* $1.db.new.redo.*; do
+	[ -r "$f" ] && mv "$f" $1.db.${f#$1.db.new.}
+done
+
 if [ -f $1.log ]; then
 	cat $1.log >> $1.log.old
 	rm $1.log
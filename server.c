@@ -27,11 +27,14 @@
 #include "config.h"
 #include "db.h"
 #include "db_io.h"
+#include "db_tune.h"
 #include "disassemble.h"
+#include "eval_env.h"
 #include "execute.h"
 #include "functions.h"
 #include "list.h"
 #include "log.h"
+#include "name_lookup.h"
 #include "network.h"
 #include "options.h"
 #include "parser.h"
@@ -39,6 +42,7 @@
 #include "server.h"
 #include "storage.h"
 #include "streams.h"
+#include "str_intern.h"
 #include "structures.h"
 #include "tasks.h"
 #include "timers.h"
@@ -61,6 +65,9 @@ typedef enum {
 static Checkpoint_Reason checkpoint_requested = CHKPT_OFF;
 
 static int checkpoint_finished = 0;	/* 1 = failure, 2 = success */
+static pid_t checkpointer_pid = 0;	/* the forked checkpointer, if any */
+static pid_t stray_pid = 0;	/* last child reaped before we knew it */
+static int stray_status;
 
 typedef struct shandle {
     struct shandle *next, **prev;
@@ -200,6 +207,7 @@ panic(const char *message)
 {
     static int in_panic = 0;
 
+    sync_log();
     errlog("PANIC%s: %s\n", in_child ? " (in child)" : "", message);
     if (in_panic) {
 	errlog("RECURSIVE PANIC: aborting\n");
@@ -222,8 +230,8 @@ panic(const char *message)
     abort_server();
 }
 
-enum Fork_Result
-fork_server(const char *subtask_name)
+static enum Fork_Result
+fork_child(const char *subtask_name, pid_t * child)
 {
     pid_t pid;
     Stream *s = new_stream(100);
@@ -239,8 +247,103 @@ fork_server(const char *subtask_name)
     if (pid == 0) {
 	in_child = 1;
 	return FORK_CHILD;
-    } else
+    } else {
+	*child = pid;
 	return FORK_PARENT;
+    }
+}
+
+enum Fork_Result
+fork_server(const char *subtask_name)
+{
+    pid_t pid;
+
+    return fork_child(subtask_name, &pid);
+}
+
+enum Fork_Result
+fork_checkpointer(void)
+{
+    enum Fork_Result r;
+
+    stray_pid = 0;
+    r = fork_child("checkpointer", &checkpointer_pid);
+
+    /* It may have finished before fork_child() could note its pid. */
+    if (r == FORK_PARENT && stray_pid == checkpointer_pid) {
+	checkpoint_finished = (stray_status == 0) + 1;
+	checkpointer_pid = stray_pid = 0;
+    }
+    return r;
+}
+
+/* Start CHILD_PROC in a grandchild process, so that the server never has to
+ * reap it, and return its pid (0 on failure).  CHILD_PROC is passed the ends
+ * of two pipes, to the server and from it; the other ends are returned in
+ * *TO_CHILD and *FROM_CHILD.
+ */
+pid_t
+spawn_pipe(void (*child_proc) (int to_parent, int from_parent),
+	   int *to_child, int *from_child)
+{
+    int pipe_to_child[2], pipe_from_child[2];
+    pid_t pid;
+
+    if (pipe(pipe_to_child) < 0) {
+	log_perror("SPAWNING: Couldn't create first pipe");
+    } else if (pipe(pipe_from_child) < 0) {
+	log_perror("SPAWNING: Couldn't create second pipe");
+	close(pipe_to_child[0]);
+	close(pipe_to_child[1]);
+    } else if ((pid = fork()) < 0) {
+	log_perror("SPAWNING: Couldn't fork middleman");
+	close(pipe_to_child[0]);
+	close(pipe_to_child[1]);
+	close(pipe_from_child[0]);
+	close(pipe_from_child[1]);
+    } else if (pid != 0) {	/* parent */
+	int status;
+
+	close(pipe_to_child[0]);
+	close(pipe_from_child[1]);
+	*to_child = pipe_to_child[1];
+	*from_child = pipe_from_child[0];
+
+	/* Cast to (void *) to avoid warnings on systems that misdeclare the
+	 * argument.
+	 */
+	wait((void *) &status);	/* wait for middleman to die */
+	if (status != 0) {
+	    errlog("SPAWNING: Middleman died with status %d!\n", status);
+	    close(pipe_to_child[1]);
+	    close(pipe_from_child[0]);
+	} else if (read(*from_child, &pid, sizeof(pid)) != sizeof(pid)) {
+	    errlog("SPAWNING: Bad read() for pid\n");
+	    close(pipe_to_child[1]);
+	    close(pipe_from_child[0]);
+	} else {
+	    return pid;
+	}
+    } else {			/* middleman */
+	close(pipe_to_child[1]);
+	close(pipe_from_child[0]);
+	if ((pid = fork()) < 0) {
+	    log_perror("SPAWNING: Couldn't fork child");
+	    exit(1);
+	} else if (pid != 0) {	/* still the middleman */
+	    if (write(pipe_from_child[1], &pid, sizeof(pid)) != sizeof(pid))
+	    {
+		log_perror("SPAWNING: Write to child pipe failed");
+		exit(1);
+	    }
+	    exit(0);
+	} else {		/* finally, the child */
+	    (*child_proc) (pipe_from_child[1], pipe_to_child[0]);
+	    exit(0);
+	}
+    }
+
+    return 0;
 }
 
 static void
@@ -277,31 +380,49 @@ call_checkpoint_notifier(int successful)
     run_server_task(-1, SYSTEM_OBJECT, "checkpoint_finished", args, "", 0);
 }
 
+/* Only the checkpointer's exit finishes a checkpoint; other children (dump
+ * and compile workers) are waited for by whoever forked them.
+ */
+static void
+child_exited(pid_t pid, int status)
+{
+    if (pid == checkpointer_pid) {
+	checkpoint_finished = (status == 0) + 1;
+	checkpointer_pid = 0;
+    } else {
+	stray_pid = pid;
+	stray_status = status;
+    }
+}
+
 static void
 child_completed_signal(int sig)
 {
     int status;
+    pid_t pid;
 
     /* (Void *) casts to avoid warnings on systems that mis-declare the
      * argument type.
      */
 #if HAVE_WAITPID
-    while (waitpid(-1, (void *) &status, WNOHANG) > 0);
+    while ((pid = waitpid(-1, (void *) &status, WNOHANG)) > 0)
+	child_exited(pid, status);
 #else
 #if HAVE_WAIT3
-    while (wait3((void *) &status, WNOHANG, 0) >= 0);
+    while ((pid = wait3((void *) &status, WNOHANG, 0)) > 0)
+	child_exited(pid, status);
 #else
 #if HAVE_WAIT2
-    while (wait2((void *) &status, WNOHANG) >= 0);
+    while ((pid = wait2((void *) &status, WNOHANG)) > 0)
+	child_exited(pid, status);
 #else
-    wait((void *) &status);
+    if ((pid = wait((void *) &status)) > 0)
+	child_exited(pid, status);
 #endif
 #endif
 #endif
 
     signal(sig, child_completed_signal);
-
-    checkpoint_finished = (status == 0) + 1;	/* 1 = failure, 2 = success */
 }
 
 static void
@@ -377,19 +498,115 @@ call_notifier(Objid player, Objid handler, const char *verb_name)
     run_server_task(player, handler, verb_name, args, "", 0);
 }
 
+static int
+find_server_option(Objid oid, const char *name, Var * r)
+{
+    db_prop_handle h;
+
+    if (!(valid(oid)
+	  && (h = db_find_property(oid, "server_options", r)).ptr)
+	&& !(valid(SYSTEM_OBJECT)
+	     && (h = db_find_property(SYSTEM_OBJECT, "server_options",
+				      r)).ptr))
+	return 0;
+    db_watch_property(h);
+    if (r->type != TYPE_OBJ || !valid(r->v.obj))
+	return 0;
+    h = db_find_property(r->v.obj, name, r);
+    db_watch_property(h);
+
+    return h.ptr != 0;
+}
+
+/* Results of find_server_option(), keyed by OID and NAME.  Every property
+ * consulted is watched (see db_watch_property() in db.h), so the cache is
+ * simply dropped whenever the watch generation moves on.  Names can come
+ * from MOO code (via the protect_ check in call_function()), so the table
+ * is also dropped when it grows past OPTION_CACHE_LIMIT entries.
+ */
+
+typedef struct Option_Entry {
+    struct Option_Entry *next;
+    Objid oid;
+    const char *name;
+    unsigned hash;
+    int found;
+    Var value;
+} Option_Entry;
+
+#define OPTION_BUCKETS		128
+#define OPTION_CACHE_LIMIT	2048
+
+static Option_Entry *option_cache[OPTION_BUCKETS];
+static int option_cache_count = 0;
+static unsigned option_cache_generation = 0;
+
+static void
+flush_server_option_cache(void)
+{
+    int i;
+
+    for (i = 0; i < OPTION_BUCKETS; i++) {
+	Option_Entry *e, *next;
+
+	for (e = option_cache[i]; e; e = next) {
+	    next = e->next;
+	    free_str(e->name);
+	    free_var(e->value);
+	    myfree(e, M_STRUCT);
+	}
+	option_cache[i] = 0;
+    }
+    option_cache_count = 0;
+}
+
 int
 get_server_option(Objid oid, const char *name, Var * r)
 {
-    if (((valid(oid) &&
-	  db_find_property(oid, "server_options", r).ptr)
-	 || (valid(SYSTEM_OBJECT) &&
-	     db_find_property(SYSTEM_OBJECT, "server_options", r).ptr))
-	&& r->type == TYPE_OBJ
-	&& valid(r->v.obj)
-	&& db_find_property(r->v.obj, name, r).ptr)
-	return 1;
+    unsigned hash = str_hash(name);
+    Option_Entry *e, **bucket;
 
-    return 0;
+    if (option_cache_generation != db_property_watch_generation()
+	|| option_cache_count >= OPTION_CACHE_LIMIT) {
+	flush_server_option_cache();
+	option_cache_generation = db_property_watch_generation();
+    }
+    bucket = &option_cache[(hash + (unsigned) oid * 31) % OPTION_BUCKETS];
+    for (e = *bucket; e; e = e->next)
+	if (e->oid == oid && e->hash == hash
+	    && !mystrcasecmp(e->name, name)) {
+	    if (e->found)
+		*r = e->value;
+	    return e->found;
+	}
+
+    e = mymalloc(sizeof(Option_Entry), M_STRUCT);
+    e->oid = oid;
+    e->name = str_dup(name);
+    e->hash = hash;
+    e->found = find_server_option(oid, name, r);
+    if (e->found)
+	e->value = var_ref(*r);
+    else
+	e->value.type = TYPE_NONE;
+    e->next = *bucket;
+    *bucket = e;
+    option_cache_count++;
+
+    return e->found;
+}
+
+int
+server_between_tasks(int do_io)
+{
+    if (shutdown_message || checkpoint_requested != CHKPT_OFF)
+	return 0;
+    if (do_io) {
+	/* As in main_loop(), commit before any output goes out. */
+	db_flush(FLUSH_IF_FULL);
+	network_process_io(0);
+    }
+    return 1;
 }
 
 static void
@@ -446,6 +663,12 @@ main_loop(void)
 	int seconds_left = task_seconds < 0 ? 2 : task_seconds;
 	shandle *h, *nexth;
 
+#ifdef BACKGROUND_CHECKPOINTS
+	/* Don't wait for input while there's a checkpoint to write. */
+	if (db_checkpoint_in_progress())
+	    seconds_left = 0;
+#endif
+
 	if (checkpoint_requested != CHKPT_OFF) {
 	    if (checkpoint_requested == CHKPT_SIGNAL)
 		oklog("CHECKPOINTING due to remote request signal.\n");
@@ -462,7 +685,12 @@ main_loop(void)
 	    set_checkpoint_timer(0);
 	}
 #ifndef UNFORKED_CHECKPOINTS
+#ifdef BACKGROUND_CHECKPOINTS
+	if (!checkpoint_finished)
+	    checkpoint_finished = db_continue_checkpoint();
+#endif
 	if (checkpoint_finished) {
+	    db_checkpoint_finished(checkpoint_finished - 1);
 	    call_checkpoint_notifier(checkpoint_finished - 1);
 	    checkpoint_finished = 0;
 	}
@@ -474,6 +702,9 @@ main_loop(void)
 	    db_flush(FLUSH_IF_FULL);
 
 	run_ready_tasks();
+	/* Commit what those tasks did before their output goes out. */
+	db_flush(FLUSH_IF_FULL);
+	flush_log();
 
 	{			/* Get rid of old un-logged-in or useless connections */
 	    int now = time(0);
@@ -1222,9 +1453,10 @@ main(int argc, char **argv)
     if (log_file) {
 	FILE *f = fopen(log_file, "a");
 
-	if (f)
+	if (f) {
 	    set_log_file(f);
-	else {
+	    start_log_writer(log_file);
+	} else {
 	    perror("Error opening specified log file");
 	    exit(1);
 	}
@@ -1278,6 +1510,7 @@ main(int argc, char **argv)
     }
     db_shutdown();
     free_str(this_program);
+    sync_log();
 
     return 0;
 }
@@ -1334,9 +1567,37 @@ bf_reset_max_object(Var arglist, Byte next, void *vdata, Objid progr)
 
 static package
 bf_memory_usage(Var arglist, Byte next, void *vdata, Objid progr)
-{
+{				/* ([mode]) */
     Var r;
-    r = memory_usage();
+
+    if (arglist.v.list[0].v.num == 0)
+	r = memory_usage();
+    else if (!mystrcasecmp(arglist.v.list[1].v.str, "types"))
+	r = memory_type_usage();
+    else if (!mystrcasecmp(arglist.v.list[1].v.str, "frames"))
+	r = frame_usage();
+    else if (!mystrcasecmp(arglist.v.list[1].v.str, "intern"))
+	r = str_intern_usage();
+    else if (!mystrcasecmp(arglist.v.list[1].v.str, "props"))
+	r = db_propval_stats();
+    else if (!mystrcasecmp(arglist.v.list[1].v.str, "compiled"))
+	r = cached_program_stats();
+    else if (!mystrcasecmp(arglist.v.list[1].v.str, "tasks"))
+	r = task_pass_stats();
+    else if (!mystrcasecmp(arglist.v.list[1].v.str, "log"))
+	r = log_stats();
+#if NETWORK_PROTOCOL == NP_TCP
+    else if (!mystrcasecmp(arglist.v.list[1].v.str, "names"))
+	r = name_lookup_stats();
+#endif
+#ifdef LAZY_PROGRAMS
+    else if (!mystrcasecmp(arglist.v.list[1].v.str, "programs"))
+	r = db_program_stats();
+#endif
+    else {
+	free_var(arglist);
+	return make_error_pack(E_INVARG);
+    }
     free_var(arglist);
     return make_var_pack(r);
 }
@@ -1403,6 +1664,98 @@ find_slistener_by_oid(Objid obj)
 
     return 0;
 }
+
+/* Tasks suspended in open_network_connection() until their connection
+ * attempt succeeds or fails.
+ */
+typedef struct connect_waiter {
+    struct connect_waiter *next;
+    vm the_vm;
+    Var arglist;
+    int use_listener;
+    slistener l;
+} connect_waiter;
+
+static connect_waiter *connect_waiters = 0;
+
+static void
+unlink_connect_waiter(connect_waiter * w)
+{
+    connect_waiter **ww;
+
+    for (ww = &connect_waiters; *ww; ww = &((*ww)->next))
+	if (*ww == w) {
+	    *ww = w->next;
+	    return;
+	}
+}
+
+static void
+connect_done(void *data, enum error e, server_handle sh)
+{
+    connect_waiter *w = data;
+    Var v;
+
+    if (e == E_NONE) {
+	v.type = TYPE_OBJ;
+	v.v.obj = ((shandle *) sh.ptr)->player;
+    } else {
+	v.type = TYPE_ERR;
+	v.v.err = e;
+    }
+    unlink_connect_waiter(w);
+    resume_task(w->the_vm, v);
+    myfree(w, M_TASK);
+}
+
+static task_enum_action
+connect_enumerator(task_closure closure, void *data)
+{
+    connect_waiter **ww;
+
+    for (ww = &connect_waiters; *ww; ww = &((*ww)->next)) {
+	connect_waiter *w = *ww;
+	task_enum_action tea = (*closure) (w->the_vm, "connecting", data);
+
+	if (tea == TEA_KILL) {
+	    *ww = w->next;
+	    network_abort_connection(w);
+	    myfree(w, M_TASK);
+	}
+	if (tea != TEA_CONTINUE)
+	    return tea;
+    }
+
+    return TEA_CONTINUE;
+}
+
+static enum error
+connect_suspender(vm the_vm, void *data)
+{
+    connect_waiter *w = data;
+    Var arglist = w->arglist;
+    server_listener sl;
+    enum error e;
+
+    w->the_vm = the_vm;
+    w->next = connect_waiters;
+    connect_waiters = w;
+
+    sl.ptr = w->use_listener ? &w->l : 0;
+    /* On success W belongs to connect_done(), which may already have run.
+     * A failure is also delivered by resuming the task, rather than by
+     * returning it from here, so that it honors the verb's `d' bit.
+     */
+    e = network_open_connection(arglist, sl, connect_done, w);
+    free_var(arglist);
+    if (e != E_NONE) {
+	server_handle sh;
+
+	sh.ptr = 0;
+	connect_done(w, e, sh);
+    }
+    return E_NONE;
+}
 #endif /* OUTBOUND_NETWORK */
 
 static package
@@ -1410,56 +1763,41 @@ bf_open_network_connection(Var arglist, Byte next, void *vdata, Objid progr)
 {
 #ifdef OUTBOUND_NETWORK
 
-    Var r;
-    enum error e;
-    server_listener sl;
-    slistener l;
+    connect_waiter *w;
 
     if (!is_wizard(progr)) {
         free_var(arglist);
         return make_error_pack(E_PERM);
     }
 
+    w = mymalloc(sizeof(connect_waiter), M_TASK);
+    w->use_listener = 0;
     if (arglist.v.list[0].v.num == 3) {
 	Objid oid;
+	slistener *l;
 
 	if (arglist.v.list[3].type != TYPE_OBJ) {
+	    myfree(w, M_TASK);
+	    free_var(arglist);
 	    return make_error_pack(E_TYPE);
 	}
 	oid = arglist.v.list[3].v.obj;
 	arglist = listdelete(arglist, 3);
 
-	sl.ptr = find_slistener_by_oid(oid);
-	if (!sl.ptr) {
-	    /* Create a temporary */
-	    l.print_messages = 0;
-	    l.name = "open_network_connection";
-	    l.desc = zero;
-	    l.oid = oid;
-	    sl.ptr = &l;
-	}
-    } else {
-	sl.ptr = NULL;
-    }
-
-    e = network_open_connection(arglist, sl);
-    free_var(arglist);
-    if (e == E_NONE) {
-	/* The connection was successfully opened, implying that
-	 * server_new_connection was called, implying and a new negative
-	 * player number was allocated for the connection.  Thus, the old
-	 * value of next_unconnected_player is the number of our connection.
+	/* Only the OID and PRINT_MESSAGES of the listener are used, so take
+	 * a copy rather than keep a pointer to a listener that may go away
+	 * while the connection is being made.
 	 */
-	r.type = TYPE_OBJ;
-	r.v.obj = next_unconnected_player + 1;
-    } else {
-	r.type = TYPE_ERR;
-	r.v.err = e;
+	w->use_listener = 1;
+	w->l.name = "open_network_connection";
+	w->l.desc = zero;
+	w->l.oid = oid;
+	l = find_slistener_by_oid(oid);
+	w->l.print_messages = l ? l->print_messages : 0;
     }
-    if (r.type == TYPE_ERR)
-	return make_error_pack(r.v.err);
-    else
-	return make_var_pack(r);
+    w->arglist = arglist;
+
+    return make_suspend_pack(connect_suspender, w);
 
 #else				/* !OUTBOUND_NETWORK */
 
@@ -1670,6 +2008,61 @@ bf_notify(Var arglist, Byte next, void *vdata, Objid progr)
     return make_var_pack(r);
 }
 
+static package
+bf_notify_many(Var arglist, Byte next, void *vdata, Objid progr)
+{				/* (players, string [, no_flush]) */
+    Var players = arglist.v.list[1];
+    const char *line = arglist.v.list[2].v.str;
+    int no_flush = (arglist.v.list[0].v.num > 2
+		    ? is_true(arglist.v.list[3])
+		    : 0);
+    int i, wizard = is_wizard(progr);
+    network_chunk nc;
+    Var r;
+
+    for (i = 1; i <= players.v.list[0].v.num; i++)
+	if (players.v.list[i].type != TYPE_OBJ) {
+	    free_var(arglist);
+	    return make_error_pack(E_TYPE);
+	} else if (!wizard && players.v.list[i].v.obj != progr) {
+	    free_var(arglist);
+	    return make_error_pack(E_PERM);
+	}
+
+    /* The line is copied once, into a chunk that the connections share,
+     * rather than once per connection; binary connections still get their
+     * own copy, since for them the line is a binary string.
+     */
+    nc.ptr = 0;
+    r = new_list(0);
+    for (i = 1; i <= players.v.list[0].v.num; i++) {
+	Objid conn = players.v.list[i].v.obj;
+	shandle *h = find_shandle(conn);
+	int ok = 1;
+
+	if (!h || h->disconnect_me) {
+	    if (in_emergency_mode)
+		emergency_notify(conn, line);
+	} else if (h->binary) {
+	    int length;
+	    const char *bytes = binary_to_raw_bytes(line, &length);
+
+	    ok = (bytes
+		  && network_send_bytes(h->nhandle, bytes, length, !no_flush));
+	} else {
+	    if (!nc.ptr)
+		nc = network_line_chunk(line);
+	    ok = network_send_chunk(h->nhandle, nc, !no_flush);
+	}
+	if (!ok)
+	    r = setadd(r, players.v.list[i]);
+    }
+    if (nc.ptr)
+	network_release_chunk(nc);
+    free_var(arglist);
+    return make_var_pack(r);
+}
+
 static package
 bf_boot_player(Var arglist, Byte next, void *vdata, Objid progr)
 {				/* (object) */
@@ -1801,8 +2194,9 @@ bf_unlisten(Var arglist, Byte next, void *vdata, Objid progr)
 
 static package
 bf_listeners(Var arglist, Byte next, void *vdata, Objid progr)
-{				/* () */
+{				/* ([stats]) */
     int i, count = 0;
+    int stats = arglist.v.list[0].v.num >= 1 && is_true(arglist.v.list[1]);
     Var list, entry;
     slistener *l;
 
@@ -1811,12 +2205,14 @@ bf_listeners(Var arglist, Byte next, void *vdata, Objid progr)
 	count++;
     list = new_list(count);
     for (i = 1, l = all_slisteners; l; i++, l = l->next) {
-	list.v.list[i] = entry = new_list(3);
+	list.v.list[i] = entry = new_list(stats ? 4 : 3);
 	entry.v.list[1].type = TYPE_OBJ;
 	entry.v.list[1].v.obj = l->oid;
 	entry.v.list[2] = var_ref(l->desc);
 	entry.v.list[3].type = TYPE_INT;
 	entry.v.list[3].v.num = l->print_messages;
+	if (stats)
+	    entry.v.list[4] = network_listener_stats(l->nlistener);
     }
 
     return make_var_pack(list);
@@ -1853,7 +2249,7 @@ register_server(void)
     register_function("server_version", 0, 1, bf_server_version, TYPE_ANY);
     register_function("renumber", 1, 1, bf_renumber, TYPE_OBJ);
     register_function("reset_max_object", 0, 0, bf_reset_max_object);
-    register_function("memory_usage", 0, 0, bf_memory_usage);
+    register_function("memory_usage", 0, 1, bf_memory_usage, TYPE_STR);
     register_function("shutdown", 0, 1, bf_shutdown, TYPE_STR);
     register_function("dump_database", 0, 0, bf_dump_database);
     register_function("db_disk_size", 0, 0, bf_db_disk_size);
@@ -1870,6 +2266,8 @@ register_server(void)
     register_function("idle_seconds", 1, 1, bf_idle_seconds, TYPE_OBJ);
     register_function("connection_name", 1, 1, bf_connection_name, TYPE_OBJ);
     register_function("notify", 2, 3, bf_notify, TYPE_OBJ, TYPE_STR, TYPE_ANY);
+    register_function("notify_many", 2, 3, bf_notify_many,
+		      TYPE_LIST, TYPE_STR, TYPE_ANY);
     register_function("boot_player", 1, 1, bf_boot_player, TYPE_OBJ);
     register_function("set_connection_option", 3, 3, bf_set_connection_option,
 		      TYPE_OBJ, TYPE_STR, TYPE_ANY);
@@ -1879,9 +2277,12 @@ register_server(void)
 		      TYPE_OBJ);
     register_function("listen", 2, 3, bf_listen, TYPE_OBJ, TYPE_ANY, TYPE_ANY);
     register_function("unlisten", 1, 1, bf_unlisten, TYPE_ANY);
-    register_function("listeners", 0, 0, bf_listeners);
+    register_function("listeners", 0, 1, bf_listeners, TYPE_ANY);
     register_function("buffered_output_length", 0, 1,
 		      bf_buffered_output_length, TYPE_OBJ);
+#ifdef OUTBOUND_NETWORK
+    register_task_queue(connect_enumerator);
+#endif
 }
 
 char rcsid_server[] = "$Id$";
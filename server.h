@@ -26,6 +26,7 @@
 #ifndef Server_H
 #define Server_H 1
 
+#include "my-types.h"
 #include "my-stdio.h"
 
 #include "config.h"
@@ -101,6 +102,15 @@ extern void server_resume_input(Objid connection);
 				 * tasks for the given connection.
 				 */
 
+extern int server_between_tasks(int do_io);
+				/* Called by run_ready_tasks() between tasks
+				 * of a pass.  Returns false if the pass should
+				 * end now (shutdown or checkpoint pending).
+				 * If DO_IO, first commits the DB changes made
+				 * so far and handles any network input and
+				 * output that is ready, without waiting.
+				 */
+
 extern void set_server_cmdline(const char *line);
 				/* If possible, the server's command line, as
 				 * shown in the output of the `ps' command, is
@@ -144,13 +154,19 @@ extern int get_server_option(Objid oid, const char *name, Var * r);
 				 * has as value a valid object OPT, and
 				 * OPT.NAME exists, then set *R to the value of
 				 * OPT.NAME and return 1; else return 0.
+				 * Results are memoized, and the memo is
+				 * dropped automatically by any write to the
+				 * properties consulted; *R is valid until the
+				 * next call.
 				 */
 
 #include "db.h"
 
 /* Some server options are cached for performance reasons.
    Changes to cached options must be followed by load_server_options()
-   in order to have any effect.  Three categories of cached options
+   in order to have any effect.  (All other options are read through
+   get_server_option(), which notices changes on its own.)
+   Three categories of cached options
    (1)  "protect_<bi-function>" cached in bf_table (functions.c).
    (2)  "protect_<bi-property>" cached here.
    (3)  SERVER_OPTIONS_CACHED_MISC cached here.
@@ -229,6 +245,14 @@ enum Fork_Result {
     FORK_PARENT, FORK_CHILD, FORK_ERROR
 };
 extern enum Fork_Result fork_server(const char *subtask_name);
+extern enum Fork_Result fork_checkpointer(void);
+				/* Like fork_server("checkpointer"), but its
+				 * exit is reported to db_checkpoint_finished()
+				 * and #0:checkpoint_finished.
+				 */
+
+extern pid_t spawn_pipe(void (*child_proc) (int to_parent, int from_parent),
+			 int *to_child, int *from_child);
 
 extern void player_connected(Objid old_id, Objid new_id,
 			     int is_newly_created);
@@ -27,10 +27,30 @@
 #include "utils.h"
 
 static unsigned alloc_num[Sizeof_Memory_Type];
+static unsigned alloc_bytes[Sizeof_Memory_Type], alloc_peak[Sizeof_Memory_Type];
 #ifdef USE_GNU_MALLOC
 static unsigned alloc_size[Sizeof_Memory_Type], alloc_real_size[Sizeof_Memory_Type];
 #endif
 
+/* Keep in step with the Memory_Type enumeration in storage.h. */
+static const char *memory_type_names[Sizeof_Memory_Type] = {
+    "ast_pool", "ast", "program", "pval", "network", "string", "verbdef",
+    "list", "prep", "propdef", "object_table", "object", "float",
+    "stream", "names", "env", "task", "pattern",
+
+    "bytecodes", "fork_vectors", "lit_list",
+    "prototype", "code_gen", "disassemble", "decompile",
+
+    "rt_stack", "rt_env", "rt_frame", "bi_func_data", "vm",
+
+    "ref_entry", "ref_table", "vc_entry", "vc_table", "string_ptrs",
+    "intern_pointer", "intern_entry", "intern_hunk",
+
+    "verbhandle",
+
+    "struct"
+};
+
 static inline int
 refcount_overhead(Memory_Type type)
 {
@@ -43,53 +63,320 @@ refcount_overhead(Memory_Type type)
 	/* for systems with picky double alignment */
 	return MAX(sizeof(int), sizeof(double));
     case M_STRING:
+	/* refcount, cached hash, and maybe the memoized length */
 #ifdef MEMO_STRLEN
-	return sizeof(int) + sizeof(int);
+	return sizeof(int) + sizeof(int) + sizeof(int);
 #else
-	return sizeof(int);
+	return sizeof(int) + sizeof(int);
 #endif /* MEMO_STRLEN */
     case M_LIST:
-	/* for systems with picky pointer alignment */
-	return MAX(sizeof(int), sizeof(Var *));
+	/* refcount and cached hash, also for systems with picky pointer
+	 * alignment */
+	return MAX(sizeof(int) + sizeof(int), sizeof(Var *));
     default:
 	return 0;
     }
 }
 
-void *
-mymalloc(unsigned size, Memory_Type type)
+static inline void
+note_alloc(Memory_Type type, unsigned bytes)
 {
-    char *memptr;
-    char msg[100];
-    int offs;
+    alloc_num[type]++;
+    alloc_bytes[type] += bytes;
+    if (alloc_bytes[type] > alloc_peak[type])
+	alloc_peak[type] = alloc_bytes[type];
+}
 
-    if (size == 0)		/* For queasy systems */
-	size = 1;
+static inline void
+note_free(Memory_Type type, unsigned bytes)
+{
+    alloc_num[type]--;
+    alloc_bytes[type] -= bytes;
+}
+
+/*
+ * Blocks that come straight from malloc() carry a header recording their
+ * size, so that myfree() can keep the per-type byte counts honest.
+ */
+typedef union {
+    unsigned size;
+    double d;			/* for picky double alignment */
+    void *p;
+} malloc_header;
+
+static void *
+raw_malloc(unsigned size, Memory_Type type)
+{
+    malloc_header *h = (malloc_header *) malloc(size + sizeof(malloc_header));
+
+    if (!h) {
+	char msg[100];
 
-    offs = refcount_overhead(type);
-    memptr = (char *) malloc(size + offs);
-    if (!memptr) {
 	sprintf(msg, "memory allocation (size %u) failed!", size);
 	panic(msg);
     }
-    alloc_num[type]++;
 #ifdef USE_GNU_MALLOC
     {
 	extern unsigned malloc_real_size(void *ptr);
 	extern unsigned malloc_size(void *ptr);
 
-	alloc_size[type] += malloc_size(memptr);
-	alloc_real_size[type] += malloc_real_size(memptr);
+	alloc_size[type] += malloc_size(h);
+	alloc_real_size[type] += malloc_real_size(h);
+    }
+#endif
+    h->size = size;
+    note_alloc(type, size);
+    return h + 1;
+}
+
+static void
+raw_free(void *block, Memory_Type type)
+{
+    malloc_header *h = (malloc_header *) block - 1;
+
+#ifdef USE_GNU_MALLOC
+    {
+	extern unsigned malloc_real_size(void *ptr);
+	extern unsigned malloc_size(void *ptr);
+
+	alloc_size[type] -= malloc_size(h);
+	alloc_real_size[type] -= malloc_real_size(h);
+    }
+#endif
+    note_free(type, h->size);
+    free(h);
+}
+
+#ifdef SLAB_ALLOCATOR
+
+/*
+ * Small values -- the bulk of them short lists, short strings and floats,
+ * plus task and network bookkeeping -- are carved out of size-class slabs
+ * instead of going to malloc() one at a time.  Classes are spaced every
+ * SLAB_GRAIN bytes up to SLAB_MAX_BLOCK, which covers lists of up to a
+ * dozen or so elements and strings of a typical command line.
+ *
+ * Slab pages are SLAB_PAGE-aligned and never given back to malloc().  A
+ * small open hash table maps each page address to its size class, so
+ * myfree() can tell slab blocks from malloc() blocks without a per-block
+ * header.
+ */
+
+#define SLAB_GRAIN	16
+#define SLAB_MAX_BLOCK	256
+#define SLAB_CLASSES	(SLAB_MAX_BLOCK / SLAB_GRAIN)
+#define SLAB_PAGE	16384
+#define SLAB_CHUNK_PAGES 64
+
+typedef struct slab_block {
+    struct slab_block *next;
+} slab_block;
+
+typedef struct {
+    slab_block *free_list;
+    unsigned nused, nfree;
+} slab_class;
+
+static slab_class slab_classes[SLAB_CLASSES];
+
+typedef struct {
+    char *page;
+    int class;
+} slab_page_entry;
+
+static slab_page_entry *slab_pages;
+static unsigned slab_pages_size, slab_pages_count;
+
+/* Spare aligned pages from the last chunk we got from malloc(). */
+static char *slab_spare;
+static unsigned slab_spare_pages;
+
+static inline int
+slab_type(Memory_Type type)
+{
+    switch (type) {
+    case M_LIST:
+    case M_STRING:
+    case M_FLOAT:
+    case M_TASK:
+    case M_NETWORK:
+	return 1;
+    default:
+	return 0;
+    }
+}
+
+static inline unsigned
+slab_page_hash(const char *page)
+{
+    return (unsigned) (((unsigned long) page / SLAB_PAGE) * 2654435761u);
+}
+
+static void
+slab_pages_insert(char *page, int class)
+{
+    unsigned i = slab_page_hash(page) & (slab_pages_size - 1);
+
+    while (slab_pages[i].page)
+	i = (i + 1) & (slab_pages_size - 1);
+    slab_pages[i].page = page;
+    slab_pages[i].class = class;
+    slab_pages_count++;
+}
+
+static void
+slab_pages_grow(void)
+{
+    slab_page_entry *old = slab_pages;
+    unsigned i, old_size = slab_pages_size;
+
+    slab_pages_size = old_size ? old_size * 2 : 256;
+    slab_pages = malloc(slab_pages_size * sizeof(slab_page_entry));
+    if (!slab_pages)
+	panic("memory allocation (slab page table) failed!");
+    for (i = 0; i < slab_pages_size; i++)
+	slab_pages[i].page = 0;
+
+    slab_pages_count = 0;
+    for (i = 0; i < old_size; i++)
+	if (old[i].page)
+	    slab_pages_insert(old[i].page, old[i].class);
+    if (old)
+	free(old);
+}
+
+/* Returns the size class of the slab page holding BLOCK, or -1. */
+static inline int
+slab_class_of(const void *block)
+{
+    const char *page;
+    unsigned i;
+
+    if (!slab_pages_count)
+	return -1;
+    page = (const char *) ((unsigned long) block & ~(unsigned long) (SLAB_PAGE - 1));
+    for (i = slab_page_hash(page) & (slab_pages_size - 1);
+	 slab_pages[i].page;
+	 i = (i + 1) & (slab_pages_size - 1))
+	if (slab_pages[i].page == page)
+	    return slab_pages[i].class;
+    return -1;
+}
+
+static void
+slab_refill(int class)
+{
+    unsigned bsize = (class + 1) * SLAB_GRAIN;
+    unsigned i, n;
+    char *page;
+
+    if (!slab_spare_pages) {
+	char *chunk = malloc((SLAB_CHUNK_PAGES + 1) * SLAB_PAGE);
+
+	if (!chunk)
+	    panic("memory allocation (slab chunk) failed!");
+	slab_spare = (char *) (((unsigned long) chunk + SLAB_PAGE - 1)
+			       & ~(unsigned long) (SLAB_PAGE - 1));
+	slab_spare_pages = SLAB_CHUNK_PAGES;
+    }
+    page = slab_spare;
+    slab_spare += SLAB_PAGE;
+    slab_spare_pages--;
+
+    if (2 * (slab_pages_count + 1) > slab_pages_size)
+	slab_pages_grow();
+    slab_pages_insert(page, class);
+
+    n = SLAB_PAGE / bsize;
+    for (i = n; i-- > 0;) {
+	slab_block *b = (slab_block *) (page + i * bsize);
+
+	b->next = slab_classes[class].free_list;
+	slab_classes[class].free_list = b;
+    }
+    slab_classes[class].nfree += n;
+}
+
+static inline void *
+slab_alloc(int class)
+{
+    slab_class *c = &slab_classes[class];
+    slab_block *b;
+
+    if (!c->free_list)
+	slab_refill(class);
+    b = c->free_list;
+    c->free_list = b->next;
+    c->nfree--;
+    c->nused++;
+    return b;
+}
+
+static inline void
+slab_free(void *block, int class)
+{
+    slab_class *c = &slab_classes[class];
+    slab_block *b = block;
+
+    b->next = c->free_list;
+    c->free_list = b;
+    c->nused--;
+    c->nfree++;
+}
+
+#endif				/* SLAB_ALLOCATOR */
+
+static inline void *
+block_alloc(unsigned size, Memory_Type type)
+{
+#ifdef SLAB_ALLOCATOR
+    if (size <= SLAB_MAX_BLOCK && slab_type(type)) {
+	int class = (size - 1) / SLAB_GRAIN;
+
+	note_alloc(type, (class + 1) * SLAB_GRAIN);
+	return slab_alloc(class);
+    }
+#endif
+    return raw_malloc(size, type);
+}
+
+static inline void
+block_free(void *block, Memory_Type type)
+{
+#ifdef SLAB_ALLOCATOR
+    int class = slab_class_of(block);
+
+    if (class >= 0) {
+	note_free(type, (class + 1) * SLAB_GRAIN);
+	slab_free(block, class);
+	return;
     }
 #endif
+    raw_free(block, type);
+}
+
+void *
+mymalloc(unsigned size, Memory_Type type)
+{
+    char *memptr;
+    int offs;
+
+    if (size == 0)		/* For queasy systems */
+	size = 1;
+
+    offs = refcount_overhead(type);
+    memptr = (char *) block_alloc(size + offs, type);
 
     if (offs) {
 	memptr += offs;
 	((int *) memptr)[-1] = 1;
+	if (type == M_STRING) {
 #ifdef MEMO_STRLEN
-	if (type == M_STRING)
 	    ((int *) memptr)[-2] = size - 1;
 #endif /* MEMO_STRLEN */
+	    str_hash_slot(memptr) = 0;
+	} else if (type == M_LIST)
+	    list_hash_slot(memptr) = 0;
     }
     return memptr;
 }
@@ -122,50 +409,68 @@ str_dup(const char *s)
     return r;
 }
 
-void *
-myrealloc(void *ptr, unsigned size, Memory_Type type)
+static void *
+raw_realloc(void *block, unsigned size, Memory_Type type)
 {
-    int offs = refcount_overhead(type);
-    static char msg[100];
+    malloc_header *h = (malloc_header *) block - 1;
 
 #ifdef USE_GNU_MALLOC
     {
 	extern unsigned malloc_real_size(void *ptr);
 	extern unsigned malloc_size(void *ptr);
 
-	alloc_size[type] -= malloc_size(ptr);
-	alloc_real_size[type] -= malloc_real_size(ptr);
+	alloc_size[type] -= malloc_size(h);
+	alloc_real_size[type] -= malloc_real_size(h);
 #endif
+	note_free(type, h->size);
+	h = realloc(h, size + sizeof(malloc_header));
+	if (!h) {
+	    static char msg[100];
 
-	ptr = realloc((char *) ptr - offs, size + offs);
-	if (!ptr) {
 	    sprintf(msg, "memory re-allocation (size %u) failed!", size);
 	    panic(msg);
 	}
+	h->size = size;
+	note_alloc(type, size);
 #ifdef USE_GNU_MALLOC
-	alloc_size[type] += malloc_size(ptr);
-	alloc_real_size[type] += malloc_real_size(ptr);
+	alloc_size[type] += malloc_size(h);
+	alloc_real_size[type] += malloc_real_size(h);
     }
 #endif
 
-    return (char *) ptr + offs;
+    return h + 1;
 }
 
-void
-myfree(void *ptr, Memory_Type type)
+void *
+myrealloc(void *ptr, unsigned size, Memory_Type type)
 {
-    alloc_num[type]--;
-#ifdef USE_GNU_MALLOC
-    {
-	extern unsigned malloc_real_size(void *ptr);
-	extern unsigned malloc_size(void *ptr);
-
-	alloc_size[type] -= malloc_size(ptr);
-	alloc_real_size[type] -= malloc_real_size(ptr);
+    int offs = refcount_overhead(type);
+    char *block = (char *) ptr - offs;
+
+#ifdef SLAB_ALLOCATOR
+    int class = slab_class_of(block);
+
+    if (class >= 0) {
+	unsigned old_size = (class + 1) * SLAB_GRAIN;
+	char *new_block;
+
+	if (size + offs <= old_size)
+	    return ptr;		/* still fits */
+	new_block = block_alloc(size + offs, type);
+	memcpy(new_block, block, old_size);
+	note_free(type, old_size);
+	slab_free(block, class);
+	return new_block + offs;
     }
 #endif
 
-    free((char *) ptr - refcount_overhead(type));
+    return (char *) raw_realloc(block, size + offs, type) + offs;
+}
+
+void
+myfree(void *ptr, Memory_Type type)
+{
+    block_free((char *) ptr - refcount_overhead(type), type);
 }
 
 #ifdef USE_GNU_MALLOC
@@ -222,6 +527,21 @@ memory_usage(void)
 	l.v.list[2].v.num = v.nused;
 	l.v.list[3].v.num = v.nfree;
     }
+#elif defined(SLAB_ALLOCATOR)
+    int i;
+
+    r = new_list(SLAB_CLASSES);
+    for (i = 1; i <= SLAB_CLASSES; i++)
+	r.v.list[i] = new_list(3);
+
+    for (i = 0; i < SLAB_CLASSES; i++) {
+	Var l = r.v.list[i + 1];
+
+	l.v.list[1].type = l.v.list[2].type = l.v.list[3].type = TYPE_INT;
+	l.v.list[1].v.num = (i + 1) * SLAB_GRAIN;
+	l.v.list[2].v.num = slab_classes[i].nused;
+	l.v.list[3].v.num = slab_classes[i].nfree;
+    }
 #else
     r = new_list(0);
 #endif
@@ -229,6 +549,34 @@ memory_usage(void)
     return r;
 }
 
+Var
+memory_type_usage(void)
+{
+    unsigned num[Sizeof_Memory_Type], bytes[Sizeof_Memory_Type];
+    Var r;
+    int i;
+
+    /* Read the counters before building the result perturbs them. */
+    for (i = 0; i < Sizeof_Memory_Type; i++) {
+	num[i] = alloc_num[i];
+	bytes[i] = alloc_bytes[i];
+    }
+
+    r = new_list(Sizeof_Memory_Type);
+    for (i = 0; i < Sizeof_Memory_Type; i++) {
+	Var l = r.v.list[i + 1] = new_list(4);
+
+	l.v.list[1].type = TYPE_STR;
+	l.v.list[1].v.str = str_dup(memory_type_names[i]);
+	l.v.list[2].type = l.v.list[3].type = l.v.list[4].type = TYPE_INT;
+	l.v.list[2].v.num = num[i];
+	l.v.list[3].v.num = bytes[i];
+	l.v.list[4].v.num = alloc_peak[i];
+    }
+
+    return r;
+}
+
 char rcsid_storage[] = "$Id$";
 
 /* 
@@ -31,7 +31,7 @@ typedef enum Memory_Type {
     M_BYTECODES, M_FORK_VECTORS, M_LIT_LIST,
     M_PROTOTYPE, M_CODE_GEN, M_DISASSEMBLE, M_DECOMPILE,
 
-    M_RT_STACK, M_RT_ENV, M_BI_FUNC_DATA, M_VM,
+    M_RT_STACK, M_RT_ENV, M_RT_FRAME, M_BI_FUNC_DATA, M_VM,
 
     M_REF_ENTRY, M_REF_TABLE, M_VC_ENTRY, M_VC_TABLE, M_STRING_PTRS,
     M_INTERN_POINTER, M_INTERN_ENTRY, M_INTERN_HUNK,
@@ -48,6 +48,7 @@ typedef enum Memory_Type {
 extern char *str_dup(const char *);
 extern const char *str_ref(const char *);
 extern Var memory_usage(void);
+extern Var memory_type_usage(void);
 
 extern void myfree(void *where, Memory_Type type);
 extern void *mymalloc(unsigned size, Memory_Type type);
@@ -71,6 +72,23 @@ free_str(const char *s)
 
 #endif /* MEMO_STRLEN */
 
+/*
+ * One more header slot, below the refcount and memoized length, where
+ * str_intern_ident() caches the string's str_hash().  Zero means the
+ * hash has not been cached.
+ */
+/* A string's str_hash(), or 0 if nothing has needed it yet. */
+#ifdef MEMO_STRLEN
+#define str_hash_slot(X)	(((unsigned *)(X))[-3])
+#else
+#define str_hash_slot(X)	(((unsigned *)(X))[-2])
+#endif /* MEMO_STRLEN */
+
+/* A list's var_hash(), or 0 if it hasn't been worked out since the list
+ * last changed.
+ */
+#define list_hash_slot(X)	(((unsigned *)(X))[-2])
+
 #endif				/* Storage_h */
 
 /* 
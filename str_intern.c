@@ -1,5 +1,8 @@
+#include "my-ctype.h"
 #include "my-stdlib.h"
+#include "my-string.h"
 
+#include "list.h"
 #include "log.h"
 #include "storage.h"
 #include "str_intern.h"
@@ -96,6 +99,17 @@ static int intern_table_count = 0;
 static int intern_bytes_saved = 0;
 static int intern_allocations_saved = 0;
 
+/* The permanent identifier table; see str_intern_ident() below. */
+static struct intern_entry **ident_table = NULL;
+static int ident_table_size = 0;
+static int ident_table_count = 0;
+
+static int ident_refs_shared = 0;
+static int ident_bytes_shared = 0;
+
+int ident_ptr_hits = 0;
+int ident_cmp_hits = 0;
+
 #define INTERN_TABLE_SIZE_INITIAL 10007
 
 static struct intern_entry **
@@ -148,6 +162,7 @@ str_intern_close(void)
     
     oklog("INTERN: %d allocations saved, %d bytes\n", intern_allocations_saved, intern_bytes_saved);
     oklog("INTERN: at end, %d entries in a %d bucket hash table.\n", intern_table_count, intern_table_size);
+    oklog("INTERN: %d identifiers, %d references shared, %d bytes\n", ident_table_count, ident_refs_shared, ident_bytes_shared);
 }
 
 static struct intern_entry *
@@ -258,6 +273,139 @@ str_intern(const char *s)
     return r;
 }
 
+/**********************/
+
+/* The permanent identifier table.  Unlike the load-time table above,
+ * entries are allocated one at a time and the table lives for the
+ * whole run.  Every entry holds a reference to its string, so a string
+ * nobody else refers to has a refcount of 1; those are swept out
+ * before the table is grown.
+ */
+
+#define IDENT_TABLE_SIZE_INITIAL 4099
+#define IDENT_MAX_LENGTH 64
+
+static int
+is_ident(const char *s)
+{
+    int n;
+
+    for (n = 0; *s; s++, n++)
+	if (n >= IDENT_MAX_LENGTH || !(isalnum((unsigned char) *s) || *s == '_'))
+	    return 0;
+
+    return n > 0;
+}
+
+static void
+ident_sweep(void)
+{
+    int i;
+    struct intern_entry *e, **prev;
+
+    for (i = 0; i < ident_table_size; i++) {
+	prev = &ident_table[i];
+	while ((e = *prev) != NULL) {
+	    if (refcount(e->s) == 1) {
+		*prev = e->next;
+		/* The string may be mutated once it is no longer shared. */
+		str_hash_slot(e->s) = 0;
+		free_str(e->s);
+		myfree(e, M_INTERN_ENTRY);
+		ident_table_count--;
+	    } else
+		prev = &e->next;
+	}
+    }
+}
+
+static void
+ident_rehash(int new_size)
+{
+    struct intern_entry **new_table;
+    struct intern_entry *e, *next;
+    int i;
+
+    new_table = make_intern_table(new_size);
+    for (i = 0; i < ident_table_size; i++)
+	for (e = ident_table[i]; e; e = next) {
+	    next = e->next;
+	    e->next = new_table[e->hash % new_size];
+	    new_table[e->hash % new_size] = e;
+	}
+    myfree(ident_table, M_INTERN_POINTER);
+    ident_table = new_table;
+    ident_table_size = new_size;
+}
+
+const char *
+str_intern_ident(const char *s)
+{
+    struct intern_entry *e;
+    unsigned hash;
+    int bucket;
+
+    if (!is_ident(s))
+	return str_ref(s);
+
+    if (ident_table == NULL) {
+	ident_table = make_intern_table(IDENT_TABLE_SIZE_INITIAL);
+	ident_table_size = IDENT_TABLE_SIZE_INITIAL;
+    }
+    hash = str_ident_hash(s);
+    bucket = hash % ident_table_size;
+    for (e = ident_table[bucket]; e; e = e->next)
+	if (e->s == s)		/* already the shared copy */
+	    return str_ref(s);
+	else if (e->hash == hash && !strcmp(e->s, s)) {
+	    ident_refs_shared++;
+	    ident_bytes_shared += memo_strlen(s) + 1;
+	    return str_ref(e->s);
+	}
+
+    if (ident_table_count >= ident_table_size) {
+	ident_sweep();
+	if (ident_table_count >= ident_table_size / 2)
+	    ident_rehash(ident_table_size * 2 + 1);
+	bucket = hash % ident_table_size;
+    }
+    e = mymalloc(sizeof(struct intern_entry), M_INTERN_ENTRY);
+    e->s = str_ref(s);
+    e->hash = hash;
+    e->next = ident_table[bucket];
+    ident_table[bucket] = e;
+    ident_table_count++;
+    str_hash_slot(s) = hash;
+
+    return str_ref(s);
+}
+
+unsigned
+str_ident_hash(const char *s)
+{
+    unsigned hash = str_hash_slot(s);
+
+    return hash ? hash : str_hash(s);
+}
+
+Var
+str_intern_usage(void)
+{
+    Var r = new_list(6);
+    int i;
+
+    for (i = 1; i <= 6; i++)
+	r.v.list[i].type = TYPE_INT;
+    r.v.list[1].v.num = ident_table_count;
+    r.v.list[2].v.num = ident_table_size;
+    r.v.list[3].v.num = ident_refs_shared;
+    r.v.list[4].v.num = ident_bytes_shared;
+    r.v.list[5].v.num = ident_ptr_hits;
+    r.v.list[6].v.num = ident_cmp_hits;
+
+    return r;
+}
+
 #else /* STRING_INTERNING */
 
 const char *
@@ -278,4 +426,25 @@ str_intern_open(int table_size)
 	;
 }
 
+int ident_ptr_hits = 0;
+int ident_cmp_hits = 0;
+
+const char *
+str_intern_ident(const char *s)
+{
+	return str_ref(s);
+}
+
+unsigned
+str_ident_hash(const char *s)
+{
+	return str_hash(s);
+}
+
+Var
+str_intern_usage(void)
+{
+	return new_list(0);
+}
+
 #endif /* STRING_INTERNING */
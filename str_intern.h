@@ -9,11 +9,19 @@
  * used during db load then freed all at once.  It might be
  * interesting to intern all strings even during runtime.  Somebody
  * else can do this.
+ *
+ * Identifiers (property names, verb names, and the string literals
+ * in programs that name them) are the exception: they live in a
+ * second, permanent table so that a literal and the propdef it names
+ * share one copy, and lookups can compare pointers before falling
+ * back to a case-insensitive string compare.
  * */
 
 #ifndef Str_Intern_h
 #define Str_Intern_h
 
+#include "structures.h"
+
 /* 0 for a default size */
 extern void str_intern_open(int table_size);
 extern void str_intern_close(void);
@@ -22,4 +30,20 @@ extern void str_intern_close(void);
    possibly share storage. */
 extern const char *str_intern(const char *s);
 
+/* Return a new reference to the shared copy of the MOO string s if
+   it looks like an identifier, otherwise a new reference to s itself.
+   Shared copies carry their str_hash() in the string header. */
+extern const char *str_intern_ident(const char *s);
+
+/* str_hash() of the MOO string s, using the cached value if s was
+   returned by str_intern_ident() or has been through var_hash(). */
+extern unsigned str_ident_hash(const char *s);
+
+/* Property lookups that matched on pointer identity vs. by comparing
+   names; bumped by db_properties.c. */
+extern int ident_ptr_hits;
+extern int ident_cmp_hits;
+
+extern Var str_intern_usage(void);
+
 #endif
@@ -15,7 +15,9 @@
     Pavel@Xerox.Com
  *****************************************************************************/
 
+#include "my-math.h"
 #include "my-string.h"
+#include "my-sys-time.h"
 #include "my-time.h"
 
 #include "config.h"
@@ -30,6 +32,7 @@
 #include "list.h"
 #include "log.h"
 #include "match.h"
+#include "numbers.h"
 #include "options.h"
 #include "parse_cmd.h"
 #include "parser.h"
@@ -39,6 +42,7 @@
 #include "streams.h"
 #include "structures.h"
 #include "tasks.h"
+#include "timers.h"
 #include "utils.h"
 #include "verbs.h"
 #include "version.h"
@@ -121,7 +125,9 @@ typedef struct tqueue {
      *
      * If an unconnected queue becomes empty, it is destroyed.
      */
-    struct tqueue *next, **prev;	/* prev only valid on idle_tqueues */
+    struct tqueue *next, **prev;	/* on idle_tqueues or active_tqueues */
+    struct tqueue *hash_next;	/* in tqueue_index, by player */
+    int heap_index;		/* in active_heap, if active */
     Objid player;
     Objid handler;
     int connected;
@@ -143,7 +149,11 @@ typedef struct tqueue {
     int input_suspended;
 
     task *first_bg, **last_bg;
-    int usage;			/* a kind of inverted priority */
+    double usage;		/* a kind of inverted priority: microseconds
+				 * run while active, plus decayed debt */
+    double debt;		/* usage above the floor when deactivated */
+    double idle_since;		/* usec_now() when deactivated */
+    double cpu_usec;		/* total microseconds run, for queue_info() */
     int num_bg_tasks;		/* in either here or waiting_tasks */
     char *output_prefix, *output_suffix;
     const char *flush_cmd;
@@ -169,8 +179,25 @@ typedef struct ext_queue {
 
 #define NO_USAGE	-1
 
+/* An idle queue's usage in excess of the least active usage halves every
+ * USAGE_HALF_LIFE seconds, so a queue cannot shed what it owes by going
+ * idle for a moment, nor carry it forever.
+ */
+#define USAGE_HALF_LIFE	60
+
 int current_task_id;
 static tqueue *idle_tqueues = 0, *active_tqueues = 0;
+
+/* Active queues are also kept in a binary heap ordered by usage, so that
+ * the next queue to run is always active_heap[0]; all queues are indexed
+ * by player in tqueue_index.
+ */
+static tqueue **active_heap = 0;
+static int num_active = 0, max_active = 0;
+static double usage_floor = 0;	/* least active usage, when last known */
+
+static tqueue **tqueue_index = 0;
+static int tqueue_index_size = 0, num_tqueues = 0;
 static task *waiting_tasks = 0;	/* forked and suspended tasks */
 static ext_queue *external_queues = 0;
 
@@ -265,46 +292,180 @@ icmd_set_flags(tqueue * tq, Var list)
     return 1;
 }
 
+static void
+heap_place(tqueue * tq, int i)
+{
+    active_heap[i] = tq;
+    tq->heap_index = i;
+}
 
 static void
-deactivate_tqueue(tqueue * tq)
+heap_sift(int i)
 {
-    tq->usage = NO_USAGE;
+    tqueue *tq = active_heap[i];
 
-    tq->next = idle_tqueues;
-    tq->prev = &idle_tqueues;
-    if (idle_tqueues)
-	idle_tqueues->prev = &(tq->next);
-    idle_tqueues = tq;
+    while (i > 0 && active_heap[(i - 1) / 2]->usage > tq->usage) {
+	heap_place(active_heap[(i - 1) / 2], i);
+	i = (i - 1) / 2;
+    }
+    for (;;) {
+	int c = 2 * i + 1;
+
+	if (c >= num_active)
+	    break;
+	if (c + 1 < num_active
+	    && active_heap[c + 1]->usage < active_heap[c]->usage)
+	    c++;
+	if (active_heap[c]->usage >= tq->usage)
+	    break;
+	heap_place(active_heap[c], i);
+	i = c;
+    }
+    heap_place(tq, i);
 }
 
 static void
-activate_tqueue(tqueue * tq)
+heap_insert(tqueue * tq)
+{
+    if (num_active == max_active) {
+	tqueue **old = active_heap;
+	int i;
+
+	max_active = max_active ? 2 * max_active : 32;
+	active_heap = mymalloc(max_active * sizeof(tqueue *), M_TASK);
+	for (i = 0; i < num_active; i++)
+	    active_heap[i] = old[i];
+	if (old)
+	    myfree(old, M_TASK);
+    }
+    active_heap[num_active] = tq;
+    heap_sift(num_active++);
+}
+
+static void
+heap_remove(tqueue * tq)
 {
-    tqueue **qq = &active_tqueues;
+    int i = tq->heap_index;
 
-    while (*qq && (*qq)->usage <= tq->usage)
-	qq = &((*qq)->next);
+    if (i != --num_active) {
+	active_heap[i] = active_heap[num_active];
+	heap_sift(i);
+    }
+}
 
-    tq->next = *qq;
-    tq->prev = 0;
-    *qq = tq;
+static void
+unlink_tqueue(tqueue * tq)
+{
+    *(tq->prev) = tq->next;
+    if (tq->next)
+	tq->next->prev = tq->prev;
+}
+
+static void
+link_tqueue(tqueue * tq, tqueue ** list)
+{
+    tq->next = *list;
+    tq->prev = list;
+    if (*list)
+	(*list)->prev = &(tq->next);
+    *list = tq;
+}
+
+static void
+deactivate_tqueue(tqueue * tq)
+{
+    /* Precondition: tq is new or on active_tqueues */
+
+    if (tq->usage != NO_USAGE) {
+	unlink_tqueue(tq);
+	heap_remove(tq);
+	usage_floor = num_active ? active_heap[0]->usage : tq->usage;
+	tq->debt = tq->usage > usage_floor ? tq->usage - usage_floor : 0;
+	tq->idle_since = usec_now();
+	tq->usage = NO_USAGE;
+    }
+    link_tqueue(tq, &idle_tqueues);
 }
 
 static void
 ensure_usage(tqueue * tq)
 {
     if (tq->usage == NO_USAGE) {
-	tq->usage = active_tqueues ? active_tqueues->usage : 0;
+	double idle = usec_now() - tq->idle_since;
+
+	if (num_active)
+	    usage_floor = active_heap[0]->usage;
+	tq->usage = usage_floor;
+	if (tq->debt > 0)
+	    tq->usage += tq->debt * pow(0.5, idle / (USAGE_HALF_LIFE * 1e6));
+
+	/* Move tq from idle_tqueues to active_tqueues */
+	unlink_tqueue(tq);
+	link_tqueue(tq, &active_tqueues);
+	heap_insert(tq);
+    }
+}
+
+static void
+charge_tqueue(tqueue * tq, double usec)
+{
+    /* Precondition: tq is on active_tqueues */
 
-	/* Remove tq from idle_tqueues... */
-	*(tq->prev) = tq->next;
-	if (tq->next)
-	    tq->next->prev = tq->prev;
+    tq->usage += usec;
+    tq->cpu_usec += usec;
+    heap_sift(tq->heap_index);
+}
 
-	/* ...and put it on active_tqueues. */
-	activate_tqueue(tq);
+static void
+index_tqueue(tqueue * tq)
+{
+    unsigned b;
+
+    if (num_tqueues >= tqueue_index_size) {
+	tqueue **old = tqueue_index;
+	int i, old_size = tqueue_index_size;
+
+	tqueue_index_size = old_size ? 2 * old_size : 64;
+	tqueue_index = mymalloc(tqueue_index_size * sizeof(tqueue *), M_TASK);
+	for (i = 0; i < tqueue_index_size; i++)
+	    tqueue_index[i] = 0;
+	for (i = 0; i < old_size; i++) {
+	    tqueue *t, *next;
+
+	    for (t = old[i]; t; t = next) {
+		next = t->hash_next;
+		b = (unsigned) t->player & (tqueue_index_size - 1);
+		t->hash_next = tqueue_index[b];
+		tqueue_index[b] = t;
+	    }
+	}
+	if (old)
+	    myfree(old, M_TASK);
     }
+    b = (unsigned) tq->player & (tqueue_index_size - 1);
+    tq->hash_next = tqueue_index[b];
+    tqueue_index[b] = tq;
+    num_tqueues++;
+}
+
+static void
+unindex_tqueue(tqueue * tq)
+{
+    tqueue **tt = &tqueue_index[(unsigned) tq->player
+				& (tqueue_index_size - 1)];
+
+    while (*tt != tq)
+	tt = &((*tt)->hash_next);
+    *tt = tq->hash_next;
+    num_tqueues--;
+}
+
+static void
+set_tqueue_player(tqueue * tq, Objid player)
+{
+    unindex_tqueue(tq);
+    tq->player = player;
+    index_tqueue(tq);
 }
 
 char *
@@ -320,22 +481,23 @@ find_tqueue(Objid player, int create_if_not_found)
 {
     tqueue *tq;
 
-    for (tq = active_tqueues; tq; tq = tq->next)
-	if (tq->player == player)
-	    return tq;
-
-    for (tq = idle_tqueues; tq; tq = tq->next)
-	if (tq->player == player)
-	    return tq;
+    if (tqueue_index)
+	for (tq = tqueue_index[(unsigned) player & (tqueue_index_size - 1)];
+	     tq; tq = tq->hash_next)
+	    if (tq->player == player)
+		return tq;
 
     if (!create_if_not_found)
 	return 0;
 
     tq = mymalloc(sizeof(tqueue), M_TASK);
 
+    tq->usage = NO_USAGE;
+    tq->debt = tq->idle_since = tq->cpu_usec = 0;
     deactivate_tqueue(tq);
 
     tq->player = player;
+    index_tqueue(tq);
     tq->handler = 0;
     tq->connected = 0;
 
@@ -375,9 +537,8 @@ free_tqueue(tqueue * tq)
     if (tq->reading)
 	free_vm(tq->reading_vm, 1);
 
-    *(tq->prev) = tq->next;
-    if (tq->next)
-	tq->next->prev = tq->prev;
+    unlink_tqueue(tq);
+    unindex_tqueue(tq);
 
     myfree(tq, M_TASK);
 }
@@ -759,7 +920,7 @@ do_login_task(tqueue * tq, char *command)
 	tqueue *dead_tq = find_tqueue(new_player, 0);
 	task *t;
 
-	tq->player = new_player;
+	set_tqueue_player(tq, new_player);
 	if (tq->num_bg_tasks) {
 	    /* Cute; this un-logged-in connection has some queued tasks!
 	     * Must copy them over to their own tqueue for accounting...
@@ -779,7 +940,10 @@ do_login_task(tqueue * tq, char *command)
 	    while ((t = dequeue_bg_task(dead_tq)) != 0) {
 		enqueue_bg_task(tq, t);
 	    }
-	    dead_tq->player = NOTHING;	/* it'll be freed by run_ready_tasks */
+	    tq->cpu_usec += dead_tq->cpu_usec;
+	    dead_tq->cpu_usec = 0;
+	    set_tqueue_player(dead_tq, NOTHING); /* it'll be freed by
+						  * run_ready_tasks */
 	    dead_tq->num_bg_tasks = 0;
 	}
 	player_connected(old_player, new_player, new_player > old_max_object);
@@ -1049,21 +1213,52 @@ enqueue_ft(Program * program, activation a, Var * rt_env,
     enqueue_waiting(t);
 }
 
+/* Effective queued_task_limit per user, valid only while the property
+ * watch generation is unchanged (see db_watch_property() in db.h).
+ */
+#define TASK_LIMIT_CACHE_SIZE	256
+
+static struct {
+    Objid user;
+    int limit;
+    unsigned generation;
+} task_limit_cache[TASK_LIMIT_CACHE_SIZE];
+
 static int
-check_user_task_limit(Objid user)
+user_task_limit(Objid user)
 {
-    tqueue *tq = find_tqueue(user, 0);
+    unsigned generation = db_property_watch_generation();
+    int slot = (unsigned) user % TASK_LIMIT_CACHE_SIZE;
     int limit = -1;
+    db_prop_handle h;
     Var v;
 
-    if (valid(user)
-	&& db_find_property(user, "queued_task_limit", &v).ptr
-	&& v.type == TYPE_INT)
-	limit = v.v.num;
+    if (task_limit_cache[slot].generation == generation
+	&& task_limit_cache[slot].user == user)
+	return task_limit_cache[slot].limit;
 
+    if (valid(user)
+	&& (h = db_find_property(user, "queued_task_limit", &v)).ptr) {
+	db_watch_property(h);
+	if (v.type == TYPE_INT)
+	    limit = v.v.num;
+    }
     if (limit < 0)
 	limit = server_int_option("queued_task_limit", -1);
 
+    task_limit_cache[slot].user = user;
+    task_limit_cache[slot].limit = limit;
+    task_limit_cache[slot].generation = generation;
+
+    return limit;
+}
+
+static int
+check_user_task_limit(Objid user)
+{
+    tqueue *tq = find_tqueue(user, 0);
+    int limit = user_task_limit(user);
+
     if (limit < 0)
 	return 1;
     else if ((tq ? tq->num_bg_tasks : 0) >= limit)
@@ -1185,6 +1380,21 @@ last_input_task_id(Objid player)
     return tq ? tq->last_input_task_id : 0;
 }
 
+static int task_passes = 0, tasks_run = 0, most_tasks_per_pass = 0;
+
+Var
+task_pass_stats(void)
+{
+    Var r = new_list(3);
+
+    r.v.list[1].type = r.v.list[2].type = r.v.list[3].type = TYPE_INT;
+    r.v.list[1].v.num = task_passes;
+    r.v.list[2].v.num = tasks_run;
+    r.v.list[3].v.num = most_tasks_per_pass;
+
+    return r;
+}
+
 int
 next_task_start(void)
 {
@@ -1203,12 +1413,13 @@ next_task_start(void)
     return -1;
 }
 
-void
-run_ready_tasks(void)
+static int
+run_one_task(void)
 {
     task *t, *next_t;
     time_t now = time(0);
-    tqueue *tq, *next_tq;
+    tqueue *tq;
+    int did_one = 0;
 
     for (t = waiting_tasks; t && GET_START_TIME(t) <= now; t = next_t) {
 	Objid progr = (t->kind == TASK_FORKED
@@ -1223,12 +1434,11 @@ run_ready_tasks(void)
     waiting_tasks = t;
 
     {
-	int did_one = 0;
-	time_t start = time(0);
+	double start = usec_now();
 
-	while (active_tqueues && !did_one) {
+	while (num_active && !did_one) {
 	    /* Loop over tqueues, looking for a task */
-	    tq = active_tqueues;
+	    tq = active_heap[0];
 
 	    if (tq->reading && is_out_of_input(tq)) {
 		Var v;
@@ -1300,14 +1510,11 @@ run_ready_tasks(void)
 		free_task(t, 0);
 	    }
 
-	    active_tqueues = tq->next;
-
 	    if (did_one) {
 		/* Bump the usage level of this tqueue */
-		time_t end = time(0);
+		double end = usec_now();
 
-		tq->usage += end - start;
-		activate_tqueue(tq);
+		charge_tqueue(tq, end > start ? end - start : 0);
 	    } else {
 		/* There was nothing to do on this tqueue, so deactivate it */
 		deactivate_tqueue(tq);
@@ -1315,6 +1522,28 @@ run_ready_tasks(void)
 	}
     }
 
+    return did_one;
+}
+
+void
+run_ready_tasks(void)
+{
+    double budget_end = usec_now() + TASK_PASS_BUDGET * 1000.0;
+    tqueue *tq, *next_tq;
+    int count = 0;
+
+    while (run_one_task()) {
+	count++;
+	if (usec_now() >= budget_end
+	    || !server_between_tasks(count % TASK_PASS_IO_INTERVAL == 0))
+	    break;
+    }
+
+    task_passes++;
+    tasks_run += count;
+    if (count > most_tasks_per_pass)
+	most_tasks_per_pass = count;
+
     /* Free any unconnected and empty tqueues */
     for (tq = idle_tqueues; tq; tq = next_tq) {
 	next_tq = tq->next;
@@ -1647,8 +1876,12 @@ bf_queue_info(Var arglist, Byte next, void *vdata, Objid progr)
 	Objid who = arglist.v.list[1].v.obj;
 	tqueue *tq = find_tqueue(who, 0);
 
-	res.type = TYPE_INT;
-	res.v.num = (tq ? tq->num_bg_tasks : 0);
+	if (nargs > 1 && is_true(arglist.v.list[2]))
+	    res = new_float(tq ? tq->cpu_usec : 0.0);
+	else {
+	    res.type = TYPE_INT;
+	    res.v.num = (tq ? tq->num_bg_tasks : 0);
+	}
     }
 
     free_var(arglist);
@@ -2245,7 +2478,7 @@ register_tasks(void)
     register_function("kill_task", 1, 1, bf_kill_task, TYPE_INT);
     register_function("output_delimiters", 1, 1, bf_output_delimiters,
 		      TYPE_OBJ);
-    register_function("queue_info", 0, 1, bf_queue_info, TYPE_OBJ);
+    register_function("queue_info", 0, 2, bf_queue_info, TYPE_OBJ, TYPE_ANY);
     register_function("resume", 1, 2, bf_resume, TYPE_INT, TYPE_ANY);
     register_function("force_input", 2, 3, bf_force_input,
 		      TYPE_OBJ, TYPE_STR, TYPE_ANY);
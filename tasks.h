@@ -81,6 +81,11 @@ extern Var read_input_now(Objid connection);
 
 extern int next_task_start(void);
 extern void run_ready_tasks(void);
+extern Var task_pass_stats(void);
+				/* {passes, tasks, most tasks in one pass}
+				 * for run_ready_tasks(); see TASK_PASS_BUDGET
+				 * in options.h.
+				 */
 extern enum outcome run_server_task(Objid player, Objid what,
 				    const char *verb, Var args,
 				    const char *argstr, Var * result);
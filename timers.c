@@ -300,6 +300,23 @@ reenable_timers(void)
 #endif
 }
 
+double
+usec_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+#endif
+    {
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+    }
+}
+
 char rcsid_timers[] = "$Id$";
 
 /* 
@@ -32,6 +32,12 @@ extern unsigned timer_wakeup_interval(Timer_ID);
 extern void timer_sleep(unsigned seconds);
 extern int virtual_timer_available();
 
+extern double usec_now(void);
+				/* Microseconds on a clock that never goes
+				 * backwards (where the system has one),
+				 * for measuring intervals.
+				 */
+
 #endif				/* !Timers_H */
 
 /* 
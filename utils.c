@@ -231,6 +231,49 @@ is_true(Var v)
 	    || (v.type == TYPE_LIST && v.v.list[0].v.num != 0));
 }
 
+/* A hash of V's contents that agrees with equality(), case ignored or
+ * not: strings hash as str_hash() does, folding case.  Strings and lists
+ * keep theirs in their headers once worked out, so equality() can tell
+ * most unequal pairs apart without looking inside, and a list that is
+ * searched often is hashed only once.
+ */
+unsigned
+var_hash(Var v)
+{
+    unsigned h;
+    int i;
+
+    switch (v.type) {
+    case TYPE_STR:
+	if ((h = str_hash_slot(v.v.str)) == 0)
+	    h = str_hash_slot(v.v.str) = str_hash(v.v.str);
+	return h;
+    case TYPE_LIST:
+	if ((h = list_hash_slot(v.v.list)) != 0)
+	    return h;
+	h = v.v.list[0].v.num + 0x345678;
+	for (i = 1; i <= v.v.list[0].v.num; i++)
+	    h = (h ^ var_hash(v.v.list[i])) * 1000003;
+	if (h == 0)
+	    h = 1;
+	return list_hash_slot(v.v.list) = h;
+    case TYPE_FLOAT:
+	{
+	    double d = *v.v.fnum;
+	    const unsigned char *p = (const unsigned char *) &d;
+
+	    if (d == 0)
+		d = 0;		/* -0.0 == 0.0 */
+	    h = TYPE_FLOAT;
+	    for (i = 0; i < sizeof(d); i++)
+		h = h * 33 + p[i];
+	    return h;
+	}
+    default:
+	return (unsigned) v.v.num * 2654435761u + v.type;
+    }
+}
+
 int
 equality(Var lhs, Var rhs, int case_matters)
 {
@@ -247,6 +290,11 @@ equality(Var lhs, Var rhs, int case_matters)
 	case TYPE_ERR:
 	    return lhs.v.err == rhs.v.err;
 	case TYPE_STR:
+	    if (lhs.v.str == rhs.v.str)
+		return 1;
+	    if (str_hash_slot(lhs.v.str) && str_hash_slot(rhs.v.str)
+		&& str_hash_slot(lhs.v.str) != str_hash_slot(rhs.v.str))
+		return 0;
 	    if (case_matters)
 		return !strcmp(lhs.v.str, rhs.v.str);
 	    else
@@ -260,6 +308,10 @@ equality(Var lhs, Var rhs, int case_matters)
 		if (lhs.v.list == rhs.v.list) {
 		    return 1;
 		}
+		if (list_hash_slot(lhs.v.list) && list_hash_slot(rhs.v.list)
+		    && (list_hash_slot(lhs.v.list)
+			!= list_hash_slot(rhs.v.list)))
+		    return 0;
 		for (i = 1; i <= lhs.v.list[0].v.num; i++) {
 		    if (!equality(lhs.v.list[i], rhs.v.list[i], case_matters))
 			return 0;
@@ -68,6 +68,7 @@ var_dup(Var v)
 	return v;
 }
 
+extern unsigned var_hash(Var);
 extern int equality(Var lhs, Var rhs, int case_matters);
 extern int is_true(Var v);
 
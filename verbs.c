@@ -512,7 +512,7 @@ bf_set_verb_code(Var arglist, Byte next, void *vdata, Objid progr)
 	free_var(arglist);
 	return make_error_pack(E_PERM);
     }
-    program = parse_list_as_program(code, &errors);
+    program = parse_list_as_cached_program(code, &errors);
     if (program) {
 	if (task_timed_out)
 	    free_program(program);
@@ -535,7 +535,7 @@ bf_eval(Var arglist, Byte next, void *data, Objid progr)
 	    p = make_error_pack(E_PERM);
 	} else {
 	    Var errors;
-	    Program *program = parse_list_as_program(arglist, &errors);
+	    Program *program = parse_list_as_cached_program(arglist, &errors);
 
 	    free_var(arglist);
 	    if (program) {
@@ -47,7 +47,15 @@ my @options =
    _DINT => [qw(DEFAULT_CONNECT_TIMEOUT
 		MAX_QUEUED_OUTPUT
 		MAX_QUEUED_INPUT
+		LISTEN_BACKLOG
+		ACCEPT_BATCH
+		LISTEN_SHARDS
+		NAME_LOOKUP_WORKERS
+		NAME_CACHE_SIZE
+		DEFAULT_NAME_LOOKUP_TTL
+		DEFAULT_NAME_LOOKUP_NEGATIVE_TTL
 	      )],
+   _DDEF => [qw(OFFER_OUTPUT_COMPRESSION)],
 
    # File I/O
    _DDEF => [qw(FILE_IO)],
@@ -65,10 +73,24 @@ my @options =
    # optimizations
    _DDEF => [qw(USE_GNU_MALLOC
 		UNFORKED_CHECKPOINTS
+		BACKGROUND_CHECKPOINTS
+		LAZY_PROGRAMS
 		BYTECODE_REDUCE_REF
 		STRING_INTERNING
 		MEMO_STRLEN
+		SLAB_ALLOCATOR
 		MOO_GCRYPT
+		MOO_ZLIB
+	      )],
+   _DINT => [qw(LOAD_COMPILE_WORKERS
+		LAZY_PROGRAM_CACHE
+		COMPILE_CACHE_SIZE
+		TASK_PASS_BUDGET
+		TASK_PASS_IO_INTERVAL
+		BACKGROUND_CHECKPOINT_SLICE
+		CHECKPOINT_WORKERS
+		DUMP_COMPRESSION_LEVEL
+		REDO_BUFFER_SIZE
 	      )],
 
    # input options
@@ -80,6 +102,12 @@ my @options =
 		OUT_OF_BAND_QUOTE_PREFIX
 	      )],
 
+   # server log
+   _DINT => [qw(LOG_BUFFER_SIZE
+		LOG_ROTATE_SIZE
+		LOG_ROTATE_KEEP
+	      )],
+
    # execution limits
    _DINT => [qw(DEFAULT_MAX_STACK_DEPTH
 		DEFAULT_FG_TICKS
@@ -87,6 +115,7 @@ my @options =
 		DEFAULT_FG_SECONDS
 		DEFAULT_BG_SECONDS
 		PATTERN_CACHE_SIZE
+		MATCH_INDEX_MIN
 		DEFAULT_MAX_LIST_CONCAT
 		MIN_LIST_CONCAT_LIMIT
 		DEFAULT_MAX_STRING_CONCAT